@@ -3,11 +3,13 @@
 
 #include <stdbool.h>
 
-struct ray;
-struct hit;
+#include "core/ray.h"
 
 struct accel {
     bool (*intersect_ray)(struct ray*, struct hit*, const struct accel*, bool);
+    ray_mask_t (*intersect_ray_packet)(struct ray_packet*, struct hit*, ray_mask_t, const struct accel*, bool);
+    void (*intersect_ray_stream)(struct ray*, struct hit*, const size_t*, size_t, const struct accel*, bool);
+    bool (*occluded_ray)(const struct ray*, const struct accel*);
     void (*free)(struct accel*);
 };
 
@@ -21,6 +23,64 @@ static inline bool intersect_ray_accel(
     return accel->intersect_ray(ray, hit, accel, any);
 }
 
+// Returns true if the ray intersects anything in the acceleration data structure. This is equivalent
+// to `intersect_ray_accel()` with `any` set, but faster, since the traversal is unordered and no hit is computed.
+static inline bool occluded_ray_accel(const struct ray* ray, const struct accel* accel) {
+    return accel->occluded_ray(ray, accel);
+}
+
+// Intersects the rays of a packet whose bit is set in `mask` with the acceleration data structure.
+// The `i`-th ray of the packet corresponds to `hits[i]`. Returns the mask of the rays that hit something.
+static inline ray_mask_t intersect_ray_packet_accel(
+    struct ray_packet* packet, struct hit* hits,
+    ray_mask_t mask,
+    const struct accel* accel, bool any)
+{
+    return accel->intersect_ray_packet(packet, hits, mask, accel, any);
+}
+
+// Packet intersection routine for acceleration data structures that
+// do not have a specialized one. Traces the rays of the packet one by one.
+static inline ray_mask_t intersect_ray_packet_accel_one_by_one(
+    struct ray_packet* packet, struct hit* hits,
+    ray_mask_t mask,
+    const struct accel* accel, bool any)
+{
+    ray_mask_t hit_mask = 0;
+    for (size_t i = 0, n = packet->size; i < n; ++i) {
+        if (!(mask & (((ray_mask_t)1) << i)))
+            continue;
+        struct ray ray = get_packet_ray(packet, i);
+        if (intersect_ray_accel(&ray, &hits[i], accel, any)) {
+            packet->t_max[i] = ray.t_max;
+            hit_mask |= ((ray_mask_t)1) << i;
+        }
+    }
+    return hit_mask;
+}
+
+// Intersects a stream of rays, given as a list of indices into the `rays` and `hits` arrays,
+// with the acceleration data structure. The hits of the rays that do not intersect anything
+// are left unchanged. Rays should be sorted so that similar rays are close in the stream.
+static inline void intersect_ray_stream_accel(
+    struct ray* rays, struct hit* hits,
+    const size_t* ray_ids, size_t ray_count,
+    const struct accel* accel, bool any)
+{
+    accel->intersect_ray_stream(rays, hits, ray_ids, ray_count, accel, any);
+}
+
+// Stream intersection routine for acceleration data structures that
+// do not have a specialized one. Traces the rays of the stream one by one.
+static inline void intersect_ray_stream_accel_one_by_one(
+    struct ray* rays, struct hit* hits,
+    const size_t* ray_ids, size_t ray_count,
+    const struct accel* accel, bool any)
+{
+    for (size_t i = 0; i < ray_count; ++i)
+        intersect_ray_accel(&rays[ray_ids[i]], &hits[ray_ids[i]], accel, any);
+}
+
 // Function to call to release the memory used by an acceleration data structure.
 static inline void free_accel(struct accel* accel) {
     accel->free(accel);
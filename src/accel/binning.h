@@ -0,0 +1,148 @@
+#ifndef ACCEL_BINNING_H
+#define ACCEL_BINNING_H
+
+#include <stdbool.h>
+
+#include "core/config.h"
+#include "core/bbox.h"
+#include "core/utils.h"
+
+/*
+ * Helpers to evaluate the SAH with binning, shared by the top-down construction algorithms.
+ * Primitives are placed in bins according to their center, on every axis, and the cost of
+ * every split between two consecutive bins is evaluated with two sweeps over the bins.
+ */
+
+#define BIN_COUNT 32
+
+struct bin {
+    struct bbox bbox;
+    struct bbox center_bbox;
+    size_t primitive_count;
+};
+
+struct bins {
+    struct bin bins[3][BIN_COUNT];
+};
+
+// Maps primitive centers to bins, for each axis.
+struct bin_mapping {
+    real_t min[3];
+    real_t scale[3]; // A scale of 0 indicates that the axis cannot be split
+};
+
+struct split {
+    int axis;
+    size_t bin;
+    real_t cost;
+    size_t left_count;
+    struct bbox bboxes[2];
+    struct bbox center_bboxes[2];
+};
+
+static inline void init_bins(struct bins* bins) {
+    for (int i = 0; i < 3; ++i) {
+        for (size_t j = 0; j < BIN_COUNT; ++j) {
+            bins->bins[i][j].bbox = empty_bbox();
+            bins->bins[i][j].center_bbox = empty_bbox();
+            bins->bins[i][j].primitive_count = 0;
+        }
+    }
+}
+
+static inline void merge_bins(struct bins* restrict dst, const struct bins* restrict src) {
+    for (int i = 0; i < 3; ++i) {
+        for (size_t j = 0; j < BIN_COUNT; ++j) {
+            dst->bins[i][j].bbox = union_bbox(dst->bins[i][j].bbox, src->bins[i][j].bbox);
+            dst->bins[i][j].center_bbox = union_bbox(dst->bins[i][j].center_bbox, src->bins[i][j].center_bbox);
+            dst->bins[i][j].primitive_count += src->bins[i][j].primitive_count;
+        }
+    }
+}
+
+static inline struct bin_mapping compute_bin_mapping(const struct bbox* center_bbox) {
+    struct bin_mapping mapping;
+    for (int i = 0; i < 3; ++i) {
+        real_t extent = center_bbox->max._[i] - center_bbox->min._[i];
+        mapping.min[i] = center_bbox->min._[i];
+        mapping.scale[i] = extent > 0 ? ((real_t)BIN_COUNT) / extent : 0;
+    }
+    return mapping;
+}
+
+static inline size_t compute_bin_index(const struct bin_mapping* mapping, int axis, real_t center) {
+    real_t bin = (center - mapping->min[axis]) * mapping->scale[axis];
+    return min_size_t(bin > 0 ? (size_t)bin : 0, BIN_COUNT - 1);
+}
+
+static inline void add_to_bins(
+    struct bins* bins,
+    const struct bin_mapping* mapping,
+    const struct bbox* bbox,
+    struct vec3 center)
+{
+    for (int i = 0; i < 3; ++i) {
+        struct bin* bin = &bins->bins[i][compute_bin_index(mapping, i, center._[i])];
+        bin->bbox = union_bbox(bin->bbox, *bbox);
+        bin->center_bbox = extend_bbox(bin->center_bbox, center);
+        bin->primitive_count++;
+    }
+}
+
+// Finds the split with the lowest SAH cost among all bin boundaries. The cost is not
+// normalized by the area of the parent, and does not include the traversal cost.
+static inline bool find_best_split(
+    const struct bins* bins,
+    const struct bin_mapping* mapping,
+    struct split* best_split)
+{
+    best_split->cost = REAL_MAX;
+    for (int i = 0; i < 3; ++i) {
+        if (mapping->scale[i] == 0)
+            continue;
+
+        // Sweep from the right to compute the cost of the right part of each split
+        real_t right_costs[BIN_COUNT];
+        struct bbox right_bbox = empty_bbox();
+        size_t right_count = 0;
+        for (size_t j = BIN_COUNT - 1; j > 0; --j) {
+            right_bbox = union_bbox(right_bbox, bins->bins[i][j].bbox);
+            right_count += bins->bins[i][j].primitive_count;
+            right_costs[j] = right_count > 0 ? half_bbox_area(right_bbox) * right_count : REAL_MAX;
+        }
+
+        // Sweep from the left and combine both parts
+        struct bbox left_bbox = empty_bbox();
+        size_t left_count = 0;
+        for (size_t j = 1; j < BIN_COUNT; ++j) {
+            left_bbox = union_bbox(left_bbox, bins->bins[i][j - 1].bbox);
+            left_count += bins->bins[i][j - 1].primitive_count;
+            if (left_count == 0 || right_costs[j] == REAL_MAX)
+                continue;
+            real_t cost = half_bbox_area(left_bbox) * left_count + right_costs[j];
+            if (cost < best_split->cost) {
+                best_split->cost = cost;
+                best_split->axis = i;
+                best_split->bin  = j;
+            }
+        }
+    }
+    if (best_split->cost == REAL_MAX)
+        return false;
+
+    // Compute the bounding boxes and primitive count of each part
+    int axis = best_split->axis;
+    best_split->left_count = 0;
+    for (int i = 0; i < 2; ++i)
+        best_split->bboxes[i] = best_split->center_bboxes[i] = empty_bbox();
+    for (size_t j = 0; j < BIN_COUNT; ++j) {
+        int side = j < best_split->bin ? 0 : 1;
+        const struct bin* bin = &bins->bins[axis][j];
+        best_split->bboxes[side] = union_bbox(best_split->bboxes[side], bin->bbox);
+        best_split->center_bboxes[side] = union_bbox(best_split->center_bboxes[side], bin->center_bbox);
+        best_split->left_count += side == 0 ? bin->primitive_count : 0;
+    }
+    return true;
+}
+
+#endif
@@ -4,7 +4,9 @@
 #include <assert.h>
 
 #include "accel/bvh.h"
+#include "accel/traversal.h"
 #include "core/thread_pool.h"
+#include "core/parallel_scan.h"
 #include "core/radix_sort.h"
 #include "core/morton.h"
 #include "core/utils.h"
@@ -208,48 +210,42 @@ static void run_neighbor_task(struct parallel_task_1d* task, size_t thread_id) {
     }
 }
 
-struct merge_count_task {
-    struct work_item work_item;
-    size_t begin, end;
-    const size_t* neighbors;
-    size_t merged_count;
-    size_t unmerged_count;
-};
-
-static void run_merge_count_task(struct work_item* work_item, size_t thread_id) {
-    IGNORE(thread_id);
-    struct merge_count_task* merge_count_task = (void*)work_item;
-    merge_count_task->merged_count = merge_count_task->unmerged_count = 0;
-    for (size_t i = merge_count_task->begin, n = merge_count_task->end; i < n; ++i) {
-        size_t j = merge_count_task->neighbors[i];
-        if (merge_count_task->neighbors[j] == i)
-            merge_count_task->merged_count += i < j ? 1 : 0;
-        else
-            merge_count_task->unmerged_count++;
-    }
-}
-
 struct merge_task {
-    struct work_item work_item;
-    size_t begin, end;
+    struct parallel_scan_task task;
     const size_t* restrict neighbors;
     const struct bvh_node* restrict src_unmerged_nodes;
     struct bvh_node* restrict dst_unmerged_nodes;
     struct bvh_node* restrict merged_nodes;
-    size_t unmerged_index;
-    size_t merged_index;
+    size_t merged_end;
 };
 
-static void run_merge_task(struct work_item* work_item, size_t thread_id) {
+// Counts the pairs of nodes that are merged (first sum), and the nodes that remain after merging (second sum).
+static void run_merge_count_task(struct parallel_scan_task* task, size_t thread_id) {
     IGNORE(thread_id);
-    struct merge_task* merge_task = (void*)work_item;
-    for (size_t i = merge_task->begin, n = merge_task->end; i < n; ++i) {
+    struct merge_task* merge_task = (void*)task;
+    for (size_t i = task->task.range.begin, n = task->task.range.end; i < n; ++i) {
+        size_t j = merge_task->neighbors[i];
+        if (merge_task->neighbors[j] != i)
+            task->sums._[1]++;
+        else if (i < j) {
+            task->sums._[0]++;
+            task->sums._[1]++;
+        }
+    }
+}
+
+static void run_merge_task(struct parallel_scan_task* task, size_t thread_id) {
+    IGNORE(thread_id);
+    struct merge_task* merge_task = (void*)task;
+    // Merged nodes are placed right before the ones that were merged at the previous level
+    size_t merged_index = merge_task->merged_end - 2 * task->total._[0] + 2 * task->sums._[0];
+    size_t unmerged_index = task->sums._[1];
+    for (size_t i = task->task.range.begin, n = task->task.range.end; i < n; ++i) {
         size_t j = merge_task->neighbors[i];
         if (merge_task->neighbors[j] == i) {
             if (i < j) {
-                struct bvh_node* unmerged_node =
-                    &merge_task->dst_unmerged_nodes[merge_task->unmerged_index];
-                size_t first_child = merge_task->merged_index;
+                struct bvh_node* unmerged_node = &merge_task->dst_unmerged_nodes[unmerged_index];
+                size_t first_child = merged_index;
                 struct bbox merged_bbox = union_bbox(
                     get_bvh_node_bbox(&merge_task->src_unmerged_nodes[i]),
                     get_bvh_node_bbox(&merge_task->src_unmerged_nodes[j]));
@@ -258,12 +254,11 @@ static void run_merge_task(struct work_item* work_item, size_t thread_id) {
                 unmerged_node->first_child_or_primitive = first_child;
                 merge_task->merged_nodes[first_child + 0] = merge_task->src_unmerged_nodes[i];
                 merge_task->merged_nodes[first_child + 1] = merge_task->src_unmerged_nodes[j];
-                merge_task->unmerged_index++;
-                merge_task->merged_index += 2;
+                unmerged_index++;
+                merged_index += 2;
             }
         } else {
-            merge_task->dst_unmerged_nodes[merge_task->unmerged_index++] =
-                merge_task->src_unmerged_nodes[i];
+            merge_task->dst_unmerged_nodes[unmerged_index++] = merge_task->src_unmerged_nodes[i];
         }
     }
 }
@@ -290,54 +285,26 @@ static void merge_nodes(
         sizeof(struct neighbor_task),
         &(struct range) { 0, *unmerged_count });
 
-    // Count how many nodes should be merged, and how many should not
-    size_t task_count = get_thread_count(thread_pool) * 4;
-    size_t chunk_size = compute_chunk_size(*unmerged_count, task_count);
-    struct merge_count_task* merge_count_tasks = xmalloc(sizeof(struct merge_count_task) * task_count);
-    for (size_t i = 0; i < task_count; ++i) {
-        merge_count_tasks[i].work_item.work_fn = run_merge_count_task;
-        merge_count_tasks[i].work_item.next = &merge_count_tasks[i + 1].work_item;
-        merge_count_tasks[i].neighbors = neighbors;
-        merge_count_tasks[i].begin = compute_chunk_begin(chunk_size, i);
-        merge_count_tasks[i].end   = compute_chunk_end(chunk_size, i, *unmerged_count);
-    }
-    merge_count_tasks[task_count - 1].work_item.next = NULL;
-    submit_work(thread_pool, &merge_count_tasks[0].work_item, &merge_count_tasks[task_count - 1].work_item);
-    wait_for_completion(thread_pool, 0);
-
-    size_t total_merged = 0;
-    for (size_t i = 0; i < task_count; ++i)
-        total_merged += merge_count_tasks[i].merged_count;
-    assert(total_merged > 0);
-
-    // Merge nodes based on the results of the neighbor search
-    assert(*merged_index > 2 * total_merged);
-    *merged_index -= 2 * total_merged;
-    size_t cur_merged_index = *merged_index;
-    size_t cur_unmerged_index = 0;
-    struct merge_task* merge_tasks = xmalloc(sizeof(struct merge_task) * task_count);
-    for (size_t i = 0; i < task_count; ++i) {
-        merge_tasks[i].work_item.work_fn = run_merge_task;
-        merge_tasks[i].work_item.next = &merge_tasks[i + 1].work_item;
-        merge_tasks[i].begin = merge_count_tasks[i].begin;
-        merge_tasks[i].end   = merge_count_tasks[i].end;
-        merge_tasks[i].merged_index   = cur_merged_index;
-        merge_tasks[i].unmerged_index = cur_unmerged_index;
-        merge_tasks[i].neighbors = neighbors;
-        merge_tasks[i].src_unmerged_nodes = src_unmerged_nodes;
-        merge_tasks[i].dst_unmerged_nodes = dst_unmerged_nodes;
-        merge_tasks[i].merged_nodes = merged_nodes;
-        cur_merged_index   += merge_count_tasks[i].merged_count * 2;
-        cur_unmerged_index += merge_count_tasks[i].merged_count + merge_count_tasks[i].unmerged_count;
-    }
-    merge_tasks[task_count - 1].work_item.next = NULL;
-    submit_work(thread_pool, &merge_tasks[0].work_item, &merge_tasks[task_count - 1].work_item);
-
-    *unmerged_count = cur_unmerged_index;
-    wait_for_completion(thread_pool, 0);
+    // Count how many nodes should be merged, and how many should not,
+    // then merge nodes based on the results of the neighbor search
+    struct parallel_sums total = parallel_exclusive_scan(
+        thread_pool,
+        run_merge_count_task,
+        run_merge_task,
+        (struct parallel_scan_task*)&(struct merge_task) {
+            .neighbors = neighbors,
+            .src_unmerged_nodes = src_unmerged_nodes,
+            .dst_unmerged_nodes = dst_unmerged_nodes,
+            .merged_nodes = merged_nodes,
+            .merged_end = *merged_index
+        },
+        sizeof(struct merge_task),
+        &(struct range) { 0, *unmerged_count });
 
-    free(merge_tasks);
-    free(merge_count_tasks);
+    assert(total._[0] > 0);
+    assert(*merged_index > 2 * total._[0]);
+    *merged_index -= 2 * total._[0];
+    *unmerged_count = total._[1];
 }
 
 /*
@@ -346,11 +313,14 @@ static void merge_nodes(
  * the Construction of BVHs, Octrees, and k-d Trees".
  */
 
+// Same as `get_bvh_node_parent()`, but returns `SIZE_MAX` for the root.
+static inline size_t get_collapse_parent(const bits_t* parents, size_t node_index) {
+    return node_index == 0 ? SIZE_MAX : parents[(node_index - 1) / 2];
+}
+
 struct collapse_init_task {
     struct parallel_task_1d task;
-    const struct bvh_node* nodes;
     size_t* restrict node_counts;
-    size_t* restrict parents;
     atomic_int* flags;
 };
 
@@ -358,13 +328,8 @@ static void run_collapse_init_task(struct parallel_task_1d* task, size_t thread_
     IGNORE(thread_id);
     struct collapse_init_task* collapse_init_task = (void*)task;
     for (size_t i = task->range.begin, n = task->range.end; i < n; ++i) {
-        const struct bvh_node* node = &collapse_init_task->nodes[i];
         collapse_init_task->node_counts[i] = 1;
         atomic_init(&collapse_init_task->flags[i], 0);
-        if (node->primitive_count == 0) {
-            collapse_init_task->parents[node->first_child_or_primitive + 0] = i;
-            collapse_init_task->parents[node->first_child_or_primitive + 1] = i;
-        }
     }
 }
 
@@ -373,7 +338,7 @@ struct collapse_task {
     const struct bvh_node* nodes;
     size_t* restrict node_counts;
     size_t* restrict primitive_counts;
-    size_t* restrict parents;
+    const bits_t* restrict parents;
     atomic_int* flags;
     real_t traversal_cost;
 };
@@ -397,7 +362,7 @@ static void run_collapse_task(struct parallel_task_1d* task, size_t thread_id) {
         size_t j = i;
         while (true) {
             size_t first_child = left_sibling(j);
-            j = collapse_task->parents[j];
+            j = get_collapse_parent(collapse_task->parents, j);
 
             // Terminate this path if the root has been reached or the two children have not yet been processed
             if (j == SIZE_MAX || atomic_fetch_add_explicit(&collapse_task->flags[j], 1, memory_order_relaxed) == 0)
@@ -431,48 +396,35 @@ static void run_collapse_task(struct parallel_task_1d* task, size_t thread_id) {
     }
 }
 
-struct collapse_count_task {
-    struct work_item work_item;
-    size_t begin, end;
-    const size_t* node_counts;
-    const size_t* primitive_counts;
-    size_t primitive_count;
-    size_t node_count;
-};
-
-static void run_counting_task(struct work_item* work_item, size_t thread_id) {
-    IGNORE(thread_id);
-    struct collapse_count_task* collapse_count_task = (void*)work_item;
-    collapse_count_task->primitive_count = 0;
-    collapse_count_task->node_count = 0;
-    for (size_t i = collapse_count_task->begin, n = collapse_count_task->end; i < n; ++i) {
-        collapse_count_task->primitive_count += collapse_count_task->primitive_counts[i];
-        collapse_count_task->node_count += collapse_count_task->node_counts[i];
-    }
-}
-
 struct rewrite_task {
-    struct work_item work_item;
-    size_t begin, end;
+    struct parallel_scan_task task;
     const struct bvh_node* restrict src_nodes;
     struct bvh_node* restrict dst_nodes;
     size_t* restrict node_counts;
-    const size_t* restrict parents;
+    const bits_t* restrict parents;
     const size_t* restrict primitive_counts;
     const size_t* restrict src_primitive_indices;
     size_t* restrict dst_primitive_indices;
-    size_t first_node;
-    size_t first_primitive;
 };
 
+// Counts the primitives (first sum) and the nodes (second sum) that are kept after collapsing leaves.
+static void run_counting_task(struct parallel_scan_task* task, size_t thread_id) {
+    IGNORE(thread_id);
+    struct rewrite_task* rewrite_task = (void*)task;
+    for (size_t i = task->task.range.begin, n = task->task.range.end; i < n; ++i) {
+        task->sums._[0] += rewrite_task->primitive_counts[i];
+        task->sums._[1] += rewrite_task->node_counts[i];
+    }
+}
+
 static size_t next_node_in_prefix_order(
     const struct bvh_node* nodes,
-    const size_t* parents,
+    const bits_t* parents,
     size_t node_index,
     size_t root_index)
 {
     while (node_index != root_index) {
-        size_t parent_index = parents[node_index];
+        size_t parent_index = get_collapse_parent(parents, node_index);
         assert(parent_index != SIZE_MAX);
 
         if (nodes[parent_index].first_child_or_primitive == node_index) {
@@ -488,7 +440,7 @@ static size_t next_node_in_prefix_order(
 static void copy_subtree_primitives(
     const struct bvh_node* nodes,
     size_t node_index,
-    const size_t* restrict parents,
+    const bits_t* restrict parents,
     const size_t* restrict src_primitive_indices,
     size_t* restrict dst_primitive_indices,
     size_t* restrict first_primitive)
@@ -514,25 +466,27 @@ static void copy_subtree_primitives(
     }
 }
 
-static void run_rewrite_task(struct work_item* work_item, size_t thread_id) {
+static void run_rewrite_task(struct parallel_scan_task* task, size_t thread_id) {
     IGNORE(thread_id);
-    struct rewrite_task* rewrite_task = (void*)work_item;
-    for (size_t i = rewrite_task->begin, n = rewrite_task->end; i < n; ++i) {
+    struct rewrite_task* rewrite_task = (void*)task;
+    size_t first_primitive = task->sums._[0];
+    size_t first_node = task->sums._[1];
+    for (size_t i = task->task.range.begin, n = task->task.range.end; i < n; ++i) {
         if (rewrite_task->node_counts[i] == 0)
             continue;
-        size_t dst_index = rewrite_task->node_counts[i] = rewrite_task->first_node++;
+        size_t dst_index = rewrite_task->node_counts[i] = first_node++;
         struct bvh_node* dst_node = &rewrite_task->dst_nodes[dst_index];
         *dst_node = rewrite_task->src_nodes[i];
         if (rewrite_task->primitive_counts[i] != 0) {
-            dst_node->first_child_or_primitive = rewrite_task->first_primitive;
+            dst_node->first_child_or_primitive = first_primitive;
             dst_node->primitive_count = rewrite_task->primitive_counts[i];
             copy_subtree_primitives(
                 rewrite_task->src_nodes, i,
                 rewrite_task->parents,
                 rewrite_task->src_primitive_indices,
                 rewrite_task->dst_primitive_indices,
-                &rewrite_task->first_primitive);
-            assert(rewrite_task->first_primitive ==
+                &first_primitive);
+            assert(first_primitive ==
                 dst_node->first_child_or_primitive +
                 dst_node->primitive_count);
         }
@@ -556,24 +510,21 @@ static void run_rewire_task(struct parallel_task_1d* task, size_t thread_id) {
     }
 }
 
+// Collapses leaves of a BVH whose parents are up to date. The parents are recomputed afterwards.
 static void collapse_leaves(struct thread_pool* thread_pool, struct bvh* bvh, real_t traversal_cost) {
-    size_t* parents     = xmalloc(sizeof(size_t) * bvh->node_count);
     atomic_int* flags   = xmalloc(sizeof(atomic_int) * bvh->node_count);
     size_t* node_counts = xmalloc(sizeof(size_t) * bvh->node_count);
 
-    // Initialize parent indices and flags
+    // Initialize flags and node counts
     parallel_for_1d(
         thread_pool,
         run_collapse_init_task,
         (struct parallel_task_1d*)&(struct collapse_init_task) {
-            .nodes       = bvh->nodes,
-            .parents     = parents,
             .flags       = flags,
             .node_counts = node_counts
         },
         sizeof(struct collapse_init_task),
         &(struct range) { 0, bvh->node_count });
-    parents[0] = SIZE_MAX;
 
     // Traverse the BVH from bottom to top, collapsing leaves on the way
     size_t* primitive_counts = xcalloc(bvh->node_count, sizeof(size_t));
@@ -584,60 +535,42 @@ static void collapse_leaves(struct thread_pool* thread_pool, struct bvh* bvh, re
             .primitive_counts = primitive_counts,
             .traversal_cost   = traversal_cost,
             .nodes            = bvh->nodes,
-            .parents          = parents,
+            .parents          = bvh->parents,
             .flags            = flags,
             .node_counts      = node_counts
         },
         sizeof(struct collapse_task),
         &(struct range) { 0, bvh->node_count });
+    free(flags);
 
-    // Perform a sum of the primitives contained in each chunk of the BVH.
-    // Since leaves will most likely be in small parts of the BVH, it is
-    // important to have enough tasks to process the array of nodes to
-    // balance the workload efficiently.
-    size_t task_count   = get_thread_count(thread_pool) * 4;
-    size_t chunk_size   = compute_chunk_size(bvh->node_count, task_count);
-    struct collapse_count_task* collapse_count_tasks = xmalloc(sizeof(struct collapse_count_task) * task_count);
-    struct rewrite_task*  rewrite_tasks = xmalloc(sizeof(struct rewrite_task) * task_count);
-    for (size_t i = 0; i < task_count; ++i) {
-        collapse_count_tasks[i].work_item.work_fn = run_counting_task;
-        collapse_count_tasks[i].work_item.next    = &collapse_count_tasks[i + 1].work_item;
-        collapse_count_tasks[i].primitive_counts  = primitive_counts;
-        collapse_count_tasks[i].node_counts       = node_counts;
-        rewrite_tasks[i].begin = collapse_count_tasks[i].begin = compute_chunk_begin(chunk_size, i);
-        rewrite_tasks[i].end   = collapse_count_tasks[i].end   = compute_chunk_end(chunk_size, i, bvh->node_count);
-    }
-    collapse_count_tasks[task_count - 1].work_item.next = NULL;
-    submit_work(thread_pool, &collapse_count_tasks[0].work_item, &collapse_count_tasks[task_count - 1].work_item);
-    wait_for_completion(thread_pool, 0);
+    // Count the primitives and nodes that are kept in each chunk of the BVH. Since leaves will
+    // most likely be in small parts of the BVH, the scan splits the array of nodes in several
+    // chunks per thread to balance the workload efficiently.
+    struct rewrite_task rewrite_task = {
+        .src_nodes             = bvh->nodes,
+        .node_counts           = node_counts,
+        .parents               = bvh->parents,
+        .primitive_counts      = primitive_counts,
+        .src_primitive_indices = bvh->primitive_indices
+    };
+    struct parallel_scan scan;
+    struct parallel_sums total = start_parallel_scan(
+        thread_pool, &scan,
+        run_counting_task,
+        &rewrite_task.task, sizeof(struct rewrite_task),
+        &(struct range) { 0, bvh->node_count });
+    assert(total._[0] <= bvh->node_count);
 
     // Now rewrite the primitive indices based on the previously computed sums
-    size_t first_primitive = 0, first_node = 0;
-    for (size_t i = 0; i < task_count; ++i) {
-        rewrite_tasks[i].work_item.work_fn = run_rewrite_task;
-        rewrite_tasks[i].work_item.next    = &rewrite_tasks[i + 1].work_item;
-        rewrite_tasks[i].primitive_counts  = primitive_counts;
-        rewrite_tasks[i].node_counts       = node_counts;
-        rewrite_tasks[i].first_primitive   = first_primitive;
-        rewrite_tasks[i].first_node        = first_node;
-        rewrite_tasks[i].parents           = parents;
-        first_primitive += collapse_count_tasks[i].primitive_count;
-        first_node += collapse_count_tasks[i].node_count;
-    }
-    assert(first_primitive <= bvh->node_count);
-    rewrite_tasks[task_count - 1].work_item.next = NULL;
-
-    size_t primitive_count = first_primitive, node_count = first_node;
+    size_t primitive_count = total._[0], node_count = total._[1];
     size_t* dst_primitive_indices = xmalloc(sizeof(size_t) * primitive_count);
     struct bvh_node* dst_nodes = xmalloc(sizeof(struct bvh_node) * node_count);
-    for (size_t i = 0; i < task_count; ++i) {
-        rewrite_tasks[i].src_nodes = bvh->nodes;
-        rewrite_tasks[i].dst_nodes = dst_nodes;
-        rewrite_tasks[i].src_primitive_indices = bvh->primitive_indices;
-        rewrite_tasks[i].dst_primitive_indices = dst_primitive_indices;
-    }
-    submit_work(thread_pool, &rewrite_tasks[0].work_item, &rewrite_tasks[task_count - 1].work_item);
-    wait_for_completion(thread_pool, 0);
+    rewrite_task.dst_nodes = dst_nodes;
+    rewrite_task.dst_primitive_indices = dst_primitive_indices;
+    finish_parallel_scan(
+        thread_pool, &scan,
+        run_rewrite_task,
+        &rewrite_task.task, sizeof(struct rewrite_task));
 
     // Finally, rewire children indices in the rewritten BVH
     parallel_for_1d(
@@ -656,12 +589,13 @@ static void collapse_leaves(struct thread_pool* thread_pool, struct bvh* bvh, re
 
     free(dst_nodes);
     free(dst_primitive_indices);
-    free(collapse_count_tasks);
-    free(rewrite_tasks);
     free(primitive_counts);
     free(node_counts);
-    free(flags);
-    free(parents);
+
+    // The collapsed BVH has fewer nodes, and thus needs fewer parents
+    bvh->node_capacity = node_count;
+    bvh->parents = xrealloc(bvh->parents, sizeof(bits_t) * (node_count / 2));
+    update_bvh_parents(thread_pool, bvh);
 }
 
 struct bvh* build_bvh(
@@ -687,8 +621,7 @@ struct bvh* build_bvh(
     free(morton_codes);
 
     // Construct leaf nodes
-    struct bvh_node* src_unmerged_nodes = xmalloc(sizeof(struct bvh_node) * primitive_count);
-    struct bvh_node* dst_unmerged_nodes = xmalloc(sizeof(struct bvh_node) * primitive_count);
+    struct bvh_node* unmerged_nodes = xmalloc(sizeof(struct bvh_node) * primitive_count);
     parallel_for_1d(
         thread_pool,
         run_leaves_task,
@@ -696,12 +629,15 @@ struct bvh* build_bvh(
             .primitive_indices = primitive_indices,
             .primitive_data = primitive_data,
             .bbox_fn = bbox_fn,
-            .leaves = src_unmerged_nodes
+            .leaves = unmerged_nodes
         },
         sizeof(struct leaves_task),
         &(struct range) { 0, primitive_count });
 
-    // Merge nodes, level by level
+    // Merge nodes, level by level. Merged nodes are stored from the end of the array, two at a time,
+    // and there are always `2 * unmerged_count - 1` entries left at the beginning of it. The nodes that
+    // remain unmerged after each level are therefore written there, and then copied back, which avoids
+    // allocating another array of unmerged nodes.
     size_t node_count = 2 * primitive_count - 1;
     size_t* neighbors = xmalloc(sizeof(size_t) * primitive_count);
     struct bvh_node* merged_nodes = xmalloc(sizeof(struct bvh_node) * node_count);
@@ -711,22 +647,26 @@ struct bvh* build_bvh(
     while (unmerged_count > 1) {
         merge_nodes(
             thread_pool,
-            src_unmerged_nodes, dst_unmerged_nodes,
+            unmerged_nodes, merged_nodes,
             merged_nodes, neighbors,
             &unmerged_count, &merged_index);
-
-        swap_nodes(&src_unmerged_nodes, &dst_unmerged_nodes);
+        assert(unmerged_count <= merged_index);
+        memcpy(unmerged_nodes, merged_nodes, sizeof(struct bvh_node) * unmerged_count);
     }
     assert(unmerged_count == 1);
-    merged_nodes[0] = src_unmerged_nodes[0];
+    merged_nodes[0] = unmerged_nodes[0];
     free(neighbors);
-    free(src_unmerged_nodes);
-    free(dst_unmerged_nodes);
+    free(unmerged_nodes);
 
     struct bvh* bvh = xmalloc(sizeof(struct bvh));
     bvh->nodes = merged_nodes;
     bvh->primitive_indices = primitive_indices;
+    bvh->primitive_index_count = primitive_count;
     bvh->node_count = node_count;
+    bvh->parents = NULL;
+    bvh->primitive_index_capacity = primitive_count;
+    bvh->node_capacity = node_count;
+    update_bvh_parents(thread_pool, bvh);
     collapse_leaves(thread_pool, bvh, traversal_cost);
     return bvh;
 }
@@ -734,67 +674,133 @@ struct bvh* build_bvh(
 void free_bvh(struct bvh* bvh) {
     free(bvh->nodes);
     free(bvh->primitive_indices);
+    free(bvh->parents);
     free(bvh);
 }
 
+struct parents_task {
+    struct parallel_task_1d task;
+    const struct bvh_node* nodes;
+    bits_t* parents;
+};
+
+static void run_parents_task(struct parallel_task_1d* task, size_t thread_id) {
+    IGNORE(thread_id);
+    struct parents_task* parents_task = (void*)task;
+    for (size_t i = task->range.begin, n = task->range.end; i < n; ++i) {
+        const struct bvh_node* node = &parents_task->nodes[i];
+        if (node->primitive_count == 0)
+            parents_task->parents[(node->first_child_or_primitive - 1) / 2] = i;
+    }
+}
+
+void update_bvh_parents(struct thread_pool* thread_pool, struct bvh* bvh) {
+    if (!bvh->parents)
+        bvh->parents = xmalloc(sizeof(bits_t) * (bvh->node_count / 2));
+    parallel_for_1d(
+        thread_pool,
+        run_parents_task,
+        (struct parallel_task_1d*)&(struct parents_task) {
+            .nodes   = bvh->nodes,
+            .parents = bvh->parents
+        },
+        sizeof(struct parents_task),
+        &(struct range) { 0, bvh->node_count });
+}
+
 /*
- * The robust traversal implementation is inspired from T. Ize's "Robust BVH Ray Traversal"
- * article. It is only enabled when USE_ROBUST_BVH_TRAVERSAL is defined.
+ * Refitting uses the same bottom-up traversal as the leaf collapsing algorithm:
+ * each leaf walks up towards the root, and the last of the two children of a
+ * node to reach it computes its bounding box.
  */
 
-#define TRAVERSAL_STACK_SIZE 64
+struct refit_init_task {
+    struct parallel_task_1d task;
+    atomic_int* flags;
+};
 
-struct ray_data {
-#ifdef USE_ROBUST_BVH_TRAVERSAL
-    struct vec3 inv_dir;
-    struct vec3 padded_inv_dir;
-#else
-    struct vec3 inv_dir;
-    struct vec3 scaled_org;
-#endif
-    int octant[3];
+static void run_refit_init_task(struct parallel_task_1d* task, size_t thread_id) {
+    IGNORE(thread_id);
+    struct refit_init_task* refit_init_task = (void*)task;
+    for (size_t i = task->range.begin, n = task->range.end; i < n; ++i)
+        atomic_init(&refit_init_task->flags[i], 0);
+}
+
+struct refit_task {
+    struct parallel_task_1d task;
+    struct bvh* bvh;
+    atomic_int* flags;
+    void* primitive_data;
+    bbox_fn_t bbox_fn;
 };
 
-static inline real_t intersect_ray_axis_min(
-    const struct ray* ray,
-    const struct ray_data* ray_data,
-    int axis, real_t p)
-{
-#ifdef USE_ROBUST_BVH_TRAVERSAL
-    return (p - ray->org._[axis]) * ray_data->inv_dir._[axis];
-#else
-    IGNORE(ray);
-    return fast_mul_add(p, ray_data->inv_dir._[axis], ray_data->scaled_org._[axis]);
-#endif
+static void run_refit_task(struct parallel_task_1d* task, size_t thread_id) {
+    IGNORE(thread_id);
+    struct refit_task* refit_task = (void*)task;
+    for (size_t i = task->range.begin, n = task->range.end; i < n; ++i) {
+        struct bvh_node* nodes = refit_task->bvh->nodes;
+        struct bvh_node* node = &nodes[i];
+        if (node->primitive_count == 0)
+            continue;
+
+        if (refit_task->bbox_fn) {
+            struct bbox bbox = empty_bbox();
+            for (size_t j = node->first_child_or_primitive, m = j + node->primitive_count; j < m; ++j)
+                bbox = union_bbox(bbox, refit_task->bbox_fn(refit_task->primitive_data, j));
+            set_bvh_node_bbox(node, &bbox);
+        }
+
+        // Walk up the parents of this node towards the root. Since both children of a node share
+        // the same parent entry, there is one flag per pair of children.
+        size_t j = i;
+        while (j != 0) {
+            size_t pair_index = (j - 1) / 2;
+            j = get_bvh_node_parent(refit_task->bvh, j);
+
+            // Terminate this path if the other child has not yet been processed. The bounding
+            // box of the other child must be visible when it has been, hence the memory ordering.
+            if (atomic_fetch_add_explicit(&refit_task->flags[pair_index], 1, memory_order_acq_rel) == 0)
+                break;
+
+            struct bvh_node* parent = &nodes[j];
+            struct bbox parent_bbox = union_bbox(
+                get_bvh_node_bbox(&nodes[parent->first_child_or_primitive + 0]),
+                get_bvh_node_bbox(&nodes[parent->first_child_or_primitive + 1]));
+            set_bvh_node_bbox(parent, &parent_bbox);
+        }
+    }
 }
 
-static inline real_t intersect_ray_axis_max(
-    const struct ray* ray,
-    const struct ray_data* ray_data,
-    int axis, real_t p)
+void refit_bvh(
+    struct thread_pool* thread_pool,
+    struct bvh* bvh,
+    void* primitive_data,
+    bbox_fn_t bbox_fn)
 {
-#ifdef USE_ROBUST_BVH_TRAVERSAL
-    return (p - ray->org._[axis]) * ray_data->padded_inv_dir._[axis];
-#else
-    return intersect_ray_axis_min(ray, ray_data, axis, p);
-#endif
-}
+    // The parents are those stored in the BVH: only the flags need to be allocated
+    size_t pair_count = bvh->node_count / 2;
+    atomic_int* flags = xmalloc(sizeof(atomic_int) * pair_count);
 
-static inline void compute_ray_data(const struct ray* ray, struct ray_data* ray_data) {
-#ifdef USE_ROBUST_BVH_TRAVERSAL
-    ray_data->inv_dir = div_vec3(const_vec3(1), ray->dir);
-    ray_data->padded_inv_dir._[0] = add_ulp_magnitude(ray_data->inv_dir._[0], 2);
-    ray_data->padded_inv_dir._[1] = add_ulp_magnitude(ray_data->inv_dir._[1], 2);
-    ray_data->padded_inv_dir._[2] = add_ulp_magnitude(ray_data->inv_dir._[2], 2);
-#else
-    ray_data->inv_dir._[0] = safe_inverse(ray->dir._[0]);
-    ray_data->inv_dir._[1] = safe_inverse(ray->dir._[1]);
-    ray_data->inv_dir._[2] = safe_inverse(ray->dir._[2]);
-    ray_data->scaled_org = neg_vec3(mul_vec3(ray->org, ray_data->inv_dir));
-#endif
-    ray_data->octant[0] = signbit(ray->dir._[0]) ? 1 : 0;
-    ray_data->octant[1] = signbit(ray->dir._[1]) ? 1 : 0;
-    ray_data->octant[2] = signbit(ray->dir._[2]) ? 1 : 0;
+    parallel_for_1d(
+        thread_pool,
+        run_refit_init_task,
+        (struct parallel_task_1d*)&(struct refit_init_task) { .flags = flags },
+        sizeof(struct refit_init_task),
+        &(struct range) { 0, pair_count });
+
+    parallel_for_1d(
+        thread_pool,
+        run_refit_task,
+        (struct parallel_task_1d*)&(struct refit_task) {
+            .bvh            = bvh,
+            .flags          = flags,
+            .primitive_data = primitive_data,
+            .bbox_fn        = bbox_fn
+        },
+        sizeof(struct refit_task),
+        &(struct range) { 0, bvh->node_count });
+
+    free(flags);
 }
 
 static inline bool intersect_ray_node(
@@ -810,13 +816,52 @@ static inline bool intersect_ray_node(
     real_t tmax_y = intersect_ray_axis_max(ray, ray_data, 1, node->bounds[2 + 1 - ray_data->octant[1]]);
     real_t tmax_z = intersect_ray_axis_max(ray, ray_data, 2, node->bounds[4 + 1 - ray_data->octant[2]]);
 
-    real_t tmin = max_real(tmin_x, max_real(tmin_x, max_real(tmin_z, ray->t_min)));
+    real_t tmin = max_real(tmin_x, max_real(tmin_y, max_real(tmin_z, ray->t_min)));
     real_t tmax = min_real(tmax_x, min_real(tmax_y, min_real(tmax_z, ray->t_max)));
 
     *t_entry = tmin;
     return tmin <= tmax;
 }
 
+// Returns true if the traversal visits the right child of a node before the left one, when both are intersected.
+static inline bool is_right_child_first(const real_t* t_entry, bool any) {
+    return !any && t_entry[0] > t_entry[1];
+}
+
+/*
+ * Finds the next node to visit after the subtree of the given node has been traversed, when
+ * the traversal stack has overflowed and is empty. Since the traversal is depth-first, the
+ * nodes that were dropped from the stack are the siblings of the ancestors of this node that
+ * are visited after them. These can be found by walking up the parents, and by intersecting
+ * the children of each parent again to know in which order they were visited. Nodes that are
+ * farther than the closest intersection are culled. Returns 0 when the traversal is over.
+ */
+static inline size_t find_next_node(
+    const struct ray* ray,
+    const struct ray_data* ray_data,
+    const struct bvh* bvh,
+    size_t node_index, bool any)
+{
+    while (node_index != 0) {
+        size_t parent_index = get_bvh_node_parent(bvh, node_index);
+        size_t first_child = bvh->nodes[parent_index].first_child_or_primitive;
+        real_t t_entry[2];
+        bool hit_left  = intersect_ray_node(ray, ray_data, bvh->nodes + first_child + 0, t_entry + 0);
+        bool hit_right = intersect_ray_node(ray, ray_data, bvh->nodes + first_child + 1, t_entry + 1);
+        bool right_first = is_right_child_first(t_entry, any);
+
+        // Leaves are intersected as soon as their parent is, so only inner nodes can remain
+        size_t sibling_index = node_index == first_child ? first_child + 1 : first_child;
+        bool was_first = (node_index == first_child) != right_first;
+        if (was_first &&
+            (sibling_index == first_child ? hit_left : hit_right) &&
+            bvh->nodes[sibling_index].primitive_count == 0)
+            return sibling_index;
+        node_index = parent_index;
+    }
+    return 0;
+}
+
 bool intersect_ray_bvh(
     struct ray* ray, struct hit* hit,
     const struct bvh* bvh,
@@ -829,19 +874,19 @@ bool intersect_ray_bvh(
     // Special case when the root node is a leaf
     if (unlikely(bvh->nodes->primitive_count > 0)) {
         real_t t_entry;
-        if (intersect_ray_node(ray, &ray_data, bvh->nodes, &t_entry))
-            return intersect_ray_leaf(ray, hit, bvh->nodes, intersection_data);
+        return
+            intersect_ray_node(ray, &ray_data, bvh->nodes, &t_entry) &&
+            intersect_ray_leaf(ray, hit, bvh->nodes, intersection_data);
     }
 
-    // Allocate some space on the stack to store nodes,
-    // to prevent dynamic allocation whenever possible.
-    bits_t stack_buf[TRAVERSAL_STACK_SIZE];
-    bits_t* stack_ptr = stack_buf;
-    size_t stack_cap = TRAVERSAL_STACK_SIZE, stack_size = 0;
+    // When the stack overflows, `find_next_node()` is used to find the dropped nodes once it becomes empty
+    struct traversal_stack stack;
+    init_traversal_stack(&stack);
 
     bool found = false;
-    const struct bvh_node* left = bvh->nodes + bvh->nodes->first_child_or_primitive;
+    size_t node_index = 0;
     while (true) {
+        const struct bvh_node* left = bvh->nodes + bvh->nodes[node_index].first_child_or_primitive;
         const struct bvh_node* right = left + 1;
 
         // Intersect the two children together
@@ -872,36 +917,480 @@ bool intersect_ray_bvh(
             if (right) {
                 // Both children were intersected, we need to sort them based
                 // on their distances (only in closest intersection mode).
-                if (!any && t_entry[0] > t_entry[1]) {
+                real_t t_far = t_entry[1];
+                if (is_right_child_first(t_entry, any)) {
                     const struct bvh_node* tmp = left;
                     left = right;
                     right = tmp;
+                    t_far = t_entry[0];
                 }
-                // Reallocate the stack on the heap if there is not enough room
-                // in the current stack buffer.
-                if (unlikely(stack_size >= stack_cap)) {
-                    stack_cap *= 2;
-                    if (stack_ptr == stack_buf) {
-                        stack_ptr = xmalloc(sizeof(bits_t) * stack_cap);
-                        memcpy(stack_ptr, stack_buf, sizeof(bits_t) * stack_size);
-                    } else
-                        stack_ptr = xrealloc(stack_ptr, sizeof(bits_t) * stack_cap);
-                }
-                stack_ptr[stack_size++] = right->first_child_or_primitive;
+                push_traversal_stack(&stack, (struct stack_entry) { .node_index = right - bvh->nodes, .t_entry = t_far });
             }
-            left = bvh->nodes + left->first_child_or_primitive;
+            node_index = left - bvh->nodes;
         } else if (right) {
             // Only the right child was intersected
-            left = bvh->nodes + right->first_child_or_primitive;
+            node_index = right - bvh->nodes;
         } else {
-            // No intersection was found
-            if (stack_size == 0)
-                break;
-            left = bvh->nodes + stack_ptr[--stack_size];
+            // No intersection was found: pop nodes until one of them is closer than the closest intersection
+            struct stack_entry entry;
+            bool popped = false;
+            while (pop_traversal_stack(&stack, &entry)) {
+                if (entry.t_entry <= ray->t_max) {
+                    node_index = entry.node_index;
+                    popped = true;
+                    break;
+                }
+            }
+            if (!popped) {
+                if (likely(!stack.overflow))
+                    break;
+                node_index = find_next_node(ray, &ray_data, bvh, node_index, any);
+                if (node_index == 0)
+                    break;
+            }
         }
     }
 
-    if (stack_ptr != stack_buf)
-        free(stack_ptr);
     return found;
 }
+
+bool occluded_ray_bvh(
+    const struct ray* ray,
+    const struct bvh* bvh,
+    occluded_ray_leaf_fn_t occluded_ray_leaf,
+    void* occlusion_data)
+{
+    struct ray_data ray_data;
+    compute_ray_data(ray, &ray_data);
+
+    // The entry distances are required by `intersect_ray_node()`, but never used
+    real_t t_entry[2];
+    if (unlikely(bvh->nodes->primitive_count > 0)) {
+        return
+            intersect_ray_node(ray, &ray_data, bvh->nodes, t_entry) &&
+            occluded_ray_leaf(ray, bvh->nodes, occlusion_data);
+    }
+
+    // The left child is always visited first, which is the order that `find_next_node()` assumes when `any` is set
+    struct node_stack stack;
+    init_node_stack(&stack);
+
+    size_t node_index = 0;
+    while (true) {
+        size_t first_child = bvh->nodes[node_index].first_child_or_primitive;
+        const struct bvh_node* left = bvh->nodes + first_child;
+        const struct bvh_node* right = left + 1;
+        bool hit_left  = intersect_ray_node(ray, &ray_data, left,  t_entry + 0);
+        bool hit_right = intersect_ray_node(ray, &ray_data, right, t_entry + 1);
+
+        if (hit_left && unlikely(left->primitive_count > 0)) {
+            if (occluded_ray_leaf(ray, left, occlusion_data))
+                return true;
+            hit_left = false;
+        }
+        if (hit_right && unlikely(right->primitive_count > 0)) {
+            if (occluded_ray_leaf(ray, right, occlusion_data))
+                return true;
+            hit_right = false;
+        }
+
+        if (hit_left) {
+            if (hit_right)
+                push_node_stack(&stack, first_child + 1);
+            node_index = first_child;
+        } else if (hit_right) {
+            node_index = first_child + 1;
+        } else {
+            bits_t next_index;
+            if (pop_node_stack(&stack, &next_index))
+                node_index = next_index;
+            else {
+                if (likely(!stack.overflow))
+                    return false;
+                node_index = find_next_node(ray, &ray_data, bvh, node_index, true);
+                if (node_index == 0)
+                    return false;
+            }
+        }
+    }
+}
+
+static inline ray_mask_t intersect_ray_packet_node(
+    const struct ray_packet* packet,
+    const struct ray_packet_data* packet_data,
+    const struct bvh_node* node,
+    ray_mask_t mask,
+    real_t* t_entry)
+{
+    bool hits[MAX_RAY_PACKET_SIZE];
+    // This loop has no branches, so that it can be vectorized across rays
+    for (size_t i = 0, n = packet->size; i < n; ++i) {
+        real_t t0_x = intersect_ray_packet_axis_min(packet, packet_data, 0, i, node->bounds[0]);
+        real_t t0_y = intersect_ray_packet_axis_min(packet, packet_data, 1, i, node->bounds[2]);
+        real_t t0_z = intersect_ray_packet_axis_min(packet, packet_data, 2, i, node->bounds[4]);
+        real_t t1_x = intersect_ray_packet_axis_min(packet, packet_data, 0, i, node->bounds[1]);
+        real_t t1_y = intersect_ray_packet_axis_min(packet, packet_data, 1, i, node->bounds[3]);
+        real_t t1_z = intersect_ray_packet_axis_min(packet, packet_data, 2, i, node->bounds[5]);
+        real_t tmin_x = min_real(t0_x, t1_x);
+        real_t tmin_y = min_real(t0_y, t1_y);
+        real_t tmin_z = min_real(t0_z, t1_z);
+#ifdef USE_ROBUST_BVH_TRAVERSAL
+        t0_x = intersect_ray_packet_axis_max(packet, packet_data, 0, i, node->bounds[0]);
+        t0_y = intersect_ray_packet_axis_max(packet, packet_data, 1, i, node->bounds[2]);
+        t0_z = intersect_ray_packet_axis_max(packet, packet_data, 2, i, node->bounds[4]);
+        t1_x = intersect_ray_packet_axis_max(packet, packet_data, 0, i, node->bounds[1]);
+        t1_y = intersect_ray_packet_axis_max(packet, packet_data, 1, i, node->bounds[3]);
+        t1_z = intersect_ray_packet_axis_max(packet, packet_data, 2, i, node->bounds[5]);
+#endif
+        real_t tmax_x = max_real(t0_x, t1_x);
+        real_t tmax_y = max_real(t0_y, t1_y);
+        real_t tmax_z = max_real(t0_z, t1_z);
+
+        real_t tmin = max_real(tmin_x, max_real(tmin_y, max_real(tmin_z, packet->t_min[i])));
+        real_t tmax = min_real(tmax_x, min_real(tmax_y, min_real(tmax_z, packet->t_max[i])));
+
+        t_entry[i] = tmin;
+        hits[i] = tmin <= tmax;
+    }
+    ray_mask_t hit_mask = 0;
+    for (size_t i = 0, n = packet->size; i < n; ++i)
+        hit_mask |= hits[i] ? ((ray_mask_t)1) << i : 0;
+    return hit_mask & mask;
+}
+
+struct packet_stack_entry {
+    bits_t node_index;
+    ray_mask_t mask;
+};
+
+GEN_TRAVERSAL_STACK(packet_stack, struct packet_stack_entry)
+
+// Returns true if the traversal of a packet visits the right child of a node before the left one. In closest
+// intersection mode, the children are sorted based on the distances of the first ray that intersects both.
+static inline bool is_right_child_first_in_packet(
+    const real_t* left_t_entry, const real_t* right_t_entry,
+    ray_mask_t left_mask, ray_mask_t right_mask,
+    bool any)
+{
+    ray_mask_t both_mask = left_mask & right_mask;
+    if (any || both_mask == 0)
+        return false;
+    size_t i = 0;
+    while (!(both_mask & (((ray_mask_t)1) << i))) i++;
+    return left_t_entry[i] > right_t_entry[i];
+}
+
+/*
+ * Same as `find_next_node()`, for a packet traversal with only one active ray. The order in which
+ * the children of a node are visited by a packet depends on the rays that reach the node, which
+ * cannot be recovered in general. With only one ray, this order only depends on that ray.
+ */
+static inline size_t find_next_packet_node(
+    const struct ray_packet* packet,
+    const struct ray_packet_data* packet_data,
+    const struct bvh* bvh,
+    size_t node_index,
+    ray_mask_t mask, bool any)
+{
+    real_t t_entry[2][MAX_RAY_PACKET_SIZE];
+    while (node_index != 0) {
+        size_t parent_index = get_bvh_node_parent(bvh, node_index);
+        size_t first_child = bvh->nodes[parent_index].first_child_or_primitive;
+        ray_mask_t left_mask  = intersect_ray_packet_node(packet, packet_data, bvh->nodes + first_child + 0, mask, t_entry[0]);
+        ray_mask_t right_mask = intersect_ray_packet_node(packet, packet_data, bvh->nodes + first_child + 1, mask, t_entry[1]);
+        bool right_first = is_right_child_first_in_packet(t_entry[0], t_entry[1], mask, mask, any);
+
+        size_t sibling_index = node_index == first_child ? first_child + 1 : first_child;
+        bool was_first = (node_index == first_child) != right_first;
+        if (was_first &&
+            (sibling_index == first_child ? left_mask : right_mask) != 0 &&
+            bvh->nodes[sibling_index].primitive_count == 0)
+            return sibling_index;
+        node_index = parent_index;
+    }
+    return 0;
+}
+
+// Traverses the BVH with the given packet, starting at the given node. When the stack of a packet with
+// several active rays overflows, this returns early, and sets `*overflow`. The rays that are still
+// active must then be traced again individually, which does not require a stack large enough.
+static inline ray_mask_t traverse_ray_packet_bvh(
+    struct ray_packet* packet, struct hit* hits,
+    const struct ray_packet_data* packet_data,
+    ray_mask_t* mask,
+    const struct bvh* bvh,
+    intersect_ray_packet_leaf_fn_t intersect_ray_packet_leaf,
+    void* intersection_data, bool any,
+    bool* overflow)
+{
+    // The stack is shared by all the rays of the packet. Each entry records
+    // the rays that intersected the node when it was pushed.
+    struct packet_stack stack;
+    init_packet_stack(&stack);
+    bool is_single_ray = (*mask & (*mask - 1)) == 0;
+
+    real_t t_entry[2][MAX_RAY_PACKET_SIZE];
+    ray_mask_t found = 0;
+    ray_mask_t node_mask = *mask;
+    size_t node_index = 0;
+    while (true) {
+        const struct bvh_node* left = bvh->nodes + bvh->nodes[node_index].first_child_or_primitive;
+        const struct bvh_node* right = left + 1;
+
+        // Intersect the two children together, only with the rays that intersected the parent
+        ray_mask_t left_mask  = intersect_ray_packet_node(packet, packet_data, left,  node_mask, t_entry[0]);
+        ray_mask_t right_mask = intersect_ray_packet_node(packet, packet_data, right, node_mask, t_entry[1]);
+        bool right_first = is_right_child_first_in_packet(t_entry[0], t_entry[1], left_mask, right_mask, any);
+
+        // In any intersection mode, the rays that found an intersection are terminated
+#define INTERSECT_CHILD(child) \
+        if (child##_mask != 0 && unlikely(child->primitive_count > 0)) { \
+            ray_mask_t leaf_mask = intersect_ray_packet_leaf(packet, hits, child##_mask, child, intersection_data); \
+            found |= leaf_mask; \
+            if (any) { \
+                *mask      &= ~leaf_mask; \
+                left_mask  &= ~leaf_mask; \
+                right_mask &= ~leaf_mask; \
+                if (*mask == 0) \
+                    return found; \
+            } \
+            child##_mask = 0; \
+        }
+
+        INTERSECT_CHILD(left)
+        INTERSECT_CHILD(right)
+
+#undef INTERSECT_CHILD
+
+        if (left_mask != 0) {
+            // The left child was intersected
+            if (right_mask != 0) {
+                // Both children were intersected, so they are visited in order
+                if (right_first) {
+                    const struct bvh_node* tmp_node = left;
+                    ray_mask_t tmp_mask = left_mask;
+                    left = right, left_mask = right_mask;
+                    right = tmp_node, right_mask = tmp_mask;
+                }
+                push_packet_stack(&stack, (struct packet_stack_entry) {
+                    .node_index = right - bvh->nodes,
+                    .mask = right_mask
+                });
+            }
+            node_mask = left_mask;
+            node_index = left - bvh->nodes;
+        } else if (right_mask != 0) {
+            // Only the right child was intersected
+            node_mask = right_mask;
+            node_index = right - bvh->nodes;
+        } else {
+            // No intersection was found: pop nodes until one has active rays
+            struct packet_stack_entry entry;
+            bool popped = false;
+            while (pop_packet_stack(&stack, &entry)) {
+                node_mask = entry.mask & *mask;
+                if (node_mask != 0) {
+                    node_index = entry.node_index;
+                    popped = true;
+                    break;
+                }
+            }
+            if (!popped) {
+                if (likely(!stack.overflow))
+                    return found;
+                if (!is_single_ray) {
+                    *overflow = true;
+                    return found;
+                }
+                node_mask = *mask;
+                node_index = find_next_packet_node(packet, packet_data, bvh, node_index, node_mask, any);
+                if (node_index == 0)
+                    return found;
+            }
+        }
+    }
+}
+
+ray_mask_t intersect_ray_packet_bvh(
+    struct ray_packet* packet, struct hit* hits,
+    ray_mask_t mask,
+    const struct bvh* bvh,
+    intersect_ray_packet_leaf_fn_t intersect_ray_packet_leaf,
+    void* intersection_data, bool any)
+{
+    assert(packet->size <= MAX_RAY_PACKET_SIZE);
+    mask &= full_ray_mask(packet->size);
+    if (mask == 0)
+        return 0;
+
+    struct ray_packet_data packet_data;
+    compute_ray_packet_data(packet, &packet_data);
+
+    // Special case when the root node is a leaf
+    if (unlikely(bvh->nodes->primitive_count > 0)) {
+        real_t t_entry[MAX_RAY_PACKET_SIZE];
+        ray_mask_t leaf_mask = intersect_ray_packet_node(packet, &packet_data, bvh->nodes, mask, t_entry);
+        return leaf_mask != 0
+            ? intersect_ray_packet_leaf(packet, hits, leaf_mask, bvh->nodes, intersection_data)
+            : 0;
+    }
+
+    bool overflow = false;
+    ray_mask_t found = traverse_ray_packet_bvh(
+        packet, hits, &packet_data, &mask, bvh,
+        intersect_ray_packet_leaf, intersection_data, any, &overflow);
+    if (likely(!overflow))
+        return found;
+
+    // Some nodes were dropped from the stack: the remaining rays are traced again one by one, from the root.
+    // The nodes that they already visited are culled or give the same intersections, since the rays are shortened.
+    for (size_t i = 0; (mask >> i) != 0; ++i) {
+        ray_mask_t ray_mask = ((ray_mask_t)1) << i;
+        if (mask & ray_mask) {
+            found |= traverse_ray_packet_bvh(
+                packet, hits, &packet_data, &ray_mask, bvh,
+                intersect_ray_packet_leaf, intersection_data, any, &overflow);
+        }
+    }
+    return found;
+}
+
+// Entry of the stack used by the stream traversal. The list of the
+// rays that intersect a node is kept along with it in a shared buffer.
+struct stream_stack_entry {
+    bits_t node_index;
+    size_t first_ray, ray_count;
+};
+
+void intersect_ray_stream_bvh(
+    struct ray* rays, struct hit* hits,
+    const size_t* ray_ids, bool* found,
+    size_t ray_count,
+    const struct bvh* bvh,
+    intersect_ray_leaf_fn_t intersect_ray_leaf,
+    void* intersection_data, bool any)
+{
+    if (ray_count == 0)
+        return;
+
+    struct ray_data* ray_data = xmalloc(sizeof(struct ray_data) * ray_count);
+    for (size_t i = 0; i < ray_count; ++i) {
+        compute_ray_data(&rays[ray_ids[i]], &ray_data[i]);
+        found[i] = false;
+    }
+
+    // Special case when the root node is a leaf
+    if (unlikely(bvh->nodes->primitive_count > 0)) {
+        for (size_t i = 0; i < ray_count; ++i) {
+            real_t t_entry;
+            struct ray* ray = &rays[ray_ids[i]];
+            if (intersect_ray_node(ray, &ray_data[i], bvh->nodes, &t_entry))
+                found[i] = intersect_ray_leaf(ray, &hits[ray_ids[i]], bvh->nodes, intersection_data);
+        }
+        free(ray_data);
+        return;
+    }
+
+    // The ray lists are allocated in a stack-like fashion: the list of the child that
+    // is visited last replaces the list of its parent, and the list of the other child
+    // is placed right after it. Lists contain positions in the `ray_ids` array.
+    size_t list_cap = ray_count * 2;
+    size_t* lists = xmalloc(sizeof(size_t) * list_cap);
+    uint8_t* child_masks = xmalloc(sizeof(uint8_t) * ray_count);
+    for (size_t i = 0; i < ray_count; ++i)
+        lists[i] = i;
+
+    size_t stack_cap = TRAVERSAL_STACK_SIZE, stack_size = 0;
+    struct stream_stack_entry* stack = xmalloc(sizeof(struct stream_stack_entry) * stack_cap);
+    stack[stack_size++] = (struct stream_stack_entry) { .node_index = 0, .first_ray = 0, .ray_count = ray_count };
+
+    while (stack_size > 0) {
+        struct stream_stack_entry entry = stack[--stack_size];
+        const struct bvh_node* left  = bvh->nodes + bvh->nodes[entry.node_index].first_child_or_primitive;
+        const struct bvh_node* right = left + 1;
+
+        if (unlikely(entry.first_ray + 2 * entry.ray_count > list_cap)) {
+            list_cap = (entry.first_ray + 2 * entry.ray_count) * 2;
+            lists = xrealloc(lists, sizeof(size_t) * list_cap);
+        }
+        size_t* list = lists + entry.first_ray;
+
+        // Intersect the two children with every ray of the list. Leaves are intersected
+        // immediately, and the rays that hit inner nodes are recorded in a mask.
+        ptrdiff_t left_first_votes = 0;
+        for (size_t i = 0, n = entry.ray_count; i < n; ++i) {
+            size_t k = list[i];
+            child_masks[i] = 0;
+            if (any && found[k])
+                continue;
+
+            struct ray* ray = &rays[ray_ids[k]];
+            struct hit* hit = &hits[ray_ids[k]];
+            real_t t_entry[2];
+            bool hit_left  = intersect_ray_node(ray, &ray_data[k], left,  t_entry + 0);
+            bool hit_right = intersect_ray_node(ray, &ray_data[k], right, t_entry + 1);
+
+#define INTERSECT_CHILD(child) \
+            if (hit_##child && unlikely(child->primitive_count > 0)) { \
+                if (intersect_ray_leaf(ray, hit, child, intersection_data)) { \
+                    found[k] = true; \
+                    if (any) \
+                        continue; \
+                } \
+                hit_##child = false; \
+            }
+
+            INTERSECT_CHILD(left)
+            INTERSECT_CHILD(right)
+
+#undef INTERSECT_CHILD
+
+            child_masks[i] = (hit_left ? 1 : 0) | (hit_right ? 2 : 0);
+            if (hit_left && hit_right)
+                left_first_votes += t_entry[0] <= t_entry[1] ? 1 : -1;
+        }
+
+        // The child that is closest for most rays is visited first (only in closest intersection mode)
+        bool left_first = any || left_first_votes >= 0;
+        const struct bvh_node* first_child  = left_first ? left  : right;
+        const struct bvh_node* second_child = left_first ? right : left;
+        uint8_t first_bit  = left_first ? 1 : 2;
+        uint8_t second_bit = left_first ? 2 : 1;
+
+        // Split the list. The list of the child that is visited last is compacted in place,
+        // which is valid since rays are written at positions lower or equal to the ones being read.
+        size_t* first_list = list + entry.ray_count;
+        size_t first_count = 0, second_count = 0;
+        for (size_t i = 0, n = entry.ray_count; i < n; ++i) {
+            size_t k = list[i];
+            if (child_masks[i] & first_bit)
+                first_list[first_count++] = k;
+            if (child_masks[i] & second_bit)
+                list[second_count++] = k;
+        }
+
+        if (unlikely(stack_size + 2 > stack_cap)) {
+            stack_cap *= 2;
+            stack = xrealloc(stack, sizeof(struct stream_stack_entry) * stack_cap);
+        }
+        if (second_count > 0) {
+            stack[stack_size++] = (struct stream_stack_entry) {
+                .node_index = second_child - bvh->nodes,
+                .first_ray = entry.first_ray,
+                .ray_count = second_count
+            };
+        }
+        if (first_count > 0) {
+            stack[stack_size++] = (struct stream_stack_entry) {
+                .node_index = first_child - bvh->nodes,
+                .first_ray = entry.first_ray + entry.ray_count,
+                .ray_count = first_count
+            };
+        }
+    }
+
+    free(stack);
+    free(child_masks);
+    free(lists);
+    free(ray_data);
+}
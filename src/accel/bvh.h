@@ -5,9 +5,8 @@
 
 #include "core/config.h"
 #include "core/bbox.h"
+#include "core/ray.h"
 
-struct ray;
-struct hit;
 struct thread_pool;
 
 struct bvh_node {
@@ -17,16 +16,36 @@ struct bvh_node {
 };
 
 struct bvh {
-    struct bvh_node* nodes;    // The root is located at nodes[0]
-    size_t* primitive_indices; // Reordered primitive indices such that leaves index into that array.
+    struct bvh_node* nodes;       // The root is located at nodes[0]
+    size_t* primitive_indices;    // Reordered primitive indices such that leaves index into that array.
+    size_t primitive_index_count; // Can be larger than the number of primitives if they are referenced several times
     size_t node_count;
+    bits_t* parents;              // Parent of each pair of children (see `get_bvh_node_parent()`)
+    // Allocated sizes of the arrays, only larger than the counts after insertions
+    // (`parents` holds `node_capacity / 2` entries).
+    size_t primitive_index_capacity;
+    size_t node_capacity;
 };
 
+// Returns the index of the parent of a node, which must not be the root. Since children are
+// stored in pairs, starting at an odd index, parents are only stored once per pair of children.
+static inline size_t get_bvh_node_parent(const struct bvh* bvh, size_t node_index) {
+    return bvh->parents[(node_index - 1) / 2];
+}
+
 // Bounding box and cent callbacks used by the construction algorithm
 // to obtain the bounding box and center of a primitive, respectively.
 typedef struct bbox (*bbox_fn_t)(void* primitive_data, size_t index);
 typedef struct vec3 (*center_fn_t)(void* primitive_data, size_t index);
 
+// Callback used by the spatial split construction algorithm to obtain the bounding boxes
+// of the parts of a primitive that lie on each side of the plane `p[axis] = position`.
+typedef void (*split_fn_t)(
+    void* primitive_data, size_t index,
+    int axis, real_t position,
+    struct bbox* left_bbox,
+    struct bbox* right_bbox);
+
 static inline struct bbox get_bvh_node_bbox(const struct bvh_node* node) {
     return (struct bbox) {
         .min = (struct vec3) { { node->bounds[0], node->bounds[2], node->bounds[4] } },
@@ -58,8 +77,107 @@ struct bvh* build_bvh(
     size_t primitive_count,
     real_t traversal_cost);
 
+/*
+ * Builds a BVH with the same interface as `build_bvh()`, using a top-down algorithm
+ * that evaluates the SAH with binning. This is slower than `build_bvh()`, but gives
+ * better trees, especially for scenes containing long and thin primitives.
+ */
+struct bvh* build_sah_bvh(
+    struct thread_pool* thread_pool,
+    void* primitive_data,
+    bbox_fn_t bbox_fn,
+    center_fn_t center_fn,
+    size_t primitive_count,
+    real_t traversal_cost);
+
+/*
+ * Builds a BVH with spatial splits, as described in "Spatial Splits in Bounding Volume
+ * Hierarchies", by M. Stich, H. Friedrich, and A. Dietrich. This is similar to
+ * `build_sah_bvh()`, except that primitives can be split along the planes that separate
+ * the children of a node, which reduces the overlap between nodes when primitives are
+ * large. Primitives may then be referenced by several leaves, and the size of the
+ * `primitive_indices` array is given by `primitive_index_count`. The number of additional
+ * references is at most `max_duplication * primitive_count`.
+ */
+struct bvh* build_sbvh(
+    struct thread_pool* thread_pool,
+    void* primitive_data,
+    bbox_fn_t bbox_fn,
+    split_fn_t split_fn,
+    size_t primitive_count,
+    real_t traversal_cost,
+    real_t max_duplication);
+
 void free_bvh(struct bvh*);
 
+/*
+ * Recomputes the parents of the nodes of a BVH. The functions that create or modify
+ * BVHs in this module keep them up to date, so this is only needed for BVHs that
+ * are created by other means (e.g. loaded from a file). The parents array is allocated
+ * if it is `NULL`.
+ */
+void update_bvh_parents(struct thread_pool* thread_pool, struct bvh* bvh);
+
+/*
+ * Recomputes the bounding boxes of the nodes of a BVH in place, after its primitives
+ * have moved. This is much faster than rebuilding the BVH, but since the topology
+ * is preserved, the quality of the BVH degrades as primitives move further away
+ * from their original positions. Unlike during construction, the bounding box
+ * callback is called with the position of the primitive in the leaves, that is,
+ * with an index into `primitive_indices`, because the primitive data is usually
+ * permuted after construction to match the order of the leaves. If the callback
+ * is `NULL`, the bounding boxes of the leaves are kept, and only those of the inner
+ * nodes are recomputed. The parents stored in the BVH are used to walk up the tree,
+ * and must therefore be up to date.
+ */
+void refit_bvh(
+    struct thread_pool* thread_pool,
+    struct bvh* bvh,
+    void* primitive_data,
+    bbox_fn_t bbox_fn);
+
+/*
+ * Restructures an existing BVH by finding the optimal topology of small treelets, as described
+ * in "Fast Parallel Construction of High-Quality Bounding Volume Hierarchies", by T. Karras and
+ * T. Aila. This is mostly useful after `build_bvh()`, and brings the quality of the resulting
+ * tree close to that of `build_sah_bvh()`. Leaves and primitive indices are left untouched.
+ */
+void restructure_bvh(struct thread_pool* thread_pool, struct bvh* bvh, real_t traversal_cost);
+
+/*
+ * Optimizes an existing BVH by moving subtrees to positions where they reduce the SAH cost,
+ * using parallel reinsertion. The leaves and primitive indices are left untouched, so this
+ * can be used after any of the construction algorithms. The optimization stops after
+ * `time_budget` seconds, or earlier when the cost of the tree no longer improves.
+ */
+void optimize_bvh(struct thread_pool* thread_pool, struct bvh* bvh, double time_budget);
+
+/*
+ * Inserts a primitive with the given bounding box into an existing BVH, as a new leaf placed
+ * next to the node that minimizes the increase of the SAH cost, as described in "Fast
+ * Insertion-Based Optimization of Bounding Volume Hierarchies", by J. Bittner et al. Only the
+ * ancestors of the new leaf are refitted, which makes this much faster than a rebuild when
+ * few primitives are added. The arrays of the BVH are reallocated as needed.
+ */
+void insert_bvh_primitive(struct bvh* bvh, size_t primitive_index, const struct bbox* bbox);
+
+/*
+ * Removes every reference to a primitive from a BVH. The given bounding box must overlap the
+ * leaves that reference the primitive, which is the case for the bounding box it was inserted
+ * or built with. Leaves that become empty are removed, and their sibling takes the place of
+ * their parent. The slots of `primitive_indices` that are freed are only reclaimed by a
+ * rebuild, and the bounding boxes of leaves that still contain other primitives are kept.
+ * The last primitive of a BVH cannot be removed. Returns the number of removed references.
+ */
+size_t remove_bvh_primitive(struct bvh* bvh, size_t primitive_index, const struct bbox* bbox);
+
+/*
+ * Computes the SAH cost of a BVH, relative to the area of its root, with the same traversal
+ * cost as the construction algorithms. This can be used to monitor the quality of a BVH
+ * that is updated incrementally.
+ */
+real_t compute_bvh_cost(const struct bvh* bvh, real_t traversal_cost);
+
 /*
  * Intersection callback used by the traversal function
  * to intersect the contents of a leaf.
@@ -79,6 +197,9 @@ typedef bool (*intersect_ray_leaf_fn_t)(
  * intersection. If an intersection was found, `ray->t_max`
  * contains the intersection distance, and `hit` contains the
  * hit data. Otherwise, `ray` and `hit` are left unchanged.
+ * This function never allocates memory: the traversal stack
+ * has a fixed size, and when it overflows, the nodes that
+ * no longer fit are found again by walking up the parents.
  */
 bool intersect_ray_bvh(
     struct ray*, struct hit*,
@@ -86,4 +207,73 @@ bool intersect_ray_bvh(
     intersect_ray_leaf_fn_t intersect_ray_leaf,
     void* intersection_data, bool any);
 
+/*
+ * Callback used by the occlusion traversal function to test the contents of a leaf.
+ * Returns true if the ray intersects one of the primitives of the leaf between
+ * `ray->t_min` and `ray->t_max`. No hit data needs to be computed.
+ */
+typedef bool (*occluded_ray_leaf_fn_t)(
+    const struct ray* ray,
+    const struct bvh_node* leaf,
+    void* occlusion_data);
+
+/*
+ * Determines whether a ray intersects anything in a BVH, as `intersect_ray_bvh()` does
+ * when `any` is set, but faster: the children of a node are visited in a fixed order
+ * instead of being sorted by distance, stack entries do not carry an entry distance since
+ * the ray is never shortened, and there is no hit to fill. Like `intersect_ray_bvh()`,
+ * this function never allocates memory.
+ */
+bool occluded_ray_bvh(
+    const struct ray*,
+    const struct bvh* bvh,
+    occluded_ray_leaf_fn_t occluded_ray_leaf,
+    void* occlusion_data);
+
+/*
+ * Intersection callback used by the packet traversal function to intersect
+ * the contents of a leaf with the rays of a packet whose bit is set in `mask`.
+ * Returns the mask of the rays for which an intersection was found.
+ */
+typedef ray_mask_t (*intersect_ray_packet_leaf_fn_t)(
+    struct ray_packet*, struct hit*,
+    ray_mask_t mask,
+    const struct bvh_node* leaf,
+    void* intersection_data);
+
+/*
+ * Intersects a BVH with a packet of rays. Only the rays whose bit is set in `mask`
+ * are traced. The rays of the packet share the same traversal stack, and a node is
+ * visited when at least one ray intersects it. This is only efficient when the rays
+ * are coherent, as is the case for primary rays. The semantics are the same as those
+ * of `intersect_ray_bvh()`, applied to each ray individually: the `i`-th ray of the
+ * packet corresponds to `hits[i]`. Returns the mask of the rays that hit something.
+ * This function never allocates memory either: when its stack overflows, the rays that
+ * are still active are traced again one by one once the packet traversal is over.
+ */
+ray_mask_t intersect_ray_packet_bvh(
+    struct ray_packet*, struct hit* hits,
+    ray_mask_t mask,
+    const struct bvh* bvh,
+    intersect_ray_packet_leaf_fn_t intersect_ray_packet_leaf,
+    void* intersection_data, bool any);
+
+/*
+ * Intersects a BVH with a stream of rays, given as a list of indices into the `rays`
+ * and `hits` arrays. The stream is filtered breadth-first through the BVH: each
+ * node is loaded once for all the rays that reach it, and the list of rays that
+ * intersect each of its children is computed before visiting them. This amortizes
+ * the cost of fetching nodes when rays are not coherent enough for packets, provided
+ * that they have been sorted beforehand. For each ray, the semantics are the same as
+ * those of `intersect_ray_bvh()`. The flag `found[i]` is set if the ray with index
+ * `ray_ids[i]` intersects something, and cleared otherwise.
+ */
+void intersect_ray_stream_bvh(
+    struct ray* rays, struct hit* hits,
+    const size_t* ray_ids, bool* found,
+    size_t ray_count,
+    const struct bvh* bvh,
+    intersect_ray_leaf_fn_t intersect_ray_leaf,
+    void* intersection_data, bool any);
+
 #endif
@@ -0,0 +1,460 @@
+#include <stdlib.h>
+#include <assert.h>
+
+#include "accel/compressed_bvh.h"
+#include "accel/traversal.h"
+#include "core/utils.h"
+#include "core/ray.h"
+
+#define QUANTIZED_MAX UINT8_MAX
+#ifdef USE_DOUBLE_PRECISION
+#define MIN_EXPONENT INT8_MIN
+#else
+#define MIN_EXPONENT (-126) // Smallest exponent of a normalized single-precision number
+#endif
+
+// Computes `2^e` by building the floating-point number directly.
+static inline real_t exponent_to_scale(int e) {
+    assert(e >= MIN_EXPONENT);
+#ifdef USE_DOUBLE_PRECISION
+    return bits_to_float(((bits_t)(e + 1023)) << 52);
+#else
+    return bits_to_float(((bits_t)(e + 127)) << 23);
+#endif
+}
+
+static inline real_t decode_bound(uint8_t q, real_t scale, real_t origin) {
+    return fast_mul_add((real_t)q, scale, origin);
+}
+
+/*
+ * The compression is done in breadth-first order, so that the inner children of a
+ * node are allocated contiguously. Each work item is either a node of the source BVH,
+ * or a range of primitives that is too large to fit in a leaf, and that must be split.
+ */
+
+struct compress_item {
+    size_t dst_index;
+    size_t node_index;       // Index of the source node, or `SIZE_MAX` for a range of primitives
+    size_t first_primitive;
+    size_t primitive_count;
+    struct bbox bbox;
+};
+
+static inline bool is_leaf_item(const struct compress_item* item) {
+    return item->node_index == SIZE_MAX && item->primitive_count <= COMPRESSED_BVH_MAX_LEAF_SIZE;
+}
+
+static size_t gather_children(
+    const struct bvh8* bvh,
+    const struct compress_item* item,
+    struct compress_item* children)
+{
+    size_t child_count = 0;
+    if (item->node_index == SIZE_MAX) {
+        // Split the range of primitives into (at most) 8 leaves with the same bounding box
+        size_t chunk_size = round_up(item->primitive_count, 8);
+        for (size_t i = 0; i < item->primitive_count; i += chunk_size) {
+            children[child_count++] = (struct compress_item) {
+                .node_index = SIZE_MAX,
+                .first_primitive = item->first_primitive + i,
+                .primitive_count = i + chunk_size < item->primitive_count ? chunk_size : item->primitive_count - i,
+                .bbox = item->bbox
+            };
+        }
+        return child_count;
+    }
+
+    const struct bvh8_node* node = &bvh->nodes[item->node_index];
+    for (size_t i = 0; i < 8; ++i) {
+        // Skip empty slots
+        if (node->bounds[0][i] > node->bounds[1][i])
+            continue;
+        struct compress_item* child = &children[child_count++];
+        child->bbox = (struct bbox) {
+            .min = make_vec3(node->bounds[0][i], node->bounds[2][i], node->bounds[4][i]),
+            .max = make_vec3(node->bounds[1][i], node->bounds[3][i], node->bounds[5][i])
+        };
+        if (node->primitive_count[i] == 0) {
+            child->node_index = node->first_child_or_primitive[i];
+            child->first_primitive = child->primitive_count = 0;
+        } else {
+            child->node_index = SIZE_MAX;
+            child->first_primitive = node->first_child_or_primitive[i];
+            child->primitive_count = node->primitive_count[i];
+        }
+    }
+    return child_count;
+}
+
+static inline void compute_frame(
+    struct compressed_bvh8_node* node,
+    const struct bbox* child_bboxes,
+    size_t child_count)
+{
+    struct bbox frame = empty_bbox();
+    for (size_t i = 0; i < child_count; ++i)
+        frame = union_bbox(frame, child_bboxes[i]);
+    for (int axis = 0; axis < 3; ++axis) {
+        real_t origin = frame.min._[axis];
+        int e;
+        frexp((frame.max._[axis] - origin) / QUANTIZED_MAX, &e);
+        e = e < MIN_EXPONENT ? MIN_EXPONENT : e;
+        // Make sure that the extent of the frame is covered, even with rounding errors
+        while (decode_bound(QUANTIZED_MAX, exponent_to_scale(e), origin) < frame.max._[axis])
+            e++;
+        assert(e <= INT8_MAX);
+        node->origin[axis] = origin;
+        node->exponents[axis] = e;
+    }
+}
+
+static inline void quantize_bounds(
+    struct compressed_bvh8_node* node, size_t i,
+    const struct bbox* bbox)
+{
+    for (int axis = 0; axis < 3; ++axis) {
+        real_t origin = node->origin[axis];
+        real_t scale  = exponent_to_scale(node->exponents[axis]);
+        real_t lo = floor((bbox->min._[axis] - origin) / scale);
+        real_t hi = ceil ((bbox->max._[axis] - origin) / scale);
+        uint8_t q_lo = lo < 0 ? 0 : (lo > QUANTIZED_MAX ? QUANTIZED_MAX : lo);
+        uint8_t q_hi = hi < 0 ? 0 : (hi > QUANTIZED_MAX ? QUANTIZED_MAX : hi);
+        // The decoded bounds must be conservative
+        while (q_lo > 0 && decode_bound(q_lo, scale, origin) > bbox->min._[axis])
+            q_lo--;
+        while (q_hi < QUANTIZED_MAX && decode_bound(q_hi, scale, origin) < bbox->max._[axis])
+            q_hi++;
+        node->bounds[axis * 2 + 0][i] = q_lo;
+        node->bounds[axis * 2 + 1][i] = q_hi;
+    }
+}
+
+struct compressed_bvh8* compress_bvh8(const struct bvh8* bvh) {
+    size_t primitive_count = 0;
+    for (size_t i = 0, n = bvh->node_count; i < n; ++i) {
+        for (size_t j = 0; j < 8; ++j)
+            primitive_count += bvh->nodes[i].primitive_count[j];
+    }
+
+    size_t node_cap = bvh->node_count, node_count = 1;
+    size_t item_cap = bvh->node_count, item_count = 1;
+    struct compressed_bvh8_node* nodes = xmalloc(sizeof(struct compressed_bvh8_node) * node_cap);
+    struct compress_item* items = xmalloc(sizeof(struct compress_item) * item_cap);
+    size_t* primitive_indices = xmalloc(sizeof(size_t) * primitive_count);
+    size_t first_primitive = 0;
+    items[0] = (struct compress_item) { .dst_index = 0, .node_index = 0 };
+
+    for (size_t i = 0; i < item_count; ++i) {
+        struct compress_item children[8];
+        size_t child_count = gather_children(bvh, &items[i], children);
+        assert(child_count > 0);
+
+        size_t inner_count = 0;
+        for (size_t j = 0; j < child_count; ++j)
+            inner_count += is_leaf_item(&children[j]) ? 0 : 1;
+        if (node_count + inner_count > node_cap) {
+            node_cap = node_cap * 2 + inner_count;
+            nodes = xrealloc(nodes, sizeof(struct compressed_bvh8_node) * node_cap);
+        }
+        if (item_count + inner_count > item_cap) {
+            item_cap = item_cap * 2 + inner_count;
+            items = xrealloc(items, sizeof(struct compress_item) * item_cap);
+        }
+
+        struct bbox child_bboxes[8];
+        for (size_t j = 0; j < child_count; ++j)
+            child_bboxes[j] = children[j].bbox;
+
+        struct compressed_bvh8_node* node = &nodes[items[i].dst_index];
+        compute_frame(node, child_bboxes, child_count);
+        node->inner_mask = 0;
+        node->first_child = node_count;
+        node->first_primitive = first_primitive;
+        for (size_t j = 0; j < 8; ++j) {
+            node->primitive_count[j] = 0;
+            if (j >= child_count) {
+                // Empty slots have inverted bounds, and are masked during traversal
+                for (int axis = 0; axis < 3; ++axis) {
+                    node->bounds[axis * 2 + 0][j] = QUANTIZED_MAX;
+                    node->bounds[axis * 2 + 1][j] = 0;
+                }
+                continue;
+            }
+            quantize_bounds(node, j, &children[j].bbox);
+            if (is_leaf_item(&children[j])) {
+                node->primitive_count[j] = children[j].primitive_count;
+                memcpy(
+                    primitive_indices + first_primitive,
+                    bvh->primitive_indices + children[j].first_primitive,
+                    sizeof(size_t) * children[j].primitive_count);
+                first_primitive += children[j].primitive_count;
+            } else {
+                node->inner_mask |= 1u << j;
+                children[j].dst_index = node_count++;
+                items[item_count++] = children[j];
+            }
+        }
+        assert(node_count <= UINT32_MAX && first_primitive <= UINT32_MAX);
+    }
+    assert(first_primitive == primitive_count);
+    free(items);
+
+    struct compressed_bvh8* compressed_bvh = xmalloc(sizeof(struct compressed_bvh8));
+    compressed_bvh->nodes = xrealloc(nodes, sizeof(struct compressed_bvh8_node) * node_count);
+    compressed_bvh->node_count = node_count;
+    compressed_bvh->primitive_indices = primitive_indices;
+    return compressed_bvh;
+}
+
+void refit_compressed_bvh8(struct compressed_bvh8* bvh, void* primitive_data, bbox_fn_t bbox_fn) {
+    // The exact bounding box of every node is needed to quantize the bounds of its parent
+    struct bbox* node_bboxes = xmalloc(sizeof(struct bbox) * bvh->node_count);
+
+    // Inner children are always stored after their parent, so nodes can be processed in reverse order
+    for (size_t i = bvh->node_count; i-- > 0;) {
+        struct compressed_bvh8_node* node = &bvh->nodes[i];
+        struct bbox child_bboxes[8];
+        size_t slots[8];
+        size_t child_count = 0;
+        size_t first_child = node->first_child, first_primitive = node->first_primitive;
+        for (size_t j = 0; j < 8; ++j) {
+            struct bbox bbox = empty_bbox();
+            if (node->primitive_count[j] > 0) {
+                for (size_t k = first_primitive, n = k + node->primitive_count[j]; k < n; ++k)
+                    bbox = union_bbox(bbox, bbox_fn(primitive_data, k));
+                first_primitive += node->primitive_count[j];
+            } else if (node->inner_mask & (1u << j))
+                bbox = node_bboxes[first_child++];
+            else
+                continue;
+            slots[child_count] = j;
+            child_bboxes[child_count++] = bbox;
+        }
+
+        compute_frame(node, child_bboxes, child_count);
+        node_bboxes[i] = empty_bbox();
+        for (size_t j = 0; j < child_count; ++j) {
+            quantize_bounds(node, slots[j], &child_bboxes[j]);
+            node_bboxes[i] = union_bbox(node_bboxes[i], child_bboxes[j]);
+        }
+    }
+
+    free(node_bboxes);
+}
+
+void free_compressed_bvh8(struct compressed_bvh8* bvh) {
+    free(bvh->nodes);
+    free(bvh->primitive_indices);
+    free(bvh);
+}
+
+static inline unsigned intersect_ray_compressed_bvh8_node(
+    const struct ray* ray,
+    const struct ray_data* ray_data,
+    const struct compressed_bvh8_node* node,
+    real_t* t_entry)
+{
+    const uint8_t* min_x = node->bounds[0 + ray_data->octant[0]];
+    const uint8_t* min_y = node->bounds[2 + ray_data->octant[1]];
+    const uint8_t* min_z = node->bounds[4 + ray_data->octant[2]];
+    const uint8_t* max_x = node->bounds[0 + 1 - ray_data->octant[0]];
+    const uint8_t* max_y = node->bounds[2 + 1 - ray_data->octant[1]];
+    const uint8_t* max_z = node->bounds[4 + 1 - ray_data->octant[2]];
+    real_t scale_x = exponent_to_scale(node->exponents[0]);
+    real_t scale_y = exponent_to_scale(node->exponents[1]);
+    real_t scale_z = exponent_to_scale(node->exponents[2]);
+    bool hits[8];
+    for (size_t i = 0; i < 8; ++i) {
+        real_t tmin_x = intersect_ray_axis_min(ray, ray_data, 0, decode_bound(min_x[i], scale_x, node->origin[0]));
+        real_t tmin_y = intersect_ray_axis_min(ray, ray_data, 1, decode_bound(min_y[i], scale_y, node->origin[1]));
+        real_t tmin_z = intersect_ray_axis_min(ray, ray_data, 2, decode_bound(min_z[i], scale_z, node->origin[2]));
+        real_t tmax_x = intersect_ray_axis_max(ray, ray_data, 0, decode_bound(max_x[i], scale_x, node->origin[0]));
+        real_t tmax_y = intersect_ray_axis_max(ray, ray_data, 1, decode_bound(max_y[i], scale_y, node->origin[1]));
+        real_t tmax_z = intersect_ray_axis_max(ray, ray_data, 2, decode_bound(max_z[i], scale_z, node->origin[2]));
+        real_t tmin = max_real(tmin_x, max_real(tmin_y, max_real(tmin_z, ray->t_min)));
+        real_t tmax = min_real(tmax_x, min_real(tmax_y, min_real(tmax_z, ray->t_max)));
+        t_entry[i] = tmin;
+        hits[i] = tmin <= tmax;
+    }
+    // Empty slots are masked out, since their bounds may be intersected due to rounding
+    unsigned mask = 0;
+    for (size_t i = 0; i < 8; ++i)
+        mask |= hits[i] && (node->primitive_count[i] > 0 || (node->inner_mask & (1u << i))) ? 1u << i : 0;
+    return mask;
+}
+
+// Recovers the index of each child from the contiguous child and primitive ranges.
+static inline void get_compressed_bvh8_child_indices(const struct compressed_bvh8_node* node, bits_t* child_indices) {
+    bits_t next_child = node->first_child, next_primitive = node->first_primitive;
+    for (size_t i = 0; i < 8; ++i) {
+        bool is_inner = node->inner_mask & (1u << i);
+        child_indices[i] = is_inner ? next_child : next_primitive;
+        next_child += is_inner ? 1 : 0;
+        next_primitive += node->primitive_count[i];
+    }
+}
+
+// Finds the parent of a node. Since nodes are stored in breadth-first order, and the inner children of a
+// node are contiguous, the indices of the first inner children are sorted, and the parent of a node is the
+// last node whose first inner child is not after it. This avoids storing parents in the compressed BVH.
+static inline size_t find_compressed_bvh8_parent(const struct compressed_bvh8* bvh, size_t node_index) {
+    size_t begin = 0, end = node_index;
+    while (end - begin > 1) {
+        size_t middle = begin + (end - begin) / 2;
+        if (bvh->nodes[middle].first_child <= node_index)
+            begin = middle;
+        else
+            end = middle;
+    }
+    return begin;
+}
+
+// Same as `find_next_node()` in the binary BVH traversal.
+static inline size_t find_next_compressed_bvh8_node(
+    const struct ray* ray,
+    const struct ray_data* ray_data,
+    const struct compressed_bvh8* bvh,
+    size_t node_index, bool any)
+{
+    while (node_index != 0) {
+        size_t parent_index = find_compressed_bvh8_parent(bvh, node_index);
+        const struct compressed_bvh8_node* parent = &bvh->nodes[parent_index];
+        real_t t_entry[8];
+        unsigned mask = intersect_ray_compressed_bvh8_node(ray, ray_data, parent, t_entry) & parent->inner_mask;
+        bits_t child_indices[8];
+        get_compressed_bvh8_child_indices(parent, child_indices);
+        size_t c = 8;
+        for (size_t i = 0; i < 8; ++i) {
+            if ((parent->inner_mask & (1u << i)) && child_indices[i] == node_index)
+                c = i;
+        }
+        assert(c < 8);
+        size_t next = find_next_hit_child(mask, t_entry, 8, !any, c);
+        if (next < 8)
+            return child_indices[next];
+        node_index = parent_index;
+    }
+    return 0;
+}
+
+bool intersect_ray_compressed_bvh8(
+    struct ray* ray, struct hit* hit,
+    const struct compressed_bvh8* bvh,
+    intersect_ray_leaf_fn_t intersect_ray_leaf,
+    void* intersection_data, bool any)
+{
+    struct ray_data ray_data;
+    compute_ray_data(ray, &ray_data);
+
+    struct traversal_stack stack;
+    init_traversal_stack(&stack);
+
+    bool found = false;
+    const struct compressed_bvh8_node* node = bvh->nodes;
+    while (true) {
+        real_t t_entry[8];
+        unsigned mask = intersect_ray_compressed_bvh8_node(ray, &ray_data, node, t_entry);
+
+        size_t hit_children[8];
+        size_t hit_count = gather_hit_children(mask, t_entry, 8, !any, hit_children);
+
+        bits_t child_indices[8];
+        get_compressed_bvh8_child_indices(node, child_indices);
+
+        // Intersect leaves from front to back
+        for (size_t k = 0; k < hit_count; ++k) {
+            size_t i = hit_children[k];
+            if (likely(node->primitive_count[i] == 0) || t_entry[i] > ray->t_max)
+                continue;
+            const struct bvh_node leaf = {
+                .primitive_count = node->primitive_count[i],
+                .first_child_or_primitive = child_indices[i]
+            };
+            if (intersect_ray_leaf(ray, hit, &leaf, intersection_data)) {
+                found = true;
+                if (any)
+                    return true;
+            }
+        }
+
+        // Push inner nodes from back to front, so that the closest one is popped first
+        for (size_t k = hit_count; k-- > 0;) {
+            size_t i = hit_children[k];
+            if (node->primitive_count[i] != 0 || t_entry[i] > ray->t_max)
+                continue;
+            push_traversal_stack(&stack, (struct stack_entry) {
+                .node_index = child_indices[i],
+                .t_entry = t_entry[i]
+            });
+        }
+
+        // Pop the next node, culling the ones that are behind the closest intersection
+        struct stack_entry entry;
+        bool popped = false;
+        while (pop_traversal_stack(&stack, &entry)) {
+            if (entry.t_entry <= ray->t_max) {
+                popped = true;
+                break;
+            }
+        }
+        if (popped)
+            node = bvh->nodes + entry.node_index;
+        else {
+            if (likely(!stack.overflow))
+                return found;
+            size_t next_index = find_next_compressed_bvh8_node(ray, &ray_data, bvh, node - bvh->nodes, any);
+            if (next_index == 0)
+                return found;
+            node = bvh->nodes + next_index;
+        }
+    }
+}
+
+bool occluded_ray_compressed_bvh8(
+    const struct ray* ray,
+    const struct compressed_bvh8* bvh,
+    occluded_ray_leaf_fn_t occluded_ray_leaf,
+    void* occlusion_data)
+{
+    struct ray_data ray_data;
+    compute_ray_data(ray, &ray_data);
+
+    struct node_stack stack;
+    init_node_stack(&stack);
+
+    const struct compressed_bvh8_node* node = bvh->nodes;
+    while (true) {
+        real_t t_entry[8];
+        unsigned mask = intersect_ray_compressed_bvh8_node(ray, &ray_data, node, t_entry);
+
+        bits_t child_indices[8];
+        get_compressed_bvh8_child_indices(node, child_indices);
+
+        // Leaves are tested immediately. Inner nodes are pushed in reverse order, so that they are popped in storage order.
+        for (size_t i = 8; i-- > 0;) {
+            if (!(mask & (1u << i)))
+                continue;
+            if (likely(node->primitive_count[i] == 0)) {
+                push_node_stack(&stack, child_indices[i]);
+                continue;
+            }
+            const struct bvh_node leaf = {
+                .primitive_count = node->primitive_count[i],
+                .first_child_or_primitive = child_indices[i]
+            };
+            if (occluded_ray_leaf(ray, &leaf, occlusion_data))
+                return true;
+        }
+
+        bits_t next_index;
+        if (!pop_node_stack(&stack, &next_index)) {
+            if (likely(!stack.overflow))
+                return false;
+            next_index = find_next_compressed_bvh8_node(ray, &ray_data, bvh, node - bvh->nodes, true);
+            if (next_index == 0)
+                return false;
+        }
+        node = bvh->nodes + next_index;
+    }
+}
@@ -0,0 +1,65 @@
+#ifndef ACCEL_COMPRESSED_BVH_H
+#define ACCEL_COMPRESSED_BVH_H
+
+#include <stdint.h>
+
+#include "accel/wide_bvh.h"
+
+/*
+ * Compressed 8-wide BVH, in the style of "Efficient Incoherent Ray Traversal on GPUs
+ * Through Compressed Wide BVHs", by H. Ylitie, T. Karras, and S. Laine.
+ * The bounding boxes of the children are quantized to 8 bits, relative to a frame
+ * made of an origin and a power-of-two scale per axis, which is stored in the parent.
+ * The inner children of a node are stored contiguously, and so are the primitives of its
+ * leaves, which removes the need to store per-child indices. A node takes 80 bytes
+ * in single precision, compared to 256 bytes for an uncompressed 8-wide node.
+ */
+
+#define COMPRESSED_BVH_MAX_LEAF_SIZE UINT8_MAX
+
+struct compressed_bvh8_node {
+    real_t origin[3];             // Origin of the quantization frame
+    int8_t exponents[3];          // Scale of the quantization frame, as a power of two
+    uint8_t inner_mask;           // Bit i is set if child i is an inner node
+    uint32_t first_child;         // Index of the first inner child
+    uint32_t first_primitive;     // Index of the first primitive of the first leaf child
+    uint8_t primitive_count[8];   // A primitive count of 0 indicates an inner node or an empty slot
+    uint8_t bounds[6][8];         // Quantized bounds, stored as min_x[], max_x[], min_y[], max_y[], ...
+};
+
+struct compressed_bvh8 {
+    struct compressed_bvh8_node* nodes; // The root is located at nodes[0]
+    size_t* primitive_indices;          // Reordered so that the leaves of a node are contiguous
+    size_t node_count;
+};
+
+/*
+ * Compresses an 8-wide BVH. The original BVH is left untouched, and can be freed
+ * after this call. Leaves that contain more than `COMPRESSED_BVH_MAX_LEAF_SIZE`
+ * primitives are split. Since primitives are reordered, the primitive indices
+ * of the compressed BVH must be used to permute the primitive data.
+ */
+struct compressed_bvh8* compress_bvh8(const struct bvh8* bvh);
+
+void free_compressed_bvh8(struct compressed_bvh8*);
+
+// Same as `refit_bvh()`, but for compressed BVHs. The quantization frames are recomputed,
+// which requires a temporary copy of the exact bounding boxes. This function runs sequentially.
+void refit_compressed_bvh8(struct compressed_bvh8* bvh, void* primitive_data, bbox_fn_t bbox_fn);
+
+// Same as `intersect_ray_bvh()`, but for compressed BVHs. The bounding boxes are decoded on the fly.
+// This function never allocates memory, and neither does `occluded_ray_compressed_bvh8()`.
+bool intersect_ray_compressed_bvh8(
+    struct ray*, struct hit*,
+    const struct compressed_bvh8* bvh,
+    intersect_ray_leaf_fn_t intersect_ray_leaf,
+    void* intersection_data, bool any);
+
+// Same as `occluded_ray_bvh()`, but for compressed BVHs.
+bool occluded_ray_compressed_bvh8(
+    const struct ray*,
+    const struct compressed_bvh8* bvh,
+    occluded_ray_leaf_fn_t occluded_ray_leaf,
+    void* occlusion_data);
+
+#endif
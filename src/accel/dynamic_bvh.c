@@ -0,0 +1,221 @@
+#include <stdlib.h>
+#include <stdatomic.h>
+#include <threads.h>
+
+#include "accel/dynamic_bvh.h"
+#include "core/thread_pool.h"
+#include "core/utils.h"
+
+// The cost of the BVH is computed every time the number of edits reaches a fraction of
+// its number of nodes, so that monitoring its quality takes amortized constant time per edit.
+#define CHECK_INTERVAL_RATIO 16
+#define MIN_CHECK_INTERVAL 64
+
+struct bvh_edit {
+    size_t primitive_index;
+    struct bbox bbox;
+    bool is_insertion;
+};
+
+struct bvh_rebuild {
+    thrd_t thread;
+    bool has_thread;
+    struct thread_pool* thread_pool;
+    struct bbox* bboxes;        // Bounding boxes of the primitives when the rebuild started
+    size_t* primitive_indices;  // Index of the primitive corresponding to each bounding box
+    size_t primitive_count;
+    real_t traversal_cost;
+    struct bvh* bvh;
+    real_t cost;
+    atomic_bool is_done;
+    struct bvh_edit* edits;     // Edits made since the rebuild started
+    size_t edit_count;
+    size_t edit_capacity;
+};
+
+struct dynamic_bvh* new_dynamic_bvh(
+    struct bvh* bvh,
+    void* primitive_data,
+    bbox_fn_t bbox_fn,
+    real_t traversal_cost,
+    real_t max_cost_ratio,
+    size_t rebuild_thread_count)
+{
+    struct dynamic_bvh* dynamic_bvh = xmalloc(sizeof(struct dynamic_bvh));
+    dynamic_bvh->bvh = bvh;
+    dynamic_bvh->primitive_data = primitive_data;
+    dynamic_bvh->bbox_fn = bbox_fn;
+    dynamic_bvh->traversal_cost = traversal_cost;
+    dynamic_bvh->max_cost_ratio = max_cost_ratio;
+    dynamic_bvh->built_cost = compute_bvh_cost(bvh, traversal_cost);
+    dynamic_bvh->edit_count = 0;
+    dynamic_bvh->rebuild_thread_pool = new_thread_pool(rebuild_thread_count);
+    dynamic_bvh->rebuild = NULL;
+    return dynamic_bvh;
+}
+
+static void free_bvh_rebuild(struct bvh_rebuild* rebuild) {
+    free(rebuild->bboxes);
+    free(rebuild->primitive_indices);
+    free(rebuild->edits);
+    free(rebuild);
+}
+
+void free_dynamic_bvh(struct dynamic_bvh* dynamic_bvh) {
+    if (dynamic_bvh->rebuild) {
+        if (dynamic_bvh->rebuild->has_thread)
+            thrd_join(dynamic_bvh->rebuild->thread, NULL);
+        free_bvh(dynamic_bvh->rebuild->bvh);
+        free_bvh_rebuild(dynamic_bvh->rebuild);
+    }
+    free_thread_pool(dynamic_bvh->rebuild_thread_pool);
+    free_bvh(dynamic_bvh->bvh);
+    free(dynamic_bvh);
+}
+
+static void record_edit(struct dynamic_bvh* dynamic_bvh, size_t primitive_index, const struct bbox* bbox, bool is_insertion) {
+    dynamic_bvh->edit_count++;
+    struct bvh_rebuild* rebuild = dynamic_bvh->rebuild;
+    if (!rebuild)
+        return;
+    if (rebuild->edit_count >= rebuild->edit_capacity) {
+        rebuild->edit_capacity = rebuild->edit_capacity ? rebuild->edit_capacity * 2 : MIN_CHECK_INTERVAL;
+        rebuild->edits = xrealloc(rebuild->edits, sizeof(struct bvh_edit) * rebuild->edit_capacity);
+    }
+    rebuild->edits[rebuild->edit_count++] = (struct bvh_edit) {
+        .primitive_index = primitive_index,
+        .bbox = *bbox,
+        .is_insertion = is_insertion
+    };
+}
+
+void insert_dynamic_bvh_primitive(struct dynamic_bvh* dynamic_bvh, size_t primitive_index) {
+    struct bbox bbox = dynamic_bvh->bbox_fn(dynamic_bvh->primitive_data, primitive_index);
+    insert_bvh_primitive(dynamic_bvh->bvh, primitive_index, &bbox);
+    record_edit(dynamic_bvh, primitive_index, &bbox, true);
+}
+
+void remove_dynamic_bvh_primitive(struct dynamic_bvh* dynamic_bvh, size_t primitive_index) {
+    struct bbox bbox = dynamic_bvh->bbox_fn(dynamic_bvh->primitive_data, primitive_index);
+    remove_bvh_primitive(dynamic_bvh->bvh, primitive_index, &bbox);
+    record_edit(dynamic_bvh, primitive_index, &bbox, false);
+}
+
+static struct bbox get_snapshot_bbox(void* primitive_data, size_t index) {
+    return ((const struct bbox*)primitive_data)[index];
+}
+
+static struct vec3 get_snapshot_center(void* primitive_data, size_t index) {
+    struct bbox bbox = ((const struct bbox*)primitive_data)[index];
+    return scale_vec3(add_vec3(bbox.min, bbox.max), 0.5);
+}
+
+static int run_bvh_rebuild(void* data) {
+    struct bvh_rebuild* rebuild = data;
+    struct bvh* bvh = build_bvh(
+        rebuild->thread_pool,
+        rebuild->bboxes,
+        get_snapshot_bbox,
+        get_snapshot_center,
+        rebuild->primitive_count,
+        rebuild->traversal_cost);
+    for (size_t i = 0; i < bvh->primitive_index_count; ++i)
+        bvh->primitive_indices[i] = rebuild->primitive_indices[bvh->primitive_indices[i]];
+    rebuild->cost = compute_bvh_cost(bvh, rebuild->traversal_cost);
+    rebuild->bvh = bvh;
+    atomic_store_explicit(&rebuild->is_done, true, memory_order_release);
+    return 0;
+}
+
+struct snapshot_task {
+    struct parallel_task_1d task;
+    const size_t* primitive_indices;
+    void* primitive_data;
+    bbox_fn_t bbox_fn;
+    struct bbox* bboxes;
+};
+
+static void run_snapshot_task(struct parallel_task_1d* task, size_t thread_id) {
+    IGNORE(thread_id);
+    struct snapshot_task* snapshot_task = (void*)task;
+    for (size_t i = task->range.begin, n = task->range.end; i < n; ++i)
+        snapshot_task->bboxes[i] = snapshot_task->bbox_fn(snapshot_task->primitive_data, snapshot_task->primitive_indices[i]);
+}
+
+static void start_bvh_rebuild(struct dynamic_bvh* dynamic_bvh) {
+    const struct bvh* bvh = dynamic_bvh->bvh;
+    struct bvh_rebuild* rebuild = xmalloc(sizeof(struct bvh_rebuild));
+    rebuild->thread_pool = dynamic_bvh->rebuild_thread_pool;
+    rebuild->traversal_cost = dynamic_bvh->traversal_cost;
+    rebuild->bvh = NULL;
+    rebuild->edits = NULL;
+    rebuild->edit_count = 0;
+    rebuild->edit_capacity = 0;
+    atomic_init(&rebuild->is_done, false);
+
+    // The primitives are gathered from the leaves, since removals leave unused entries in `primitive_indices`
+    rebuild->primitive_indices = xmalloc(sizeof(size_t) * bvh->primitive_index_count);
+    rebuild->primitive_count = 0;
+    for (size_t i = 0; i < bvh->node_count; ++i) {
+        const struct bvh_node* node = &bvh->nodes[i];
+        for (size_t j = 0; j < node->primitive_count; ++j)
+            rebuild->primitive_indices[rebuild->primitive_count++] = bvh->primitive_indices[node->first_child_or_primitive + j];
+    }
+
+    // The primitive data may be modified while the rebuild runs, hence the copy of the bounding boxes
+    rebuild->bboxes = xmalloc(sizeof(struct bbox) * rebuild->primitive_count);
+    parallel_for_1d(
+        rebuild->thread_pool,
+        run_snapshot_task,
+        (struct parallel_task_1d*)&(struct snapshot_task) {
+            .primitive_indices = rebuild->primitive_indices,
+            .primitive_data = dynamic_bvh->primitive_data,
+            .bbox_fn = dynamic_bvh->bbox_fn,
+            .bboxes = rebuild->bboxes
+        },
+        sizeof(struct snapshot_task),
+        &(struct range) { 0, rebuild->primitive_count });
+
+    // If no thread can be created, the rebuild is performed synchronously
+    rebuild->has_thread = thrd_create(&rebuild->thread, run_bvh_rebuild, rebuild) == thrd_success;
+    if (!rebuild->has_thread)
+        run_bvh_rebuild(rebuild);
+    dynamic_bvh->rebuild = rebuild;
+}
+
+static void finish_bvh_rebuild(struct dynamic_bvh* dynamic_bvh) {
+    struct bvh_rebuild* rebuild = dynamic_bvh->rebuild;
+    if (rebuild->has_thread)
+        thrd_join(rebuild->thread, NULL);
+    for (size_t i = 0; i < rebuild->edit_count; ++i) {
+        const struct bvh_edit* edit = &rebuild->edits[i];
+        if (edit->is_insertion)
+            insert_bvh_primitive(rebuild->bvh, edit->primitive_index, &edit->bbox);
+        else
+            remove_bvh_primitive(rebuild->bvh, edit->primitive_index, &edit->bbox);
+    }
+    free_bvh(dynamic_bvh->bvh);
+    dynamic_bvh->bvh = rebuild->bvh;
+    dynamic_bvh->built_cost = rebuild->cost;
+    dynamic_bvh->edit_count = rebuild->edit_count;
+    dynamic_bvh->rebuild = NULL;
+    free_bvh_rebuild(rebuild);
+}
+
+bool update_dynamic_bvh(struct dynamic_bvh* dynamic_bvh) {
+    if (dynamic_bvh->rebuild) {
+        if (!atomic_load_explicit(&dynamic_bvh->rebuild->is_done, memory_order_acquire))
+            return false;
+        finish_bvh_rebuild(dynamic_bvh);
+        return true;
+    }
+
+    size_t check_interval = dynamic_bvh->bvh->node_count / CHECK_INTERVAL_RATIO;
+    if (dynamic_bvh->edit_count < (check_interval > MIN_CHECK_INTERVAL ? check_interval : MIN_CHECK_INTERVAL))
+        return false;
+    dynamic_bvh->edit_count = 0;
+    real_t cost = compute_bvh_cost(dynamic_bvh->bvh, dynamic_bvh->traversal_cost);
+    if (cost > dynamic_bvh->built_cost * dynamic_bvh->max_cost_ratio)
+        start_bvh_rebuild(dynamic_bvh);
+    return false;
+}
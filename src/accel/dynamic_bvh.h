@@ -0,0 +1,67 @@
+#ifndef ACCEL_DYNAMIC_BVH_H
+#define ACCEL_DYNAMIC_BVH_H
+
+#include <stddef.h>
+#include <stdbool.h>
+
+#include "accel/bvh.h"
+
+/*
+ * BVH for scenes that are edited incrementally. Primitives are inserted and removed with
+ * `insert_bvh_primitive()` and `remove_bvh_primitive()`, which is much faster than a rebuild,
+ * but degrades the quality of the tree over time. The SAH cost of the tree is therefore
+ * monitored periodically, and once it exceeds the cost obtained after the last full build
+ * by a given ratio, a new BVH is built in the background, on a dedicated thread pool.
+ * The edits made in the meantime are recorded, and replayed on the new BVH before it
+ * replaces the current one.
+ */
+
+struct bvh_rebuild;
+
+struct dynamic_bvh {
+    struct bvh* bvh;                // Current BVH, only replaced by `update_dynamic_bvh()`
+    void* primitive_data;           // Passed to the bounding box callback, may be changed between edits
+    bbox_fn_t bbox_fn;              // Called with the index of a primitive, as during construction
+    real_t traversal_cost;
+    real_t max_cost_ratio;          // Maximum ratio between the current cost and the cost after the last build
+    real_t built_cost;              // Cost of the BVH right after the last build
+    size_t edit_count;              // Number of edits since the cost was last checked
+    struct thread_pool* rebuild_thread_pool;
+    struct bvh_rebuild* rebuild;    // Rebuild in progress, if any
+};
+
+/*
+ * Creates a dynamic BVH from an existing BVH, which is then owned by it. The BVH must have
+ * been built with the given primitive data and bounding box callback, and the primitive data
+ * must not be permuted afterwards. Background rebuilds use a new thread pool with the given
+ * number of threads.
+ */
+struct dynamic_bvh* new_dynamic_bvh(
+    struct bvh* bvh,
+    void* primitive_data,
+    bbox_fn_t bbox_fn,
+    real_t traversal_cost,
+    real_t max_cost_ratio,
+    size_t rebuild_thread_count);
+
+// Waits for the rebuild in progress, if any, and frees the dynamic BVH along with its BVH.
+void free_dynamic_bvh(struct dynamic_bvh*);
+
+// Inserts the primitive with the given index, whose bounding box is obtained with the callback.
+void insert_dynamic_bvh_primitive(struct dynamic_bvh*, size_t primitive_index);
+
+// Removes the primitive with the given index. The primitive must not have been modified since
+// its insertion, so that the callback still returns the bounding box it was inserted with.
+// To move a primitive, remove it first, and insert it again once it has been modified.
+void remove_dynamic_bvh_primitive(struct dynamic_bvh*, size_t primitive_index);
+
+/*
+ * Checks the quality of the BVH if enough edits have been made since the last check, and
+ * starts a background rebuild if needed. When a rebuild is finished, the edits made since it
+ * started are replayed on the new BVH, which replaces the current one. This never waits for
+ * a rebuild, and is meant to be called regularly (e.g. once per frame), at a point where the
+ * BVH is not being traversed. Returns true if the BVH has been replaced.
+ */
+bool update_dynamic_bvh(struct dynamic_bvh*);
+
+#endif
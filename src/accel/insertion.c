@@ -0,0 +1,223 @@
+#include <stdlib.h>
+#include <assert.h>
+
+#include "accel/bvh.h"
+#include "core/utils.h"
+
+/*
+ * Incremental updates of a BVH. New leaves are inserted with the heuristic of "Fast
+ * Insertion-Based Optimization of Bounding Volume Hierarchies", by J. Bittner, M. Hapala,
+ * and V. Havran: the leaf becomes the sibling of the node that minimizes the increase of the
+ * sum of the areas of the inner nodes, found with the same branch-and-bound search as in
+ * `reinsertion.c`. Inserting a leaf L next to a node X moves X to a new pair of slots at the
+ * end of the array of nodes, along with L, and turns the slot of X into their parent.
+ * Removing a leaf L, whose parent is P and sibling is S, moves S to the slot of P, and fills
+ * the pair of slots previously occupied by L and S with the last pair of the array, so that
+ * the nodes stay contiguous. In both cases, only the ancestors of the modified node are refitted.
+ */
+
+// Maximum depth of the search for the best position of a new leaf.
+#define MAX_SEARCH_DEPTH 64
+
+struct search_item {
+    size_t node_index;
+    size_t depth;
+    real_t induced_cost; // Increase of the area of the ancestors if the leaf is inserted below this node
+};
+
+static inline size_t sibling(size_t node_index) {
+    assert(node_index != 0);
+    return node_index % 2 == 1 ? node_index + 1 : node_index - 1;
+}
+
+// Arrays grow geometrically, so that insertions take amortized constant time. The capacities
+// are stored in the BVH, so that the arrays are only reallocated when they are full.
+static inline size_t get_capacity(size_t count) {
+    size_t capacity = 1;
+    while (capacity < count)
+        capacity <<= 1;
+    return capacity;
+}
+
+static inline void set_bvh_node_parent(struct bvh* bvh, size_t node_index, size_t parent_index) {
+    bvh->parents[(node_index - 1) / 2] = parent_index;
+}
+
+// Moves a node to another slot, and updates the parent of its children.
+static inline void move_bvh_node(struct bvh* bvh, size_t src_index, size_t dst_index) {
+    struct bvh_node* node = &bvh->nodes[dst_index];
+    *node = bvh->nodes[src_index];
+    if (node->primitive_count == 0)
+        set_bvh_node_parent(bvh, node->first_child_or_primitive, dst_index);
+}
+
+// Recomputes the bounding boxes of the ancestors of a node, until one of them does not change.
+static void refit_ancestors(struct bvh* bvh, size_t node_index) {
+    while (node_index != 0) {
+        node_index = get_bvh_node_parent(bvh, node_index);
+        struct bvh_node* node = &bvh->nodes[node_index];
+        struct bvh_node* children = &bvh->nodes[node->first_child_or_primitive];
+        struct bbox old_bbox = get_bvh_node_bbox(node);
+        struct bbox new_bbox = union_bbox(get_bvh_node_bbox(&children[0]), get_bvh_node_bbox(&children[1]));
+        if (bbox_contains(old_bbox, new_bbox) && bbox_contains(new_bbox, old_bbox))
+            break;
+        set_bvh_node_bbox(node, &new_bbox);
+    }
+}
+
+static size_t find_insertion(const struct bvh* bvh, const struct bbox* bbox) {
+    real_t area = half_bbox_area(*bbox);
+    real_t best_cost = REAL_MAX;
+    size_t best_target = 0;
+    struct search_item stack[MAX_SEARCH_DEPTH * 2 + 2];
+    size_t stack_size = 0;
+    stack[stack_size++] = (struct search_item) { .node_index = 0 };
+    while (stack_size > 0) {
+        struct search_item item = stack[--stack_size];
+        if (item.induced_cost + area >= best_cost)
+            continue;
+
+        const struct bvh_node* node = &bvh->nodes[item.node_index];
+        struct bbox node_bbox = get_bvh_node_bbox(node);
+        real_t node_area = half_bbox_area(node_bbox);
+        real_t merged_area = half_bbox_area(union_bbox(node_bbox, *bbox));
+
+        // The new parent of the leaf has the area of the merged bounding box
+        real_t cost = item.induced_cost + merged_area;
+        if (cost < best_cost) {
+            best_cost = cost;
+            best_target = item.node_index;
+        }
+
+        real_t child_cost = item.induced_cost + merged_area - node_area;
+        if (node->primitive_count == 0 && child_cost + area < best_cost && item.depth < MAX_SEARCH_DEPTH) {
+            for (size_t i = 0; i < 2; ++i) {
+                stack[stack_size++] = (struct search_item) {
+                    .node_index = node->first_child_or_primitive + i,
+                    .depth = item.depth + 1,
+                    .induced_cost = child_cost
+                };
+            }
+        }
+    }
+    return best_target;
+}
+
+void insert_bvh_primitive(struct bvh* bvh, size_t primitive_index, const struct bbox* bbox) {
+    size_t target = find_insertion(bvh, bbox);
+    size_t first_child = bvh->node_count;
+    size_t primitive_slot = bvh->primitive_index_count;
+    if (first_child + 2 > bvh->node_capacity) {
+        bvh->node_capacity = get_capacity(first_child + 2);
+        bvh->nodes = xrealloc(bvh->nodes, sizeof(struct bvh_node) * bvh->node_capacity);
+        bvh->parents = xrealloc(bvh->parents, sizeof(bits_t) * (bvh->node_capacity / 2));
+    }
+    if (primitive_slot + 1 > bvh->primitive_index_capacity) {
+        bvh->primitive_index_capacity = get_capacity(primitive_slot + 1);
+        bvh->primitive_indices = xrealloc(bvh->primitive_indices, sizeof(size_t) * bvh->primitive_index_capacity);
+    }
+    bvh->primitive_indices[primitive_slot] = primitive_index;
+    bvh->primitive_index_count++;
+    bvh->node_count += 2;
+
+    struct bvh_node* leaf = &bvh->nodes[first_child + 1];
+    leaf->primitive_count = 1;
+    leaf->first_child_or_primitive = primitive_slot;
+    set_bvh_node_bbox(leaf, bbox);
+    move_bvh_node(bvh, target, first_child);
+    set_bvh_node_parent(bvh, first_child, target);
+
+    struct bvh_node* parent = &bvh->nodes[target];
+    struct bbox parent_bbox = union_bbox(get_bvh_node_bbox(&bvh->nodes[first_child]), *bbox);
+    parent->primitive_count = 0;
+    parent->first_child_or_primitive = first_child;
+    set_bvh_node_bbox(parent, &parent_bbox);
+    refit_ancestors(bvh, target);
+}
+
+// Returns the index of the next node in depth-first order that is not a descendant of the given node,
+// or 0 if there is none. This makes it possible to traverse the tree without a stack.
+static inline size_t skip_bvh_subtree(const struct bvh* bvh, size_t node_index) {
+    for (; node_index != 0; node_index = get_bvh_node_parent(bvh, node_index)) {
+        if (node_index % 2 == 1)
+            return node_index + 1;
+    }
+    return 0;
+}
+
+// Finds a reference to the given primitive. Returns its position in `primitive_indices`,
+// along with the index of the leaf that contains it, or `SIZE_MAX` if there is none.
+static size_t find_reference(
+    const struct bvh* bvh,
+    size_t primitive_index,
+    const struct bbox* bbox,
+    size_t* leaf_index)
+{
+    size_t node_index = 0;
+    do {
+        const struct bvh_node* node = &bvh->nodes[node_index];
+        if (bbox_overlaps(get_bvh_node_bbox(node), *bbox)) {
+            if (node->primitive_count == 0) {
+                node_index = node->first_child_or_primitive;
+                continue;
+            }
+            for (size_t i = 0; i < node->primitive_count; ++i) {
+                size_t position = node->first_child_or_primitive + i;
+                if (bvh->primitive_indices[position] == primitive_index) {
+                    *leaf_index = node_index;
+                    return position;
+                }
+            }
+        }
+        node_index = skip_bvh_subtree(bvh, node_index);
+    } while (node_index != 0);
+    return SIZE_MAX;
+}
+
+static void remove_bvh_leaf(struct bvh* bvh, size_t leaf_index) {
+    assert(leaf_index != 0 && "the last primitive of a BVH cannot be removed");
+    size_t parent_index = get_bvh_node_parent(bvh, leaf_index);
+    size_t free_pair = leaf_index % 2 == 1 ? leaf_index : leaf_index - 1;
+    move_bvh_node(bvh, sibling(leaf_index), parent_index);
+
+    size_t last_pair = bvh->node_count - 2;
+    if (free_pair != last_pair) {
+        size_t last_parent = get_bvh_node_parent(bvh, last_pair);
+        bvh->nodes[last_parent].first_child_or_primitive = free_pair;
+        set_bvh_node_parent(bvh, free_pair, last_parent);
+        move_bvh_node(bvh, last_pair + 0, free_pair + 0);
+        move_bvh_node(bvh, last_pair + 1, free_pair + 1);
+        if (parent_index >= last_pair)
+            parent_index = parent_index - last_pair + free_pair;
+    }
+    bvh->node_count -= 2;
+    refit_ancestors(bvh, parent_index);
+}
+
+size_t remove_bvh_primitive(struct bvh* bvh, size_t primitive_index, const struct bbox* bbox) {
+    size_t removed_count = 0;
+    size_t leaf_index, position;
+    while ((position = find_reference(bvh, primitive_index, bbox, &leaf_index)) != SIZE_MAX) {
+        struct bvh_node* leaf = &bvh->nodes[leaf_index];
+        if (leaf->primitive_count > 1) {
+            // The bounding box of the leaf is kept, since the remaining primitives are not known
+            leaf->primitive_count--;
+            bvh->primitive_indices[position] =
+                bvh->primitive_indices[leaf->first_child_or_primitive + leaf->primitive_count];
+        } else
+            remove_bvh_leaf(bvh, leaf_index);
+        removed_count++;
+    }
+    return removed_count;
+}
+
+real_t compute_bvh_cost(const struct bvh* bvh, real_t traversal_cost) {
+    real_t cost = 0;
+    for (size_t i = 0; i < bvh->node_count; ++i) {
+        const struct bvh_node* node = &bvh->nodes[i];
+        real_t area = half_bbox_area(get_bvh_node_bbox(node));
+        cost += area * (node->primitive_count == 0 ? traversal_cost : (real_t)node->primitive_count);
+    }
+    real_t root_area = half_bbox_area(get_bvh_node_bbox(&bvh->nodes[0]));
+    return root_area > 0 ? cost / root_area : cost;
+}
@@ -0,0 +1,401 @@
+#include <stdlib.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <time.h>
+#include <assert.h>
+
+#include "accel/bvh.h"
+#include "core/thread_pool.h"
+#include "core/utils.h"
+
+/*
+ * Post-build optimization algorithm that moves subtrees to better locations in the BVH,
+ * based on "Parallel Reinsertion for Bounding Volume Hierarchy Optimization", by D. Meister
+ * and J. Bittner. Each iteration searches, in parallel, the best position for every node of
+ * the tree. Since the resulting reinsertions can conflict with each other, every reinsertion
+ * tries to lock the nodes it modifies with its priority, and only those that obtain all their
+ * locks are performed. The bounding boxes are then refitted, and the process is repeated until
+ * the time budget is exhausted or the cost of the tree no longer decreases significantly.
+ *
+ * A reinsertion of a node L, whose parent is P and sibling is S, next to a node X, works as
+ * follows: S takes the place of P, and the slot of X receives a new node N whose children are
+ * L and X. The children of N are stored in the slots that were previously occupied by L and S,
+ * so that siblings remain next to each other in the array of nodes.
+ */
+
+// Maximum depth of the search for the best position of a node. Nodes that are deeper than this are not moved.
+#define MAX_SEARCH_DEPTH 64
+
+// Stops the optimization when an iteration reduces the cost of the tree by less than this ratio.
+#define MIN_RELATIVE_GAIN ((real_t)0.001)
+
+struct reinsertion {
+    size_t target;
+    real_t gain; // Reduction of the sum of the areas of inner nodes
+};
+
+struct locks_task {
+    struct parallel_task_1d task;
+    atomic_uint_fast64_t* locks;
+};
+
+static void run_locks_task(struct parallel_task_1d* task, size_t thread_id) {
+    IGNORE(thread_id);
+    struct locks_task* locks_task = (void*)task;
+    for (size_t i = task->range.begin, n = task->range.end; i < n; ++i)
+        atomic_init(&locks_task->locks[i], 0);
+}
+
+static inline size_t sibling(size_t node_index) {
+    assert(node_index != 0);
+    return node_index % 2 == 1 ? node_index + 1 : node_index - 1;
+}
+
+// Same as `get_bvh_node_parent()`, but returns `SIZE_MAX` for the root.
+static inline size_t parent(const struct bvh* bvh, size_t node_index) {
+    return node_index == 0 ? SIZE_MAX : get_bvh_node_parent(bvh, node_index);
+}
+
+struct search_item {
+    size_t node_index;
+    size_t depth;
+    real_t induced_cost; // Increase of the area of the ancestors if the node is inserted below this node
+};
+
+static struct reinsertion find_reinsertion(const struct bvh* bvh, size_t node_index) {
+    const struct bvh_node* nodes = bvh->nodes;
+    struct reinsertion reinsertion = { .target = SIZE_MAX, .gain = 0 };
+    size_t parent_index  = parent(bvh, node_index);
+    size_t sibling_index = sibling(node_index);
+
+    // Gather the ancestors of the parent, from the root downwards
+    size_t path[MAX_SEARCH_DEPTH + 1];
+    size_t path_length = 0;
+    for (size_t i = parent_index; i != SIZE_MAX; i = parent(bvh, i)) {
+        if (path_length > MAX_SEARCH_DEPTH)
+            return reinsertion;
+        path[path_length++] = i;
+    }
+    for (size_t i = 0, j = path_length - 1; i < j; ++i, --j) {
+        size_t tmp = path[i];
+        path[i] = path[j];
+        path[j] = tmp;
+    }
+
+    // Compute the bounding boxes of the ancestors once the node is removed,
+    // along with the corresponding reduction of the areas (which includes the parent itself).
+    struct bbox bboxes[MAX_SEARCH_DEPTH + 1];
+    size_t parent_depth = path_length - 1;
+    bboxes[parent_depth] = get_bvh_node_bbox(&nodes[sibling_index]);
+    real_t removal_gain = half_bbox_area(get_bvh_node_bbox(&nodes[parent_index]));
+    for (size_t i = parent_depth; i-- > 0;) {
+        bboxes[i] = union_bbox(bboxes[i + 1], get_bvh_node_bbox(&nodes[sibling(path[i + 1])]));
+        removal_gain += half_bbox_area(get_bvh_node_bbox(&nodes[path[i]])) - half_bbox_area(bboxes[i]);
+    }
+
+    // Search the position that minimizes the cost of the insertion with a branch-and-bound traversal.
+    // The parent is replaced by the sibling, and any insertion must be cheaper than the removal.
+    struct bbox bbox = get_bvh_node_bbox(&nodes[node_index]);
+    real_t area = half_bbox_area(bbox);
+    real_t best_cost = removal_gain;
+    struct search_item stack[MAX_SEARCH_DEPTH * 2 + 2];
+    size_t stack_size = 0;
+    stack[stack_size++] = (struct search_item) { .node_index = 0 };
+    while (stack_size > 0) {
+        struct search_item item = stack[--stack_size];
+        if (item.induced_cost + area >= best_cost)
+            continue;
+
+        bool is_parent = item.node_index == parent_index;
+        bool is_on_path = item.depth < path_length && path[item.depth] == item.node_index;
+        const struct bvh_node* node = &nodes[is_parent ? sibling_index : item.node_index];
+        struct bbox node_bbox = is_on_path ? bboxes[item.depth] : get_bvh_node_bbox(node);
+        real_t node_area = half_bbox_area(node_bbox);
+        real_t merged_area = half_bbox_area(union_bbox(node_bbox, bbox));
+
+        // Inserting next to the sibling gives back the original tree
+        real_t cost = item.induced_cost + merged_area;
+        if (!is_parent && cost < best_cost) {
+            best_cost = cost;
+            reinsertion.target = item.node_index;
+        }
+
+        real_t child_cost = item.induced_cost + merged_area - node_area;
+        if (node->primitive_count == 0 && child_cost + area < best_cost && item.depth < MAX_SEARCH_DEPTH) {
+            for (size_t i = 0; i < 2; ++i) {
+                stack[stack_size++] = (struct search_item) {
+                    .node_index = node->first_child_or_primitive + i,
+                    .depth = item.depth + 1,
+                    .induced_cost = child_cost
+                };
+            }
+        }
+    }
+
+    if (reinsertion.target != SIZE_MAX)
+        reinsertion.gain = removal_gain - best_cost;
+    return reinsertion;
+}
+
+struct search_task {
+    struct parallel_task_1d task;
+    const struct bvh* bvh;
+    struct reinsertion* reinsertions;
+};
+
+static void run_search_task(struct parallel_task_1d* task, size_t thread_id) {
+    IGNORE(thread_id);
+    struct search_task* search_task = (void*)task;
+    for (size_t i = task->range.begin, n = task->range.end; i < n; ++i) {
+        search_task->reinsertions[i] = i == 0
+            ? (struct reinsertion) { .target = SIZE_MAX }
+            : find_reinsertion(search_task->bvh, i);
+    }
+}
+
+// Returns the nodes that are modified by the given reinsertion, or that affect its gain.
+static inline size_t get_locked_nodes(const struct bvh* bvh, size_t node_index, size_t target, size_t* locked_nodes) {
+    size_t count = 0;
+    locked_nodes[count++] = node_index;
+    locked_nodes[count++] = sibling(node_index);
+    locked_nodes[count++] = parent(bvh, node_index);
+    locked_nodes[count++] = target;
+    if (target != 0)
+        locked_nodes[count++] = parent(bvh, target);
+    return count;
+}
+
+// Reinsertions with a higher gain have a higher priority. The node index breaks ties.
+static inline uint64_t get_priority(const struct reinsertion* reinsertion, size_t node_index) {
+    float gain = reinsertion->gain;
+    uint32_t bits;
+    memcpy(&bits, &gain, sizeof(float));
+    return ((uint64_t)bits << 32) | (uint32_t)node_index;
+}
+
+struct lock_task {
+    struct parallel_task_1d task;
+    const struct bvh* bvh;
+    const struct reinsertion* reinsertions;
+    atomic_uint_fast64_t* locks;
+};
+
+static void run_lock_task(struct parallel_task_1d* task, size_t thread_id) {
+    IGNORE(thread_id);
+    struct lock_task* lock_task = (void*)task;
+    for (size_t i = task->range.begin, n = task->range.end; i < n; ++i) {
+        const struct reinsertion* reinsertion = &lock_task->reinsertions[i];
+        if (reinsertion->gain <= 0)
+            continue;
+        size_t locked_nodes[5];
+        size_t locked_count = get_locked_nodes(lock_task->bvh, i, reinsertion->target, locked_nodes);
+        uint64_t priority = get_priority(reinsertion, i);
+        for (size_t j = 0; j < locked_count; ++j) {
+            atomic_uint_fast64_t* lock = &lock_task->locks[locked_nodes[j]];
+            uint64_t prev = atomic_load_explicit(lock, memory_order_relaxed);
+            while (prev < priority && !atomic_compare_exchange_weak_explicit(
+                lock, &prev, priority, memory_order_relaxed, memory_order_relaxed))
+                ;
+        }
+    }
+}
+
+struct select_task {
+    struct parallel_task_1d task;
+    const struct bvh* bvh;
+    struct reinsertion* reinsertions;
+    atomic_uint_fast64_t* locks;
+    bool* is_moved;
+};
+
+static void run_select_task(struct parallel_task_1d* task, size_t thread_id) {
+    IGNORE(thread_id);
+    struct select_task* select_task = (void*)task;
+    for (size_t i = task->range.begin, n = task->range.end; i < n; ++i) {
+        struct reinsertion* reinsertion = &select_task->reinsertions[i];
+        select_task->is_moved[i] = false;
+        if (reinsertion->gain <= 0)
+            continue;
+        size_t locked_nodes[5];
+        size_t locked_count = get_locked_nodes(select_task->bvh, i, reinsertion->target, locked_nodes);
+        uint64_t priority = get_priority(reinsertion, i);
+        for (size_t j = 0; j < locked_count; ++j) {
+            if (atomic_load_explicit(&select_task->locks[locked_nodes[j]], memory_order_relaxed) != priority) {
+                reinsertion->gain = 0;
+                break;
+            }
+        }
+        select_task->is_moved[i] = reinsertion->gain > 0;
+    }
+}
+
+struct cycle_task {
+    struct parallel_task_1d task;
+    const struct bvh* bvh;
+    struct reinsertion* reinsertions;
+    const bool* is_moved;
+};
+
+static void run_cycle_task(struct parallel_task_1d* task, size_t thread_id) {
+    IGNORE(thread_id);
+    struct cycle_task* cycle_task = (void*)task;
+    for (size_t i = task->range.begin, n = task->range.end; i < n; ++i) {
+        struct reinsertion* reinsertion = &cycle_task->reinsertions[i];
+        if (!cycle_task->is_moved[i])
+            continue;
+        // Two nodes that are inserted in the subtree of each other would create a cycle:
+        // to prevent this, nodes cannot be inserted in a subtree that is moved.
+        for (size_t j = reinsertion->target; j != SIZE_MAX; j = parent(cycle_task->bvh, j)) {
+            if (cycle_task->is_moved[j]) {
+                reinsertion->gain = 0;
+                break;
+            }
+        }
+    }
+}
+
+struct reinsert_task {
+    struct parallel_task_1d task;
+    struct bvh* bvh;
+    const struct reinsertion* reinsertions;
+    real_t* thread_gains;
+};
+
+// Makes the children of a node, if any, point to it. The locks of a reinsertion cover the
+// nodes whose contents it moves, so that concurrent reinsertions update distinct parents.
+static inline void update_children_parent(struct bvh* bvh, size_t node_index) {
+    const struct bvh_node* node = &bvh->nodes[node_index];
+    if (node->primitive_count == 0)
+        bvh->parents[(node->first_child_or_primitive - 1) / 2] = node_index;
+}
+
+static void run_reinsert_task(struct parallel_task_1d* task, size_t thread_id) {
+    struct reinsert_task* reinsert_task = (void*)task;
+    struct bvh* bvh = reinsert_task->bvh;
+    struct bvh_node* nodes = bvh->nodes;
+    real_t gain = 0;
+    for (size_t i = task->range.begin, n = task->range.end; i < n; ++i) {
+        const struct reinsertion* reinsertion = &reinsert_task->reinsertions[i];
+        if (reinsertion->gain <= 0)
+            continue;
+
+        size_t sibling_index = sibling(i);
+        size_t parent_index  = get_bvh_node_parent(bvh, i);
+        size_t target_index  = reinsertion->target;
+        struct bvh_node target = nodes[target_index];
+        struct bbox bbox = union_bbox(get_bvh_node_bbox(&target), get_bvh_node_bbox(&nodes[i]));
+
+        nodes[parent_index] = nodes[sibling_index];
+        nodes[sibling_index] = target;
+        nodes[target_index].primitive_count = 0;
+        nodes[target_index].first_child_or_primitive = i < sibling_index ? i : sibling_index;
+        set_bvh_node_bbox(&nodes[target_index], &bbox);
+
+        // S and X have moved along with their children, and N is the new parent of L and S
+        update_children_parent(bvh, parent_index);
+        update_children_parent(bvh, sibling_index);
+        update_children_parent(bvh, target_index);
+        gain += reinsertion->gain;
+    }
+    reinsert_task->thread_gains[thread_id] += gain;
+}
+
+static real_t compute_inner_node_area(const struct bvh* bvh) {
+    real_t area = 0;
+    for (size_t i = 0; i < bvh->node_count; ++i) {
+        if (bvh->nodes[i].primitive_count == 0)
+            area += half_bbox_area(get_bvh_node_bbox(&bvh->nodes[i]));
+    }
+    return area;
+}
+
+void optimize_bvh(struct thread_pool* thread_pool, struct bvh* bvh, double time_budget) {
+    if (bvh->node_count < 3 || time_budget <= 0)
+        return;
+    assert(bvh->parents);
+
+    struct timespec t_start, t_now;
+    timespec_get(&t_start, TIME_UTC);
+
+    size_t thread_count = get_thread_count(thread_pool);
+    atomic_uint_fast64_t* locks = xmalloc(sizeof(atomic_uint_fast64_t) * bvh->node_count);
+    struct reinsertion* reinsertions = xmalloc(sizeof(struct reinsertion) * bvh->node_count);
+    bool* is_moved = xmalloc(sizeof(bool) * bvh->node_count);
+    real_t* thread_gains = xmalloc(sizeof(real_t) * thread_count);
+    real_t cost = compute_inner_node_area(bvh);
+    struct range range = { 0, bvh->node_count };
+
+    do {
+        parallel_for_1d(
+            thread_pool,
+            run_locks_task,
+            (struct parallel_task_1d*)&(struct locks_task) { .locks = locks },
+            sizeof(struct locks_task), &range);
+
+        parallel_for_1d(
+            thread_pool,
+            run_search_task,
+            (struct parallel_task_1d*)&(struct search_task) {
+                .bvh          = bvh,
+                .reinsertions = reinsertions
+            },
+            sizeof(struct search_task), &range);
+
+        // Resolve conflicts between reinsertions
+        parallel_for_1d(
+            thread_pool,
+            run_lock_task,
+            (struct parallel_task_1d*)&(struct lock_task) {
+                .bvh          = bvh,
+                .reinsertions = reinsertions,
+                .locks        = locks
+            },
+            sizeof(struct lock_task), &range);
+        parallel_for_1d(
+            thread_pool,
+            run_select_task,
+            (struct parallel_task_1d*)&(struct select_task) {
+                .bvh          = bvh,
+                .reinsertions = reinsertions,
+                .locks        = locks,
+                .is_moved     = is_moved
+            },
+            sizeof(struct select_task), &range);
+        parallel_for_1d(
+            thread_pool,
+            run_cycle_task,
+            (struct parallel_task_1d*)&(struct cycle_task) {
+                .bvh          = bvh,
+                .reinsertions = reinsertions,
+                .is_moved     = is_moved
+            },
+            sizeof(struct cycle_task), &range);
+
+        for (size_t i = 0; i < thread_count; ++i)
+            thread_gains[i] = 0;
+        parallel_for_1d(
+            thread_pool,
+            run_reinsert_task,
+            (struct parallel_task_1d*)&(struct reinsert_task) {
+                .bvh          = bvh,
+                .reinsertions = reinsertions,
+                .thread_gains = thread_gains
+            },
+            sizeof(struct reinsert_task), &range);
+        refit_bvh(thread_pool, bvh, NULL, NULL);
+
+        real_t gain = 0;
+        for (size_t i = 0; i < thread_count; ++i)
+            gain += thread_gains[i];
+        cost -= gain;
+        if (gain <= cost * MIN_RELATIVE_GAIN)
+            break;
+
+        timespec_get(&t_now, TIME_UTC);
+    } while (elapsed_seconds(&t_start, &t_now) < time_budget);
+
+    free(thread_gains);
+    free(is_moved);
+    free(reinsertions);
+    free(locks);
+}
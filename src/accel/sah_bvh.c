@@ -0,0 +1,425 @@
+#include <stdlib.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <assert.h>
+
+#include "accel/bvh.h"
+#include "accel/binning.h"
+#include "core/thread_pool.h"
+#include "core/parallel_scan.h"
+#include "core/utils.h"
+
+/*
+ * Top-down BVH construction algorithm that uses binning to evaluate the SAH,
+ * as described in "On fast Construction of SAH-based Bounding Volume Hierarchies",
+ * by I. Wald. The top of the hierarchy is built breadth-first, by splitting large
+ * nodes with parallel binning and partitioning passes (horizontal parallelism).
+ * Once nodes are small enough, the remaining subtrees are built sequentially,
+ * each of them in a separate task (vertical parallelism).
+ */
+
+#define MAX_LEAF_SIZE 16
+#define MIN_PARALLEL_SPLIT_SIZE 4096
+#define SUBTREES_PER_THREAD 4
+
+// Node of the BVH that still has to be processed, along with its primitive range.
+struct build_item {
+    size_t node_index;
+    size_t begin, end;
+    struct bbox center_bbox;
+};
+
+struct sah_builder {
+    const struct bbox* bboxes;
+    const struct vec3* centers;
+    size_t* primitive_indices;
+    size_t* tmp_primitive_indices;
+    struct bvh_node* nodes;
+    atomic_size_t node_count;
+    real_t traversal_cost;
+};
+
+static void bin_primitives(
+    const struct sah_builder* builder,
+    const struct bin_mapping* mapping,
+    struct bins* bins,
+    size_t begin, size_t end)
+{
+    for (size_t i = begin; i < end; ++i) {
+        size_t primitive_index = builder->primitive_indices[i];
+        add_to_bins(bins, mapping, &builder->bboxes[primitive_index], builder->centers[primitive_index]);
+    }
+}
+
+struct bin_task {
+    struct parallel_task_1d task;
+    const struct sah_builder* builder;
+    const struct bin_mapping* mapping;
+    struct bins* thread_bins;
+};
+
+static void run_bin_task(struct parallel_task_1d* task, size_t thread_id) {
+    struct bin_task* bin_task = (void*)task;
+    bin_primitives(
+        bin_task->builder,
+        bin_task->mapping,
+        &bin_task->thread_bins[thread_id],
+        task->range.begin, task->range.end);
+}
+
+static void bin_primitives_in_parallel(
+    struct thread_pool* thread_pool,
+    const struct sah_builder* builder,
+    const struct bin_mapping* mapping,
+    struct bins* bins,
+    size_t begin, size_t end)
+{
+    size_t thread_count = get_thread_count(thread_pool);
+    struct bins* thread_bins = alloc_task_storage(thread_pool, sizeof(struct bins) * thread_count);
+    for (size_t i = 0; i < thread_count; ++i)
+        init_bins(&thread_bins[i]);
+    parallel_for_1d(
+        thread_pool,
+        run_bin_task,
+        (struct parallel_task_1d*)&(struct bin_task) {
+            .builder     = builder,
+            .mapping     = mapping,
+            .thread_bins = thread_bins
+        },
+        sizeof(struct bin_task),
+        &(struct range) { begin, end });
+    for (size_t i = 0; i < thread_count; ++i)
+        merge_bins(bins, &thread_bins[i]);
+    free_task_storage(thread_pool, thread_bins);
+}
+
+static inline bool is_on_left_side(
+    const struct sah_builder* builder,
+    const struct bin_mapping* mapping,
+    const struct split* split,
+    size_t primitive_index)
+{
+    real_t center = builder->centers[primitive_index]._[split->axis];
+    return compute_bin_index(mapping, split->axis, center) < split->bin;
+}
+
+static void partition_primitives(
+    struct sah_builder* builder,
+    const struct bin_mapping* mapping,
+    const struct split* split,
+    size_t begin, size_t end)
+{
+    size_t* primitive_indices = builder->primitive_indices;
+    size_t i = begin, j = end;
+    while (true) {
+        while (i < j && is_on_left_side(builder, mapping, split, primitive_indices[i])) i++;
+        while (i < j && !is_on_left_side(builder, mapping, split, primitive_indices[j - 1])) j--;
+        if (i >= j)
+            break;
+        size_t tmp = primitive_indices[i];
+        primitive_indices[i] = primitive_indices[j - 1];
+        primitive_indices[j - 1] = tmp;
+        i++, j--;
+    }
+    assert(i == begin + split->left_count);
+}
+
+struct partition_data {
+    const struct sah_builder* builder;
+    const struct bin_mapping* mapping;
+    const struct split* split;
+};
+
+static bool is_primitive_on_left_side(const void* elem, const void* data) {
+    const struct partition_data* partition_data = data;
+    return is_on_left_side(
+        partition_data->builder,
+        partition_data->mapping,
+        partition_data->split,
+        *(const size_t*)elem);
+}
+
+static void partition_primitives_in_parallel(
+    struct thread_pool* thread_pool,
+    struct sah_builder* builder,
+    const struct bin_mapping* mapping,
+    const struct split* split,
+    size_t begin, size_t end)
+{
+    size_t left_count = parallel_partition(
+        thread_pool,
+        is_primitive_on_left_side,
+        &(struct partition_data) {
+            .builder = builder,
+            .mapping = mapping,
+            .split   = split
+        },
+        builder->primitive_indices + begin,
+        builder->tmp_primitive_indices + begin,
+        sizeof(size_t), end - begin);
+    assert(left_count == split->left_count);
+    IGNORE(left_count);
+
+    memcpy(
+        builder->primitive_indices + begin,
+        builder->tmp_primitive_indices + begin,
+        sizeof(size_t) * (end - begin));
+}
+
+static struct bbox compute_range_bbox(const struct sah_builder* builder, size_t begin, size_t end) {
+    struct bbox bbox = empty_bbox();
+    for (size_t i = begin; i < end; ++i)
+        bbox = union_bbox(bbox, builder->bboxes[builder->primitive_indices[i]]);
+    return bbox;
+}
+
+static inline void make_leaf(struct bvh_node* node, size_t begin, size_t end) {
+    node->primitive_count = end - begin;
+    node->first_child_or_primitive = begin;
+}
+
+// Splits the given node, or turns it into a leaf if splitting is not beneficial according to the SAH.
+// Binning and partitioning are done in parallel if a thread pool is given. Returns the number of children.
+static size_t split_node(
+    struct sah_builder* builder,
+    struct thread_pool* thread_pool,
+    const struct build_item* item,
+    struct build_item* children)
+{
+    struct bvh_node* node = &builder->nodes[item->node_index];
+    size_t primitive_count = item->end - item->begin;
+    if (primitive_count <= 1) {
+        make_leaf(node, item->begin, item->end);
+        return 0;
+    }
+
+    struct bins bins;
+    struct split split;
+    struct bin_mapping mapping = compute_bin_mapping(&item->center_bbox);
+    init_bins(&bins);
+    if (thread_pool)
+        bin_primitives_in_parallel(thread_pool, builder, &mapping, &bins, item->begin, item->end);
+    else
+        bin_primitives(builder, &mapping, &bins, item->begin, item->end);
+
+    if (find_best_split(&bins, &mapping, &split)) {
+        // Same criterion as the one used to collapse leaves in the other construction algorithm
+        real_t leaf_cost = half_bbox_area(get_bvh_node_bbox(node)) * (primitive_count - builder->traversal_cost);
+        if (primitive_count <= MAX_LEAF_SIZE && leaf_cost <= split.cost) {
+            make_leaf(node, item->begin, item->end);
+            return 0;
+        }
+        if (thread_pool)
+            partition_primitives_in_parallel(thread_pool, builder, &mapping, &split, item->begin, item->end);
+        else
+            partition_primitives(builder, &mapping, &split, item->begin, item->end);
+    } else {
+        // All the centers are at the same location: Split in the middle if the leaf is too big
+        if (primitive_count <= MAX_LEAF_SIZE) {
+            make_leaf(node, item->begin, item->end);
+            return 0;
+        }
+        split.left_count = primitive_count / 2;
+        split.bboxes[0] = compute_range_bbox(builder, item->begin, item->begin + split.left_count);
+        split.bboxes[1] = compute_range_bbox(builder, item->begin + split.left_count, item->end);
+        split.center_bboxes[0] = split.center_bboxes[1] = item->center_bbox;
+    }
+
+    // Children are allocated by pairs, starting at index 1, so that the first child always has an odd index
+    size_t first_child = atomic_fetch_add_explicit(&builder->node_count, 2, memory_order_relaxed);
+    node->primitive_count = 0;
+    node->first_child_or_primitive = first_child;
+    for (int i = 0; i < 2; ++i) {
+        set_bvh_node_bbox(&builder->nodes[first_child + i], &split.bboxes[i]);
+        children[i] = (struct build_item) {
+            .node_index  = first_child + i,
+            .begin       = i == 0 ? item->begin : item->begin + split.left_count,
+            .end         = i == 0 ? item->begin + split.left_count : item->end,
+            .center_bbox = split.center_bboxes[i]
+        };
+    }
+    return 2;
+}
+
+static inline void push_build_item(
+    struct build_item** items,
+    size_t* item_count,
+    size_t* item_capacity,
+    const struct build_item* item)
+{
+    if (*item_count >= *item_capacity) {
+        *item_capacity = *item_capacity > 0 ? *item_capacity * 2 : 16;
+        *items = xrealloc(*items, sizeof(struct build_item) * *item_capacity);
+    }
+    (*items)[(*item_count)++] = *item;
+}
+
+static void build_subtree(struct sah_builder* builder, const struct build_item* root) {
+    struct build_item* stack = NULL;
+    size_t stack_size = 0, stack_capacity = 0;
+    push_build_item(&stack, &stack_size, &stack_capacity, root);
+    while (stack_size > 0) {
+        struct build_item item = stack[--stack_size];
+        struct build_item children[2];
+        size_t child_count = split_node(builder, NULL, &item, children);
+        for (size_t i = 0; i < child_count; ++i)
+            push_build_item(&stack, &stack_size, &stack_capacity, &children[i]);
+    }
+    free(stack);
+}
+
+struct subtree_task {
+    struct work_item work_item;
+    struct sah_builder* builder;
+    struct build_item root;
+};
+
+static void run_subtree_task(struct work_item* work_item, size_t thread_id) {
+    IGNORE(thread_id);
+    struct subtree_task* subtree_task = (void*)work_item;
+    build_subtree(subtree_task->builder, &subtree_task->root);
+}
+
+static int compare_build_item_size(const void* left, const void* right) {
+    const struct build_item* left_item  = left;
+    const struct build_item* right_item = right;
+    size_t left_size  = left_item->end  - left_item->begin;
+    size_t right_size = right_item->end - right_item->begin;
+    return left_size > right_size ? -1 : (left_size < right_size ? 1 : 0);
+}
+
+struct primitives_task {
+    struct parallel_task_1d task;
+    void* primitive_data;
+    bbox_fn_t bbox_fn;
+    center_fn_t center_fn;
+    struct bbox* bboxes;
+    struct vec3* centers;
+    size_t* primitive_indices;
+    struct bbox* thread_bboxes;
+    struct bbox* thread_center_bboxes;
+};
+
+static void run_primitives_task(struct parallel_task_1d* task, size_t thread_id) {
+    struct primitives_task* primitives_task = (void*)task;
+    struct bbox bbox = primitives_task->thread_bboxes[thread_id];
+    struct bbox center_bbox = primitives_task->thread_center_bboxes[thread_id];
+    for (size_t i = task->range.begin, n = task->range.end; i < n; ++i) {
+        primitives_task->bboxes[i]  = primitives_task->bbox_fn(primitives_task->primitive_data, i);
+        primitives_task->centers[i] = primitives_task->center_fn(primitives_task->primitive_data, i);
+        primitives_task->primitive_indices[i] = i;
+        bbox = union_bbox(bbox, primitives_task->bboxes[i]);
+        center_bbox = extend_bbox(center_bbox, primitives_task->centers[i]);
+    }
+    primitives_task->thread_bboxes[thread_id] = bbox;
+    primitives_task->thread_center_bboxes[thread_id] = center_bbox;
+}
+
+struct bvh* build_sah_bvh(
+    struct thread_pool* thread_pool,
+    void* primitive_data,
+    bbox_fn_t bbox_fn,
+    center_fn_t center_fn,
+    size_t primitive_count,
+    real_t traversal_cost)
+{
+    assert(primitive_count > 0);
+
+    // Compute the bounding box and center of every primitive, as well as global bounding boxes
+    size_t thread_count = get_thread_count(thread_pool);
+    struct bbox* bboxes = xmalloc(sizeof(struct bbox) * primitive_count);
+    struct vec3* centers = xmalloc(sizeof(struct vec3) * primitive_count);
+    size_t* primitive_indices = xmalloc(sizeof(size_t) * primitive_count);
+    struct bbox* thread_bboxes = xmalloc(sizeof(struct bbox) * thread_count * 2);
+    for (size_t i = 0; i < thread_count * 2; ++i)
+        thread_bboxes[i] = empty_bbox();
+    parallel_for_1d(
+        thread_pool,
+        run_primitives_task,
+        (struct parallel_task_1d*)&(struct primitives_task) {
+            .primitive_data       = primitive_data,
+            .bbox_fn              = bbox_fn,
+            .center_fn            = center_fn,
+            .bboxes               = bboxes,
+            .centers              = centers,
+            .primitive_indices    = primitive_indices,
+            .thread_bboxes        = thread_bboxes,
+            .thread_center_bboxes = thread_bboxes + thread_count
+        },
+        sizeof(struct primitives_task),
+        &(struct range) { 0, primitive_count });
+    struct bbox bbox = empty_bbox(), center_bbox = empty_bbox();
+    for (size_t i = 0; i < thread_count; ++i) {
+        bbox = union_bbox(bbox, thread_bboxes[i]);
+        center_bbox = union_bbox(center_bbox, thread_bboxes[thread_count + i]);
+    }
+    free(thread_bboxes);
+
+    struct sah_builder builder = {
+        .bboxes                = bboxes,
+        .centers               = centers,
+        .primitive_indices     = primitive_indices,
+        .tmp_primitive_indices = xmalloc(sizeof(size_t) * primitive_count),
+        .nodes                 = xmalloc(sizeof(struct bvh_node) * (2 * primitive_count - 1)),
+        .traversal_cost        = traversal_cost
+    };
+    atomic_init(&builder.node_count, 1);
+    set_bvh_node_bbox(&builder.nodes[0], &bbox);
+
+    // Split large nodes breadth-first, using all threads for each of them,
+    // until there are enough subtrees to keep all the threads busy
+    size_t subtree_size = primitive_count / (thread_count * SUBTREES_PER_THREAD);
+    subtree_size = subtree_size > MIN_PARALLEL_SPLIT_SIZE ? subtree_size : MIN_PARALLEL_SPLIT_SIZE;
+    struct build_item* items = NULL, *subtrees = NULL;
+    size_t item_count = 0, item_capacity = 0;
+    size_t subtree_count = 0, subtree_capacity = 0;
+    push_build_item(&items, &item_count, &item_capacity, &(struct build_item) {
+        .node_index  = 0,
+        .begin       = 0,
+        .end         = primitive_count,
+        .center_bbox = center_bbox
+    });
+    while (item_count > 0) {
+        struct build_item item = items[--item_count];
+        if (item.end - item.begin <= subtree_size) {
+            push_build_item(&subtrees, &subtree_count, &subtree_capacity, &item);
+            continue;
+        }
+        struct build_item children[2];
+        size_t child_count = split_node(&builder, thread_pool, &item, children);
+        for (size_t i = 0; i < child_count; ++i)
+            push_build_item(&items, &item_count, &item_capacity, &children[i]);
+    }
+    free(items);
+
+    // Build the remaining subtrees in parallel, starting with the largest ones to balance the workload
+    if (subtree_count > 0) {
+        qsort(subtrees, subtree_count, sizeof(struct build_item), compare_build_item_size);
+        struct subtree_task* subtree_tasks = xmalloc(sizeof(struct subtree_task) * subtree_count);
+        for (size_t i = 0; i < subtree_count; ++i) {
+            subtree_tasks[i].work_item.work_fn = run_subtree_task;
+            subtree_tasks[i].work_item.next = &subtree_tasks[i + 1].work_item;
+            subtree_tasks[i].builder = &builder;
+            subtree_tasks[i].root = subtrees[i];
+        }
+        subtree_tasks[subtree_count - 1].work_item.next = NULL;
+        submit_work(thread_pool, &subtree_tasks[0].work_item, &subtree_tasks[subtree_count - 1].work_item);
+        wait_for_completion(thread_pool, 0);
+        free(subtree_tasks);
+    }
+    free(subtrees);
+    free(builder.tmp_primitive_indices);
+    free(centers);
+    free(bboxes);
+
+    struct bvh* bvh = xmalloc(sizeof(struct bvh));
+    bvh->node_count = atomic_load(&builder.node_count);
+    bvh->nodes = xrealloc(builder.nodes, sizeof(struct bvh_node) * bvh->node_count);
+    bvh->primitive_indices = primitive_indices;
+    bvh->primitive_index_count = primitive_count;
+    bvh->parents = NULL;
+    bvh->primitive_index_capacity = primitive_count;
+    bvh->node_capacity = bvh->node_count;
+    update_bvh_parents(thread_pool, bvh);
+    return bvh;
+}
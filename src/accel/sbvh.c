@@ -0,0 +1,596 @@
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "accel/bvh.h"
+#include "accel/binning.h"
+#include "core/thread_pool.h"
+#include "core/utils.h"
+
+/*
+ * This construction algorithm is based on "Spatial Splits in Bounding Volume Hierarchies",
+ * by M. Stich, H. Friedrich, and A. Dietrich. The BVH is built over references to primitives,
+ * each of which has its own bounding box. For each node, the best object split is found with
+ * binning, and if the children of that split overlap significantly, spatial splits are also
+ * evaluated. When a spatial split is selected, the references that straddle the splitting
+ * plane are either clipped into two references, or kept on one side if that is cheaper
+ * ("reference unsplitting"). The number of references that can be added in a subtree is
+ * limited by a budget, which is divided among the children of a node when it is split.
+ * The top of the hierarchy is built sequentially, and the remaining subtrees are built in
+ * parallel, each of them in a separate task, before being assembled into one BVH.
+ */
+
+#define MAX_LEAF_SIZE 16
+#define MIN_OVERLAP_RATIO 1e-5
+#define MIN_SUBTREE_SIZE 1024
+#define SUBTREES_PER_THREAD 4
+
+struct reference {
+    struct bbox bbox;
+    size_t primitive_index;
+};
+
+struct spatial_bin {
+    struct bbox bbox;
+    size_t entry_count;
+    size_t exit_count;
+};
+
+struct spatial_split {
+    int axis;
+    real_t position;
+    real_t cost;
+    size_t counts[2];
+    struct bbox bboxes[2];
+};
+
+// Node of the BVH that still has to be processed. It owns its array of references.
+struct sbvh_item {
+    size_t node_index;
+    struct reference* references;
+    size_t reference_count;
+    size_t budget; // Number of references that can still be added in this subtree
+};
+
+// Nodes and primitive indices of a BVH (or subtree) under construction.
+struct sbvh_output {
+    struct bvh_node* nodes;
+    size_t node_count, node_capacity;
+    size_t* primitive_indices;
+    size_t primitive_index_count, primitive_index_capacity;
+};
+
+struct sbvh_builder {
+    void* primitive_data;
+    split_fn_t split_fn;
+    real_t traversal_cost;
+    real_t min_overlap; // Minimum overlap between the children of an object split to try spatial splits
+};
+
+static inline struct vec3 get_reference_center(const struct reference* reference) {
+    return scale_vec3(add_vec3(reference->bbox.min, reference->bbox.max), (real_t)0.5);
+}
+
+static inline void push_sbvh_item(
+    struct sbvh_item** items,
+    size_t* item_count,
+    size_t* item_capacity,
+    const struct sbvh_item* item)
+{
+    if (*item_count >= *item_capacity) {
+        *item_capacity = *item_capacity > 0 ? *item_capacity * 2 : 16;
+        *items = xrealloc(*items, sizeof(struct sbvh_item) * *item_capacity);
+    }
+    (*items)[(*item_count)++] = *item;
+}
+
+static inline size_t alloc_sbvh_nodes(struct sbvh_output* output, size_t count) {
+    if (output->node_count + count > output->node_capacity) {
+        output->node_capacity = (output->node_count + count) * 2;
+        output->nodes = xrealloc(output->nodes, sizeof(struct bvh_node) * output->node_capacity);
+    }
+    size_t first_node = output->node_count;
+    output->node_count += count;
+    return first_node;
+}
+
+static inline size_t alloc_sbvh_primitive_indices(struct sbvh_output* output, size_t count) {
+    if (output->primitive_index_count + count > output->primitive_index_capacity) {
+        output->primitive_index_capacity = (output->primitive_index_count + count) * 2;
+        output->primitive_indices = xrealloc(
+            output->primitive_indices,
+            sizeof(size_t) * output->primitive_index_capacity);
+    }
+    size_t first_index = output->primitive_index_count;
+    output->primitive_index_count += count;
+    return first_index;
+}
+
+static void split_reference(
+    const struct sbvh_builder* builder,
+    const struct reference* reference,
+    int axis, real_t position,
+    struct reference* left,
+    struct reference* right)
+{
+    struct bbox left_bbox, right_bbox;
+    builder->split_fn(builder->primitive_data, reference->primitive_index, axis, position, &left_bbox, &right_bbox);
+    left->bbox  = intersect_bbox(reference->bbox, left_bbox);
+    right->bbox = intersect_bbox(reference->bbox, right_bbox);
+    left->bbox.max._[axis]  = min_real(left->bbox.max._[axis], position);
+    right->bbox.min._[axis] = max_real(right->bbox.min._[axis], position);
+    left->primitive_index = right->primitive_index = reference->primitive_index;
+}
+
+static inline size_t compute_spatial_bin_index(real_t min, real_t scale, real_t p) {
+    real_t bin = (p - min) * scale;
+    return min_size_t(bin > 0 ? (size_t)bin : 0, BIN_COUNT - 1);
+}
+
+static bool find_spatial_split(
+    const struct sbvh_builder* builder,
+    const struct sbvh_item* item,
+    const struct bbox* bbox,
+    struct spatial_split* best_split)
+{
+    best_split->cost = REAL_MAX;
+    for (int i = 0; i < 3; ++i) {
+        real_t min = bbox->min._[i];
+        real_t extent = bbox->max._[i] - min;
+        if (extent <= 0)
+            continue;
+        real_t bin_size = extent / (real_t)BIN_COUNT;
+        real_t scale = ((real_t)BIN_COUNT) / extent;
+
+        // Clip each reference against the planes that separate the bins it overlaps
+        struct spatial_bin bins[BIN_COUNT];
+        for (size_t j = 0; j < BIN_COUNT; ++j) {
+            bins[j].bbox = empty_bbox();
+            bins[j].entry_count = bins[j].exit_count = 0;
+        }
+        for (size_t j = 0; j < item->reference_count; ++j) {
+            struct reference reference = item->references[j];
+            size_t first_bin = compute_spatial_bin_index(min, scale, reference.bbox.min._[i]);
+            size_t last_bin  = compute_spatial_bin_index(min, scale, reference.bbox.max._[i]);
+            for (size_t k = first_bin; k < last_bin; ++k) {
+                struct reference left, right;
+                split_reference(builder, &reference, i, min + bin_size * (real_t)(k + 1), &left, &right);
+                bins[k].bbox = union_bbox(bins[k].bbox, left.bbox);
+                reference = right;
+            }
+            bins[last_bin].bbox = union_bbox(bins[last_bin].bbox, reference.bbox);
+            bins[first_bin].entry_count++;
+            bins[last_bin].exit_count++;
+        }
+
+        // Sweep from the right, and then from the left, as for object splits
+        real_t right_costs[BIN_COUNT];
+        struct bbox right_bbox = empty_bbox();
+        size_t right_count = 0;
+        for (size_t j = BIN_COUNT - 1; j > 0; --j) {
+            right_bbox = union_bbox(right_bbox, bins[j].bbox);
+            right_count += bins[j].exit_count;
+            right_costs[j] = right_count > 0 ? half_bbox_area(right_bbox) * right_count : REAL_MAX;
+        }
+        struct bbox left_bbox = empty_bbox();
+        size_t left_count = 0, split_bin = 0;
+        for (size_t j = 1; j < BIN_COUNT; ++j) {
+            left_bbox = union_bbox(left_bbox, bins[j - 1].bbox);
+            left_count += bins[j - 1].entry_count;
+            if (left_count == 0 || right_costs[j] == REAL_MAX)
+                continue;
+            real_t cost = half_bbox_area(left_bbox) * left_count + right_costs[j];
+            if (cost < best_split->cost) {
+                best_split->cost = cost;
+                best_split->axis = i;
+                best_split->position = min + bin_size * (real_t)j;
+                best_split->counts[0] = left_count;
+                best_split->bboxes[0] = left_bbox;
+                split_bin = j;
+            }
+        }
+
+        // Compute the bounding box and count of the right side, if the best split is on this axis
+        if (split_bin > 0) {
+            best_split->counts[1] = 0;
+            best_split->bboxes[1] = empty_bbox();
+            for (size_t j = split_bin; j < BIN_COUNT; ++j) {
+                best_split->bboxes[1] = union_bbox(best_split->bboxes[1], bins[j].bbox);
+                best_split->counts[1] += bins[j].exit_count;
+            }
+        }
+    }
+    return best_split->cost != REAL_MAX;
+}
+
+// Distributes the references of a node according to a spatial split. Returns false if one of
+// the children would be empty, in which case the references of the node are left untouched.
+static bool apply_spatial_split(
+    const struct sbvh_builder* builder,
+    const struct sbvh_item* item,
+    const struct spatial_split* split,
+    struct sbvh_item* children)
+{
+    int axis = split->axis;
+    real_t left_area  = half_bbox_area(split->bboxes[0]);
+    real_t right_area = half_bbox_area(split->bboxes[1]);
+    real_t split_cost = left_area * split->counts[0] + right_area * split->counts[1];
+
+    struct reference* references[2] = {
+        xmalloc(sizeof(struct reference) * item->reference_count),
+        xmalloc(sizeof(struct reference) * item->reference_count)
+    };
+    size_t counts[2] = { 0, 0 }, capacities[2] = { item->reference_count, item->reference_count };
+    for (size_t i = 0; i < item->reference_count; ++i) {
+        const struct reference* reference = &item->references[i];
+        int side = -1;
+        if (reference->bbox.max._[axis] <= split->position)
+            side = 0;
+        else if (reference->bbox.min._[axis] >= split->position)
+            side = 1;
+        else {
+            // Keep the reference on one side only if that is cheaper than splitting it
+            real_t left_cost =
+                half_bbox_area(union_bbox(split->bboxes[0], reference->bbox)) * split->counts[0] +
+                right_area * (split->counts[1] - 1);
+            real_t right_cost =
+                left_area * (split->counts[0] - 1) +
+                half_bbox_area(union_bbox(split->bboxes[1], reference->bbox)) * split->counts[1];
+            if (left_cost < split_cost && left_cost <= right_cost)
+                side = 0;
+            else if (right_cost < split_cost)
+                side = 1;
+            else {
+                struct reference parts[2];
+                split_reference(builder, reference, axis, split->position, &parts[0], &parts[1]);
+                for (int j = 0; j < 2; ++j) {
+                    if (is_empty_bbox(parts[j].bbox))
+                        continue;
+                    if (counts[j] >= capacities[j]) {
+                        capacities[j] *= 2;
+                        references[j] = xrealloc(references[j], sizeof(struct reference) * capacities[j]);
+                    }
+                    references[j][counts[j]++] = parts[j];
+                }
+                continue;
+            }
+        }
+        if (counts[side] >= capacities[side]) {
+            capacities[side] *= 2;
+            references[side] = xrealloc(references[side], sizeof(struct reference) * capacities[side]);
+        }
+        references[side][counts[side]++] = *reference;
+    }
+
+    if (counts[0] == 0 || counts[1] == 0) {
+        free(references[0]);
+        free(references[1]);
+        return false;
+    }
+
+    // Divide the remaining budget between the children, in proportion to their size
+    size_t added_count = counts[0] + counts[1] - item->reference_count;
+    size_t budget = item->budget > added_count ? item->budget - added_count : 0;
+    size_t left_budget = (size_t)((double)budget * (double)counts[0] / (double)(counts[0] + counts[1]));
+    for (int i = 0; i < 2; ++i) {
+        children[i].references = references[i];
+        children[i].reference_count = counts[i];
+        children[i].budget = i == 0 ? left_budget : budget - left_budget;
+    }
+    return true;
+}
+
+static void apply_object_split(
+    const struct sbvh_item* item,
+    const struct bin_mapping* mapping,
+    const struct split* split,
+    struct sbvh_item* children)
+{
+    struct reference* references = item->references;
+    size_t i = 0, j = item->reference_count;
+    while (true) {
+        while (i < j && compute_bin_index(mapping, split->axis, get_reference_center(&references[i])._[split->axis]) < split->bin) i++;
+        while (i < j && compute_bin_index(mapping, split->axis, get_reference_center(&references[j - 1])._[split->axis]) >= split->bin) j--;
+        if (i >= j)
+            break;
+        struct reference tmp = references[i];
+        references[i] = references[j - 1];
+        references[j - 1] = tmp;
+        i++, j--;
+    }
+    assert(i == split->left_count);
+
+    // The left child keeps the array of the parent, and the right child gets a copy of its part
+    size_t right_count = item->reference_count - i;
+    children[0].references = references;
+    children[0].reference_count = i;
+    children[1].references = xmalloc(sizeof(struct reference) * right_count);
+    children[1].reference_count = right_count;
+    memcpy(children[1].references, references + i, sizeof(struct reference) * right_count);
+}
+
+static void apply_median_split(const struct sbvh_item* item, struct sbvh_item* children) {
+    size_t left_count = item->reference_count / 2;
+    size_t right_count = item->reference_count - left_count;
+    children[0].references = item->references;
+    children[0].reference_count = left_count;
+    children[1].references = xmalloc(sizeof(struct reference) * right_count);
+    children[1].reference_count = right_count;
+    memcpy(children[1].references, item->references + left_count, sizeof(struct reference) * right_count);
+}
+
+static void make_sbvh_leaf(struct sbvh_output* output, const struct sbvh_item* item) {
+    size_t first_index = alloc_sbvh_primitive_indices(output, item->reference_count);
+    for (size_t i = 0; i < item->reference_count; ++i)
+        output->primitive_indices[first_index + i] = item->references[i].primitive_index;
+    struct bvh_node* node = &output->nodes[item->node_index];
+    node->primitive_count = item->reference_count;
+    node->first_child_or_primitive = first_index;
+    free(item->references);
+}
+
+// Splits a node, or turns it into a leaf. Returns the number of children.
+static size_t split_sbvh_node(
+    const struct sbvh_builder* builder,
+    struct sbvh_output* output,
+    const struct sbvh_item* item,
+    struct sbvh_item* children)
+{
+    struct bbox bbox = empty_bbox(), center_bbox = empty_bbox();
+    for (size_t i = 0; i < item->reference_count; ++i) {
+        bbox = union_bbox(bbox, item->references[i].bbox);
+        center_bbox = extend_bbox(center_bbox, get_reference_center(&item->references[i]));
+    }
+    set_bvh_node_bbox(&output->nodes[item->node_index], &bbox);
+    if (item->reference_count <= 1) {
+        make_sbvh_leaf(output, item);
+        return 0;
+    }
+
+    struct bins bins;
+    struct split object_split = { .cost = REAL_MAX };
+    struct bin_mapping mapping = compute_bin_mapping(&center_bbox);
+    init_bins(&bins);
+    for (size_t i = 0; i < item->reference_count; ++i)
+        add_to_bins(&bins, &mapping, &item->references[i].bbox, get_reference_center(&item->references[i]));
+    bool has_object_split = find_best_split(&bins, &mapping, &object_split);
+
+    // Only try spatial splits when the children of the object split overlap
+    struct spatial_split spatial_split = { .cost = REAL_MAX };
+    bool has_spatial_split = false;
+    if (item->budget > 0 &&
+        (!has_object_split ||
+        (bbox_overlaps(object_split.bboxes[0], object_split.bboxes[1]) &&
+        half_bbox_area(intersect_bbox(object_split.bboxes[0], object_split.bboxes[1])) > builder->min_overlap)))
+    {
+        has_spatial_split =
+            find_spatial_split(builder, item, &bbox, &spatial_split) &&
+            spatial_split.counts[0] + spatial_split.counts[1] - item->reference_count <= item->budget &&
+            (!has_object_split || spatial_split.cost < object_split.cost);
+    }
+
+    // Same criterion as the one used to collapse leaves in the other construction algorithms
+    real_t leaf_cost = half_bbox_area(bbox) * (item->reference_count - builder->traversal_cost);
+    real_t split_cost = has_spatial_split ? spatial_split.cost : (has_object_split ? object_split.cost : REAL_MAX);
+    if (item->reference_count <= MAX_LEAF_SIZE && leaf_cost <= split_cost) {
+        make_sbvh_leaf(output, item);
+        return 0;
+    }
+
+    if (has_spatial_split && apply_spatial_split(builder, item, &spatial_split, children))
+        free(item->references);
+    else if (has_object_split) {
+        apply_object_split(item, &mapping, &object_split, children);
+        children[0].budget = item->budget / 2;
+        children[1].budget = item->budget - children[0].budget;
+    } else if (item->reference_count > MAX_LEAF_SIZE) {
+        apply_median_split(item, children);
+        children[0].budget = item->budget / 2;
+        children[1].budget = item->budget - children[0].budget;
+    } else {
+        make_sbvh_leaf(output, item);
+        return 0;
+    }
+
+    // Children are allocated by pairs, starting at index 1, so that the first child always has an odd index
+    size_t first_child = alloc_sbvh_nodes(output, 2);
+    output->nodes[item->node_index].primitive_count = 0;
+    output->nodes[item->node_index].first_child_or_primitive = first_child;
+    children[0].node_index = first_child + 0;
+    children[1].node_index = first_child + 1;
+    return 2;
+}
+
+static void build_sbvh_subtree(
+    const struct sbvh_builder* builder,
+    struct sbvh_output* output,
+    const struct sbvh_item* root)
+{
+    struct sbvh_item* stack = NULL;
+    size_t stack_size = 0, stack_capacity = 0;
+    push_sbvh_item(&stack, &stack_size, &stack_capacity, root);
+    while (stack_size > 0) {
+        struct sbvh_item item = stack[--stack_size];
+        struct sbvh_item children[2];
+        size_t child_count = split_sbvh_node(builder, output, &item, children);
+        for (size_t i = 0; i < child_count; ++i)
+            push_sbvh_item(&stack, &stack_size, &stack_capacity, &children[i]);
+    }
+    free(stack);
+}
+
+struct sbvh_subtree_task {
+    struct work_item work_item;
+    const struct sbvh_builder* builder;
+    struct sbvh_item root;
+    size_t root_index; // Index of the root of the subtree in the top of the hierarchy
+    struct sbvh_output output;
+};
+
+static void run_sbvh_subtree_task(struct work_item* work_item, size_t thread_id) {
+    IGNORE(thread_id);
+    struct sbvh_subtree_task* subtree_task = (void*)work_item;
+    struct sbvh_output* output = &subtree_task->output;
+    size_t capacity = subtree_task->root.reference_count;
+    *output = (struct sbvh_output) {
+        .nodes = xmalloc(sizeof(struct bvh_node) * (2 * capacity - 1)),
+        .node_capacity = 2 * capacity - 1,
+        .primitive_indices = xmalloc(sizeof(size_t) * capacity),
+        .primitive_index_capacity = capacity
+    };
+    alloc_sbvh_nodes(output, 1);
+    subtree_task->root.node_index = 0;
+    build_sbvh_subtree(subtree_task->builder, output, &subtree_task->root);
+}
+
+static int compare_sbvh_item_size(const void* left, const void* right) {
+    size_t left_size  = ((const struct sbvh_item*)left)->reference_count;
+    size_t right_size = ((const struct sbvh_item*)right)->reference_count;
+    return left_size > right_size ? -1 : (left_size < right_size ? 1 : 0);
+}
+
+struct references_task {
+    struct parallel_task_1d task;
+    void* primitive_data;
+    bbox_fn_t bbox_fn;
+    struct reference* references;
+};
+
+static void run_references_task(struct parallel_task_1d* task, size_t thread_id) {
+    IGNORE(thread_id);
+    struct references_task* references_task = (void*)task;
+    for (size_t i = task->range.begin, n = task->range.end; i < n; ++i) {
+        references_task->references[i].bbox = references_task->bbox_fn(references_task->primitive_data, i);
+        references_task->references[i].primitive_index = i;
+    }
+}
+
+// Copies the nodes of a subtree after the nodes already present in the BVH, except for its root,
+// which replaces the corresponding leaf of the top of the hierarchy. Children indices are adjusted.
+static void copy_sbvh_subtree(
+    struct bvh* bvh,
+    const struct sbvh_subtree_task* subtree_task,
+    size_t first_node,
+    size_t first_primitive)
+{
+    const struct sbvh_output* output = &subtree_task->output;
+    for (size_t i = 0; i < output->node_count; ++i) {
+        size_t node_index = i == 0 ? subtree_task->root_index : first_node + i - 1;
+        struct bvh_node* node = &bvh->nodes[node_index];
+        *node = output->nodes[i];
+        if (node->primitive_count == 0)
+            node->first_child_or_primitive = first_node + node->first_child_or_primitive - 1;
+        else
+            node->first_child_or_primitive += first_primitive;
+    }
+    memcpy(
+        bvh->primitive_indices + first_primitive,
+        output->primitive_indices,
+        sizeof(size_t) * output->primitive_index_count);
+}
+
+struct bvh* build_sbvh(
+    struct thread_pool* thread_pool,
+    void* primitive_data,
+    bbox_fn_t bbox_fn,
+    split_fn_t split_fn,
+    size_t primitive_count,
+    real_t traversal_cost,
+    real_t max_duplication)
+{
+    assert(primitive_count > 0);
+
+    struct reference* references = xmalloc(sizeof(struct reference) * primitive_count);
+    parallel_for_1d(
+        thread_pool,
+        run_references_task,
+        (struct parallel_task_1d*)&(struct references_task) {
+            .primitive_data = primitive_data,
+            .bbox_fn        = bbox_fn,
+            .references     = references
+        },
+        sizeof(struct references_task),
+        &(struct range) { 0, primitive_count });
+    struct bbox bbox = empty_bbox();
+    for (size_t i = 0; i < primitive_count; ++i)
+        bbox = union_bbox(bbox, references[i].bbox);
+
+    struct sbvh_builder builder = {
+        .primitive_data = primitive_data,
+        .split_fn       = split_fn,
+        .traversal_cost = traversal_cost,
+        .min_overlap    = half_bbox_area(bbox) * MIN_OVERLAP_RATIO
+    };
+
+    // Build the top of the hierarchy sequentially, until nodes are small enough to be processed in parallel
+    size_t thread_count = get_thread_count(thread_pool);
+    size_t subtree_size = primitive_count / (thread_count * SUBTREES_PER_THREAD);
+    subtree_size = subtree_size > MIN_SUBTREE_SIZE ? subtree_size : MIN_SUBTREE_SIZE;
+    struct sbvh_output top = { 0 };
+    struct sbvh_item* items = NULL, *subtrees = NULL;
+    size_t item_count = 0, item_capacity = 0;
+    size_t subtree_count = 0, subtree_capacity = 0;
+    alloc_sbvh_nodes(&top, 1);
+    push_sbvh_item(&items, &item_count, &item_capacity, &(struct sbvh_item) {
+        .node_index      = 0,
+        .references      = references,
+        .reference_count = primitive_count,
+        .budget          = (size_t)(max_duplication * (real_t)primitive_count)
+    });
+    while (item_count > 0) {
+        struct sbvh_item item = items[--item_count];
+        if (item.reference_count <= subtree_size) {
+            push_sbvh_item(&subtrees, &subtree_count, &subtree_capacity, &item);
+            continue;
+        }
+        struct sbvh_item children[2];
+        size_t child_count = split_sbvh_node(&builder, &top, &item, children);
+        for (size_t i = 0; i < child_count; ++i)
+            push_sbvh_item(&items, &item_count, &item_capacity, &children[i]);
+    }
+    free(items);
+
+    // Build the subtrees in parallel, starting with the largest ones to balance the workload
+    qsort(subtrees, subtree_count, sizeof(struct sbvh_item), compare_sbvh_item_size);
+    struct sbvh_subtree_task* subtree_tasks = xmalloc(sizeof(struct sbvh_subtree_task) * (subtree_count + 1));
+    for (size_t i = 0; i < subtree_count; ++i) {
+        subtree_tasks[i].work_item.work_fn = run_sbvh_subtree_task;
+        subtree_tasks[i].work_item.next = &subtree_tasks[i + 1].work_item;
+        subtree_tasks[i].builder = &builder;
+        subtree_tasks[i].root = subtrees[i];
+        subtree_tasks[i].root_index = subtrees[i].node_index;
+    }
+    if (subtree_count > 0) {
+        subtree_tasks[subtree_count - 1].work_item.next = NULL;
+        submit_work(thread_pool, &subtree_tasks[0].work_item, &subtree_tasks[subtree_count - 1].work_item);
+        wait_for_completion(thread_pool, 0);
+    }
+    free(subtrees);
+
+    // Assemble the top of the hierarchy and the subtrees. Since every subtree has an odd number
+    // of nodes, the first child of every node still has an odd index after this step.
+    size_t node_count = top.node_count, primitive_index_count = top.primitive_index_count;
+    for (size_t i = 0; i < subtree_count; ++i) {
+        node_count += subtree_tasks[i].output.node_count - 1;
+        primitive_index_count += subtree_tasks[i].output.primitive_index_count;
+    }
+    struct bvh* bvh = xmalloc(sizeof(struct bvh));
+    bvh->nodes = xrealloc(top.nodes, sizeof(struct bvh_node) * node_count);
+    bvh->primitive_indices = xrealloc(top.primitive_indices, sizeof(size_t) * primitive_index_count);
+    bvh->node_count = node_count;
+    bvh->primitive_index_count = primitive_index_count;
+    bvh->node_capacity = node_count;
+    bvh->primitive_index_capacity = primitive_index_count;
+    size_t first_node = top.node_count, first_primitive = top.primitive_index_count;
+    for (size_t i = 0; i < subtree_count; ++i) {
+        copy_sbvh_subtree(bvh, &subtree_tasks[i], first_node, first_primitive);
+        first_node += subtree_tasks[i].output.node_count - 1;
+        first_primitive += subtree_tasks[i].output.primitive_index_count;
+        free(subtree_tasks[i].output.nodes);
+        free(subtree_tasks[i].output.primitive_indices);
+    }
+    free(subtree_tasks);
+    bvh->parents = NULL;
+    update_bvh_parents(thread_pool, bvh);
+    return bvh;
+}
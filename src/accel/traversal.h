@@ -0,0 +1,213 @@
+#ifndef ACCEL_TRAVERSAL_H
+#define ACCEL_TRAVERSAL_H
+
+#include "core/config.h"
+#include "core/utils.h"
+#include "core/ray.h"
+
+/*
+ * Helpers shared by the different BVH traversal routines.
+ * The robust traversal implementation is inspired from T. Ize's "Robust BVH Ray Traversal"
+ * article. It is only enabled when USE_ROBUST_BVH_TRAVERSAL is defined.
+ */
+
+#define TRAVERSAL_STACK_SIZE 64
+
+struct ray_data {
+#ifdef USE_ROBUST_BVH_TRAVERSAL
+    struct vec3 inv_dir;
+    struct vec3 padded_inv_dir;
+#else
+    struct vec3 inv_dir;
+    struct vec3 scaled_org;
+#endif
+    int octant[3];
+};
+
+static inline real_t intersect_ray_axis_min(
+    const struct ray* ray,
+    const struct ray_data* ray_data,
+    int axis, real_t p)
+{
+#ifdef USE_ROBUST_BVH_TRAVERSAL
+    return (p - ray->org._[axis]) * ray_data->inv_dir._[axis];
+#else
+    IGNORE(ray);
+    return fast_mul_add(p, ray_data->inv_dir._[axis], ray_data->scaled_org._[axis]);
+#endif
+}
+
+static inline real_t intersect_ray_axis_max(
+    const struct ray* ray,
+    const struct ray_data* ray_data,
+    int axis, real_t p)
+{
+#ifdef USE_ROBUST_BVH_TRAVERSAL
+    return (p - ray->org._[axis]) * ray_data->padded_inv_dir._[axis];
+#else
+    return intersect_ray_axis_min(ray, ray_data, axis, p);
+#endif
+}
+
+static inline void compute_ray_data(const struct ray* ray, struct ray_data* ray_data) {
+#ifdef USE_ROBUST_BVH_TRAVERSAL
+    ray_data->inv_dir = div_vec3(const_vec3(1), ray->dir);
+    ray_data->padded_inv_dir._[0] = add_ulp_magnitude(ray_data->inv_dir._[0], 2);
+    ray_data->padded_inv_dir._[1] = add_ulp_magnitude(ray_data->inv_dir._[1], 2);
+    ray_data->padded_inv_dir._[2] = add_ulp_magnitude(ray_data->inv_dir._[2], 2);
+#else
+    ray_data->inv_dir._[0] = safe_inverse(ray->dir._[0]);
+    ray_data->inv_dir._[1] = safe_inverse(ray->dir._[1]);
+    ray_data->inv_dir._[2] = safe_inverse(ray->dir._[2]);
+    ray_data->scaled_org = neg_vec3(mul_vec3(ray->org, ray_data->inv_dir));
+#endif
+    ray_data->octant[0] = signbit(ray->dir._[0]) ? 1 : 0;
+    ray_data->octant[1] = signbit(ray->dir._[1]) ? 1 : 0;
+    ray_data->octant[2] = signbit(ray->dir._[2]) ? 1 : 0;
+}
+
+// Entry of the traversal stack. The entry distance of a node is stored along with it,
+// so that it can be culled when it is popped, if a closer intersection was found since.
+struct stack_entry {
+    bits_t node_index;
+    real_t t_entry;
+};
+
+/*
+ * Traversal stacks have a fixed size, so that traversal routines never allocate memory. They are
+ * used as ring buffers: when a stack is full, its oldest entry is overwritten, and the stack is
+ * marked as having overflowed. The nodes that were dropped are then found again once the stack
+ * is empty, by walking up the parents of the last node that was visited.
+ */
+#define GEN_TRAVERSAL_STACK(name, T) \
+    struct name { \
+        T entries[TRAVERSAL_STACK_SIZE]; \
+        size_t size, top; \
+        bool overflow; \
+    }; \
+    static inline void init_##name(struct name* stack) { \
+        /* The entries are not initialized, since they are only read after being written */ \
+        stack->size = stack->top = 0; \
+        stack->overflow = false; \
+    } \
+    static inline void push_##name(struct name* stack, T entry) { \
+        if (unlikely(stack->size == TRAVERSAL_STACK_SIZE)) { \
+            stack->overflow = true; \
+            stack->size--; \
+        } \
+        stack->entries[stack->top] = entry; \
+        stack->top = (stack->top + 1) % TRAVERSAL_STACK_SIZE; \
+        stack->size++; \
+    } \
+    static inline bool pop_##name(struct name* stack, T* entry) { \
+        if (stack->size == 0) \
+            return false; \
+        stack->top = (stack->top + TRAVERSAL_STACK_SIZE - 1) % TRAVERSAL_STACK_SIZE; \
+        stack->size--; \
+        *entry = stack->entries[stack->top]; \
+        return true; \
+    }
+
+GEN_TRAVERSAL_STACK(traversal_stack, struct stack_entry)
+GEN_TRAVERSAL_STACK(node_stack, bits_t) // For the occlusion traversal routines, which only need node indices
+
+// Places the indices of the children whose bit is set in `mask` into `children`,
+// sorted by increasing entry distance if `sort` is set. Returns the number of children.
+static inline size_t gather_hit_children(
+    unsigned mask, const real_t* t_entry,
+    size_t width, bool sort,
+    size_t* children)
+{
+    size_t hit_count = 0;
+    for (size_t i = 0; i < width; ++i) {
+        if (!(mask & (1u << i)))
+            continue;
+        size_t j = hit_count++;
+        for (; sort && j > 0 && t_entry[children[j - 1]] > t_entry[i]; --j)
+            children[j] = children[j - 1];
+        children[j] = i;
+    }
+    return hit_count;
+}
+
+// Returns the child that `gather_hit_children()` places right after child `c`, among the children
+// whose bit is set in `mask`, or `width` if there is none. Child `c` does not need to be in the mask.
+// This is used to find the nodes that were dropped from a traversal stack after an overflow.
+static inline size_t find_next_hit_child(
+    unsigned mask, const real_t* t_entry,
+    size_t width, bool sort,
+    size_t c)
+{
+    size_t next = width;
+    for (size_t i = 0; i < width; ++i) {
+        if (!(mask & (1u << i)))
+            continue;
+        // Children with the same entry distance are kept in storage order when sorting
+        bool is_after = sort
+            ? t_entry[i] > t_entry[c] || (t_entry[i] == t_entry[c] && i > c)
+            : i > c;
+        bool is_before_next = next == width || (sort
+            ? t_entry[i] < t_entry[next] || (t_entry[i] == t_entry[next] && i < next)
+            : i < next);
+        if (is_after && is_before_next)
+            next = i;
+    }
+    return next;
+}
+
+// Same as `struct ray_data`, but for a packet of rays. Since the rays of a packet
+// do not necessarily have the same octant, there is no per-ray octant: both slabs
+// of each axis are intersected, and the resulting distances are sorted instead.
+struct ray_packet_data {
+#ifdef USE_ROBUST_BVH_TRAVERSAL
+    real_t inv_dir[3][MAX_RAY_PACKET_SIZE];
+    real_t padded_inv_dir[3][MAX_RAY_PACKET_SIZE];
+#else
+    real_t inv_dir[3][MAX_RAY_PACKET_SIZE];
+    real_t scaled_org[3][MAX_RAY_PACKET_SIZE];
+#endif
+};
+
+static inline real_t intersect_ray_packet_axis_min(
+    const struct ray_packet* packet,
+    const struct ray_packet_data* packet_data,
+    int axis, size_t i, real_t p)
+{
+#ifdef USE_ROBUST_BVH_TRAVERSAL
+    return (p - packet->org[axis][i]) * packet_data->inv_dir[axis][i];
+#else
+    IGNORE(packet);
+    return fast_mul_add(p, packet_data->inv_dir[axis][i], packet_data->scaled_org[axis][i]);
+#endif
+}
+
+static inline real_t intersect_ray_packet_axis_max(
+    const struct ray_packet* packet,
+    const struct ray_packet_data* packet_data,
+    int axis, size_t i, real_t p)
+{
+#ifdef USE_ROBUST_BVH_TRAVERSAL
+    return (p - packet->org[axis][i]) * packet_data->padded_inv_dir[axis][i];
+#else
+    return intersect_ray_packet_axis_min(packet, packet_data, axis, i, p);
+#endif
+}
+
+static inline void compute_ray_packet_data(
+    const struct ray_packet* packet,
+    struct ray_packet_data* packet_data)
+{
+    for (int j = 0; j < 3; ++j) {
+        for (size_t i = 0, n = packet->size; i < n; ++i) {
+#ifdef USE_ROBUST_BVH_TRAVERSAL
+            packet_data->inv_dir[j][i] = ((real_t)1) / packet->dir[j][i];
+            packet_data->padded_inv_dir[j][i] = add_ulp_magnitude(packet_data->inv_dir[j][i], 2);
+#else
+            packet_data->inv_dir[j][i] = safe_inverse(packet->dir[j][i]);
+            packet_data->scaled_org[j][i] = -packet->org[j][i] * packet_data->inv_dir[j][i];
+#endif
+        }
+    }
+}
+
+#endif
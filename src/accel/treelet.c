@@ -0,0 +1,270 @@
+#include <stdlib.h>
+#include <stdatomic.h>
+#include <assert.h>
+
+#include "accel/bvh.h"
+#include "core/thread_pool.h"
+#include "core/utils.h"
+
+/*
+ * Treelet restructuring algorithm, described in "Fast Parallel Construction of High-Quality
+ * Bounding Volume Hierarchies", by T. Karras and T. Aila. The BVH is traversed bottom-up in
+ * parallel, with the same scheme as the leaf collapsing algorithm. For each node, a treelet is
+ * formed by expanding the children with the largest area, and its optimal topology is found with
+ * dynamic programming over the subsets of its leaves. The leaves of a treelet are subtrees which
+ * are left untouched, and only the inner nodes of the treelet are rearranged, reusing their slots.
+ */
+
+#define MAX_TREELET_LEAF_COUNT 7
+#define MAX_TREELET_SUBSET_COUNT (1 << MAX_TREELET_LEAF_COUNT)
+
+// Number of passes over the tree. Only nodes with more than `MAX_TREELET_LEAF_COUNT << i`
+// leaves are restructured during pass `i`, since most of the improvement comes from the
+// first pass, and the following passes only need to improve the top of the tree.
+#define PASS_COUNT 3
+
+struct treelet_init_task {
+    struct parallel_task_1d task;
+    const struct bvh_node* nodes;
+    size_t* parents;
+    atomic_int* flags;
+    bool* is_leaf;
+};
+
+static void run_treelet_init_task(struct parallel_task_1d* task, size_t thread_id) {
+    IGNORE(thread_id);
+    struct treelet_init_task* treelet_init_task = (void*)task;
+    for (size_t i = task->range.begin, n = task->range.end; i < n; ++i) {
+        const struct bvh_node* node = &treelet_init_task->nodes[i];
+        atomic_init(&treelet_init_task->flags[i], 0);
+        treelet_init_task->is_leaf[i] = node->primitive_count != 0;
+        if (node->primitive_count == 0) {
+            treelet_init_task->parents[node->first_child_or_primitive + 0] = i;
+            treelet_init_task->parents[node->first_child_or_primitive + 1] = i;
+        }
+    }
+}
+
+struct treelet {
+    size_t leaves[MAX_TREELET_LEAF_COUNT];
+    size_t pairs[MAX_TREELET_LEAF_COUNT - 1]; // Index of the first slot of each pair of children
+    size_t leaf_count;
+    size_t pair_count;
+    struct bvh_node leaf_nodes[MAX_TREELET_LEAF_COUNT];
+    real_t leaf_costs[MAX_TREELET_LEAF_COUNT];
+    size_t leaf_leaf_counts[MAX_TREELET_LEAF_COUNT];
+    struct bbox bboxes[MAX_TREELET_SUBSET_COUNT];
+    real_t costs[MAX_TREELET_SUBSET_COUNT];
+    uint8_t partitions[MAX_TREELET_SUBSET_COUNT];
+    size_t next_pair;
+};
+
+struct treelet_task {
+    struct parallel_task_1d task;
+    struct bvh_node* nodes;
+    const size_t* parents;
+    const bool* is_leaf;
+    atomic_int* flags;
+    real_t* costs;        // SAH cost of the subtree rooted at each node
+    size_t* leaf_counts;  // Number of leaves in the subtree rooted at each node
+    size_t min_leaf_count;
+    real_t traversal_cost;
+};
+
+// Forms a treelet by repeatedly expanding the leaf with the largest area.
+static void form_treelet(const struct bvh_node* nodes, size_t root_index, struct treelet* treelet) {
+    size_t first_child = nodes[root_index].first_child_or_primitive;
+    treelet->leaves[0] = first_child + 0;
+    treelet->leaves[1] = first_child + 1;
+    treelet->pairs[0] = first_child;
+    treelet->leaf_count = 2;
+    treelet->pair_count = 1;
+    while (treelet->leaf_count < MAX_TREELET_LEAF_COUNT) {
+        size_t best_leaf = SIZE_MAX;
+        real_t best_area = -REAL_MAX;
+        for (size_t i = 0; i < treelet->leaf_count; ++i) {
+            const struct bvh_node* node = &nodes[treelet->leaves[i]];
+            real_t area = half_bbox_area(get_bvh_node_bbox(node));
+            if (node->primitive_count == 0 && area > best_area) {
+                best_area = area;
+                best_leaf = i;
+            }
+        }
+        if (best_leaf == SIZE_MAX)
+            break;
+        size_t first_grandchild = nodes[treelet->leaves[best_leaf]].first_child_or_primitive;
+        treelet->leaves[best_leaf] = first_grandchild + 0;
+        treelet->leaves[treelet->leaf_count++] = first_grandchild + 1;
+        treelet->pairs[treelet->pair_count++] = first_grandchild;
+    }
+}
+
+// Finds the optimal topology of the treelet. Returns the cost of the resulting subtree.
+static real_t optimize_treelet(struct treelet* treelet, real_t traversal_cost) {
+    size_t subset_count = (size_t)1 << treelet->leaf_count;
+    for (size_t i = 0; i < treelet->leaf_count; ++i) {
+        treelet->bboxes[1 << i] = get_bvh_node_bbox(&treelet->leaf_nodes[i]);
+        treelet->costs[1 << i] = treelet->leaf_costs[i];
+    }
+    // Subsets are processed in increasing order, so that smaller subsets are processed first
+    for (size_t s = 1; s < subset_count; ++s) {
+        size_t lowest_bit = s & (~s + 1);
+        if (s == lowest_bit)
+            continue;
+        treelet->bboxes[s] = union_bbox(treelet->bboxes[lowest_bit], treelet->bboxes[s & ~lowest_bit]);
+
+        // Only the partitions in which the left part contains the lowest leaf are considered,
+        // since the other ones are the same up to a permutation of the children.
+        real_t best_cost = REAL_MAX;
+        size_t best_partition = lowest_bit;
+        for (size_t p = (s - 1) & s; p != 0; p = (p - 1) & s) {
+            if (!(p & lowest_bit))
+                continue;
+            real_t cost = treelet->costs[p] + treelet->costs[s & ~p];
+            if (cost < best_cost) {
+                best_cost = cost;
+                best_partition = p;
+            }
+        }
+        treelet->costs[s] = best_cost + traversal_cost * half_bbox_area(treelet->bboxes[s]);
+        treelet->partitions[s] = best_partition;
+    }
+    return treelet->costs[subset_count - 1];
+}
+
+// Writes the optimized topology of a subset of the treelet at the given slot.
+static size_t write_treelet(
+    struct treelet_task* treelet_task,
+    struct treelet* treelet,
+    size_t subset,
+    size_t node_index)
+{
+    struct bvh_node* node = &treelet_task->nodes[node_index];
+    if ((subset & (subset - 1)) == 0) {
+        size_t leaf_index = 0;
+        while (subset != ((size_t)1 << leaf_index))
+            leaf_index++;
+        *node = treelet->leaf_nodes[leaf_index];
+        treelet_task->costs[node_index] = treelet->leaf_costs[leaf_index];
+        treelet_task->leaf_counts[node_index] = treelet->leaf_leaf_counts[leaf_index];
+        return treelet->leaf_leaf_counts[leaf_index];
+    }
+
+    size_t first_child = treelet->pairs[treelet->next_pair++];
+    node->primitive_count = 0;
+    node->first_child_or_primitive = first_child;
+    set_bvh_node_bbox(node, &treelet->bboxes[subset]);
+    size_t left_subset = treelet->partitions[subset];
+    size_t leaf_count =
+        write_treelet(treelet_task, treelet, left_subset, first_child + 0) +
+        write_treelet(treelet_task, treelet, subset & ~left_subset, first_child + 1);
+    treelet_task->costs[node_index] = treelet->costs[subset];
+    treelet_task->leaf_counts[node_index] = leaf_count;
+    return leaf_count;
+}
+
+static void restructure_treelet(struct treelet_task* treelet_task, size_t root_index) {
+    struct treelet treelet;
+    form_treelet(treelet_task->nodes, root_index, &treelet);
+    if (treelet.leaf_count < 3)
+        return;
+
+    for (size_t i = 0; i < treelet.leaf_count; ++i) {
+        treelet.leaf_nodes[i] = treelet_task->nodes[treelet.leaves[i]];
+        treelet.leaf_costs[i] = treelet_task->costs[treelet.leaves[i]];
+        treelet.leaf_leaf_counts[i] = treelet_task->leaf_counts[treelet.leaves[i]];
+    }
+    real_t cost = optimize_treelet(&treelet, treelet_task->traversal_cost);
+    if (cost >= treelet_task->costs[root_index])
+        return;
+
+    treelet.next_pair = 0;
+    write_treelet(treelet_task, &treelet, ((size_t)1 << treelet.leaf_count) - 1, root_index);
+    assert(treelet.next_pair == treelet.pair_count);
+}
+
+static void run_treelet_task(struct parallel_task_1d* task, size_t thread_id) {
+    IGNORE(thread_id);
+    struct treelet_task* treelet_task = (void*)task;
+    for (size_t i = task->range.begin, n = task->range.end; i < n; ++i) {
+        // Nodes may be moved by other threads, but only once all the leaves below them have been processed.
+        // Hence, the contents of this slot have not changed if it was a leaf initially.
+        if (!treelet_task->is_leaf[i])
+            continue;
+
+        const struct bvh_node* node = &treelet_task->nodes[i];
+        treelet_task->costs[i] = half_bbox_area(get_bvh_node_bbox(node)) * node->primitive_count;
+        treelet_task->leaf_counts[i] = 1;
+
+        // Walk up the parents of this node towards the root
+        size_t j = i;
+        while (true) {
+            j = treelet_task->parents[j];
+
+            // Terminate this path if the root has been reached or the other child has not yet been processed.
+            // The other child may have been restructured by another thread, hence the memory ordering.
+            if (j == SIZE_MAX || atomic_fetch_add_explicit(&treelet_task->flags[j], 1, memory_order_acq_rel) == 0)
+                break;
+
+            const struct bvh_node* parent = &treelet_task->nodes[j];
+            size_t first_child = parent->first_child_or_primitive;
+            treelet_task->leaf_counts[j] =
+                treelet_task->leaf_counts[first_child + 0] +
+                treelet_task->leaf_counts[first_child + 1];
+            treelet_task->costs[j] =
+                treelet_task->traversal_cost * half_bbox_area(get_bvh_node_bbox(parent)) +
+                treelet_task->costs[first_child + 0] +
+                treelet_task->costs[first_child + 1];
+            if (treelet_task->leaf_counts[j] >= treelet_task->min_leaf_count)
+                restructure_treelet(treelet_task, j);
+        }
+    }
+}
+
+void restructure_bvh(struct thread_pool* thread_pool, struct bvh* bvh, real_t traversal_cost) {
+    if (bvh->node_count < 5)
+        return;
+
+    size_t* parents     = xmalloc(sizeof(size_t) * bvh->node_count);
+    atomic_int* flags   = xmalloc(sizeof(atomic_int) * bvh->node_count);
+    real_t* costs       = xmalloc(sizeof(real_t) * bvh->node_count);
+    size_t* leaf_counts = xmalloc(sizeof(size_t) * bvh->node_count);
+    bool* is_leaf       = xmalloc(sizeof(bool) * bvh->node_count);
+    for (size_t i = 0; i < PASS_COUNT; ++i) {
+        // Restructuring moves nodes, which invalidates the parent indices
+        parallel_for_1d(
+            thread_pool,
+            run_treelet_init_task,
+            (struct parallel_task_1d*)&(struct treelet_init_task) {
+                .nodes   = bvh->nodes,
+                .parents = parents,
+                .flags   = flags,
+                .is_leaf = is_leaf
+            },
+            sizeof(struct treelet_init_task),
+            &(struct range) { 0, bvh->node_count });
+        parents[0] = SIZE_MAX;
+
+        parallel_for_1d(
+            thread_pool,
+            run_treelet_task,
+            (struct parallel_task_1d*)&(struct treelet_task) {
+                .nodes          = bvh->nodes,
+                .parents        = parents,
+                .is_leaf        = is_leaf,
+                .flags          = flags,
+                .costs          = costs,
+                .leaf_counts    = leaf_counts,
+                .min_leaf_count = MAX_TREELET_LEAF_COUNT << i,
+                .traversal_cost = traversal_cost
+            },
+            sizeof(struct treelet_task),
+            &(struct range) { 0, bvh->node_count });
+    }
+    free(is_leaf);
+    free(leaf_counts);
+    free(costs);
+    free(flags);
+    free(parents);
+    update_bvh_parents(thread_pool, bvh);
+}
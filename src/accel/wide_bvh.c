@@ -0,0 +1,356 @@
+#include <stdlib.h>
+#include <assert.h>
+
+#include "accel/wide_bvh.h"
+#include "accel/traversal.h"
+#include "core/utils.h"
+#include "core/ray.h"
+
+/*
+ * The collapsing algorithm is a greedy top-down pass: the children of a wide node are
+ * obtained by repeatedly replacing the inner node with the largest surface area by its
+ * two children, until the node is full or only leaves remain.
+ */
+
+static size_t count_inner_nodes(const struct bvh* bvh) {
+    size_t inner_count = 0;
+    for (size_t i = 0, n = bvh->node_count; i < n; ++i)
+        inner_count += bvh->nodes[i].primitive_count == 0 ? 1 : 0;
+    return inner_count > 0 ? inner_count : 1;
+}
+
+static size_t select_wide_children(
+    const struct bvh* bvh,
+    size_t node_index,
+    size_t width,
+    size_t* children)
+{
+    const struct bvh_node* node = &bvh->nodes[node_index];
+    assert(node->primitive_count == 0);
+    children[0] = node->first_child_or_primitive + 0;
+    children[1] = node->first_child_or_primitive + 1;
+    size_t child_count = 2;
+    while (child_count < width) {
+        size_t best_child = SIZE_MAX;
+        real_t best_area = -REAL_MAX;
+        for (size_t i = 0; i < child_count; ++i) {
+            const struct bvh_node* child = &bvh->nodes[children[i]];
+            if (child->primitive_count > 0)
+                continue;
+            real_t area = half_bbox_area(get_bvh_node_bbox(child));
+            if (area > best_area) {
+                best_area = area;
+                best_child = i;
+            }
+        }
+        if (best_child == SIZE_MAX)
+            break;
+        size_t first_grandchild = bvh->nodes[children[best_child]].first_child_or_primitive;
+        children[best_child] = first_grandchild;
+        children[child_count++] = first_grandchild + 1;
+    }
+    return child_count;
+}
+
+// Leaves can reference any entry of the array after incremental updates, since removals leave
+// unused entries and insertions append new ones, so the whole array is copied.
+static inline size_t* copy_primitive_indices(const struct bvh* bvh) {
+    size_t* primitive_indices = xmalloc(sizeof(size_t) * bvh->primitive_index_count);
+    memcpy(primitive_indices, bvh->primitive_indices, sizeof(size_t) * bvh->primitive_index_count);
+    return primitive_indices;
+}
+
+#define GEN_COLLAPSE_BVH(width) \
+    static inline void init_bvh##width##_node(struct bvh##width##_node* node) { \
+        for (size_t i = 0; i < width; ++i) { \
+            node->bounds[0][i] = node->bounds[2][i] = node->bounds[4][i] =  REAL_MAX; \
+            node->bounds[1][i] = node->bounds[3][i] = node->bounds[5][i] = -REAL_MAX; \
+            node->primitive_count[i] = 0; \
+            node->first_child_or_primitive[i] = 0; \
+        } \
+    } \
+    static inline struct bbox get_bvh##width##_node_child_bbox(const struct bvh##width##_node* node, size_t i) { \
+        return (struct bbox) { \
+            .min = make_vec3(node->bounds[0][i], node->bounds[2][i], node->bounds[4][i]), \
+            .max = make_vec3(node->bounds[1][i], node->bounds[3][i], node->bounds[5][i]) \
+        }; \
+    } \
+    static inline void set_bvh##width##_child_bbox(struct bvh##width##_node* node, size_t i, const struct bbox* bbox) { \
+        for (int axis = 0; axis < 3; ++axis) { \
+            node->bounds[axis * 2 + 0][i] = bbox->min._[axis]; \
+            node->bounds[axis * 2 + 1][i] = bbox->max._[axis]; \
+        } \
+    } \
+    static inline void set_bvh##width##_child( \
+        struct bvh##width##_node* node, size_t i, \
+        const struct bvh_node* child) \
+    { \
+        for (size_t j = 0; j < 6; ++j) \
+            node->bounds[j][i] = child->bounds[j]; \
+        node->primitive_count[i] = child->primitive_count; \
+        node->first_child_or_primitive[i] = child->first_child_or_primitive; \
+    } \
+    struct bvh##width* collapse_bvh##width(const struct bvh* bvh) { \
+        size_t max_node_count = count_inner_nodes(bvh); \
+        struct bvh##width##_node* nodes = xmalloc(sizeof(struct bvh##width##_node) * max_node_count); \
+        bits_t* parents = xmalloc(sizeof(bits_t) * max_node_count); \
+        size_t* stack = xmalloc(sizeof(size_t) * 2 * max_node_count); \
+        size_t stack_size = 0, node_count = 1; \
+        init_bvh##width##_node(&nodes[0]); \
+        parents[0] = 0; \
+        if (bvh->nodes[0].primitive_count > 0) { \
+            /* The root of the binary BVH is a leaf: it becomes the only child of the root */ \
+            set_bvh##width##_child(&nodes[0], 0, &bvh->nodes[0]); \
+        } else { \
+            stack[stack_size++] = 0; \
+            stack[stack_size++] = 0; \
+        } \
+        while (stack_size > 0) { \
+            size_t wide_index   = stack[--stack_size]; \
+            size_t binary_index = stack[--stack_size]; \
+            size_t children[width]; \
+            size_t child_count = select_wide_children(bvh, binary_index, width, children); \
+            struct bvh##width##_node* wide_node = &nodes[wide_index]; \
+            for (size_t i = 0; i < child_count; ++i) { \
+                const struct bvh_node* child = &bvh->nodes[children[i]]; \
+                set_bvh##width##_child(wide_node, i, child); \
+                if (child->primitive_count == 0) { \
+                    assert(node_count < max_node_count); \
+                    init_bvh##width##_node(&nodes[node_count]); \
+                    wide_node->first_child_or_primitive[i] = node_count; \
+                    parents[node_count] = wide_index; \
+                    stack[stack_size++] = children[i]; \
+                    stack[stack_size++] = node_count++; \
+                } \
+            } \
+        } \
+        free(stack); \
+        struct bvh##width* wide_bvh = xmalloc(sizeof(struct bvh##width)); \
+        wide_bvh->nodes = xrealloc(nodes, sizeof(struct bvh##width##_node) * node_count); \
+        wide_bvh->node_count = node_count; \
+        wide_bvh->parents = xrealloc(parents, sizeof(bits_t) * node_count); \
+        wide_bvh->primitive_indices = copy_primitive_indices(bvh); \
+        return wide_bvh; \
+    } \
+    void free_bvh##width(struct bvh##width* bvh) { \
+        free(bvh->nodes); \
+        free(bvh->primitive_indices); \
+        free(bvh->parents); \
+        free(bvh); \
+    } \
+    void update_bvh##width##_parents(struct bvh##width* bvh) { \
+        if (!bvh->parents) \
+            bvh->parents = xmalloc(sizeof(bits_t) * bvh->node_count); \
+        bvh->parents[0] = 0; \
+        for (size_t i = 0, n = bvh->node_count; i < n; ++i) { \
+            const struct bvh##width##_node* node = &bvh->nodes[i]; \
+            for (size_t j = 0; j < width; ++j) { \
+                if (node->primitive_count[j] == 0 && node->bounds[0][j] <= node->bounds[1][j]) \
+                    bvh->parents[node->first_child_or_primitive[j]] = i; \
+            } \
+        } \
+    } \
+    void refit_bvh##width(struct bvh##width* bvh, void* primitive_data, bbox_fn_t bbox_fn) { \
+        /* Children are always stored after their parent, so nodes can be processed in reverse order */ \
+        for (size_t i = bvh->node_count; i-- > 0;) { \
+            struct bvh##width##_node* node = &bvh->nodes[i]; \
+            for (size_t j = 0; j < width; ++j) { \
+                if (node->bounds[0][j] > node->bounds[1][j]) \
+                    continue; \
+                struct bbox bbox = empty_bbox(); \
+                if (node->primitive_count[j] > 0) { \
+                    size_t first_primitive = node->first_child_or_primitive[j]; \
+                    for (size_t k = first_primitive, n = k + node->primitive_count[j]; k < n; ++k) \
+                        bbox = union_bbox(bbox, bbox_fn(primitive_data, k)); \
+                } else { \
+                    const struct bvh##width##_node* child = &bvh->nodes[node->first_child_or_primitive[j]]; \
+                    for (size_t k = 0; k < width; ++k) { \
+                        if (child->bounds[0][k] <= child->bounds[1][k]) \
+                            bbox = union_bbox(bbox, get_bvh##width##_node_child_bbox(child, k)); \
+                    } \
+                } \
+                set_bvh##width##_child_bbox(node, j, &bbox); \
+            } \
+        } \
+    }
+
+#define GEN_INTERSECT_RAY_BVH(width) \
+    static inline unsigned intersect_ray_bvh##width##_node( \
+        const struct ray* ray, \
+        const struct ray_data* ray_data, \
+        const struct bvh##width##_node* node, \
+        real_t* t_entry) \
+    { \
+        /* The bounds are selected once for all children, based on the ray octant */ \
+        const real_t* min_x = node->bounds[0 + ray_data->octant[0]]; \
+        const real_t* min_y = node->bounds[2 + ray_data->octant[1]]; \
+        const real_t* min_z = node->bounds[4 + ray_data->octant[2]]; \
+        const real_t* max_x = node->bounds[0 + 1 - ray_data->octant[0]]; \
+        const real_t* max_y = node->bounds[2 + 1 - ray_data->octant[1]]; \
+        const real_t* max_z = node->bounds[4 + 1 - ray_data->octant[2]]; \
+        bool hits[width]; \
+        /* This loop has a fixed trip count and no branches, so that it can be vectorized */ \
+        for (size_t i = 0; i < width; ++i) { \
+            real_t tmin_x = intersect_ray_axis_min(ray, ray_data, 0, min_x[i]); \
+            real_t tmin_y = intersect_ray_axis_min(ray, ray_data, 1, min_y[i]); \
+            real_t tmin_z = intersect_ray_axis_min(ray, ray_data, 2, min_z[i]); \
+            real_t tmax_x = intersect_ray_axis_max(ray, ray_data, 0, max_x[i]); \
+            real_t tmax_y = intersect_ray_axis_max(ray, ray_data, 1, max_y[i]); \
+            real_t tmax_z = intersect_ray_axis_max(ray, ray_data, 2, max_z[i]); \
+            real_t tmin = max_real(tmin_x, max_real(tmin_y, max_real(tmin_z, ray->t_min))); \
+            real_t tmax = min_real(tmax_x, min_real(tmax_y, min_real(tmax_z, ray->t_max))); \
+            t_entry[i] = tmin; \
+            hits[i] = tmin <= tmax; \
+        } \
+        unsigned mask = 0; \
+        for (size_t i = 0; i < width; ++i) \
+            mask |= hits[i] ? 1u << i : 0; \
+        return mask; \
+    } \
+    /* Same as `find_next_node()` in the binary BVH traversal. The empty slots of a node */ \
+    /* are never intersected, and its leaves are intersected as soon as the node is. */ \
+    static inline size_t find_next_bvh##width##_node( \
+        const struct ray* ray, \
+        const struct ray_data* ray_data, \
+        const struct bvh##width* bvh, \
+        size_t node_index, bool any) \
+    { \
+        while (node_index != 0) { \
+            size_t parent_index = bvh->parents[node_index]; \
+            const struct bvh##width##_node* parent = &bvh->nodes[parent_index]; \
+            real_t t_entry[width]; \
+            unsigned mask = intersect_ray_bvh##width##_node(ray, ray_data, parent, t_entry); \
+            size_t c = width; \
+            for (size_t i = 0; i < width; ++i) { \
+                if (parent->primitive_count[i] != 0) \
+                    mask &= ~(1u << i); \
+                else if (parent->first_child_or_primitive[i] == node_index) \
+                    c = i; \
+            } \
+            assert(c < width); \
+            size_t next = find_next_hit_child(mask, t_entry, width, !any, c); \
+            if (next < width) \
+                return parent->first_child_or_primitive[next]; \
+            node_index = parent_index; \
+        } \
+        return 0; \
+    } \
+    bool intersect_ray_bvh##width( \
+        struct ray* ray, struct hit* hit, \
+        const struct bvh##width* bvh, \
+        intersect_ray_leaf_fn_t intersect_ray_leaf, \
+        void* intersection_data, bool any) \
+    { \
+        struct ray_data ray_data; \
+        compute_ray_data(ray, &ray_data); \
+        \
+        struct traversal_stack stack; \
+        init_traversal_stack(&stack); \
+        \
+        bool found = false; \
+        const struct bvh##width##_node* node = bvh->nodes; \
+        while (true) { \
+            real_t t_entry[width]; \
+            unsigned mask = intersect_ray_bvh##width##_node(ray, &ray_data, node, t_entry); \
+            \
+            /* Sort the children that are intersected by distance (only in closest intersection mode) */ \
+            size_t hit_children[width]; \
+            size_t hit_count = gather_hit_children(mask, t_entry, width, !any, hit_children); \
+            \
+            /* Intersect leaves from front to back */ \
+            for (size_t k = 0; k < hit_count; ++k) { \
+                size_t i = hit_children[k]; \
+                if (likely(node->primitive_count[i] == 0) || t_entry[i] > ray->t_max) \
+                    continue; \
+                const struct bvh_node leaf = { \
+                    .primitive_count = node->primitive_count[i], \
+                    .first_child_or_primitive = node->first_child_or_primitive[i] \
+                }; \
+                if (intersect_ray_leaf(ray, hit, &leaf, intersection_data)) { \
+                    found = true; \
+                    if (any) \
+                        return true; \
+                } \
+            } \
+            \
+            /* Push inner nodes from back to front, so that the closest one is popped first */ \
+            for (size_t k = hit_count; k-- > 0;) { \
+                size_t i = hit_children[k]; \
+                if (node->primitive_count[i] != 0 || t_entry[i] > ray->t_max) \
+                    continue; \
+                push_traversal_stack(&stack, (struct stack_entry) { \
+                    .node_index = node->first_child_or_primitive[i], \
+                    .t_entry = t_entry[i] \
+                }); \
+            } \
+            \
+            /* Pop the next node, culling the ones that are behind the closest intersection */ \
+            struct stack_entry entry; \
+            bool popped = false; \
+            while (pop_traversal_stack(&stack, &entry)) { \
+                if (entry.t_entry <= ray->t_max) { \
+                    popped = true; \
+                    break; \
+                } \
+            } \
+            if (popped) \
+                node = bvh->nodes + entry.node_index; \
+            else { \
+                if (likely(!stack.overflow)) \
+                    return found; \
+                size_t next_index = find_next_bvh##width##_node(ray, &ray_data, bvh, node - bvh->nodes, any); \
+                if (next_index == 0) \
+                    return found; \
+                node = bvh->nodes + next_index; \
+            } \
+        } \
+    } \
+    bool occluded_ray_bvh##width( \
+        const struct ray* ray, \
+        const struct bvh##width* bvh, \
+        occluded_ray_leaf_fn_t occluded_ray_leaf, \
+        void* occlusion_data) \
+    { \
+        struct ray_data ray_data; \
+        compute_ray_data(ray, &ray_data); \
+        \
+        struct node_stack stack; \
+        init_node_stack(&stack); \
+        \
+        const struct bvh##width##_node* node = bvh->nodes; \
+        while (true) { \
+            real_t t_entry[width]; \
+            unsigned mask = intersect_ray_bvh##width##_node(ray, &ray_data, node, t_entry); \
+            \
+            /* Leaves are tested immediately. Inner nodes are pushed in reverse order, so that they are popped in storage order. */ \
+            for (size_t i = width; i-- > 0;) { \
+                if (!(mask & (1u << i))) \
+                    continue; \
+                if (likely(node->primitive_count[i] == 0)) { \
+                    push_node_stack(&stack, node->first_child_or_primitive[i]); \
+                    continue; \
+                } \
+                const struct bvh_node leaf = { \
+                    .primitive_count = node->primitive_count[i], \
+                    .first_child_or_primitive = node->first_child_or_primitive[i] \
+                }; \
+                if (occluded_ray_leaf(ray, &leaf, occlusion_data)) \
+                    return true; \
+            } \
+            \
+            bits_t next_index; \
+            if (!pop_node_stack(&stack, &next_index)) { \
+                if (likely(!stack.overflow)) \
+                    return false; \
+                next_index = find_next_bvh##width##_node(ray, &ray_data, bvh, node - bvh->nodes, true); \
+                if (next_index == 0) \
+                    return false; \
+            } \
+            node = bvh->nodes + next_index; \
+        } \
+    }
+
+GEN_COLLAPSE_BVH(4)
+GEN_COLLAPSE_BVH(8)
+GEN_INTERSECT_RAY_BVH(4)
+GEN_INTERSECT_RAY_BVH(8)
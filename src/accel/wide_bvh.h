@@ -0,0 +1,62 @@
+#ifndef ACCEL_WIDE_BVH_H
+#define ACCEL_WIDE_BVH_H
+
+#include "accel/bvh.h"
+
+/*
+ * Wide BVHs are obtained by collapsing a binary BVH, so that each node has up to
+ * 4 or 8 children. The bounding boxes of the children of a node are stored in SoA
+ * layout, which allows the traversal to intersect all of them at once with SIMD
+ * instructions. Leaves are not stored as separate nodes: each child slot either
+ * references another node, or a range of primitives. Unused slots have an empty
+ * bounding box and are thus never intersected.
+ */
+
+#define GEN_WIDE_BVH(width) \
+    struct bvh##width##_node { \
+        real_t bounds[6][width];                /* Stored as min_x[], max_x[], min_y[], max_y[], ... */ \
+        bits_t primitive_count[width];          /* A primitive count of 0 indicates an inner node */ \
+        bits_t first_child_or_primitive[width]; \
+    }; \
+    struct bvh##width { \
+        struct bvh##width##_node* nodes; /* The root is located at nodes[0] */ \
+        size_t* primitive_indices;       /* Same as the primitive indices of the binary BVH */ \
+        size_t node_count; \
+        bits_t* parents;                 /* Parent of each node, used by the traversal when its stack overflows */ \
+    }; \
+    struct bvh##width* collapse_bvh##width(const struct bvh* bvh); \
+    void free_bvh##width(struct bvh##width* bvh); \
+    void update_bvh##width##_parents(struct bvh##width* bvh); \
+    void refit_bvh##width(struct bvh##width* bvh, void* primitive_data, bbox_fn_t bbox_fn); \
+    bool intersect_ray_bvh##width( \
+        struct ray*, struct hit*, \
+        const struct bvh##width* bvh, \
+        intersect_ray_leaf_fn_t intersect_ray_leaf, \
+        void* intersection_data, bool any); \
+    bool occluded_ray_bvh##width( \
+        const struct ray*, \
+        const struct bvh##width* bvh, \
+        occluded_ray_leaf_fn_t occluded_ray_leaf, \
+        void* occlusion_data);
+
+/*
+ * The functions declared here are, for each width:
+ *
+ * - `collapse_bvhN()`, which creates a wide BVH from a binary one. The binary BVH is left
+ *   untouched, and can be freed after this call. Leaves are preserved, so that the primitive
+ *   indices are the same in both BVHs.
+ * - `free_bvhN()`, which releases the memory used by a wide BVH.
+ * - `update_bvhN_parents()`, which has the same semantics as `update_bvh_parents()`, but runs sequentially.
+ * - `refit_bvhN()`, which has the same semantics as `refit_bvh()`, but runs sequentially.
+ * - `intersect_ray_bvhN()`, which has the same semantics as `intersect_ray_bvh()`.
+ *   The leaf passed to the intersection callback only has its primitive range set. Like the
+ *   binary version, it never allocates memory.
+ * - `occluded_ray_bvhN()`, which has the same semantics as `occluded_ray_bvh()`, and passes
+ *   leaves to the callback in the same way.
+ */
+GEN_WIDE_BVH(4)
+GEN_WIDE_BVH(8)
+
+#undef GEN_WIDE_BVH
+
+#endif
@@ -22,6 +22,13 @@ static inline struct bbox union_bbox(struct bbox a, struct bbox b) {
     };
 }
 
+static inline struct bbox intersect_bbox(struct bbox a, struct bbox b) {
+    return (struct bbox) {
+        .min = max_vec3(a.min, b.min),
+        .max = min_vec3(a.max, b.max)
+    };
+}
+
 static inline real_t half_bbox_area(struct bbox bbox) {
     struct vec3 e = max_vec3(sub_vec3(bbox.max, bbox.min), (struct vec3) { { 0, 0, 0 } });
     return fast_mul_add(e._[0], e._[1], fast_mul_add(e._[0], e._[2], e._[1] * e._[2]));
@@ -41,6 +48,13 @@ static inline bool bbox_overlaps(const struct bbox bbox, const struct bbox other
         bbox.max._[2] >= other.min._[2] && bbox.min._[2] <= other.max._[2];
 }
 
+static inline bool is_empty_bbox(const struct bbox bbox) {
+    return
+        bbox.min._[0] > bbox.max._[0] ||
+        bbox.min._[1] > bbox.max._[1] ||
+        bbox.min._[2] > bbox.max._[2];
+}
+
 static inline struct bbox point_bbox(struct vec3 p) {
     return (struct bbox) { .min = p, .max = p };
 }
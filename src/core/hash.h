@@ -7,6 +7,10 @@
 #define FNV_OFFSET UINT32_C(0x811C9DC5) // Initial value for an empty hash
 #define FNV_PRIME  UINT32_C(0x01000193)
 
+// 64-bit variants, used when hash collisions must be very unlikely (e.g. for content hashes)
+#define FNV64_OFFSET UINT64_C(0xCBF29CE484222325)
+#define FNV64_PRIME  UINT64_C(0x00000100000001B3)
+
 #define hash_uint(h, x) _Generic((x), \
     uint8_t: hash_uint8, \
     uint16_t: hash_uint16, \
@@ -52,6 +56,20 @@ static inline uint32_t hash_bytes(uint32_t h, const void* data, size_t size) {
     return h;
 }
 
+static inline uint64_t hash64_init(void) {
+    return FNV64_OFFSET;
+}
+
+static inline uint64_t hash64_bytes(uint64_t h, const void* data, size_t size) {
+    for (size_t i = 0; i < size; ++i)
+        h = (h ^ ((const uint8_t*)data)[i]) * FNV64_PRIME;
+    return h;
+}
+
+static inline uint64_t hash64_uint64(uint64_t h, uint64_t u) {
+    return hash64_bytes(h, &u, sizeof(u));
+}
+
 static inline uint32_t hash_ptr(uint32_t h, const void* ptr) {
     return hash_uint(h, (uintptr_t)ptr);
 }
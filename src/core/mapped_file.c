@@ -0,0 +1,65 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+
+#include "core/mapped_file.h"
+#include "core/utils.h"
+
+#if defined (__unix__) || (defined (__APPLE__) && defined (__MACH__))
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#define USE_MMAP
+#endif
+
+struct mapped_file* map_file(const char* file_name) {
+#ifdef USE_MMAP
+    int fd = open(file_name, O_RDONLY);
+    if (fd < 0)
+        return NULL;
+    struct stat st;
+    void* data = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && st.st_size > 0)
+        data = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    // The mapping remains valid after the file descriptor is closed
+    close(fd);
+    if (data == MAP_FAILED)
+        return NULL;
+    struct mapped_file* mapped_file = xmalloc(sizeof(struct mapped_file));
+    mapped_file->data = data;
+    mapped_file->size = st.st_size;
+    return mapped_file;
+#else
+    FILE* fp = fopen(file_name, "rb");
+    if (!fp)
+        return NULL;
+    long size = -1;
+    if (fseek(fp, 0, SEEK_END) == 0)
+        size = ftell(fp);
+    void* data = NULL;
+    if (size > 0 && fseek(fp, 0, SEEK_SET) == 0) {
+        data = xmalloc(size);
+        if (fread(data, 1, size, fp) != (size_t)size) {
+            free(data);
+            data = NULL;
+        }
+    }
+    fclose(fp);
+    if (!data)
+        return NULL;
+    struct mapped_file* mapped_file = xmalloc(sizeof(struct mapped_file));
+    mapped_file->data = data;
+    mapped_file->size = size;
+    return mapped_file;
+#endif
+}
+
+void unmap_file(struct mapped_file* mapped_file) {
+#ifdef USE_MMAP
+    munmap(mapped_file->data, mapped_file->size);
+#else
+    free(mapped_file->data);
+#endif
+    free(mapped_file);
+}
@@ -0,0 +1,21 @@
+#ifndef CORE_MAPPED_FILE_H
+#define CORE_MAPPED_FILE_H
+
+#include <stddef.h>
+
+/*
+ * Contents of a file mapped in memory. The mapping is private: the data can be modified
+ * in memory, without affecting the file. On systems that do not support memory-mapped
+ * files, the whole file is read into memory instead.
+ */
+
+struct mapped_file {
+    void* data;
+    size_t size;
+};
+
+// Maps the given file in memory, or returns `NULL` if it cannot be opened.
+struct mapped_file* map_file(const char* file_name);
+void unmap_file(struct mapped_file*);
+
+#endif
@@ -57,4 +57,54 @@ static inline struct vec3 mul_mat4x3_vec4(struct mat4x3 a, struct vec4 b) {
     return c;
 }
 
+// Transforms a point (the translation is applied).
+static inline struct vec3 transform_point(struct mat4x3 a, struct vec3 p) {
+    return mul_mat4x3_vec4(a, vec3_to_vec4(p, 1));
+}
+
+// Transforms a vector (the translation is ignored).
+static inline struct vec3 transform_vector(struct mat4x3 a, struct vec3 v) {
+    return mul_mat4x3_vec4(a, vec3_to_vec4(v, 0));
+}
+
+// Transforms a normal, given the inverse of the transformation to apply
+// (normals are transformed with the inverse transpose of the matrix).
+static inline struct vec3 transform_normal(struct mat4x3 inverse, struct vec3 n) {
+    struct vec3 c = { 0 };
+    for (int i = 0; i < 3; ++i) {
+        for (int j = 0; j < 3; ++j)
+            c._[i] = fast_mul_add(inverse._[i][j], n._[j], c._[i]);
+    }
+    return c;
+}
+
+// Computes the inverse of an affine transformation.
+// The linear part of the transformation must be invertible.
+static inline struct mat4x3 inverse_mat4x3(struct mat4x3 a) {
+    struct vec3 c0 = make_vec3(a._[0][0], a._[0][1], a._[0][2]);
+    struct vec3 c1 = make_vec3(a._[1][0], a._[1][1], a._[1][2]);
+    struct vec3 c2 = make_vec3(a._[2][0], a._[2][1], a._[2][2]);
+    struct vec3 c3 = make_vec3(a._[3][0], a._[3][1], a._[3][2]);
+
+    // The rows of the inverse of the linear part are the cross products of its columns
+    struct vec3 r0 = cross_vec3(c1, c2);
+    struct vec3 r1 = cross_vec3(c2, c0);
+    struct vec3 r2 = cross_vec3(c0, c1);
+    real_t inv_det = ((real_t)1) / dot_vec3(c0, r0);
+    r0 = scale_vec3(r0, inv_det);
+    r1 = scale_vec3(r1, inv_det);
+    r2 = scale_vec3(r2, inv_det);
+
+    struct mat4x3 b = make_mat4x3(
+        make_vec3(r0._[0], r1._[0], r2._[0]),
+        make_vec3(r0._[1], r1._[1], r2._[1]),
+        make_vec3(r0._[2], r1._[2], r2._[2]),
+        const_vec3(0));
+    struct vec3 t = neg_vec3(transform_vector(b, c3));
+    b._[3][0] = t._[0];
+    b._[3][1] = t._[1];
+    b._[3][2] = t._[2];
+    return b;
+}
+
 #endif
@@ -0,0 +1,250 @@
+#include <string.h>
+#include <assert.h>
+
+#include "core/parallel_scan.h"
+#include "core/utils.h"
+
+// Number of chunks per thread. Both passes of a scan use the same chunks, so
+// there must be enough of them to balance the workload in each pass.
+#define CHUNKS_PER_THREAD 4
+
+// Minimum number of values per chunk for `parallel_exclusive_sum()`, below which summing
+// values is faster than distributing them to several threads.
+#define MIN_SUM_CHUNK_SIZE 4096
+
+static inline void add_parallel_sums(struct parallel_sums* sums, const struct parallel_sums* other) {
+    for (size_t i = 0; i < PARALLEL_SUM_COUNT; ++i)
+        sums->_[i] += other->_[i];
+}
+
+static void init_parallel_scan(
+    struct thread_pool* thread_pool,
+    struct parallel_scan* scan,
+    const struct range* range,
+    size_t min_chunk_size)
+{
+    size_t elem_count = range->end > range->begin ? range->end - range->begin : 0;
+    size_t chunk_count = min_size_t(
+        get_thread_count(thread_pool) * CHUNKS_PER_THREAD,
+        compute_chunk_size(elem_count, min_chunk_size));
+    scan->range = *range;
+    scan->grain_size = chunk_count > 0 ? compute_chunk_size(elem_count, chunk_count) : 1;
+    scan->chunk_count = compute_chunk_size(elem_count, scan->grain_size);
+    scan->chunk_sums = alloc_task_storage(thread_pool, sizeof(struct parallel_sums) * scan->chunk_count);
+    memset(&scan->total, 0, sizeof(struct parallel_sums));
+}
+
+static inline size_t get_chunk_index(const struct parallel_scan* scan, const struct range* range) {
+    size_t chunk_index = (range->begin - scan->range.begin) / scan->grain_size;
+    assert(range->end == min_size_t(range->begin + scan->grain_size, scan->range.end));
+    assert(chunk_index < scan->chunk_count);
+    return chunk_index;
+}
+
+static void run_reduce_task(struct parallel_task_1d* task, size_t thread_id) {
+    struct parallel_scan_task* scan_task = (void*)task;
+    const struct parallel_scan* scan = scan_task->scan;
+    memset(&scan_task->sums, 0, sizeof(struct parallel_sums));
+    scan->compute(scan_task, thread_id);
+    scan->chunk_sums[get_chunk_index(scan, &task->range)] = scan_task->sums;
+}
+
+static void run_scan_task(struct parallel_task_1d* task, size_t thread_id) {
+    struct parallel_scan_task* scan_task = (void*)task;
+    const struct parallel_scan* scan = scan_task->scan;
+    scan_task->sums = scan->chunk_sums[get_chunk_index(scan, &task->range)];
+    scan_task->total = scan->total;
+    scan->compute(scan_task, thread_id);
+}
+
+static void run_scan_pass(
+    struct thread_pool* thread_pool,
+    struct parallel_scan* scan,
+    void (*run_task)(struct parallel_task_1d*, size_t),
+    void (*compute)(struct parallel_scan_task*, size_t),
+    struct parallel_scan_task* init, size_t task_size)
+{
+    // The task of the client is copied so that the fields that belong to the implementation can be set
+    struct parallel_scan_task* task = alloc_task_storage(thread_pool, task_size);
+    memcpy(task, init, task_size);
+    task->scan = scan;
+    scan->compute = compute;
+
+    // With a dynamic schedule of grain-sized chunks, every call processes exactly one chunk
+    parallel_for_1d_scheduled(
+        thread_pool, run_task,
+        &task->task, task_size,
+        &scan->range, DYNAMIC_SCHEDULE, scan->grain_size);
+    free_task_storage(thread_pool, task);
+}
+
+struct parallel_sums parallel_reduce(
+    struct thread_pool* thread_pool,
+    void (*reduce)(struct parallel_scan_task*, size_t),
+    struct parallel_scan_task* init, size_t task_size,
+    const struct range* range)
+{
+    struct parallel_scan scan;
+    init_parallel_scan(thread_pool, &scan, range, 1);
+    run_scan_pass(thread_pool, &scan, run_reduce_task, reduce, init, task_size);
+    for (size_t i = 0; i < scan.chunk_count; ++i)
+        add_parallel_sums(&scan.total, &scan.chunk_sums[i]);
+    free_task_storage(thread_pool, scan.chunk_sums);
+    return scan.total;
+}
+
+static struct parallel_sums start_parallel_scan_with_chunk_size(
+    struct thread_pool* thread_pool,
+    struct parallel_scan* scan,
+    void (*reduce)(struct parallel_scan_task*, size_t),
+    struct parallel_scan_task* init, size_t task_size,
+    const struct range* range,
+    size_t min_chunk_size)
+{
+    init_parallel_scan(thread_pool, scan, range, min_chunk_size);
+    run_scan_pass(thread_pool, scan, run_reduce_task, reduce, init, task_size);
+
+    // There are only a few chunks per thread, so their sums are scanned sequentially
+    for (size_t i = 0; i < scan->chunk_count; ++i) {
+        struct parallel_sums chunk_sums = scan->chunk_sums[i];
+        scan->chunk_sums[i] = scan->total;
+        add_parallel_sums(&scan->total, &chunk_sums);
+    }
+    return scan->total;
+}
+
+struct parallel_sums start_parallel_scan(
+    struct thread_pool* thread_pool,
+    struct parallel_scan* scan,
+    void (*reduce)(struct parallel_scan_task*, size_t),
+    struct parallel_scan_task* init, size_t task_size,
+    const struct range* range)
+{
+    return start_parallel_scan_with_chunk_size(thread_pool, scan, reduce, init, task_size, range, 1);
+}
+
+void finish_parallel_scan(
+    struct thread_pool* thread_pool,
+    struct parallel_scan* scan,
+    void (*scan_fn)(struct parallel_scan_task*, size_t),
+    struct parallel_scan_task* init, size_t task_size)
+{
+    run_scan_pass(thread_pool, scan, run_scan_task, scan_fn, init, task_size);
+    free_task_storage(thread_pool, scan->chunk_sums);
+}
+
+struct parallel_sums parallel_exclusive_scan(
+    struct thread_pool* thread_pool,
+    void (*reduce)(struct parallel_scan_task*, size_t),
+    void (*scan_fn)(struct parallel_scan_task*, size_t),
+    struct parallel_scan_task* init, size_t task_size,
+    const struct range* range)
+{
+    struct parallel_scan scan;
+    struct parallel_sums total = start_parallel_scan(thread_pool, &scan, reduce, init, task_size, range);
+    finish_parallel_scan(thread_pool, &scan, scan_fn, init, task_size);
+    return total;
+}
+
+struct sum_task {
+    struct parallel_scan_task task;
+    size_t* values;
+};
+
+static void run_sum_reduce_task(struct parallel_scan_task* task, size_t thread_id) {
+    IGNORE(thread_id);
+    struct sum_task* sum_task = (void*)task;
+    size_t sum = 0;
+    for (size_t i = task->task.range.begin, n = task->task.range.end; i < n; ++i)
+        sum += sum_task->values[i];
+    task->sums._[0] = sum;
+}
+
+static void run_sum_scan_task(struct parallel_scan_task* task, size_t thread_id) {
+    IGNORE(thread_id);
+    struct sum_task* sum_task = (void*)task;
+    size_t sum = task->sums._[0];
+    for (size_t i = task->task.range.begin, n = task->task.range.end; i < n; ++i) {
+        size_t value = sum_task->values[i];
+        sum_task->values[i] = sum;
+        sum += value;
+    }
+}
+
+size_t parallel_exclusive_sum(struct thread_pool* thread_pool, size_t* values, size_t count) {
+    struct parallel_scan scan;
+    struct sum_task init = { .values = values };
+    struct parallel_sums total = start_parallel_scan_with_chunk_size(
+        thread_pool, &scan, run_sum_reduce_task,
+        &init.task, sizeof(struct sum_task),
+        &(struct range) { 0, count }, MIN_SUM_CHUNK_SIZE);
+    finish_parallel_scan(thread_pool, &scan, run_sum_scan_task, &init.task, sizeof(struct sum_task));
+    return total._[0];
+}
+
+struct partition_task {
+    struct parallel_scan_task task;
+    bool (*pred)(const void*, const void*);
+    const void* data;
+    const char* restrict src;
+    char* restrict dst;
+    size_t elem_size;
+};
+
+static inline void copy_elem(void* restrict dst, const void* restrict src, size_t elem_size) {
+    // Common sizes are handled separately so that the copy is inlined
+    switch (elem_size) {
+        case 4:  memcpy(dst, src, 4); break;
+        case 8:  memcpy(dst, src, 8); break;
+        default: memcpy(dst, src, elem_size); break;
+    }
+}
+
+static void run_partition_reduce_task(struct parallel_scan_task* task, size_t thread_id) {
+    IGNORE(thread_id);
+    struct partition_task* partition_task = (void*)task;
+    size_t elem_size = partition_task->elem_size;
+    size_t true_count = 0;
+    for (size_t i = task->task.range.begin, n = task->task.range.end; i < n; ++i) {
+        const char* elem = partition_task->src + i * elem_size;
+        true_count += partition_task->pred(elem, partition_task->data) ? 1 : 0;
+    }
+    task->sums._[0] = true_count;
+}
+
+static void run_partition_scan_task(struct parallel_scan_task* task, size_t thread_id) {
+    IGNORE(thread_id);
+    struct partition_task* partition_task = (void*)task;
+    size_t elem_size = partition_task->elem_size;
+    size_t begin = task->task.range.begin;
+    // Elements that do not satisfy the predicate are placed after all those that do
+    size_t true_index = task->sums._[0];
+    size_t false_index = task->total._[0] + begin - true_index;
+    for (size_t i = begin, n = task->task.range.end; i < n; ++i) {
+        const char* elem = partition_task->src + i * elem_size;
+        size_t j = partition_task->pred(elem, partition_task->data) ? true_index++ : false_index++;
+        copy_elem(partition_task->dst + j * elem_size, elem, elem_size);
+    }
+}
+
+size_t parallel_partition(
+    struct thread_pool* thread_pool,
+    bool (*pred)(const void*, const void*), const void* data,
+    const void* restrict src, void* restrict dst,
+    size_t elem_size, size_t elem_count)
+{
+    struct parallel_sums total = parallel_exclusive_scan(
+        thread_pool,
+        run_partition_reduce_task,
+        run_partition_scan_task,
+        (struct parallel_scan_task*)&(struct partition_task) {
+            .pred = pred,
+            .data = data,
+            .src = src,
+            .dst = dst,
+            .elem_size = elem_size
+        },
+        sizeof(struct partition_task),
+        &(struct range) { 0, elem_count });
+    return total._[0];
+}
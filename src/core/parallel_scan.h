@@ -0,0 +1,87 @@
+#ifndef CORE_PARALLEL_SCAN_H
+#define CORE_PARALLEL_SCAN_H
+
+#include <stddef.h>
+#include <stdbool.h>
+
+#include "core/thread_pool.h"
+
+/*
+ * Parallel reductions and exclusive scans, built on top of `parallel_for_1d()`. The range is
+ * split in a few chunks per thread. Scans run in two passes over the same chunks: the first
+ * pass reduces each chunk, and the second one processes each chunk given the sums of all the
+ * elements before it, which are obtained by scanning the sums of the chunks sequentially.
+ * Several sums are computed at once, so that different kinds of elements can be counted together.
+ */
+
+#define PARALLEL_SUM_COUNT 2
+
+struct parallel_sums {
+    size_t _[PARALLEL_SUM_COUNT];
+};
+
+struct parallel_scan;
+
+struct parallel_scan_task {
+    struct parallel_task_1d task;
+    struct parallel_sums sums;        // Sums of the elements of the range when reducing, or of the elements before it when scanning
+    struct parallel_sums total;       // Sums of all the elements, only valid when scanning
+    const struct parallel_scan* scan; // Set by the implementation
+};
+
+struct parallel_scan {
+    struct range range;
+    size_t grain_size;
+    size_t chunk_count;
+    struct parallel_sums* chunk_sums;
+    struct parallel_sums total;
+    void (*compute)(struct parallel_scan_task*, size_t);
+};
+
+// Computes sums over the given range. The reduction must add the values of the elements
+// of `task->range` to `task->sums`, which are initially zero. Returns the sums of all the elements.
+struct parallel_sums parallel_reduce(
+    struct thread_pool* thread_pool,
+    void (*reduce)(struct parallel_scan_task*, size_t),
+    struct parallel_scan_task* init, size_t task_size,
+    const struct range* range);
+
+// Starts a scan by reducing every chunk of the range as `parallel_reduce()` does, and returns the
+// sums of all the elements. Data that depends on these sums can be allocated before finishing the scan.
+struct parallel_sums start_parallel_scan(
+    struct thread_pool* thread_pool,
+    struct parallel_scan* scan,
+    void (*reduce)(struct parallel_scan_task*, size_t),
+    struct parallel_scan_task* init, size_t task_size,
+    const struct range* range);
+
+// Finishes a scan by processing every chunk of the range with `task->sums` set to the sums of the
+// elements before the chunk. The scan must be finished on the thread that started it, after freeing
+// the storage allocated with `alloc_task_storage()` since it was started.
+void finish_parallel_scan(
+    struct thread_pool* thread_pool,
+    struct parallel_scan* scan,
+    void (*scan_fn)(struct parallel_scan_task*, size_t),
+    struct parallel_scan_task* init, size_t task_size);
+
+// Starts and finishes a scan with the same task. Returns the sums of all the elements.
+struct parallel_sums parallel_exclusive_scan(
+    struct thread_pool* thread_pool,
+    void (*reduce)(struct parallel_scan_task*, size_t),
+    void (*scan_fn)(struct parallel_scan_task*, size_t),
+    struct parallel_scan_task* init, size_t task_size,
+    const struct range* range);
+
+// Replaces each value by the sum of the values before it, and returns the sum of all the values.
+size_t parallel_exclusive_sum(struct thread_pool* thread_pool, size_t* values, size_t count);
+
+// Stable partition: copies the elements of `src` for which the predicate is true at the beginning of
+// `dst`, and the others after them, in the same order. Returns the number of elements that satisfy the
+// predicate. The predicate is evaluated twice for each element, and receives `data` as its second argument.
+size_t parallel_partition(
+    struct thread_pool* thread_pool,
+    bool (*pred)(const void*, const void*), const void* data,
+    const void* restrict src, void* restrict dst,
+    size_t elem_size, size_t elem_count);
+
+#endif
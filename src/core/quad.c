@@ -1,33 +1,111 @@
 #include "core/quad.h"
 
-bool intersect_ray_quad(struct ray* ray, struct hit* hit, const struct quad* quad) {
-    struct vec3 c = sub_vec3(quad->p0, ray->org);
-    struct vec3 r = cross_vec3(ray->dir, c);
+// Number of triangles that make up a quad.
+#define QUAD_TRI_COUNT 2
+
+// Intersects both triangles of a quad with a ray. The second triangle is p2, p3, p1,
+// whose edges p2 - p3 and p1 - p2 are recovered from the edges of the first one.
+static inline void intersect_ray_quad_tris(
+    const struct vec3* org, const struct vec3* dir,
+    real_t t_min, real_t t_max,
+    const struct quad* quad,
+    real_t* t, real_t* u, real_t* v, bool* hits)
+{
+    struct vec3 d = sub_vec3(quad->p2, quad->p0);
+    struct vec3 p [QUAD_TRI_COUNT] = { quad->p0, quad->p2 };
+    struct vec3 e1[QUAD_TRI_COUNT] = { quad->e1, sub_vec3(d, quad->e2) };
+    struct vec3 e2[QUAD_TRI_COUNT] = { quad->e2, neg_vec3(add_vec3(quad->e1, d)) };
+    struct vec3 n [QUAD_TRI_COUNT] = { quad->n0, quad->n2 };
+
+    // This loop has no branches, so that both triangles are tested at once with SIMD instructions
+    for (size_t i = 0; i < QUAD_TRI_COUNT; ++i) {
+        struct vec3 c = sub_vec3(p[i], *org);
+        struct vec3 r = cross_vec3(*dir, c);
 
-    real_t inv_det = ((real_t)1) / dot_vec3(quad->n, ray->dir);
-    real_t u, v, t;
+        real_t inv_det = ((real_t)1) / dot_vec3(n[i], *dir);
+        u[i] = dot_vec3(r, e2[i]) * inv_det;
+        v[i] = dot_vec3(r, e1[i]) * inv_det;
+        t[i] = dot_vec3(n[i], c) * inv_det;
 
-    real_t u1 = dot_vec3(r, quad->e2) * inv_det;
-    real_t v1 = dot_vec3(r, quad->e1) * inv_det;
-    if (u1 >= 0 && v1 >= 0 && u1 + v1 <= 1) {
-        u = u1, v = v1;
-        goto hit;
+        // These comparisons are designed to return false
+        // when one of t, u, or v is a NaN (e.g. for degenerate triangles)
+        hits[i] =
+            u[i] >= 0 && v[i] >= 0 && u[i] + v[i] <= 1 &&
+            t[i] >= t_min && t[i] <= t_max;
     }
+}
+
+// Returns the index of the closest triangle that is hit, or `QUAD_TRI_COUNT` if there is none.
+// Both triangles can only be hit at once when the quad is not planar.
+static inline size_t find_closest_quad_tri(const real_t* t, const bool* hits) {
+    if (hits[1] && (!hits[0] || t[1] < t[0]))
+        return 1;
+    return hits[0] ? 0 : QUAD_TRI_COUNT;
+}
+
+// The coordinates of the second triangle are flipped, so that the quad covers the unit square.
+static inline struct vec2 get_quad_uv(size_t tri_index, real_t u, real_t v) {
+    return tri_index == 0 ? make_vec2(u, v) : make_vec2(1 - u, 1 - v);
+}
+
+bool intersect_ray_quad(struct ray* ray, struct hit* hit, const struct quad* quad) {
+    real_t t[QUAD_TRI_COUNT];
+    real_t u[QUAD_TRI_COUNT];
+    real_t v[QUAD_TRI_COUNT];
+    bool hits[QUAD_TRI_COUNT];
+    intersect_ray_quad_tris(&ray->org, &ray->dir, ray->t_min, ray->t_max, quad, t, u, v, hits);
+
+    size_t closest = find_closest_quad_tri(t, hits);
+    if (closest == QUAD_TRI_COUNT)
+        return false;
+    ray->t_max = t[closest];
+    hit->uv = get_quad_uv(closest, u[closest], v[closest]);
+    return true;
+}
+
+bool occluded_ray_quad(const struct ray* ray, const struct quad* quad) {
+    real_t t[QUAD_TRI_COUNT];
+    real_t u[QUAD_TRI_COUNT];
+    real_t v[QUAD_TRI_COUNT];
+    bool hits[QUAD_TRI_COUNT];
+    intersect_ray_quad_tris(&ray->org, &ray->dir, ray->t_min, ray->t_max, quad, t, u, v, hits);
+    return hits[0] | hits[1];
+}
 
-    real_t u2 = dot_vec3(r, quad->e4) * inv_det;
-    real_t v2 = dot_vec3(r, quad->e3) * inv_det;
-    if (u2 >= 0 && v2 >= 0 && u2 + v2 <= 1) {
-        u = 1 - u2, v = 1 - v2;
-        goto hit;
+ray_mask_t intersect_ray_packet_quad(struct ray_packet* packet, struct hit* hits, ray_mask_t mask, const struct quad* quad) {
+    real_t t[MAX_RAY_PACKET_SIZE];
+    real_t u[MAX_RAY_PACKET_SIZE];
+    real_t v[MAX_RAY_PACKET_SIZE];
+    bool hit[MAX_RAY_PACKET_SIZE];
+
+    for (size_t i = 0, n = packet->size; i < n; ++i) {
+        struct vec3 org = make_vec3(packet->org[0][i], packet->org[1][i], packet->org[2][i]);
+        struct vec3 dir = make_vec3(packet->dir[0][i], packet->dir[1][i], packet->dir[2][i]);
+        real_t tri_t[QUAD_TRI_COUNT];
+        real_t tri_u[QUAD_TRI_COUNT];
+        real_t tri_v[QUAD_TRI_COUNT];
+        bool tri_hits[QUAD_TRI_COUNT];
+        intersect_ray_quad_tris(&org, &dir, packet->t_min[i], packet->t_max[i], quad, tri_t, tri_u, tri_v, tri_hits);
+
+        size_t closest = find_closest_quad_tri(tri_t, tri_hits);
+        size_t j = closest == QUAD_TRI_COUNT ? 0 : closest;
+        struct vec2 uv = get_quad_uv(j, tri_u[j], tri_v[j]);
+        t[i] = tri_t[j];
+        u[i] = uv._[0];
+        v[i] = uv._[1];
+        hit[i] = closest != QUAD_TRI_COUNT;
     }
-    return false;
-
-hit:
-    t = dot_vec3(quad->n, c) * inv_det;
-    if (t >= ray->t_min && t <= ray->t_max) {
-        ray->t_max = t;
-        hit->uv = make_vec2(u, v);
-        return true;
+
+    ray_mask_t hit_mask = 0;
+    for (size_t i = 0, n = packet->size; i < n; ++i)
+        hit_mask |= hit[i] ? ((ray_mask_t)1) << i : 0;
+    hit_mask &= mask;
+
+    for (size_t i = 0, n = packet->size; i < n; ++i) {
+        if (hit_mask & (((ray_mask_t)1) << i)) {
+            packet->t_max[i] = t[i];
+            hits[i].uv = make_vec2(u[i], v[i]);
+        }
     }
-    return false;
+    return hit_mask;
 }
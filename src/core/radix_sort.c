@@ -5,6 +5,7 @@
 #include <stdlib.h>
 
 #include "core/radix_sort.h"
+#include "core/parallel_scan.h"
 #include "core/utils.h"
 
 #define RADIX_SORT_BITS 8
@@ -20,9 +21,18 @@ struct binning_task {
     size_t begin, end;
     void** src_keys;
     unsigned first_bit;
+    size_t task_index;
+    size_t task_count;
+    size_t* bin_offsets;
     size_t bins[BIN_COUNT];
 };
 
+// The offsets are stored bin by bin, so that an exclusive sum over them gives the location
+// of the elements of each bin and each task in the destination arrays.
+static inline size_t* get_bin_offset(const struct binning_task* binning_task, size_t bin) {
+    return &binning_task->bin_offsets[bin * binning_task->task_count + binning_task->task_index];
+}
+
 #define GEN_BINNING_TASK(bit_count) \
     static void run_##bit_count##_bit_binning_task(struct work_item* work_item, size_t thread_id) { \
         IGNORE(thread_id); \
@@ -33,6 +43,8 @@ struct binning_task {
         memset(binning_task->bins, 0, sizeof(size_t) * BIN_COUNT); \
         for (size_t i = binning_task->begin, n = binning_task->end; i < n; ++i) \
             binning_task->bins[(keys[i] >> shift) & mask]++; \
+        for (size_t i = 0; i < BIN_COUNT; ++i) \
+            *get_bin_offset(binning_task, i) = binning_task->bins[i]; \
     }
 
 GEN_BINNING_TASK(8)
@@ -47,32 +59,8 @@ static const work_fn_t binning_fns[] = {
     [sizeof(uint64_t)] = run_64_bit_binning_task,
 };
 
-struct prefix_sum_task {
-    struct work_item work_item;
-    struct binning_task* binning_tasks;
-    size_t* shared_bins;
-    size_t binning_task_count;
-    size_t begin, end;
-};
-
-static void prefix_sum_task(struct work_item* work_item, size_t thread_id) {
-    IGNORE(thread_id);
-    struct prefix_sum_task* prefix_sum_task = (void*)work_item;
-    struct binning_task* binning_tasks = prefix_sum_task->binning_tasks;
-    for (size_t i = prefix_sum_task->begin, n = prefix_sum_task->end; i < n; ++i) {
-        size_t sum = 0;
-        for (size_t j = 0, m = prefix_sum_task->binning_task_count; j < m; ++j) {
-            size_t old_sum = sum;
-            sum += binning_tasks[j].bins[i];
-            binning_tasks[j].bins[i] = old_sum;
-        }
-        prefix_sum_task->shared_bins[i] = sum;
-    }
-}
-
 struct copy_task {
     struct work_item work_item;
-    const size_t* shared_bins;
     size_t** src_values;
     void** dst_keys;
     size_t** dst_values;
@@ -85,12 +73,8 @@ struct copy_task {
         IGNORE(thread_id); \
         struct copy_task* copy_task = (void*)work_item; \
         struct binning_task* this_binning_task = copy_task->this_binning_task; \
-        size_t sum = 0; \
-        for (size_t i = 0; i < BIN_COUNT; ++i) { \
-            size_t old_sum = sum; \
-            sum += copy_task->shared_bins[i]; \
-            this_binning_task->bins[i] += old_sum; \
-        } \
+        for (size_t i = 0; i < BIN_COUNT; ++i) \
+            this_binning_task->bins[i] = *get_bin_offset(this_binning_task, i); \
         const UINT_N(bit_count)* src_keys = *this_binning_task->src_keys; \
         const size_t* src_values = *copy_task->src_values; \
         UINT_N(bit_count)* dst_keys = *copy_task->dst_keys; \
@@ -127,32 +111,25 @@ void radix_sort(
 {
     size_t thread_count = get_thread_count(thread_pool);
 
-    struct binning_task* binning_tasks = xmalloc(sizeof(struct binning_task) * thread_count);
-    struct copy_task* copy_tasks       = xmalloc(sizeof(struct copy_task) * thread_count);
-    struct prefix_sum_task* sum_tasks  = xmalloc(sizeof(struct prefix_sum_task) * thread_count);
-    size_t* shared_bins                = xmalloc(sizeof(size_t) * BIN_COUNT);
+    struct binning_task* binning_tasks = alloc_task_storage(thread_pool, sizeof(struct binning_task) * thread_count);
+    struct copy_task* copy_tasks       = alloc_task_storage(thread_pool, sizeof(struct copy_task) * thread_count);
+    size_t* bin_offsets                = alloc_task_storage(thread_pool, sizeof(size_t) * BIN_COUNT * thread_count);
 
     assert(key_size < ARRAY_SIZE(binning_fns) && binning_fns[key_size]);
-    size_t data_chunk_size = compute_chunk_size(count,     thread_count);
-    size_t bin_chunk_size  = compute_chunk_size(BIN_COUNT, thread_count);
+    size_t data_chunk_size = compute_chunk_size(count, thread_count);
     for (size_t j = 0; j < thread_count; ++j) {
         copy_tasks[j].begin = binning_tasks[j].begin = compute_chunk_begin(data_chunk_size, j);
         copy_tasks[j].end   = binning_tasks[j].end   = compute_chunk_end(data_chunk_size, j, count);
         binning_tasks[j].work_item.work_fn = binning_fns[key_size];
         binning_tasks[j].src_keys = src_keys;
+        binning_tasks[j].task_index = j;
+        binning_tasks[j].task_count = thread_count;
+        binning_tasks[j].bin_offsets = bin_offsets;
         copy_tasks[j].work_item.work_fn    = copy_fns[key_size];
         copy_tasks[j].this_binning_task = &binning_tasks[j];
-        copy_tasks[j].shared_bins = shared_bins;
         copy_tasks[j].src_values = src_values;
         copy_tasks[j].dst_values = dst_values;
         copy_tasks[j].dst_keys = dst_keys;
-
-        sum_tasks[j].begin = compute_chunk_begin(bin_chunk_size, j);
-        sum_tasks[j].end   = compute_chunk_end(bin_chunk_size, j, BIN_COUNT);
-        sum_tasks[j].shared_bins = shared_bins;
-        sum_tasks[j].binning_tasks = binning_tasks;
-        sum_tasks[j].binning_task_count = thread_count;
-        sum_tasks[j].work_item.work_fn = prefix_sum_task;
     }
 
     for (unsigned i = 0; i < bit_count; i += RADIX_SORT_BITS) {
@@ -164,20 +141,16 @@ void radix_sort(
         binning_tasks[thread_count - 1].work_item.next = NULL;
         submit_work(thread_pool, &binning_tasks[0].work_item, &binning_tasks[thread_count - 1].work_item);
 
-        // Reset the task data for summing and copying
-        for (size_t j = 1; j < thread_count; ++j) {
-            sum_tasks[j - 1].work_item.next  = &sum_tasks[j].work_item;
+        // Reset the task data for copying
+        for (size_t j = 1; j < thread_count; ++j)
             copy_tasks[j - 1].work_item.next = &copy_tasks[j].work_item;
-        }
         copy_tasks[thread_count - 1].work_item.next = NULL;
-        sum_tasks[thread_count - 1].work_item.next  = NULL;
 
-        // Do a prefix sum over the bins, in parallel
+        // Compute the offsets of every bin for every task
         wait_for_completion(thread_pool, 0);
-        submit_work(thread_pool, &sum_tasks[0].work_item, &sum_tasks[thread_count - 1].work_item);
+        parallel_exclusive_sum(thread_pool, bin_offsets, BIN_COUNT * thread_count);
 
         // Place the sorted data for that bit range in the destination arrays
-        wait_for_completion(thread_pool, 0);
         submit_work(thread_pool, &copy_tasks[0].work_item, &copy_tasks[thread_count - 1].work_item);
 
         wait_for_completion(thread_pool, 0);
@@ -185,8 +158,7 @@ void radix_sort(
         swap_values(src_values, dst_values);
     }
 
-    free(binning_tasks);
-    free(sum_tasks);
-    free(copy_tasks);
-    free(shared_bins);
+    free_task_storage(thread_pool, bin_offsets);
+    free_task_storage(thread_pool, copy_tasks);
+    free_task_storage(thread_pool, binning_tasks);
 }
@@ -3,12 +3,17 @@
 
 #include <stddef.h>
 #include <stdint.h>
+#include <assert.h>
 
 #include "core/vec3.h"
 #include "core/vec2.h"
 #include "core/utils.h"
 
 #define INVALID_PRIMITIVE_INDEX SIZE_MAX
+#define INVALID_INSTANCE_INDEX  SIZE_MAX
+
+// Maximum number of rays in a packet. Packets of 4, 8, or 16 rays are typical.
+#define MAX_RAY_PACKET_SIZE 16
 
 struct ray {
     struct vec3 org;
@@ -18,11 +23,53 @@ struct ray {
 
 struct hit {
     size_t primitive_index;
+    size_t instance_index; // Only set when the primitive is part of an instance
     struct vec2 uv;
 };
 
+// Group of rays that are traced together. The rays are stored in SoA layout, so that
+// operations can be vectorized across rays. Only the first `size` rays are valid.
+struct ray_packet {
+    real_t org[3][MAX_RAY_PACKET_SIZE];
+    real_t dir[3][MAX_RAY_PACKET_SIZE];
+    real_t t_min[MAX_RAY_PACKET_SIZE];
+    real_t t_max[MAX_RAY_PACKET_SIZE];
+    size_t size;
+};
+
+// Bit mask where bit `i` is set for the `i`-th ray of a packet.
+typedef uint32_t ray_mask_t;
+
+static inline ray_mask_t full_ray_mask(size_t size) {
+    assert(size <= MAX_RAY_PACKET_SIZE);
+    return (((ray_mask_t)1) << size) - 1;
+}
+
+static inline void set_packet_ray(struct ray_packet* packet, size_t i, const struct ray* ray) {
+    assert(i < MAX_RAY_PACKET_SIZE);
+    for (int j = 0; j < 3; ++j) {
+        packet->org[j][i] = ray->org._[j];
+        packet->dir[j][i] = ray->dir._[j];
+    }
+    packet->t_min[i] = ray->t_min;
+    packet->t_max[i] = ray->t_max;
+}
+
+static inline struct ray get_packet_ray(const struct ray_packet* packet, size_t i) {
+    assert(i < packet->size);
+    return (struct ray) {
+        .org = make_vec3(packet->org[0][i], packet->org[1][i], packet->org[2][i]),
+        .dir = make_vec3(packet->dir[0][i], packet->dir[1][i], packet->dir[2][i]),
+        .t_min = packet->t_min[i],
+        .t_max = packet->t_max[i]
+    };
+}
+
 static inline struct hit empty_hit(void) {
-    return (struct hit) { .primitive_index = INVALID_PRIMITIVE_INDEX };
+    return (struct hit) {
+        .primitive_index = INVALID_PRIMITIVE_INDEX,
+        .instance_index = INVALID_INSTANCE_INDEX
+    };
 }
 
 static inline struct vec3 point_at(const struct ray* ray, real_t t) {
@@ -0,0 +1,122 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <limits.h>
+
+#include "core/ray_sort.h"
+#include "core/radix_sort.h"
+#include "core/thread_pool.h"
+#include "core/morton.h"
+#include "core/bbox.h"
+#include "core/utils.h"
+
+// Number of bits per axis used to quantize ray directions and origins. The direction
+// comes first in the key, so that rays are mostly grouped by direction. The sign of each
+// component is the most significant bit of its quantized value, which means that the
+// rays are grouped by octant first.
+#define RAY_SORT_DIR_BITS 3
+#define RAY_SORT_ORG_BITS 7
+#define RAY_SORT_KEY_BITS (3 * (RAY_SORT_DIR_BITS + RAY_SORT_ORG_BITS))
+
+struct ray_key_task {
+    struct parallel_task_1d task;
+    const struct ray* rays;
+    uint32_t* keys;
+    size_t* ray_ids;
+    struct vec3 org_min;
+    struct vec3 org_to_grid;
+};
+
+static inline morton_t quantize_ray_coord(real_t x, unsigned bit_count) {
+    const morton_t grid_dim = ((morton_t)1) << bit_count;
+    // The comparisons are written so that NaNs end up in the first cell
+    return x > 0 ? (x < grid_dim ? (morton_t)x : grid_dim - 1) : 0;
+}
+
+static void run_ray_key_task(struct parallel_task_1d* task, size_t thread_id) {
+    IGNORE(thread_id);
+    struct ray_key_task* ray_key_task = (void*)task;
+    const real_t dir_to_grid = (real_t)(((morton_t)1) << RAY_SORT_DIR_BITS) * (real_t)0.5;
+    for (size_t i = task->range.begin, n = task->range.end; i < n; ++i) {
+        const struct ray* ray = &ray_key_task->rays[i];
+
+        // Directions are projected on the unit cube, which only requires a division
+        real_t max_dir = max_real(fabs(ray->dir._[0]), max_real(fabs(ray->dir._[1]), fabs(ray->dir._[2])));
+        real_t inv_max_dir = max_dir > 0 ? ((real_t)1) / max_dir : 0;
+        morton_t dir_code = morton_encode(
+            quantize_ray_coord((ray->dir._[0] * inv_max_dir + 1) * dir_to_grid, RAY_SORT_DIR_BITS),
+            quantize_ray_coord((ray->dir._[1] * inv_max_dir + 1) * dir_to_grid, RAY_SORT_DIR_BITS),
+            quantize_ray_coord((ray->dir._[2] * inv_max_dir + 1) * dir_to_grid, RAY_SORT_DIR_BITS));
+
+        struct vec3 p = mul_vec3(sub_vec3(ray->org, ray_key_task->org_min), ray_key_task->org_to_grid);
+        morton_t org_code = morton_encode(
+            quantize_ray_coord(p._[0], RAY_SORT_ORG_BITS),
+            quantize_ray_coord(p._[1], RAY_SORT_ORG_BITS),
+            quantize_ray_coord(p._[2], RAY_SORT_ORG_BITS));
+
+        ray_key_task->keys[i] = ((uint32_t)dir_code << (3 * RAY_SORT_ORG_BITS)) | (uint32_t)org_code;
+        ray_key_task->ray_ids[i] = i;
+    }
+}
+
+size_t* sort_rays(struct thread_pool* thread_pool, const struct ray* rays, size_t count) {
+    struct bbox bbox = empty_bbox();
+    for (size_t i = 0; i < count; ++i)
+        bbox = extend_bbox(bbox, rays[i].org);
+    const real_t grid_dim = (real_t)(((morton_t)1) << RAY_SORT_ORG_BITS);
+    struct vec3 extents = sub_vec3(bbox.max, bbox.min);
+
+    uint32_t* keys = xmalloc(sizeof(uint32_t) * count);
+    size_t* ray_ids = xmalloc(sizeof(size_t) * count);
+    parallel_for_1d(
+        thread_pool,
+        run_ray_key_task,
+        (struct parallel_task_1d*)&(struct ray_key_task) {
+            .rays        = rays,
+            .keys        = keys,
+            .ray_ids     = ray_ids,
+            .org_min     = bbox.min,
+            .org_to_grid = make_vec3(
+                extents._[0] > 0 ? grid_dim / extents._[0] : 0,
+                extents._[1] > 0 ? grid_dim / extents._[1] : 0,
+                extents._[2] > 0 ? grid_dim / extents._[2] : 0)
+        },
+        sizeof(struct ray_key_task),
+        &(struct range) { 0, count });
+
+    void* src_keys = keys, *dst_keys = xmalloc(sizeof(uint32_t) * count);
+    size_t* dst_ray_ids = xmalloc(sizeof(size_t) * count);
+    radix_sort(
+        thread_pool,
+        &src_keys, &ray_ids,
+        &dst_keys, &dst_ray_ids,
+        sizeof(uint32_t), count, RAY_SORT_KEY_BITS);
+    free(src_keys);
+    free(dst_keys);
+    free(dst_ray_ids);
+    return ray_ids;
+}
+
+void gather_rays(
+    const struct ray* rays, const struct hit* hits,
+    const size_t* ray_ids,
+    struct ray* sorted_rays, struct hit* sorted_hits,
+    size_t count)
+{
+    for (size_t i = 0; i < count; ++i)
+        sorted_rays[i] = rays[ray_ids[i]];
+    for (size_t i = 0; hits && i < count; ++i)
+        sorted_hits[i] = hits[ray_ids[i]];
+}
+
+void scatter_hits(
+    const struct ray* sorted_rays, const struct hit* sorted_hits,
+    const size_t* ray_ids,
+    struct ray* rays, struct hit* hits,
+    size_t count)
+{
+    for (size_t i = 0; i < count; ++i) {
+        rays[ray_ids[i]].t_max = sorted_rays[i].t_max;
+        hits[ray_ids[i]] = sorted_hits[i];
+    }
+}
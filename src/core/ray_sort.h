@@ -0,0 +1,39 @@
+#ifndef CORE_RAY_SORT_H
+#define CORE_RAY_SORT_H
+
+#include <stddef.h>
+
+#include "core/ray.h"
+
+struct thread_pool;
+
+/*
+ * Reordering of incoherent rays, such as those generated by diffuse bounces. Each ray is
+ * given a key made of the Morton code of its quantized direction, followed by the Morton code
+ * of its origin on a grid that covers the origins of all the rays. Sorting these keys groups
+ * rays that go in similar directions from nearby points, which then visit the same BVH nodes
+ * when they are traced one after the other.
+ */
+
+// Returns the indices of the given rays, in the order in which they should be traced. The
+// keys are sorted in parallel with `radix_sort()`, so this must not be called from a worker
+// thread of the given thread pool. The returned array must be freed with `free()`.
+size_t* sort_rays(struct thread_pool* thread_pool, const struct ray* rays, size_t count);
+
+// Copies the rays in sorted order, so that `sorted_rays[i] = rays[ray_ids[i]]`. If `hits`
+// is not `NULL`, the hits are copied in the same way into `sorted_hits`.
+void gather_rays(
+    const struct ray* rays, const struct hit* hits,
+    const size_t* ray_ids,
+    struct ray* sorted_rays, struct hit* sorted_hits,
+    size_t count);
+
+// Copies the results of the sorted rays back to their original location, so that `rays[ray_ids[i]]`
+// and `hits[ray_ids[i]]` receive the intersection distance of `sorted_rays[i]` and `sorted_hits[i]`.
+void scatter_hits(
+    const struct ray* sorted_rays, const struct hit* sorted_hits,
+    const size_t* ray_ids,
+    struct ray* rays, struct hit* hits,
+    size_t count);
+
+#endif
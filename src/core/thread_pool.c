@@ -1,5 +1,9 @@
 #include <stdlib.h>
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdalign.h>
+#include <stdatomic.h>
 #include <string.h>
 #include <assert.h>
 #include <threads.h>
@@ -13,31 +17,90 @@
  */
 #define DEFAULT_THREAD_COUNT 2
 
-struct work_queue {
-    struct work_item* first_item; // Where the worker threads take work items from
-    struct work_item* last_item;  // Where the client's work items are enqueued
-    struct work_item* done_items; // Where finished work items are placed
-    size_t done_count;            // The number of items that are finished
-    size_t done_target;           // The number of items that are required before the next synchronization
-    size_t worked_on;             // The number of items being worked on
-    cnd_t avail_cond, done_cond;
-    mtx_t mutex;
+// Size of a cache line, used to prevent false sharing between the ends of the deques.
+#define CACHE_LINE_SIZE 64
+
+// Initial number of work items that a deque can hold. Deques grow when they are full.
+#define INITIAL_DEQUE_CAPACITY 64
+
+/*
+ * Each worker owns a work-stealing deque, based on D. Chase and Y. Lev's paper: "Dynamic Circular
+ * Work-Stealing Deque", with the memory orderings given by N. M. Lê et al. in "Correct and Efficient
+ * Work-Stealing for Weak Memory Models". Submitted work items are placed in a shared queue, from
+ * which workers take batches that they push on their own deque, and idle workers steal items from
+ * the deques of the other workers. Finished items are pushed on a lock-free list. The mutex of the
+ * pool is thus only taken when work is submitted, when a batch is taken from the shared queue, and
+ * when threads go to sleep or are woken up, but never once per work item. Items spawned from a running
+ * item in a task group go directly on the deque of the worker, and are only tracked by their group.
+ */
+
+struct deque_buffer {
+    size_t capacity;             // Always a power of two
+    struct deque_buffer* prev;   // Buffer replaced by this one, which may still be read by thieves
+    _Atomic(struct work_item*) items[];
+};
+
+struct work_deque {
+    alignas(CACHE_LINE_SIZE) atomic_ptrdiff_t top;    // Where other workers steal items from
+    alignas(CACHE_LINE_SIZE) atomic_ptrdiff_t bottom; // Where the owner pushes and pops items
+    _Atomic(struct deque_buffer*) buffer;
+};
+
+/*
+ * Storage for work items, such as the tasks of parallel loops, is taken from arenas that are reused
+ * across calls. There is one arena per worker, and one that is shared by the client threads, but that
+ * only one of them can use at a time. Allocations are released in reverse order, so an arena is just
+ * a stack. It can only be reallocated when it is empty, and allocations that do not fit are made on
+ * the heap until then. The arena is then made large enough for all the allocations that were in use
+ * at the same time, including those made on the heap.
+ */
+
+struct task_arena {
+    char* data;
+    size_t capacity;
+    size_t size;
+    size_t heap_size;         // Size of the allocations that did not fit, and were made on the heap
+    size_t peak_size;         // Largest size that the arena would have reached if it had no limit
+    _Atomic(void*) owner;     // Tag of the client thread using the arena, if any (see `thread_tag`)
 };
 
-struct thread_data {
+struct worker {
+    struct work_deque deque;
+    struct task_arena task_arena;
     struct thread_pool* thread_pool;
-    struct work_queue* queue;
     size_t thread_id;
 };
 
 struct thread_pool {
     thrd_t* threads;
+    struct worker* workers;
     size_t thread_count;
-    bool should_stop;
-    struct work_queue queue;
-    struct thread_data* thread_data;
+    atomic_bool should_stop;
+
+    struct work_item* first_item;  // Where the workers take batches of work items from
+    struct work_item* last_item;   // Where the client's work items are enqueued
+    atomic_size_t queued_count;    // The number of items in the shared queue
+    atomic_size_t sleeping_count;  // The number of workers waiting for work
+
+    _Atomic(struct work_item*) done_items; // Where finished work items are placed
+    atomic_size_t pending_count;   // The number of items that are submitted but not yet finished
+    atomic_size_t done_count;      // The number of items that are finished
+    atomic_size_t done_target;     // The number of items that are required before the next synchronization
+    atomic_bool is_waiting;        // Set when the client waits for completion
+    atomic_size_t joining_count;   // The number of threads waiting for a task group
+    atomic_size_t idle_joining_count; // The number of workers among them that have no work to run
+    struct task_arena client_arena; // Where client threads take storage for work items from
+
+    cnd_t avail_cond, done_cond;
+    mtx_t mutex;
 };
 
+// Worker that runs on the current thread, if any.
+static thread_local struct worker* current_worker = NULL;
+
+// The address of this variable identifies the current thread.
+static thread_local char thread_tag;
+
 #if defined (__unix__) || (defined (__APPLE__) && defined (__MACH__))
 #include <unistd.h>
 static inline long get_system_thread_count(void) {
@@ -56,98 +119,415 @@ size_t detect_system_thread_count(void) {
     return DEFAULT_THREAD_COUNT;
 }
 
-static inline bool waiting_condition(const struct work_queue* queue) {
+static struct deque_buffer* new_deque_buffer(size_t capacity, struct deque_buffer* prev) {
+    struct deque_buffer* buffer = xmalloc(sizeof(struct deque_buffer) + sizeof(_Atomic(struct work_item*)) * capacity);
+    buffer->capacity = capacity;
+    buffer->prev = prev;
+    return buffer;
+}
+
+static inline void init_work_deque(struct work_deque* deque) {
+    atomic_init(&deque->top, 0);
+    atomic_init(&deque->bottom, 0);
+    atomic_init(&deque->buffer, new_deque_buffer(INITIAL_DEQUE_CAPACITY, NULL));
+}
+
+static inline void free_work_deque(struct work_deque* deque) {
+    struct deque_buffer* buffer = atomic_load_explicit(&deque->buffer, memory_order_relaxed);
+    while (buffer) {
+        struct deque_buffer* prev = buffer->prev;
+        free(buffer);
+        buffer = prev;
+    }
+}
+
+static inline struct work_item* get_deque_item(struct deque_buffer* buffer, ptrdiff_t index) {
+    return atomic_load_explicit(&buffer->items[(size_t)index & (buffer->capacity - 1)], memory_order_relaxed);
+}
+
+static inline void set_deque_item(struct deque_buffer* buffer, ptrdiff_t index, struct work_item* item) {
+    atomic_store_explicit(&buffer->items[(size_t)index & (buffer->capacity - 1)], item, memory_order_relaxed);
+}
+
+static inline bool is_work_deque_empty(struct work_deque* deque) {
+    return atomic_load(&deque->top) >= atomic_load(&deque->bottom);
+}
+
+// Pushes an item at the bottom of the deque. Must only be called by the owner of the deque.
+static void push_work_deque(struct work_deque* deque, struct work_item* item) {
+    ptrdiff_t bottom = atomic_load_explicit(&deque->bottom, memory_order_relaxed);
+    ptrdiff_t top = atomic_load_explicit(&deque->top, memory_order_acquire);
+    struct deque_buffer* buffer = atomic_load_explicit(&deque->buffer, memory_order_relaxed);
+    if (bottom - top >= (ptrdiff_t)buffer->capacity) {
+        // The old buffer is kept until the deque is destroyed, since thieves may still read from it
+        struct deque_buffer* new_buffer = new_deque_buffer(buffer->capacity * 2, buffer);
+        for (ptrdiff_t i = top; i < bottom; ++i)
+            set_deque_item(new_buffer, i, get_deque_item(buffer, i));
+        atomic_store_explicit(&deque->buffer, new_buffer, memory_order_release);
+        buffer = new_buffer;
+    }
+    set_deque_item(buffer, bottom, item);
+    atomic_thread_fence(memory_order_release);
+    atomic_store_explicit(&deque->bottom, bottom + 1, memory_order_relaxed);
+}
+
+// Pops an item from the bottom of the deque. Must only be called by the owner of the deque.
+static struct work_item* pop_work_deque(struct work_deque* deque) {
+    ptrdiff_t bottom = atomic_load_explicit(&deque->bottom, memory_order_relaxed) - 1;
+    struct deque_buffer* buffer = atomic_load_explicit(&deque->buffer, memory_order_relaxed);
+    atomic_store_explicit(&deque->bottom, bottom, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    ptrdiff_t top = atomic_load_explicit(&deque->top, memory_order_relaxed);
+    if (top > bottom) {
+        atomic_store_explicit(&deque->bottom, bottom + 1, memory_order_relaxed);
+        return NULL;
+    }
+    struct work_item* item = get_deque_item(buffer, bottom);
+    if (top == bottom) {
+        // This is the last item, which thieves may be trying to steal at the same time
+        if (!atomic_compare_exchange_strong_explicit(
+            &deque->top, &top, top + 1, memory_order_seq_cst, memory_order_relaxed))
+            item = NULL;
+        atomic_store_explicit(&deque->bottom, bottom + 1, memory_order_relaxed);
+    }
+    return item;
+}
+
+// Steals an item from the top of the deque. Sets `is_contended` when
+// the item could not be taken because another thread took it first.
+static struct work_item* steal_work_deque(struct work_deque* deque, bool* is_contended) {
+    ptrdiff_t top = atomic_load_explicit(&deque->top, memory_order_acquire);
+    atomic_thread_fence(memory_order_seq_cst);
+    ptrdiff_t bottom = atomic_load_explicit(&deque->bottom, memory_order_acquire);
+    if (top >= bottom)
+        return NULL;
+    struct deque_buffer* buffer = atomic_load_explicit(&deque->buffer, memory_order_acquire);
+    struct work_item* item = get_deque_item(buffer, top);
+    if (!atomic_compare_exchange_strong_explicit(
+        &deque->top, &top, top + 1, memory_order_seq_cst, memory_order_relaxed))
+    {
+        *is_contended = true;
+        return NULL;
+    }
+    return item;
+}
+
+static inline size_t align_task_size(size_t task_size) {
+    return round_up(task_size, alignof(max_align_t)) * alignof(max_align_t);
+}
+
+static inline void init_task_arena(struct task_arena* arena) {
+    arena->data = NULL;
+    arena->capacity = 0;
+    arena->size = 0;
+    arena->heap_size = 0;
+    arena->peak_size = 0;
+    atomic_init(&arena->owner, NULL);
+}
+
+static inline void free_task_arena(struct task_arena* arena) {
+    assert(arena->size == 0 && arena->heap_size == 0);
+    free(arena->data);
+}
+
+static inline bool is_task_arena_empty(const struct task_arena* arena) {
+    return arena->size == 0 && arena->heap_size == 0;
+}
+
+static void* alloc_from_task_arena(struct task_arena* arena, size_t size) {
+    size = align_task_size(size > 0 ? size : 1);
+    arena->peak_size = max_size_t(arena->peak_size, arena->size + arena->heap_size + size);
+    if (arena->peak_size > arena->capacity && is_task_arena_empty(arena)) {
+        free(arena->data);
+        arena->data = xmalloc(arena->peak_size);
+        arena->capacity = arena->peak_size;
+    }
+    if (arena->size + size > arena->capacity) {
+        // The blocks that are in use cannot be moved, so the block is allocated on the heap, after its size
+        size_t header_size = align_task_size(sizeof(size_t));
+        char* block = xmalloc(header_size + size);
+        *(size_t*)block = size;
+        arena->heap_size += size;
+        return block + header_size;
+    }
+    void* ptr = arena->data + arena->size;
+    arena->size += size;
+    return ptr;
+}
+
+// Releases the given block. Blocks of the arena itself are released along with everything allocated after them.
+static void free_to_task_arena(struct task_arena* arena, void* ptr) {
+    uintptr_t begin = (uintptr_t)arena->data;
+    if (!arena->data || (uintptr_t)ptr < begin || (uintptr_t)ptr >= begin + arena->capacity) {
+        char* block = (char*)ptr - align_task_size(sizeof(size_t));
+        assert(arena->heap_size >= *(size_t*)block);
+        arena->heap_size -= *(size_t*)block;
+        free(block);
+        return;
+    }
+    assert((uintptr_t)ptr - begin < arena->size);
+    arena->size = (uintptr_t)ptr - begin;
+}
+
+// Returns the arena that the current thread uses for the given pool, if any.
+static inline struct task_arena* get_task_arena(struct thread_pool* thread_pool) {
+    if (current_worker && current_worker->thread_pool == thread_pool)
+        return &current_worker->task_arena;
+    if (atomic_load_explicit(&thread_pool->client_arena.owner, memory_order_relaxed) == &thread_tag)
+        return &thread_pool->client_arena;
+    return NULL;
+}
+
+static inline struct task_arena* acquire_task_arena(struct thread_pool* thread_pool) {
+    struct task_arena* arena = get_task_arena(thread_pool);
+    void* owner = NULL;
+    if (!arena && atomic_compare_exchange_strong_explicit(
+        &thread_pool->client_arena.owner, &owner, &thread_tag, memory_order_acquire, memory_order_relaxed))
+        arena = &thread_pool->client_arena;
+    return arena;
+}
+
+static inline bool has_available_work(struct thread_pool* thread_pool) {
+    if (atomic_load(&thread_pool->queued_count) > 0)
+        return true;
+    for (size_t i = 0, n = thread_pool->thread_count; i < n; ++i) {
+        if (!is_work_deque_empty(&thread_pool->workers[i].deque))
+            return true;
+    }
+    return false;
+}
+
+static inline void wake_up_workers(struct thread_pool* thread_pool, size_t item_count) {
+    // This fence orders the publication of the items before the load of the number of sleeping
+    // (or idle joining) workers, which these workers increment before checking for available work.
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(&thread_pool->sleeping_count, memory_order_relaxed) == 0 &&
+        atomic_load_explicit(&thread_pool->idle_joining_count, memory_order_relaxed) == 0)
+        return;
+    mtx_lock(&thread_pool->mutex);
+    if (item_count == 1)
+        cnd_signal(&thread_pool->avail_cond);
+    else
+        cnd_broadcast(&thread_pool->avail_cond);
+    if (atomic_load(&thread_pool->idle_joining_count) > 0)
+        cnd_broadcast(&thread_pool->done_cond);
+    mtx_unlock(&thread_pool->mutex);
+}
+
+// Takes a batch of items from the shared queue. The first one is returned, and the
+// others are pushed on the deque of the worker, where other workers can steal them.
+static struct work_item* take_queued_work(struct worker* worker) {
+    struct thread_pool* thread_pool = worker->thread_pool;
+    if (atomic_load_explicit(&thread_pool->queued_count, memory_order_relaxed) == 0)
+        return NULL;
+
+    mtx_lock(&thread_pool->mutex);
+    size_t queued_count = atomic_load_explicit(&thread_pool->queued_count, memory_order_relaxed);
+    size_t batch_size = min_size_t(queued_count, queued_count / thread_pool->thread_count + 1);
+    struct work_item* first = thread_pool->first_item;
+    struct work_item* last = first;
+    for (size_t i = 1; i < batch_size; ++i)
+        last = last->next;
+    if (batch_size > 0) {
+        thread_pool->first_item = last->next;
+        if (!thread_pool->first_item) {
+            assert(thread_pool->last_item == last);
+            thread_pool->last_item = NULL;
+        }
+        atomic_store_explicit(&thread_pool->queued_count, queued_count - batch_size, memory_order_relaxed);
+    }
+    mtx_unlock(&thread_pool->mutex);
+    if (batch_size == 0)
+        return NULL;
+
+    struct work_item* item = first->next;
+    for (size_t i = 1; i < batch_size; ++i) {
+        struct work_item* next = item->next;
+        push_work_deque(&worker->deque, item);
+        item = next;
+    }
+    if (batch_size > 1)
+        wake_up_workers(thread_pool, batch_size - 1);
+    return first;
+}
+
+static struct work_item* steal_work(struct worker* worker) {
+    struct thread_pool* thread_pool = worker->thread_pool;
+    bool is_contended;
+    do {
+        is_contended = false;
+        for (size_t i = 1, n = thread_pool->thread_count; i < n; ++i) {
+            struct worker* victim = &thread_pool->workers[(worker->thread_id + i) % n];
+            struct work_item* item = steal_work_deque(&victim->deque, &is_contended);
+            if (item)
+                return item;
+        }
+    } while (is_contended);
+    return NULL;
+}
+
+static struct work_item* find_work(struct worker* worker) {
+    struct work_item* item = pop_work_deque(&worker->deque);
+    if (!item)
+        item = take_queued_work(worker);
+    if (!item)
+        item = steal_work(worker);
+    return item;
+}
+
+// Puts the worker to sleep until work becomes available.
+// Returns false if the worker should stop instead.
+static bool wait_for_work(struct thread_pool* thread_pool) {
+    bool should_stop = false;
+    mtx_lock(&thread_pool->mutex);
+    atomic_fetch_add(&thread_pool->sleeping_count, 1);
+    while (!has_available_work(thread_pool)) {
+        if (atomic_load(&thread_pool->should_stop) ||
+            cnd_wait(&thread_pool->avail_cond, &thread_pool->mutex) != thrd_success) {
+            should_stop = true;
+            break;
+        }
+    }
+    atomic_fetch_sub(&thread_pool->sleeping_count, 1);
+    mtx_unlock(&thread_pool->mutex);
+    return !should_stop;
+}
+
+static inline bool is_wait_over(struct thread_pool* thread_pool, size_t count) {
     return
-        (queue->worked_on > 0 || queue->first_item) &&
-        (queue->done_target == 0 || queue->done_count < queue->done_target);
+        atomic_load(&thread_pool->pending_count) == 0 ||
+        (count > 0 && atomic_load(&thread_pool->done_count) >= count);
+}
+
+static void finish_group_work(struct thread_pool* thread_pool, struct task_group* task_group) {
+    // The group may be destroyed as soon as its counter reaches zero, so it cannot be accessed after that
+    if (atomic_fetch_sub(&task_group->pending_count, 1) == 1 &&
+        atomic_load(&thread_pool->joining_count) > 0)
+    {
+        mtx_lock(&thread_pool->mutex);
+        cnd_broadcast(&thread_pool->done_cond);
+        mtx_unlock(&thread_pool->mutex);
+    }
+}
+
+static void finish_work(struct thread_pool* thread_pool, struct work_item* item) {
+    if (item->task_group) {
+        finish_group_work(thread_pool, item->task_group);
+        return;
+    }
+
+    // The counter is incremented before the item is added to the list of finished items,
+    // so that it is never smaller than the length of that list.
+    size_t done_count = atomic_fetch_add(&thread_pool->done_count, 1) + 1;
+    struct work_item* done_items = atomic_load_explicit(&thread_pool->done_items, memory_order_relaxed);
+    do {
+        item->next = done_items;
+    } while (!atomic_compare_exchange_weak_explicit(
+        &thread_pool->done_items, &done_items, item,
+        memory_order_release, memory_order_relaxed));
+    size_t pending_count = atomic_fetch_sub(&thread_pool->pending_count, 1) - 1;
+
+    if (atomic_load(&thread_pool->is_waiting)) {
+        size_t done_target = atomic_load(&thread_pool->done_target);
+        if (pending_count == 0 || (done_target > 0 && done_count >= done_target)) {
+            // Threads joining a task group wait on the same condition, so they must not take the only wake-up
+            mtx_lock(&thread_pool->mutex);
+            cnd_broadcast(&thread_pool->done_cond);
+            mtx_unlock(&thread_pool->mutex);
+        }
+    }
 }
 
 static int thread_pool_worker(void* data) {
-    struct thread_data* thread_data = data;
-    struct work_queue* queue = thread_data->queue;
-    struct thread_pool* thread_pool = thread_data->thread_pool;
-    size_t thread_id = thread_data->thread_id;
+    struct worker* worker = data;
+    struct thread_pool* thread_pool = worker->thread_pool;
+    current_worker = worker;
     while (true) {
-        mtx_lock(&queue->mutex);
-        while (!queue->first_item) {
-            if (thread_pool->should_stop || cnd_wait(&queue->avail_cond, &queue->mutex) != thrd_success)
-                goto end;
-        }
-        struct work_item* item = queue->first_item;
-        queue->first_item = item->next;
-        if (!queue->first_item) {
-            assert(queue->last_item == item);
-            queue->last_item = NULL;
+        struct work_item* item = find_work(worker);
+        if (!item) {
+            if (!wait_for_work(thread_pool))
+                break;
+            continue;
         }
-        queue->worked_on++;
-        mtx_unlock(&queue->mutex);
-
-        item->work_fn(item, thread_id);
-
-        mtx_lock(&queue->mutex);
-        item->next = queue->done_items;
-        queue->done_items = item;
-        queue->worked_on--;
-        queue->done_count++;
-        if (!waiting_condition(queue))
-            cnd_signal(&queue->done_cond);
-        mtx_unlock(&queue->mutex);
-    }
-end:
-    mtx_unlock(&queue->mutex);
+        item->work_fn(item, worker->thread_id);
+        finish_work(thread_pool, item);
+    }
     return 0;
 }
 
-static inline bool init_work_queue(struct work_queue* queue) {
-    if (cnd_init(&queue->avail_cond) != thrd_success)
+static inline bool init_sync_objects(struct thread_pool* thread_pool) {
+    if (cnd_init(&thread_pool->avail_cond) != thrd_success)
         return false;        
-    if (cnd_init(&queue->done_cond) != thrd_success)
+    if (cnd_init(&thread_pool->done_cond) != thrd_success)
         goto cleanup_cond;
-    if (mtx_init(&queue->mutex, mtx_plain) != thrd_success)
+    if (mtx_init(&thread_pool->mutex, mtx_plain) != thrd_success)
         goto cleanup_mutex;
-    queue->first_item = NULL;
-    queue->last_item = NULL;
-    queue->done_items = NULL;
-    queue->worked_on = 0;
-    queue->done_count = 0;
-    queue->done_target = 0;
     return true;
 cleanup_mutex:
-    cnd_destroy(&queue->done_cond);
+    cnd_destroy(&thread_pool->done_cond);
 cleanup_cond:
-    cnd_destroy(&queue->avail_cond);
+    cnd_destroy(&thread_pool->avail_cond);
     return false;
 }
 
-static inline void free_work_queue(struct work_queue* queue) {
-    mtx_destroy(&queue->mutex);
-    cnd_destroy(&queue->avail_cond);
-    cnd_destroy(&queue->done_cond);
+static inline void free_sync_objects(struct thread_pool* thread_pool) {
+    mtx_destroy(&thread_pool->mutex);
+    cnd_destroy(&thread_pool->avail_cond);
+    cnd_destroy(&thread_pool->done_cond);
 }
 
 static inline void terminate_threads(struct thread_pool* thread_pool) {
-    mtx_lock(&thread_pool->queue.mutex);
-    thread_pool->should_stop = true;
-    cnd_broadcast(&thread_pool->queue.avail_cond);
-    mtx_unlock(&thread_pool->queue.mutex);
+    mtx_lock(&thread_pool->mutex);
+    atomic_store(&thread_pool->should_stop, true);
+    cnd_broadcast(&thread_pool->avail_cond);
+    mtx_unlock(&thread_pool->mutex);
     for (size_t i = 0, n = thread_pool->thread_count; i < n; ++i)
         thrd_join(thread_pool->threads[i], NULL);
 }
 
+static inline void free_workers(struct worker* workers, size_t worker_count) {
+    for (size_t i = 0; i < worker_count; ++i) {
+        free_work_deque(&workers[i].deque);
+        free_task_arena(&workers[i].task_arena);
+    }
+    free(workers);
+}
+
 struct thread_pool* new_thread_pool(size_t thread_count) {
     assert(thread_count > 0);
     struct thread_pool* thread_pool = xmalloc(sizeof(struct thread_pool));
-    if (!init_work_queue(&thread_pool->queue))
-        goto cleanup_queue;
-    thread_pool->thread_data = xmalloc(sizeof(struct thread_data) * thread_count);
+    if (!init_sync_objects(thread_pool))
+        goto cleanup_sync_objects;
+    thread_pool->first_item = NULL;
+    thread_pool->last_item = NULL;
+    atomic_init(&thread_pool->queued_count, 0);
+    atomic_init(&thread_pool->sleeping_count, 0);
+    atomic_init(&thread_pool->done_items, NULL);
+    atomic_init(&thread_pool->pending_count, 0);
+    atomic_init(&thread_pool->done_count, 0);
+    atomic_init(&thread_pool->done_target, 0);
+    atomic_init(&thread_pool->is_waiting, false);
+    atomic_init(&thread_pool->joining_count, 0);
+    atomic_init(&thread_pool->idle_joining_count, 0);
+    atomic_init(&thread_pool->should_stop, false);
+    init_task_arena(&thread_pool->client_arena);
+
+    // The workers are aligned so that their deques do not share cache lines
+    thread_pool->workers = aligned_alloc(CACHE_LINE_SIZE, sizeof(struct worker) * thread_count);
+    if (!thread_pool->workers)
+        die("not enough memory");
+    for (size_t i = 0; i < thread_count; ++i) {
+        init_work_deque(&thread_pool->workers[i].deque);
+        init_task_arena(&thread_pool->workers[i].task_arena);
+        thread_pool->workers[i].thread_pool = thread_pool;
+        thread_pool->workers[i].thread_id = i;
+    }
+
+    // All the workers must be initialized before starting any thread, since workers steal from each other
     thread_pool->threads = xmalloc(sizeof(thrd_t) * thread_count);
     thread_pool->thread_count = thread_count;
-    thread_pool->should_stop = false;
     for (size_t i = 0; i < thread_count; ++i) {
-        thread_pool->thread_data[i].thread_pool = thread_pool;
-        thread_pool->thread_data[i].queue = &thread_pool->queue;
-        thread_pool->thread_data[i].thread_id = i;
-        if (thrd_create(thread_pool->threads + i, thread_pool_worker, &thread_pool->thread_data[i]) != thrd_success) {
+        if (thrd_create(thread_pool->threads + i, thread_pool_worker, &thread_pool->workers[i]) != thrd_success) {
             thread_pool->thread_count = i;
             goto cleanup_thread;
         }
@@ -155,19 +535,21 @@ struct thread_pool* new_thread_pool(size_t thread_count) {
     return thread_pool;
 cleanup_thread:
     terminate_threads(thread_pool);
-    free_work_queue(&thread_pool->queue);
+    free_sync_objects(thread_pool);
     free(thread_pool->threads);
-    free(thread_pool->thread_data);
-cleanup_queue:
+    free_workers(thread_pool->workers, thread_count);
+    free_task_arena(&thread_pool->client_arena);
+cleanup_sync_objects:
     free(thread_pool);
     return NULL;
 }
 
 void free_thread_pool(struct thread_pool* thread_pool) {
     terminate_threads(thread_pool);
-    free_work_queue(&thread_pool->queue);
+    free_sync_objects(thread_pool);
     free(thread_pool->threads);
-    free(thread_pool->thread_data);
+    free_workers(thread_pool->workers, thread_pool->thread_count);
+    free_task_arena(&thread_pool->client_arena);
     free(thread_pool);
 }
 
@@ -175,73 +557,346 @@ size_t get_thread_count(const struct thread_pool* thread_pool) {
     return thread_pool->thread_count;
 }
 
+// Appends the given items to the shared queue, and wakes up workers to execute them.
+static void enqueue_work(struct thread_pool* thread_pool, struct work_item* first, struct work_item* last, size_t item_count) {
+    mtx_lock(&thread_pool->mutex);
+    if (thread_pool->last_item) {
+        assert(thread_pool->first_item);
+        thread_pool->last_item->next = first;
+        thread_pool->last_item = last;
+    } else {
+        assert(!thread_pool->first_item);
+        thread_pool->first_item = first;
+        thread_pool->last_item  = last;
+    }
+    atomic_fetch_add_explicit(&thread_pool->queued_count, item_count, memory_order_relaxed);
+    if (atomic_load(&thread_pool->sleeping_count) > 0) {
+        if (item_count == 1)
+            cnd_signal(&thread_pool->avail_cond);
+        else
+            cnd_broadcast(&thread_pool->avail_cond);
+    }
+    if (atomic_load(&thread_pool->idle_joining_count) > 0)
+        cnd_broadcast(&thread_pool->done_cond);
+    mtx_unlock(&thread_pool->mutex);
+}
+
 void submit_work(struct thread_pool* thread_pool, struct work_item* first, struct work_item* last) {
-#ifndef NDEBUG
     // Ensure that following the links from `first` gives `last` as the last element.
-    struct work_item* prev = first;
-    while (prev->next) prev = prev->next;
-    assert(prev == last);
-#endif
-    mtx_lock(&thread_pool->queue.mutex);
-    if (thread_pool->queue.last_item) {
-        assert(thread_pool->queue.first_item);
-        thread_pool->queue.last_item->next = first;
-        thread_pool->queue.last_item = last;
-    } else {
-        assert(!thread_pool->queue.first_item);
-        thread_pool->queue.first_item = first;
-        thread_pool->queue.last_item  = last;
+    assert(!last->next);
+    size_t item_count = 1;
+    for (struct work_item* item = first; item != last; item = item->next) {
+        assert(item);
+        item->task_group = NULL;
+        item_count++;
     }
-    if (first == last)
-        cnd_signal(&thread_pool->queue.avail_cond);
-    else
-        cnd_broadcast(&thread_pool->queue.avail_cond);
-    mtx_unlock(&thread_pool->queue.mutex);
+    last->task_group = NULL;
+
+    // The items must be counted as pending before any worker can finish them
+    atomic_fetch_add(&thread_pool->pending_count, item_count);
+    enqueue_work(thread_pool, first, last, item_count);
+}
+
+static inline struct worker* get_current_worker(struct thread_pool* thread_pool) {
+    return current_worker && current_worker->thread_pool == thread_pool ? current_worker : NULL;
+}
+
+void spawn_work(
+    struct thread_pool* thread_pool,
+    struct task_group* task_group,
+    struct work_item* first,
+    struct work_item* last)
+{
+    assert(!last->next);
+    size_t item_count = 0;
+    for (struct work_item* item = first; item; item = item->next) {
+        item->task_group = task_group;
+        item_count++;
+    }
+    atomic_fetch_add(&task_group->pending_count, item_count);
+
+    struct worker* worker = get_current_worker(thread_pool);
+    if (!worker) {
+        enqueue_work(thread_pool, first, last, item_count);
+        return;
+    }
+    for (struct work_item* item = first; item;) {
+        // Items cannot be accessed once they are on the deque, since they may be stolen right away
+        struct work_item* next = item->next;
+        push_work_deque(&worker->deque, item);
+        item = next;
+    }
+    wake_up_workers(thread_pool, item_count);
+}
+
+void join_work(struct thread_pool* thread_pool, struct task_group* task_group) {
+    struct worker* worker = get_current_worker(thread_pool);
+    if (worker) {
+        // Workers run items while they wait, starting with their own deque, where the items of the group
+        // are likely to be. When there is nothing to run, they sleep until the group is finished or until
+        // new work becomes available, since the remaining items of the group may spawn more work.
+        while (atomic_load(&task_group->pending_count) > 0) {
+            struct work_item* item = find_work(worker);
+            if (item) {
+                item->work_fn(item, worker->thread_id);
+                finish_work(thread_pool, item);
+                continue;
+            }
+            mtx_lock(&thread_pool->mutex);
+            atomic_fetch_add(&thread_pool->joining_count, 1);
+            atomic_fetch_add(&thread_pool->idle_joining_count, 1);
+            while (atomic_load(&task_group->pending_count) > 0 &&
+                !has_available_work(thread_pool) &&
+                cnd_wait(&thread_pool->done_cond, &thread_pool->mutex) == thrd_success)
+                ;
+            atomic_fetch_sub(&thread_pool->idle_joining_count, 1);
+            atomic_fetch_sub(&thread_pool->joining_count, 1);
+            mtx_unlock(&thread_pool->mutex);
+        }
+        return;
+    }
+
+    mtx_lock(&thread_pool->mutex);
+    atomic_fetch_add(&thread_pool->joining_count, 1);
+    while (atomic_load(&task_group->pending_count) > 0 &&
+        cnd_wait(&thread_pool->done_cond, &thread_pool->mutex) == thrd_success)
+        ;
+    atomic_fetch_sub(&thread_pool->joining_count, 1);
+    mtx_unlock(&thread_pool->mutex);
 }
 
 struct work_item* wait_for_completion(struct thread_pool* thread_pool, size_t count) {
-    struct work_queue* queue = &thread_pool->queue;
+    atomic_store(&thread_pool->done_target, count);
+    if (!is_wait_over(thread_pool, count)) {
+        mtx_lock(&thread_pool->mutex);
+        atomic_store(&thread_pool->is_waiting, true);
+        while (!is_wait_over(thread_pool, count) &&
+            cnd_wait(&thread_pool->done_cond, &thread_pool->mutex) == thrd_success)
+            ;
+        atomic_store(&thread_pool->is_waiting, false);
+        mtx_unlock(&thread_pool->mutex);
+    }
+
+    // Finished items may not have been added to the list yet, even though they have been
+    // counted. When all items are finished, however, they are all in the list.
     struct work_item* done_items = NULL;
-    mtx_lock(&queue->mutex);
-    queue->done_target = count;
+    size_t done_count = 0;
     while (true) {
-        if (waiting_condition(queue) &&
-            cnd_wait(&queue->done_cond, &queue->mutex) == thrd_success)
-            continue;
-        break;
+        bool is_idle = atomic_load(&thread_pool->pending_count) == 0;
+        struct work_item* items = atomic_exchange_explicit(&thread_pool->done_items, NULL, memory_order_acquire);
+        while (items) {
+            struct work_item* next = items->next;
+            items->next = done_items;
+            done_items = items;
+            items = next;
+            done_count++;
+        }
+        if (is_idle || (count > 0 && done_count >= count))
+            break;
+        thrd_yield();
     }
-    done_items = queue->done_items;
-    queue->done_items = NULL;
-    queue->done_count = 0;
-    queue->done_target = 0;
-    mtx_unlock(&queue->mutex);
+    atomic_fetch_sub(&thread_pool->done_count, done_count);
+    atomic_store(&thread_pool->done_target, 0);
     return done_items;
 }
 
-static inline struct work_item* task_at(
-    struct work_item* tasks, size_t task_size, size_t index)
+void* alloc_task_storage(struct thread_pool* thread_pool, size_t size) {
+    struct task_arena* arena = acquire_task_arena(thread_pool);
+    return arena ? alloc_from_task_arena(arena, size) : xmalloc(size);
+}
+
+void free_task_storage(struct thread_pool* thread_pool, void* storage) {
+    struct task_arena* arena = get_task_arena(thread_pool);
+    if (!arena) {
+        free(storage);
+        return;
+    }
+    free_to_task_arena(arena, storage);
+    // Other client threads can use the arena once it is empty
+    if (arena == &thread_pool->client_arena && is_task_arena_empty(arena))
+        atomic_store_explicit(&arena->owner, NULL, memory_order_release);
+}
+
+/*
+ * Parallel loops split their range in chunks, which are tiles in 2D, numbered row by row. With a
+ * static schedule, each task processes the chunks whose index is equal to its own modulo the number
+ * of tasks. With the other schedules, there is one task per worker, and tasks claim chunks from a
+ * shared counter until there are none left, so that no thread waits while others have work left. The
+ * tasks are spawned in a task group, which makes it possible to run loops from inside a work item.
+ */
+
+// Number of chunks per thread used by default to split 1D loops with a dynamic or guided schedule.
+#define DEFAULT_CHUNKS_PER_THREAD 8
+
+struct parallel_loop {
+    work_fn_t compute;
+    enum parallel_schedule schedule;
+    size_t dim_count;
+    struct range range[2];
+    size_t grain_size[2];
+    size_t chunk_count[2];
+    size_t task_count;
+    atomic_size_t next_chunk;
+};
+
+struct parallel_loop_task {
+    struct work_item work_item;
+    struct parallel_loop* loop;
+    struct work_item* task;   // Copy of the task given by the client
+    size_t next_chunk;        // Next chunk to process, with a static schedule
+};
+
+// Claims a range of chunks for the given task. Returns false if there are no chunks left.
+static bool claim_chunks(struct parallel_loop_task* loop_task, struct range* chunks) {
+    struct parallel_loop* loop = loop_task->loop;
+    size_t chunk_count = loop->chunk_count[0] * loop->chunk_count[1];
+    size_t begin = 0, end = 0;
+    switch (loop->schedule) {
+        case DYNAMIC_SCHEDULE:
+            begin = atomic_fetch_add_explicit(&loop->next_chunk, 1, memory_order_relaxed);
+            end = begin + 1;
+            break;
+        case GUIDED_SCHEDULE:
+            // As in OpenMP, the number of chunks that are claimed is proportional to the number of remaining chunks
+            begin = atomic_load_explicit(&loop->next_chunk, memory_order_relaxed);
+            do {
+                if (begin >= chunk_count)
+                    return false;
+                end = begin + compute_chunk_size(chunk_count - begin, loop->task_count);
+            } while (!atomic_compare_exchange_weak_explicit(
+                &loop->next_chunk, &begin, end, memory_order_relaxed, memory_order_relaxed));
+            break;
+        default:
+            assert(loop->schedule == STATIC_SCHEDULE);
+            begin = loop_task->next_chunk;
+            end = begin + 1;
+            loop_task->next_chunk += loop->task_count;
+            break;
+    }
+    chunks->begin = begin;
+    chunks->end = min_size_t(end, chunk_count);
+    return begin < chunk_count;
+}
+
+static inline struct range get_chunk_range(const struct parallel_loop* loop, size_t dim, size_t chunk_index) {
+    size_t begin = loop->range[dim].begin + chunk_index * loop->grain_size[dim];
+    return (struct range) { begin, min_size_t(begin + loop->grain_size[dim], loop->range[dim].end) };
+}
+
+static void run_parallel_loop_task(struct work_item* work_item, size_t thread_id) {
+    struct parallel_loop_task* loop_task = (void*)work_item;
+    const struct parallel_loop* loop = loop_task->loop;
+    struct range chunks;
+    while (claim_chunks(loop_task, &chunks)) {
+        if (loop->dim_count == 1) {
+            // Consecutive chunks form a single range in 1D
+            struct parallel_task_1d* task = (void*)loop_task->task;
+            task->range.begin = get_chunk_range(loop, 0, chunks.begin).begin;
+            task->range.end   = get_chunk_range(loop, 0, chunks.end - 1).end;
+            loop->compute(loop_task->task, thread_id);
+            continue;
+        }
+        for (size_t i = chunks.begin; i < chunks.end; ++i) {
+            struct parallel_task_2d* task = (void*)loop_task->task;
+            task->range[0] = get_chunk_range(loop, 0, i % loop->chunk_count[0]);
+            task->range[1] = get_chunk_range(loop, 1, i / loop->chunk_count[0]);
+            loop->compute(loop_task->task, thread_id);
+        }
+    }
+}
+
+static void run_parallel_loop(
+    struct thread_pool* thread_pool,
+    struct parallel_loop* loop,
+    const struct work_item* init, size_t task_size)
 {
-    return (struct work_item*)(((char*)tasks) + task_size * index);
+    size_t chunk_count = loop->chunk_count[0] * loop->chunk_count[1];
+    loop->task_count = min_size_t(loop->task_count, chunk_count);
+    if (loop->task_count == 0)
+        return;
+    atomic_init(&loop->next_chunk, 0);
+
+    // The tasks of the loop are followed by the copies of the task given by the client
+    size_t loop_task_size = align_task_size(sizeof(struct parallel_loop_task));
+    size_t client_task_size = align_task_size(task_size);
+    char* tasks = alloc_task_storage(thread_pool, (loop_task_size + client_task_size) * loop->task_count);
+    struct work_item* first = NULL, *last = NULL;
+    for (size_t i = loop->task_count; i-- > 0;) {
+        struct parallel_loop_task* loop_task = (void*)(tasks + loop_task_size * i);
+        loop_task->work_item.work_fn = run_parallel_loop_task;
+        loop_task->work_item.next = first;
+        loop_task->loop = loop;
+        loop_task->task = (void*)(tasks + loop_task_size * loop->task_count + client_task_size * i);
+        loop_task->next_chunk = i;
+        memcpy(loop_task->task, init, task_size);
+        first = &loop_task->work_item;
+        if (!last)
+            last = first;
+    }
+
+    struct task_group task_group;
+    init_task_group(&task_group);
+    spawn_work(thread_pool, &task_group, first, last);
+    join_work(thread_pool, &task_group);
+    free_task_storage(thread_pool, tasks);
+}
+
+static inline size_t get_parallel_loop_task_count(const struct thread_pool* thread_pool, enum parallel_schedule schedule) {
+    // Static schedules use more tasks than threads, to mitigate load imbalance
+    return get_thread_count(thread_pool) * (schedule == STATIC_SCHEDULE ? 2 : 1);
 }
 
-static inline void init_parallel_tasks(
-    struct work_item* tasks,
-    struct work_item* init,
-    void (*compute)(struct work_item*, size_t),
-    size_t task_size, size_t task_count)
+void parallel_for_1d_scheduled(
+    struct thread_pool* thread_pool,
+    void (*compute)(struct parallel_task_1d*, size_t),
+    struct parallel_task_1d* init, size_t task_size,
+    const struct range* range,
+    enum parallel_schedule schedule,
+    size_t grain_size)
 {
-    init->work_fn = compute; 
-    init->next    = NULL;
-    for (size_t i = 0; i < task_count; ++i) {
-        struct work_item* task = task_at(tasks, task_size, i);
-        memcpy(task, init, task_size);
-        if (i != task_count - 1)
-            task->next = task_at(tasks, task_size, i + 1);
+    size_t elem_count = range[0].end > range[0].begin ? range[0].end - range[0].begin : 0;
+    size_t task_count = get_parallel_loop_task_count(thread_pool, schedule);
+    if (grain_size == 0) {
+        grain_size = compute_chunk_size(elem_count,
+            schedule == STATIC_SCHEDULE ? task_count : task_count * DEFAULT_CHUNKS_PER_THREAD);
+        grain_size = grain_size > 0 ? grain_size : 1;
     }
+    struct parallel_loop loop = {
+        .compute = (work_fn_t)compute,
+        .schedule = schedule,
+        .dim_count = 1,
+        .range = { range[0], { 0, 1 } },
+        .grain_size = { grain_size, 1 },
+        .chunk_count = { compute_chunk_size(elem_count, grain_size), 1 },
+        .task_count = task_count
+    };
+    run_parallel_loop(thread_pool, &loop, &init->work_item, task_size);
 }
 
-static inline size_t range_end(size_t i, size_t chunk_size, size_t end) {
-    return i + chunk_size > end ? end : i + chunk_size;
+void parallel_for_2d_scheduled(
+    struct thread_pool* thread_pool,
+    void (*compute)(struct parallel_task_2d*, size_t),
+    struct parallel_task_2d* init, size_t task_size,
+    const struct range* range,
+    enum parallel_schedule schedule,
+    const size_t* grain_size)
+{
+    struct parallel_loop loop = {
+        .compute = (work_fn_t)compute,
+        .schedule = schedule,
+        .dim_count = 2,
+        .range = { range[0], range[1] },
+        .task_count = get_parallel_loop_task_count(thread_pool, schedule)
+    };
+    for (size_t i = 0; i < 2; ++i) {
+        size_t elem_count = range[i].end > range[i].begin ? range[i].end - range[i].begin : 0;
+        size_t tile_size = grain_size && grain_size[i] > 0
+            ? grain_size[i]
+            : compute_chunk_size(elem_count, get_thread_count(thread_pool) * 2);
+        loop.grain_size[i] = tile_size > 0 ? tile_size : 1;
+        loop.chunk_count[i] = compute_chunk_size(elem_count, loop.grain_size[i]);
+    }
+    run_parallel_loop(thread_pool, &loop, &init->work_item, task_size);
 }
 
 void parallel_for_1d(
@@ -250,34 +905,7 @@ void parallel_for_1d(
     struct parallel_task_1d* init, size_t task_size,
     const struct range* range)
 {
-    size_t thread_count = get_thread_count(thread_pool);
-    size_t task_count = thread_count * 2;
-    struct work_item* tasks = xmalloc(task_size * task_count);
-    init_parallel_tasks(tasks, &init->work_item, (work_fn_t)compute, task_size, task_count);
-
-    struct work_item* current_task  = tasks;
-    struct work_item* first_task    = tasks;
-    struct work_item* previous_task = NULL;
-
-    const size_t chunk_size = compute_chunk_size(range[0].end - range[0].begin, task_count);
-    for (size_t i = range[0].begin; i < range[0].end; i += chunk_size) {
-        assert(current_task);
-        ((struct parallel_task_1d*)current_task)->range.begin = i;
-        ((struct parallel_task_1d*)current_task)->range.end   = range_end(i, chunk_size, range[0].end);
-        previous_task = current_task;
-        current_task = current_task->next;
-        if (!current_task) {
-            submit_work(thread_pool, first_task, previous_task);
-            first_task = current_task = wait_for_completion(thread_pool, thread_count);
-            previous_task = NULL;
-        }
-    }
-    if (previous_task) {
-        previous_task->next = NULL;
-        submit_work(thread_pool, first_task, previous_task);
-    }
-    wait_for_completion(thread_pool, 0);
-    free(tasks);
+    parallel_for_1d_scheduled(thread_pool, compute, init, task_size, range, STATIC_SCHEDULE, 0);
 }
 
 void parallel_for_2d(
@@ -286,41 +914,5 @@ void parallel_for_2d(
     struct parallel_task_2d* init, size_t task_size,
     const struct range* range)
 {
-    size_t thread_count = get_thread_count(thread_pool);
-    size_t task_count = thread_count * 2;
-    struct work_item* tasks = xmalloc(task_size * task_count);
-    init_parallel_tasks(tasks, &init->work_item, (work_fn_t)compute, task_size, task_count);
-
-    struct work_item* current_task  = tasks;
-    struct work_item* first_task    = tasks;
-    struct work_item* previous_task = NULL;
-
-    const size_t chunk_size[] = {
-        compute_chunk_size(range[0].end - range[0].begin, task_count),
-        compute_chunk_size(range[1].end - range[1].begin, task_count)
-    };
-    for (size_t j = range[1].begin; j < range[1].end; j += chunk_size[1]) {
-        size_t next_j = range_end(j, chunk_size[1], range[1].end);
-        for (size_t i = range[0].begin; i < range[0].end; i += chunk_size[0]) {
-            size_t next_i = range_end(i, chunk_size[0], range[0].end);
-            assert(current_task);
-            ((struct parallel_task_2d*)current_task)->range[0].begin = i;
-            ((struct parallel_task_2d*)current_task)->range[0].end   = next_i;
-            ((struct parallel_task_2d*)current_task)->range[1].begin = j;
-            ((struct parallel_task_2d*)current_task)->range[1].end   = next_j;
-            previous_task = current_task;
-            current_task = current_task->next;
-            if (!current_task) {
-                submit_work(thread_pool, first_task, previous_task);
-                first_task = current_task = wait_for_completion(thread_pool, thread_count);
-                previous_task = NULL;
-            }
-        }
-    }
-    if (previous_task) {
-        previous_task->next = NULL;
-        submit_work(thread_pool, first_task, previous_task);
-    }
-    wait_for_completion(thread_pool, 0);
-    free(tasks);
+    parallel_for_2d_scheduled(thread_pool, compute, init, task_size, range, STATIC_SCHEDULE, NULL);
 }
@@ -2,6 +2,7 @@
 #define CORE_THREAD_POOL_H
 
 #include <stddef.h>
+#include <stdatomic.h>
 
 struct work_item;
 
@@ -10,6 +11,12 @@ typedef void (*work_fn_t)(struct work_item*, size_t);
 struct work_item {
     work_fn_t work_fn;
     struct work_item* next;
+    struct task_group* task_group; // Group of the item, if it was spawned with `spawn_work()`
+};
+
+// Work items that are spawned and joined together, possibly from inside a running work item.
+struct task_group {
+    atomic_size_t pending_count;
 };
 
 struct range {
@@ -45,6 +52,29 @@ void submit_work(struct thread_pool* thread_pool, struct work_item* first, struc
 // Returns the executed work items for re-use.
 struct work_item* wait_for_completion(struct thread_pool* thread_pool, size_t count);
 
+static inline void init_task_group(struct task_group* task_group) {
+    atomic_init(&task_group->pending_count, 0);
+}
+
+// Spawns several work items in the given task group. This can be called from a running work item, in which
+// case the items are pushed on the deque of the calling worker, or from the client, like `submit_work()`.
+void spawn_work(
+    struct thread_pool* thread_pool,
+    struct task_group* task_group,
+    struct work_item* first,
+    struct work_item* last);
+
+// Waits for all the work items of the task group to terminate. When called from a running work item,
+// the calling worker executes other work items in the meantime instead of blocking, which makes nested
+// fork-join parallelism possible. Items of a task group are not returned by `wait_for_completion()`.
+void join_work(struct thread_pool* thread_pool, struct task_group* task_group);
+
+// Allocates storage for work items from an arena of the pool that belongs to the calling thread. Arenas are
+// reused across calls, so that building arrays of work items does not require heap allocations once they are
+// large enough. The storage must be freed by the same thread, in the reverse order of allocation.
+void* alloc_task_storage(struct thread_pool* thread_pool, size_t size);
+void free_task_storage(struct thread_pool* thread_pool, void* storage);
+
 static inline size_t compute_chunk_size(size_t elem_count, size_t chunk_count) {
     return elem_count / chunk_count + (elem_count % chunk_count ? 1 : 0);
 }
@@ -58,18 +88,45 @@ static inline size_t compute_chunk_end(size_t chunk_size, size_t chunk_index, si
     return chunk_end < count ? chunk_end : count;
 }
 
-// Runs the given computation in parallel on the given thread pool.
+// Determines how the chunks of a parallel loop are distributed among threads.
+enum parallel_schedule {
+    STATIC_SCHEDULE,  // Chunks are assigned to tasks in advance
+    DYNAMIC_SCHEDULE, // Threads claim chunks one at a time until there are none left
+    GUIDED_SCHEDULE   // Same, but threads claim a number of chunks proportional to the number of remaining chunks
+};
+
+// Runs the given computation in parallel on the given thread pool. This can be called from a running work item.
 void parallel_for_1d(
     struct thread_pool* thread_pool,
     void (*compute)(struct parallel_task_1d*, size_t),
     struct parallel_task_1d* init, size_t task_size,
     const struct range* range);
 
-// Same, but in 2D.
+// Same, but with the given schedule, and with chunks of `grain_size` elements (a default size is used
+// when `grain_size` is zero). The computation can be called several times on the same task.
+void parallel_for_1d_scheduled(
+    struct thread_pool* thread_pool,
+    void (*compute)(struct parallel_task_1d*, size_t),
+    struct parallel_task_1d* init, size_t task_size,
+    const struct range* range,
+    enum parallel_schedule schedule,
+    size_t grain_size);
+
+// Same as `parallel_for_1d()`, but in 2D.
 void parallel_for_2d(
     struct thread_pool* thread_pool,
     void (*compute)(struct parallel_task_2d*, size_t),
     struct parallel_task_2d* init, size_t task_size,
     const struct range* range);
 
+// Same as `parallel_for_1d_scheduled()`, but in 2D. The chunks are tiles whose width and
+// height are given by `grain_size`, which can be `NULL` to use a default size.
+void parallel_for_2d_scheduled(
+    struct thread_pool* thread_pool,
+    void (*compute)(struct parallel_task_2d*, size_t),
+    struct parallel_task_2d* init, size_t task_size,
+    const struct range* range,
+    enum parallel_schedule schedule,
+    const size_t* grain_size);
+
 #endif
@@ -1,5 +1,9 @@
 #include "core/tri.h"
 
+// The watertight test relies on computations not being fused into multiply-add instructions (see
+// `compute_edge_functions()`). GCC ignores this pragma, which is why the build also disables contraction.
+#pragma STDC FP_CONTRACT OFF
+
 bool intersect_ray_tri(struct ray* ray, struct hit* hit, const struct tri* tri) {
     struct vec3 c = sub_vec3(tri->p0, ray->org);
     struct vec3 r = cross_vec3(ray->dir, c);
@@ -21,3 +25,292 @@ bool intersect_ray_tri(struct ray* ray, struct hit* hit, const struct tri* tri)
 
     return false;
 }
+
+// Intersects all the triangles of a block with a ray, regardless of the mask.
+static inline void intersect_ray_tri_block_lanes(
+    const struct ray* ray,
+    const struct tri_block* block,
+    real_t* t, real_t* u, real_t* v, bool* hits)
+{
+    // This loop has no branches, so that it can be vectorized across triangles
+    for (size_t i = 0; i < TRI_BLOCK_SIZE; ++i) {
+        struct vec3 p0 = make_vec3(block->p0[0][i], block->p0[1][i], block->p0[2][i]);
+        struct vec3 e1 = make_vec3(block->e1[0][i], block->e1[1][i], block->e1[2][i]);
+        struct vec3 e2 = make_vec3(block->e2[0][i], block->e2[1][i], block->e2[2][i]);
+        struct vec3 n  = make_vec3(block->n [0][i], block->n [1][i], block->n [2][i]);
+        struct vec3 c = sub_vec3(p0, ray->org);
+        struct vec3 r = cross_vec3(ray->dir, c);
+
+        real_t inv_det = ((real_t)1) / dot_vec3(n, ray->dir);
+        u[i] = dot_vec3(r, e2) * inv_det;
+        v[i] = dot_vec3(r, e1) * inv_det;
+        t[i] = dot_vec3(n, c) * inv_det;
+
+        // See `intersect_ray_tri()`
+        hits[i] =
+            u[i] >= 0 && v[i] >= 0 && u[i] + v[i] <= 1 &&
+            t[i] >= ray->t_min && t[i] <= ray->t_max;
+    }
+}
+
+size_t intersect_ray_tri_block(struct ray* ray, struct hit* hit, const struct tri_block* block, unsigned mask) {
+    real_t t[TRI_BLOCK_SIZE];
+    real_t u[TRI_BLOCK_SIZE];
+    real_t v[TRI_BLOCK_SIZE];
+    bool hits[TRI_BLOCK_SIZE];
+    intersect_ray_tri_block_lanes(ray, block, t, u, v, hits);
+
+    size_t closest = TRI_BLOCK_SIZE;
+    real_t t_closest = ray->t_max;
+    for (size_t i = 0; i < TRI_BLOCK_SIZE; ++i) {
+        if (hits[i] && (mask & (1u << i)) && t[i] <= t_closest) {
+            t_closest = t[i];
+            closest = i;
+        }
+    }
+    if (closest != TRI_BLOCK_SIZE) {
+        ray->t_max = t_closest;
+        hit->uv = make_vec2(u[closest], v[closest]);
+    }
+    return closest;
+}
+
+bool occluded_ray_tri_block(const struct ray* ray, const struct tri_block* block, unsigned mask) {
+    real_t t[TRI_BLOCK_SIZE];
+    real_t u[TRI_BLOCK_SIZE];
+    real_t v[TRI_BLOCK_SIZE];
+    bool hits[TRI_BLOCK_SIZE];
+    intersect_ray_tri_block_lanes(ray, block, t, u, v, hits);
+
+    unsigned hit_mask = 0;
+    for (size_t i = 0; i < TRI_BLOCK_SIZE; ++i)
+        hit_mask |= hits[i] ? 1u << i : 0;
+    return (hit_mask & mask) != 0;
+}
+
+struct watertight_ray make_watertight_ray(const struct ray* ray) {
+    struct vec3 abs_dir = make_vec3(fabs(ray->dir._[0]), fabs(ray->dir._[1]), fabs(ray->dir._[2]));
+    int kz = abs_dir._[0] > abs_dir._[1]
+        ? (abs_dir._[0] > abs_dir._[2] ? 0 : 2)
+        : (abs_dir._[1] > abs_dir._[2] ? 1 : 2);
+    int kx = kz == 2 ? 0 : kz + 1;
+    int ky = kx == 2 ? 0 : kx + 1;
+
+    // Swapping the other two axes preserves the winding order of the triangles
+    if (ray->dir._[kz] < 0) {
+        int tmp = kx;
+        kx = ky;
+        ky = tmp;
+    }
+
+    real_t inv_dir_z = ((real_t)1) / ray->dir._[kz];
+    return (struct watertight_ray) {
+        .org = ray->org,
+        .shear = { ray->dir._[kx] * inv_dir_z, ray->dir._[ky] * inv_dir_z, inv_dir_z },
+        .axes = { kx, ky, kz }
+    };
+}
+
+// Computes the edge functions of a triangle, given its vertices in the space of the ray.
+// The two triangles that share an edge compute the exact opposite of each other's edge function,
+// which is what makes the test watertight. For this reason, these computations must not be fused
+// into multiply-add instructions.
+static inline void compute_edge_functions(
+    real_t ax, real_t ay,
+    real_t bx, real_t by,
+    real_t cx, real_t cy,
+    real_t* u, real_t* v, real_t* w)
+{
+    *u = cx * by - cy * bx;
+    *v = ax * cy - ay * cx;
+    *w = bx * ay - by * ax;
+#ifndef USE_DOUBLE_PRECISION
+    // When the ray goes exactly through an edge in single precision, the
+    // edge functions are recomputed in double precision, which is exact.
+    if (unlikely(*u == 0 || *v == 0 || *w == 0)) {
+        *u = (double)cx * (double)by - (double)cy * (double)bx;
+        *v = (double)ax * (double)cy - (double)ay * (double)cx;
+        *w = (double)bx * (double)ay - (double)by * (double)ax;
+    }
+#endif
+}
+
+bool intersect_ray_tri_watertight(
+    struct ray* ray, struct hit* hit,
+    const struct watertight_ray* watertight_ray,
+    const struct vec3* p0,
+    const struct vec3* p1,
+    const struct vec3* p2)
+{
+    int kx = watertight_ray->axes[0];
+    int ky = watertight_ray->axes[1];
+    int kz = watertight_ray->axes[2];
+    real_t sx = watertight_ray->shear[0];
+    real_t sy = watertight_ray->shear[1];
+    real_t sz = watertight_ray->shear[2];
+
+    struct vec3 a = sub_vec3(*p0, watertight_ray->org);
+    struct vec3 b = sub_vec3(*p1, watertight_ray->org);
+    struct vec3 c = sub_vec3(*p2, watertight_ray->org);
+    real_t ax = a._[kx] - sx * a._[kz];
+    real_t ay = a._[ky] - sy * a._[kz];
+    real_t bx = b._[kx] - sx * b._[kz];
+    real_t by = b._[ky] - sy * b._[kz];
+    real_t cx = c._[kx] - sx * c._[kz];
+    real_t cy = c._[ky] - sy * c._[kz];
+
+    real_t u, v, w;
+    compute_edge_functions(ax, ay, bx, by, cx, cy, &u, &v, &w);
+
+    // Rays hitting the edges are accepted on both sides of the edge. The
+    // determinant is only zero when the triangle is seen from its side.
+    real_t det = u + v + w;
+    if ((u < 0 || v < 0 || w < 0) && (u > 0 || v > 0 || w > 0))
+        return false;
+    if (det == 0)
+        return false;
+
+    real_t inv_det = ((real_t)1) / det;
+    real_t t = (u * a._[kz] + v * b._[kz] + w * c._[kz]) * sz * inv_det;
+    if (t >= ray->t_min && t <= ray->t_max) {
+        ray->t_max = t;
+        hit->uv = make_vec2(v * inv_det, w * inv_det);
+        return true;
+    }
+    return false;
+}
+
+// Same as `intersect_ray_tri_block_lanes()`, for the watertight intersection test. The barycentric
+// coordinates of the intersections are given by `v[i] * inv_det[i]` and `w[i] * inv_det[i]`.
+static inline void intersect_ray_watertight_tri_block_lanes(
+    const struct ray* ray,
+    const struct watertight_ray* watertight_ray,
+    const struct watertight_tri_block* block,
+    real_t* t, real_t* v, real_t* w, real_t* inv_det, bool* hits)
+{
+    int kx = watertight_ray->axes[0];
+    int ky = watertight_ray->axes[1];
+    int kz = watertight_ray->axes[2];
+    real_t sx = watertight_ray->shear[0];
+    real_t sy = watertight_ray->shear[1];
+    real_t sz = watertight_ray->shear[2];
+    real_t ox = watertight_ray->org._[kx];
+    real_t oy = watertight_ray->org._[ky];
+    real_t oz = watertight_ray->org._[kz];
+
+    real_t ax[TRI_BLOCK_SIZE], ay[TRI_BLOCK_SIZE], az[TRI_BLOCK_SIZE];
+    real_t bx[TRI_BLOCK_SIZE], by[TRI_BLOCK_SIZE], bz[TRI_BLOCK_SIZE];
+    real_t cx[TRI_BLOCK_SIZE], cy[TRI_BLOCK_SIZE], cz[TRI_BLOCK_SIZE];
+    real_t u[TRI_BLOCK_SIZE];
+
+    // See `intersect_ray_tri_watertight()`. These loops have no branches, so that they can be vectorized.
+    for (size_t i = 0; i < TRI_BLOCK_SIZE; ++i) {
+        az[i] = block->p0[kz][i] - oz;
+        bz[i] = block->p1[kz][i] - oz;
+        cz[i] = block->p2[kz][i] - oz;
+        ax[i] = (block->p0[kx][i] - ox) - sx * az[i];
+        ay[i] = (block->p0[ky][i] - oy) - sy * az[i];
+        bx[i] = (block->p1[kx][i] - ox) - sx * bz[i];
+        by[i] = (block->p1[ky][i] - oy) - sy * bz[i];
+        cx[i] = (block->p2[kx][i] - ox) - sx * cz[i];
+        cy[i] = (block->p2[ky][i] - oy) - sy * cz[i];
+        u[i] = cx[i] * by[i] - cy[i] * bx[i];
+        v[i] = ax[i] * cy[i] - ay[i] * cx[i];
+        w[i] = bx[i] * ay[i] - by[i] * ax[i];
+    }
+
+#ifndef USE_DOUBLE_PRECISION
+    for (size_t i = 0; i < TRI_BLOCK_SIZE; ++i) {
+        if (unlikely(u[i] == 0 || v[i] == 0 || w[i] == 0))
+            compute_edge_functions(ax[i], ay[i], bx[i], by[i], cx[i], cy[i], &u[i], &v[i], &w[i]);
+    }
+#endif
+
+    for (size_t i = 0; i < TRI_BLOCK_SIZE; ++i) {
+        real_t det = u[i] + v[i] + w[i];
+        inv_det[i] = ((real_t)1) / det;
+        t[i] = (u[i] * az[i] + v[i] * bz[i] + w[i] * cz[i]) * sz * inv_det[i];
+        hits[i] =
+            ((u[i] >= 0 && v[i] >= 0 && w[i] >= 0) || (u[i] <= 0 && v[i] <= 0 && w[i] <= 0)) &&
+            det != 0 && t[i] >= ray->t_min && t[i] <= ray->t_max;
+    }
+}
+
+size_t intersect_ray_watertight_tri_block(
+    struct ray* ray, struct hit* hit,
+    const struct watertight_ray* watertight_ray,
+    const struct watertight_tri_block* block,
+    unsigned mask)
+{
+    real_t t[TRI_BLOCK_SIZE], v[TRI_BLOCK_SIZE], w[TRI_BLOCK_SIZE], inv_det[TRI_BLOCK_SIZE];
+    bool hits[TRI_BLOCK_SIZE];
+    intersect_ray_watertight_tri_block_lanes(ray, watertight_ray, block, t, v, w, inv_det, hits);
+
+    size_t closest = TRI_BLOCK_SIZE;
+    real_t t_closest = ray->t_max;
+    for (size_t i = 0; i < TRI_BLOCK_SIZE; ++i) {
+        if (hits[i] && (mask & (1u << i)) && t[i] <= t_closest) {
+            t_closest = t[i];
+            closest = i;
+        }
+    }
+    if (closest != TRI_BLOCK_SIZE) {
+        ray->t_max = t_closest;
+        hit->uv = make_vec2(v[closest] * inv_det[closest], w[closest] * inv_det[closest]);
+    }
+    return closest;
+}
+
+bool occluded_ray_watertight_tri_block(
+    const struct ray* ray,
+    const struct watertight_ray* watertight_ray,
+    const struct watertight_tri_block* block,
+    unsigned mask)
+{
+    real_t t[TRI_BLOCK_SIZE], v[TRI_BLOCK_SIZE], w[TRI_BLOCK_SIZE], inv_det[TRI_BLOCK_SIZE];
+    bool hits[TRI_BLOCK_SIZE];
+    intersect_ray_watertight_tri_block_lanes(ray, watertight_ray, block, t, v, w, inv_det, hits);
+
+    unsigned hit_mask = 0;
+    for (size_t i = 0; i < TRI_BLOCK_SIZE; ++i)
+        hit_mask |= hits[i] ? 1u << i : 0;
+    return (hit_mask & mask) != 0;
+}
+
+ray_mask_t intersect_ray_packet_tri(struct ray_packet* packet, struct hit* hits, ray_mask_t mask, const struct tri* tri) {
+    real_t t[MAX_RAY_PACKET_SIZE];
+    real_t u[MAX_RAY_PACKET_SIZE];
+    real_t v[MAX_RAY_PACKET_SIZE];
+    bool hit[MAX_RAY_PACKET_SIZE];
+
+    // This loop has no branches, so that it can be vectorized across rays
+    for (size_t i = 0, n = packet->size; i < n; ++i) {
+        struct vec3 org = make_vec3(packet->org[0][i], packet->org[1][i], packet->org[2][i]);
+        struct vec3 dir = make_vec3(packet->dir[0][i], packet->dir[1][i], packet->dir[2][i]);
+        struct vec3 c = sub_vec3(tri->p0, org);
+        struct vec3 r = cross_vec3(dir, c);
+
+        real_t inv_det = ((real_t)1) / dot_vec3(tri->n, dir);
+        u[i] = dot_vec3(r, tri->e2) * inv_det;
+        v[i] = dot_vec3(r, tri->e1) * inv_det;
+        t[i] = dot_vec3(tri->n, c) * inv_det;
+
+        // See `intersect_ray_tri()`
+        hit[i] =
+            u[i] >= 0 && v[i] >= 0 && u[i] + v[i] <= 1 &&
+            t[i] >= packet->t_min[i] && t[i] <= packet->t_max[i];
+    }
+
+    ray_mask_t hit_mask = 0;
+    for (size_t i = 0, n = packet->size; i < n; ++i)
+        hit_mask |= hit[i] ? ((ray_mask_t)1) << i : 0;
+    hit_mask &= mask;
+
+    for (size_t i = 0, n = packet->size; i < n; ++i) {
+        if (hit_mask & (((ray_mask_t)1) << i)) {
+            packet->t_max[i] = t[i];
+            hits[i].uv = make_vec2(u[i], v[i]);
+        }
+    }
+    return hit_mask;
+}
@@ -32,6 +32,103 @@ static inline struct vec3 get_tri_p2(const struct tri* tri) {
     return add_vec3(tri->p0, tri->e2);
 }
 
+// Number of triangles in a block of triangles.
+#define TRI_BLOCK_SIZE 4
+
+// Block of triangles stored in SoA layout, so that all of them can be intersected at once with SIMD instructions.
+struct tri_block {
+    real_t p0[3][TRI_BLOCK_SIZE];
+    real_t e1[3][TRI_BLOCK_SIZE];
+    real_t e2[3][TRI_BLOCK_SIZE];
+    real_t n[3][TRI_BLOCK_SIZE];
+};
+
+static inline void set_tri_block_lane(struct tri_block* block, size_t lane, const struct tri* tri) {
+    for (int i = 0; i < 3; ++i) {
+        block->p0[i][lane] = tri->p0._[i];
+        block->e1[i][lane] = tri->e1._[i];
+        block->e2[i][lane] = tri->e2._[i];
+        block->n [i][lane] = tri->n._[i];
+    }
+}
+
+static inline struct tri get_tri_block_lane(const struct tri_block* block, size_t lane) {
+    return (struct tri) {
+        .p0 = make_vec3(block->p0[0][lane], block->p0[1][lane], block->p0[2][lane]),
+        .e1 = make_vec3(block->e1[0][lane], block->e1[1][lane], block->e1[2][lane]),
+        .e2 = make_vec3(block->e2[0][lane], block->e2[1][lane], block->e2[2][lane]),
+        .n  = make_vec3(block->n [0][lane], block->n [1][lane], block->n [2][lane])
+    };
+}
+
+// Ray transformed for the watertight intersection test: the vertices of the triangles are translated
+// and sheared so that the ray starts at the origin and goes along the Z axis, with the axes permuted so that
+// Z is the dominant axis of the ray direction.
+struct watertight_ray {
+    struct vec3 org;
+    real_t shear[3];
+    int axes[3];
+};
+
+// Block of triangles stored in SoA layout, for the watertight intersection test. The vertices are
+// stored as-is, since reconstructing them from the edges would break the watertightness of the test.
+struct watertight_tri_block {
+    real_t p0[3][TRI_BLOCK_SIZE];
+    real_t p1[3][TRI_BLOCK_SIZE];
+    real_t p2[3][TRI_BLOCK_SIZE];
+};
+
+static inline void set_watertight_tri_block_lane(
+    struct watertight_tri_block* block, size_t lane,
+    const struct vec3* p0,
+    const struct vec3* p1,
+    const struct vec3* p2)
+{
+    for (int i = 0; i < 3; ++i) {
+        block->p0[i][lane] = p0->_[i];
+        block->p1[i][lane] = p1->_[i];
+        block->p2[i][lane] = p2->_[i];
+    }
+}
+
 bool intersect_ray_tri(struct ray* ray, struct hit*, const struct tri* tri);
 
+struct watertight_ray make_watertight_ray(const struct ray* ray);
+
+// Watertight ray-triangle intersection test, described in "Watertight Ray/Triangle Intersection",
+// by S. Woop et al. Rays going through an edge or vertex shared by several triangles always hit at
+// least one of them, unlike with `intersect_ray_tri()`, which is slightly faster.
+bool intersect_ray_tri_watertight(
+    struct ray* ray, struct hit*,
+    const struct watertight_ray* watertight_ray,
+    const struct vec3* p0,
+    const struct vec3* p1,
+    const struct vec3* p2);
+
+// Intersects the triangles of a block whose bit is set in `mask` with a ray. Returns the index of
+// the triangle with the closest intersection in the block, or `TRI_BLOCK_SIZE` if there is none.
+size_t intersect_ray_tri_block(struct ray* ray, struct hit*, const struct tri_block* block, unsigned mask);
+
+// Same as `intersect_ray_tri_block()`, using the watertight intersection test.
+size_t intersect_ray_watertight_tri_block(
+    struct ray* ray, struct hit*,
+    const struct watertight_ray* watertight_ray,
+    const struct watertight_tri_block* block,
+    unsigned mask);
+
+// Returns true if the ray intersects one of the triangles of a block whose bit is set in `mask`,
+// between `ray->t_min` and `ray->t_max`. Used for occlusion queries, which do not need hit data.
+bool occluded_ray_tri_block(const struct ray* ray, const struct tri_block* block, unsigned mask);
+
+// Same as `occluded_ray_tri_block()`, using the watertight intersection test.
+bool occluded_ray_watertight_tri_block(
+    const struct ray* ray,
+    const struct watertight_ray* watertight_ray,
+    const struct watertight_tri_block* block,
+    unsigned mask);
+
+// Intersects a triangle with the rays of a packet whose bit is set in `mask`.
+// Returns the mask of the rays that intersect the triangle.
+ray_mask_t intersect_ray_packet_tri(struct ray_packet*, struct hit* hits, ray_mask_t mask, const struct tri* tri);
+
 #endif
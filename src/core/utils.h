@@ -117,6 +117,14 @@ static inline size_t round_up(size_t i, size_t j) {
     return i / j + (i % j ? 1 : 0);
 }
 
+static inline size_t min_size_t(size_t i, size_t j) {
+    return i < j ? i : j;
+}
+
+static inline size_t max_size_t(size_t i, size_t j) {
+    return i > j ? i : j;
+}
+
 static inline char* copy_str_n(const char* p, size_t n) {
     char* q = xmalloc(n + 1);
     memcpy(q, p, n);
@@ -1,5 +1,6 @@
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 
 #include "scene/scene.h"
 #include "scene/camera.h"
@@ -54,7 +55,21 @@ int main(int argc, char** argv) {
         fprintf(stderr, "Cannot load OBJ model");
         goto cleanup;
     }
-    geometry = new_mesh_geometry(scene, mesh);
+    // Setting this environment variable enables the on-disk BVH cache
+    struct mesh_accel_params accel_params = default_mesh_accel_params();
+    accel_params.cache_dir = getenv("RT_BVH_CACHE_DIR");
+    // Setting this one reads triangles from the mesh instead of copying them, which saves memory
+    if (getenv("RT_INDEXED_TRIS"))
+        accel_params.tri_storage = INDEXED_TRI_STORAGE;
+    // This one selects a wide BVH layout, which is faster for incoherent rays
+    const char* bvh_layout = getenv("RT_BVH_LAYOUT");
+    if (bvh_layout && !strcmp(bvh_layout, "bvh4"))
+        accel_params.bvh_layout = WIDE_BVH4;
+    else if (bvh_layout && !strcmp(bvh_layout, "bvh8"))
+        accel_params.bvh_layout = WIDE_BVH8;
+    else if (bvh_layout && !strcmp(bvh_layout, "cbvh8"))
+        accel_params.bvh_layout = COMPRESSED_BVH8;
+    geometry = new_mesh_geometry(scene, mesh, &accel_params);
     prepare_geometry(geometry, thread_pool);
 
     render_debug_fn(thread_pool, &(struct render_params) {
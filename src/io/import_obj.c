@@ -72,9 +72,9 @@ static struct mesh* build_mesh_from_obj_model(const struct obj_model* model) {
     bool has_normals = false, has_tex_coords = false;
     size_t vertex_count = compute_unique_vertices(model, index_table, &has_normals, &has_tex_coords);
 
-    // TODO: Debug this
-    //bool should_use_quads = sizeof(struct quad) * quad_count <= sizeof(struct tri) * tri_count;
-    bool should_use_quads = false;
+    // Quads are used when they take less memory than triangles, which is the case when most faces have
+    // four vertices or more. This also reduces the number of primitives in the BVH and the number of leaf tests.
+    bool should_use_quads = sizeof(struct quad) * quad_count <= sizeof(struct tri) * tri_count;
     size_t attr_count = has_tex_coords ? ARRAY_SIZE(obj_attr_bindings) : ARRAY_SIZE(obj_attr_bindings) - 1;
     struct mesh* mesh = new_mesh(
         should_use_quads ? QUAD_MESH : TRI_MESH,
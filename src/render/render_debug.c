@@ -4,6 +4,13 @@
 #include "core/random.h"
 #include "scene/image.h"
 
+// Width and height of the blocks of pixels that are traced as one packet
+#define PACKET_BLOCK_SIZE 4
+
+// Width and height of the tiles that threads claim one at a time, a multiple of the packet block size.
+// The cost of tiles varies a lot, so small tiles that are dynamically scheduled balance the load best.
+#define TILE_SIZE 16
+
 struct tile_task {
     struct parallel_task_2d task;
     const struct render_params* render_params;
@@ -20,20 +27,37 @@ static void run_tile_task(struct parallel_task_2d* task, size_t thread_id) {
 
     uint64_t seed = random_seed(task->range[0].begin, task->range[1].begin, render_params->frame_index);
     struct rnd_gen rnd_gen = make_rnd_gen(seed);
-    for (size_t i = task->range[1].begin, n = task->range[1].end; i < n; ++i) {
-        for (size_t j = task->range[0].begin, m = task->range[0].end; j < m; ++j) {
-            struct vec2 offset = random_vec2_01(&rnd_gen);
-            struct vec2 xy = image_to_camera(j, i, target_image->width, target_image->height, &offset);
-            struct ray ray = camera->generate_ray(camera, &xy);
-            struct hit hit = empty_hit();
-
-            struct rgb color = black;
-            if (intersect_ray_geometry(&ray, &hit, geometry, false)) {
-                struct vec3 normal = normalize_vec3(get_geometry_attr(geometry, ATTR_SHADING_NORMAL, &ray, &hit).vec3);
-                real_t intensity = fabs(dot_vec3(normal, ray.dir));
-                color = gray(intensity);
+
+    // Camera rays are traced in packets that cover square blocks of pixels, since they are coherent
+    for (size_t i = task->range[1].begin, n = task->range[1].end; i < n; i += PACKET_BLOCK_SIZE) {
+        for (size_t j = task->range[0].begin, m = task->range[0].end; j < m; j += PACKET_BLOCK_SIZE) {
+            struct ray_packet packet = { .size = 0 };
+            struct hit hits[MAX_RAY_PACKET_SIZE];
+            size_t pixels[MAX_RAY_PACKET_SIZE][2];
+            for (size_t y = i, y_end = min_size_t(i + PACKET_BLOCK_SIZE, n); y < y_end; ++y) {
+                for (size_t x = j, x_end = min_size_t(j + PACKET_BLOCK_SIZE, m); x < x_end; ++x) {
+                    struct vec2 offset = random_vec2_01(&rnd_gen);
+                    struct vec2 xy = image_to_camera(x, y, target_image->width, target_image->height, &offset);
+                    struct ray ray = camera->generate_ray(camera, &xy);
+                    set_packet_ray(&packet, packet.size, &ray);
+                    hits[packet.size] = empty_hit();
+                    pixels[packet.size][0] = x;
+                    pixels[packet.size][1] = y;
+                    packet.size++;
+                }
+            }
+
+            ray_mask_t hit_mask = intersect_ray_packet_geometry(&packet, hits, full_ray_mask(packet.size), geometry, false);
+            for (size_t k = 0; k < packet.size; ++k) {
+                struct rgb color = black;
+                if (hit_mask & (((ray_mask_t)1) << k)) {
+                    struct ray ray = get_packet_ray(&packet, k);
+                    struct vec3 normal = normalize_vec3(get_geometry_attr(geometry, ATTR_SHADING_NORMAL, &ray, &hits[k]).vec3);
+                    real_t intensity = fabs(dot_vec3(normal, ray.dir));
+                    color = gray(intensity);
+                }
+                set_rgb_pixel(target_image, pixels[k][0], pixels[k][1], &color);
             }
-            set_rgb_pixel(target_image, j, i, &color);
         }
     }
 }
@@ -42,7 +66,7 @@ static void render_debug(
     struct thread_pool* thread_pool,
     const struct render_params* render_params)
 {
-    parallel_for_2d(
+    parallel_for_2d_scheduled(
         thread_pool,
         run_tile_task,
         (struct parallel_task_2d*)&(struct tile_task) {
@@ -52,7 +76,9 @@ static void render_debug(
         (struct range[2]) {
             { render_params->viewport.x_min, render_params->viewport.x_max },
             { render_params->viewport.y_min, render_params->viewport.y_max }
-        });
+        },
+        DYNAMIC_SCHEDULE,
+        (size_t[2]) { TILE_SIZE, TILE_SIZE });
 }
 
 render_fn_t render_debug_fn = render_debug;
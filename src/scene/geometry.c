@@ -1,15 +1,36 @@
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+
 #include "scene/geometry.h"
 #include "accel/accel.h"
 #include "core/mem_pool.h"
 #include "core/utils.h"
 #include "core/hash.h"
+#include "core/ray_sort.h"
+#include "core/thread_pool.h"
+#include "core/bbox.h"
+#include "core/mat4x3.h"
+#include "accel/bvh.h"
+
+// Number of rays that are traced together by `intersect_rays_geometry()`
+#define RAY_STREAM_SIZE 1024
+
+// Cost of traversing a node of the top-level BVH of a group, relative to the cost of
+// intersecting an instance. Instances are expensive, since they contain a whole BVH.
+#define INSTANCE_TRAVERSAL_COST 0.1
 
 struct geometry {
     struct scene_node node;
 
     void (*prepare)(geometry_t, struct thread_pool*);
+    void (*update)(geometry_t, struct thread_pool*);
     bool (*intersect_ray)(geometry_t, struct ray*, struct hit*, bool any);
+    ray_mask_t (*intersect_ray_packet)(geometry_t, struct ray_packet*, struct hit*, ray_mask_t, bool any);
+    void (*intersect_ray_stream)(geometry_t, struct ray*, struct hit*, const size_t*, size_t, bool any);
+    bool (*occluded_ray)(geometry_t, const struct ray*);
     union attr (*get_attr)(geometry_t, unsigned, const struct ray*, const struct hit*);
+    struct bbox (*get_bbox)(geometry_t);
     struct surface_sample (*sample_surface)(geometry_t, const struct vec2*);
     real_t (*get_surface_area)(geometry_t);
 };
@@ -18,14 +39,127 @@ void prepare_geometry(geometry_t geometry, struct thread_pool* thread_pool) {
     geometry->prepare(geometry, thread_pool);
 }
 
+void update_geometry(geometry_t geometry, struct thread_pool* thread_pool) {
+    geometry->update(geometry, thread_pool);
+}
+
 bool intersect_ray_geometry(struct ray* ray, struct hit* hit, geometry_t geometry, bool any) {
     return geometry->intersect_ray(geometry, ray, hit, any);
 }
 
+ray_mask_t intersect_ray_packet_geometry(struct ray_packet* packet, struct hit* hits, ray_mask_t mask, geometry_t geometry, bool any) {
+    return geometry->intersect_ray_packet(geometry, packet, hits, mask, any);
+}
+
+bool occluded_ray_geometry(const struct ray* ray, geometry_t geometry) {
+    return geometry->occluded_ray(geometry, ray);
+}
+
+struct ray_stream_task {
+    struct parallel_task_1d task;
+    geometry_t geometry;
+    struct ray* rays;
+    struct hit* hits;
+    bool any;
+};
+
+static void run_ray_stream_task(struct parallel_task_1d* task, size_t thread_id) {
+    IGNORE(thread_id);
+    struct ray_stream_task* ray_stream_task = (void*)task;
+    size_t stream_ids[RAY_STREAM_SIZE];
+    for (size_t i = 0; i < RAY_STREAM_SIZE; ++i)
+        stream_ids[i] = i;
+    for (size_t i = task->range.begin, n = task->range.end; i < n; i += RAY_STREAM_SIZE) {
+        ray_stream_task->geometry->intersect_ray_stream(
+            ray_stream_task->geometry,
+            ray_stream_task->rays + i,
+            ray_stream_task->hits + i,
+            stream_ids, min_size_t(n - i, RAY_STREAM_SIZE),
+            ray_stream_task->any);
+    }
+}
+
+void intersect_rays_geometry(
+    geometry_t geometry,
+    struct ray* rays, struct hit* hits,
+    size_t count, bool any,
+    struct thread_pool* thread_pool)
+{
+    if (count == 0)
+        return;
+    size_t* ray_ids = sort_rays(thread_pool, rays, count);
+    struct ray* sorted_rays = xmalloc(sizeof(struct ray) * count);
+    struct hit* sorted_hits = xmalloc(sizeof(struct hit) * count);
+    gather_rays(rays, hits, ray_ids, sorted_rays, sorted_hits, count);
+    parallel_for_1d(
+        thread_pool,
+        run_ray_stream_task,
+        (struct parallel_task_1d*)&(struct ray_stream_task) {
+            .geometry = geometry,
+            .rays     = sorted_rays,
+            .hits     = sorted_hits,
+            .any      = any
+        },
+        sizeof(struct ray_stream_task),
+        &(struct range) { 0, count });
+    scatter_hits(sorted_rays, sorted_hits, ray_ids, rays, hits, count);
+    free(sorted_hits);
+    free(sorted_rays);
+    free(ray_ids);
+}
+
+struct occlusion_task {
+    struct parallel_task_1d task;
+    geometry_t geometry;
+    const struct ray* sorted_rays;
+    const size_t* ray_ids;
+    bool* occluded;
+};
+
+static void run_occlusion_task(struct parallel_task_1d* task, size_t thread_id) {
+    IGNORE(thread_id);
+    struct occlusion_task* occlusion_task = (void*)task;
+    geometry_t geometry = occlusion_task->geometry;
+    for (size_t i = task->range.begin, n = task->range.end; i < n; ++i) {
+        occlusion_task->occluded[occlusion_task->ray_ids[i]] =
+            geometry->occluded_ray(geometry, &occlusion_task->sorted_rays[i]);
+    }
+}
+
+void occluded_rays_geometry(
+    geometry_t geometry,
+    const struct ray* rays, bool* occluded,
+    size_t count,
+    struct thread_pool* thread_pool)
+{
+    if (count == 0)
+        return;
+    size_t* ray_ids = sort_rays(thread_pool, rays, count);
+    struct ray* sorted_rays = xmalloc(sizeof(struct ray) * count);
+    gather_rays(rays, NULL, ray_ids, sorted_rays, NULL, count);
+    parallel_for_1d(
+        thread_pool,
+        run_occlusion_task,
+        (struct parallel_task_1d*)&(struct occlusion_task) {
+            .geometry    = geometry,
+            .sorted_rays = sorted_rays,
+            .ray_ids     = ray_ids,
+            .occluded    = occluded
+        },
+        sizeof(struct occlusion_task),
+        &(struct range) { 0, count });
+    free(sorted_rays);
+    free(ray_ids);
+}
+
 union attr get_geometry_attr(geometry_t geometry, unsigned attr_index, const struct ray* ray, const struct hit* hit) {
     return geometry->get_attr(geometry, attr_index, ray, hit);
 }
 
+struct bbox get_geometry_bbox(geometry_t geometry) {
+    return geometry->get_bbox(geometry);
+}
+
 struct surface_sample sample_geometry_surface(geometry_t geometry, const struct vec2* uv) {
     return geometry->sample_surface(geometry, uv);
 }
@@ -38,17 +172,71 @@ struct submesh_geometry {
     struct geometry geometry;
     const struct mesh* mesh;
     size_t begin, end;
+    struct mesh_accel_params accel_params;
     struct accel* accel;
+    struct bbox bbox;
 };
 
-geometry_t new_mesh_geometry(struct scene* scene, const struct mesh* mesh) {
-    return new_submesh_geometry(scene, mesh, 0, mesh->primitive_count);
+geometry_t new_mesh_geometry(struct scene* scene, const struct mesh* mesh, const struct mesh_accel_params* params) {
+    return new_submesh_geometry(scene, mesh, 0, mesh->primitive_count, params);
+}
+
+static struct bbox compute_submesh_bbox(const struct submesh_geometry* submesh_geometry) {
+    const struct mesh* mesh = submesh_geometry->mesh;
+    const struct vec3* vertices = mesh->attrs[ATTR_POSITION].data;
+    size_t index_stride = mesh->type == TRI_MESH ? 3 : 4;
+    struct bbox bbox = empty_bbox();
+    for (size_t i = submesh_geometry->begin * index_stride, n = submesh_geometry->end * index_stride; i < n; ++i)
+        bbox = extend_bbox(bbox, vertices[mesh->indices[i]]);
+    return bbox;
+}
+
+// Loads the acceleration data structure from the cache if possible, otherwise builds it and saves it in the cache.
+static struct accel* load_or_build_mesh_accel(
+    const struct submesh_geometry* submesh_geometry,
+    struct thread_pool* thread_pool)
+{
+    const struct mesh_accel_params* params = &submesh_geometry->accel_params;
+    const struct mesh* mesh = submesh_geometry->mesh;
+    size_t begin = submesh_geometry->begin, end = submesh_geometry->end;
+    if (!params->cache_dir)
+        return build_mesh_accel(thread_pool, mesh, begin, end, params);
+
+    uint64_t key = hash_mesh_accel_input(thread_pool, mesh, begin, end, params);
+    size_t file_name_size = strlen(params->cache_dir) + 22;
+    char* file_name = xmalloc(file_name_size);
+    snprintf(file_name, file_name_size, "%s/%016"PRIx64".bvh", params->cache_dir, key);
+    struct accel* accel = load_mesh_accel(thread_pool, file_name, key, mesh, begin, params);
+    if (!accel) {
+        accel = build_mesh_accel(thread_pool, mesh, begin, end, params);
+        if (!save_mesh_accel(accel, file_name, key, mesh))
+            fprintf(stderr, "Cannot save BVH to '%s'\n", file_name);
+    }
+    free(file_name);
+    return accel;
 }
 
 static void prepare_submesh_geometry(geometry_t geometry, struct thread_pool* thread_pool) {
     struct submesh_geometry* submesh_geometry = (void*)geometry;
-    submesh_geometry->accel = build_mesh_accel(
+    if (submesh_geometry->accel) {
+        // Geometries can be shared by several instances, in which case they are only prepared once
+        return;
+    }
+
+    submesh_geometry->bbox = compute_submesh_bbox(submesh_geometry);
+    submesh_geometry->accel = load_or_build_mesh_accel(submesh_geometry, thread_pool);
+}
+
+static void update_submesh_geometry(geometry_t geometry, struct thread_pool* thread_pool) {
+    struct submesh_geometry* submesh_geometry = (void*)geometry;
+    if (!submesh_geometry->accel) {
+        prepare_submesh_geometry(geometry, thread_pool);
+        return;
+    }
+    submesh_geometry->bbox = compute_submesh_bbox(submesh_geometry);
+    update_mesh_accel(
         thread_pool,
+        submesh_geometry->accel,
         submesh_geometry->mesh,
         submesh_geometry->begin,
         submesh_geometry->end);
@@ -60,6 +248,32 @@ static bool intersect_submesh_geometry_ray(geometry_t geometry, struct ray* ray,
     return intersect_ray_accel(ray, hit, submesh_geometry->accel, any);
 }
 
+static ray_mask_t intersect_submesh_geometry_ray_packet(
+    geometry_t geometry,
+    struct ray_packet* packet, struct hit* hits,
+    ray_mask_t mask, bool any)
+{
+    struct submesh_geometry* submesh_geometry = (void*)geometry;
+    assert(submesh_geometry->accel);
+    return intersect_ray_packet_accel(packet, hits, mask, submesh_geometry->accel, any);
+}
+
+static void intersect_submesh_geometry_ray_stream(
+    geometry_t geometry,
+    struct ray* rays, struct hit* hits,
+    const size_t* ray_ids, size_t ray_count, bool any)
+{
+    struct submesh_geometry* submesh_geometry = (void*)geometry;
+    assert(submesh_geometry->accel);
+    intersect_ray_stream_accel(rays, hits, ray_ids, ray_count, submesh_geometry->accel, any);
+}
+
+static bool occluded_submesh_geometry_ray(geometry_t geometry, const struct ray* ray) {
+    struct submesh_geometry* submesh_geometry = (void*)geometry;
+    assert(submesh_geometry->accel);
+    return occluded_ray_accel(ray, submesh_geometry->accel);
+}
+
 static union attr get_submesh_geometry_attr(
     geometry_t geometry, unsigned attr_index,
     const struct ray* ray, const struct hit* hit)
@@ -73,6 +287,12 @@ static union attr get_submesh_geometry_attr(
         &hit->uv);
 }
 
+static struct bbox get_submesh_geometry_bbox(geometry_t geometry) {
+    struct submesh_geometry* submesh_geometry = (void*)geometry;
+    assert(submesh_geometry->accel);
+    return submesh_geometry->bbox;
+}
+
 static struct surface_sample sample_submesh_geometry_surface(geometry_t geometry, const struct vec2* uv) {
     // TODO
     IGNORE(geometry);
@@ -93,10 +313,15 @@ static real_t get_submesh_geometry_surface_area(geometry_t geometry) {
 static uint32_t hash_submesh_geometry(const struct scene_node* node) {
     assert(node->type == SUBMESH_GEOMETRY);
     struct submesh_geometry* submesh_geometry = (void*)node;
-    return hash_uint(hash_uint(hash_ptr(hash_init(),
+    return hash_bytes(hash_uint(hash_uint(hash_uint(hash_uint(hash_uint(hash_uint(hash_ptr(hash_init(),
         submesh_geometry->mesh),
         submesh_geometry->begin),
-        submesh_geometry->end);
+        submesh_geometry->end),
+        (uint32_t)submesh_geometry->accel_params.bvh_layout),
+        (uint32_t)submesh_geometry->accel_params.bvh_builder),
+        (uint32_t)submesh_geometry->accel_params.tri_intersection),
+        (uint32_t)submesh_geometry->accel_params.tri_storage),
+        &submesh_geometry->accel_params.bvh_optimization_time, sizeof(double));
 }
 
 static bool compare_submesh_geometry(const struct scene_node* left, const struct scene_node* right) {
@@ -106,15 +331,24 @@ static bool compare_submesh_geometry(const struct scene_node* left, const struct
     return
         left_submesh_geometry->mesh  == right_submesh_geometry->mesh &&
         left_submesh_geometry->begin == right_submesh_geometry->begin &&
-        left_submesh_geometry->end   == right_submesh_geometry->end;
+        left_submesh_geometry->end   == right_submesh_geometry->end &&
+        left_submesh_geometry->accel_params.bvh_layout  == right_submesh_geometry->accel_params.bvh_layout &&
+        left_submesh_geometry->accel_params.bvh_builder == right_submesh_geometry->accel_params.bvh_builder &&
+        left_submesh_geometry->accel_params.tri_intersection == right_submesh_geometry->accel_params.tri_intersection &&
+        left_submesh_geometry->accel_params.tri_storage == right_submesh_geometry->accel_params.tri_storage &&
+        left_submesh_geometry->accel_params.bvh_optimization_time == right_submesh_geometry->accel_params.bvh_optimization_time;
 }
 
 static void cleanup_submesh_geometry(struct scene_node* node) {
     struct submesh_geometry* submesh_geometry  = (void*)node;
-    free_accel(submesh_geometry->accel);
+    if (submesh_geometry->accel)
+        free_accel(submesh_geometry->accel);
 }
 
-geometry_t new_submesh_geometry(struct scene* scene, const struct mesh* mesh, size_t begin, size_t end) {
+geometry_t new_submesh_geometry(
+    struct scene* scene, const struct mesh* mesh, size_t begin, size_t end,
+    const struct mesh_accel_params* params)
+{
     struct submesh_geometry submesh_geometry = {
         .geometry = {
             .node = {
@@ -123,17 +357,404 @@ geometry_t new_submesh_geometry(struct scene* scene, const struct mesh* mesh, si
                 .compare = compare_submesh_geometry,
                 .cleanup = cleanup_submesh_geometry
             },
-            .prepare          = prepare_submesh_geometry,
-            .intersect_ray    = intersect_submesh_geometry_ray,
-            .get_attr         = get_submesh_geometry_attr,
-            .sample_surface   = sample_submesh_geometry_surface,
-            .get_surface_area = get_submesh_geometry_surface_area
+            .prepare              = prepare_submesh_geometry,
+            .update               = update_submesh_geometry,
+            .intersect_ray        = intersect_submesh_geometry_ray,
+            .intersect_ray_packet = intersect_submesh_geometry_ray_packet,
+            .intersect_ray_stream = intersect_submesh_geometry_ray_stream,
+            .occluded_ray         = occluded_submesh_geometry_ray,
+            .get_attr             = get_submesh_geometry_attr,
+            .get_bbox             = get_submesh_geometry_bbox,
+            .sample_surface       = sample_submesh_geometry_surface,
+            .get_surface_area     = get_submesh_geometry_surface_area
         },
         .mesh = mesh,
         .begin = begin,
-        .end = end
+        .end = end,
+        .accel_params = params ? *params : default_mesh_accel_params()
     };
     return (geometry_t)insert_scene_node(scene,
         &submesh_geometry.geometry.node,
         sizeof(submesh_geometry));
 }
+
+struct group_geometry {
+    struct geometry geometry;
+    const struct instance* instances;
+    const struct mat4x3* inverse_transforms; // World-to-object transformations
+    size_t instance_count;
+    struct bvh* bvh;
+    struct bbox bbox;
+};
+
+static struct bbox get_instance_bbox(void* primitive_data, size_t index) {
+    return ((const struct bbox*)primitive_data)[index];
+}
+
+static struct vec3 get_instance_center(void* primitive_data, size_t index) {
+    const struct bbox* bbox = &((const struct bbox*)primitive_data)[index];
+    return scale_vec3(add_vec3(bbox->min, bbox->max), 0.5);
+}
+
+static struct bbox transform_bbox(const struct mat4x3* transform, const struct bbox* bbox) {
+    struct bbox transformed_bbox = empty_bbox();
+    for (int i = 0; i < 8; ++i) {
+        struct vec3 corner = make_vec3(
+            (i & 1) ? bbox->max._[0] : bbox->min._[0],
+            (i & 2) ? bbox->max._[1] : bbox->min._[1],
+            (i & 4) ? bbox->max._[2] : bbox->min._[2]);
+        transformed_bbox = extend_bbox(transformed_bbox, transform_point(*transform, corner));
+    }
+    return transformed_bbox;
+}
+
+static struct bbox compute_instance_bbox(const struct instance* instance) {
+    struct bbox bbox = get_geometry_bbox(instance->geometry);
+    return transform_bbox(&instance->transform, &bbox);
+}
+
+static void prepare_group_geometry(geometry_t geometry, struct thread_pool* thread_pool) {
+    struct group_geometry* group_geometry = (void*)geometry;
+    if (group_geometry->bvh || group_geometry->instance_count == 0)
+        return;
+
+    // Instanced geometries are shared: each of them is only prepared once
+    for (size_t i = 0, n = group_geometry->instance_count; i < n; ++i)
+        prepare_geometry(group_geometry->instances[i].geometry, thread_pool);
+
+    struct bbox* instance_bboxes = xmalloc(sizeof(struct bbox) * group_geometry->instance_count);
+    group_geometry->bbox = empty_bbox();
+    for (size_t i = 0, n = group_geometry->instance_count; i < n; ++i) {
+        instance_bboxes[i] = compute_instance_bbox(&group_geometry->instances[i]);
+        group_geometry->bbox = union_bbox(group_geometry->bbox, instance_bboxes[i]);
+    }
+    group_geometry->bvh = build_bvh(
+        thread_pool, instance_bboxes,
+        get_instance_bbox,
+        get_instance_center,
+        group_geometry->instance_count,
+        INSTANCE_TRAVERSAL_COST);
+    free(instance_bboxes);
+}
+
+static int compare_geometry_ptrs(const void* left, const void* right) {
+    uintptr_t left_ptr  = (uintptr_t)*(const geometry_t*)left;
+    uintptr_t right_ptr = (uintptr_t)*(const geometry_t*)right;
+    return left_ptr < right_ptr ? -1 : (left_ptr > right_ptr ? 1 : 0);
+}
+
+static void update_group_geometry(geometry_t geometry, struct thread_pool* thread_pool) {
+    struct group_geometry* group_geometry = (void*)geometry;
+    if (!group_geometry->bvh) {
+        prepare_group_geometry(geometry, thread_pool);
+        return;
+    }
+
+    // Update each instanced geometry only once, even if it is shared by several instances
+    size_t instance_count = group_geometry->instance_count;
+    geometry_t* geometries = xmalloc(sizeof(geometry_t) * instance_count);
+    for (size_t i = 0; i < instance_count; ++i)
+        geometries[i] = group_geometry->instances[i].geometry;
+    qsort(geometries, instance_count, sizeof(geometry_t), compare_geometry_ptrs);
+    for (size_t i = 0; i < instance_count; ++i) {
+        if (i == 0 || geometries[i] != geometries[i - 1])
+            update_geometry(geometries[i], thread_pool);
+    }
+    free(geometries);
+
+    // The bounding boxes are given in the order of the leaves, as required by `refit_bvh()`
+    struct bbox* instance_bboxes = xmalloc(sizeof(struct bbox) * instance_count);
+    group_geometry->bbox = empty_bbox();
+    for (size_t i = 0; i < instance_count; ++i) {
+        instance_bboxes[i] = compute_instance_bbox(&group_geometry->instances[group_geometry->bvh->primitive_indices[i]]);
+        group_geometry->bbox = union_bbox(group_geometry->bbox, instance_bboxes[i]);
+    }
+    refit_bvh(thread_pool, group_geometry->bvh, instance_bboxes, get_instance_bbox);
+    free(instance_bboxes);
+}
+
+// Transforms the ray into the object space of an instance. The direction is not
+// normalized, so that intersection distances are the same in both spaces.
+static inline struct ray transform_ray_to_instance(
+    const struct group_geometry* group_geometry,
+    size_t instance_index,
+    const struct ray* ray)
+{
+    const struct mat4x3* inverse_transform = &group_geometry->inverse_transforms[instance_index];
+    return (struct ray) {
+        .org = transform_point(*inverse_transform, ray->org),
+        .dir = transform_vector(*inverse_transform, ray->dir),
+        .t_min = ray->t_min,
+        .t_max = ray->t_max
+    };
+}
+
+static inline bool intersect_ray_instances(
+    struct ray* ray, struct hit* hit,
+    const struct bvh_node* leaf,
+    const struct group_geometry* group_geometry, bool any)
+{
+    bool found = false;
+    for (size_t i = leaf->first_child_or_primitive, n = i + leaf->primitive_count; i < n; ++i) {
+        size_t instance_index = group_geometry->bvh->primitive_indices[i];
+        struct ray instance_ray = transform_ray_to_instance(group_geometry, instance_index, ray);
+        if (intersect_ray_geometry(&instance_ray, hit, group_geometry->instances[instance_index].geometry, any)) {
+            ray->t_max = instance_ray.t_max;
+            hit->instance_index = instance_index;
+            found = true;
+            if (any)
+                return true;
+        }
+    }
+    return found;
+}
+
+static bool intersect_ray_instances_closest(
+    struct ray* ray, struct hit* hit,
+    const struct bvh_node* leaf,
+    void* intersection_data)
+{
+    return intersect_ray_instances(ray, hit, leaf, intersection_data, false);
+}
+
+static bool intersect_ray_instances_any(
+    struct ray* ray, struct hit* hit,
+    const struct bvh_node* leaf,
+    void* intersection_data)
+{
+    return intersect_ray_instances(ray, hit, leaf, intersection_data, true);
+}
+
+static bool intersect_group_geometry_ray(geometry_t geometry, struct ray* ray, struct hit* hit, bool any) {
+    struct group_geometry* group_geometry = (void*)geometry;
+    if (group_geometry->instance_count == 0)
+        return false;
+    assert(group_geometry->bvh);
+    return intersect_ray_bvh(
+        ray, hit,
+        group_geometry->bvh,
+        any ? intersect_ray_instances_any : intersect_ray_instances_closest,
+        group_geometry, any);
+}
+
+// Rays are transformed differently for each instance,
+// so packets and streams are traced one ray at a time.
+static ray_mask_t intersect_group_geometry_ray_packet(
+    geometry_t geometry,
+    struct ray_packet* packet, struct hit* hits,
+    ray_mask_t mask, bool any)
+{
+    ray_mask_t hit_mask = 0;
+    for (size_t i = 0, n = packet->size; i < n; ++i) {
+        if (!(mask & (((ray_mask_t)1) << i)))
+            continue;
+        struct ray ray = get_packet_ray(packet, i);
+        if (intersect_group_geometry_ray(geometry, &ray, &hits[i], any)) {
+            packet->t_max[i] = ray.t_max;
+            hit_mask |= ((ray_mask_t)1) << i;
+        }
+    }
+    return hit_mask;
+}
+
+static void intersect_group_geometry_ray_stream(
+    geometry_t geometry,
+    struct ray* rays, struct hit* hits,
+    const size_t* ray_ids, size_t ray_count, bool any)
+{
+    for (size_t i = 0; i < ray_count; ++i)
+        intersect_group_geometry_ray(geometry, &rays[ray_ids[i]], &hits[ray_ids[i]], any);
+}
+
+static bool occluded_ray_instances(
+    const struct ray* ray,
+    const struct bvh_node* leaf,
+    void* occlusion_data)
+{
+    const struct group_geometry* group_geometry = occlusion_data;
+    for (size_t i = leaf->first_child_or_primitive, n = i + leaf->primitive_count; i < n; ++i) {
+        size_t instance_index = group_geometry->bvh->primitive_indices[i];
+        struct ray instance_ray = transform_ray_to_instance(group_geometry, instance_index, ray);
+        if (occluded_ray_geometry(&instance_ray, group_geometry->instances[instance_index].geometry))
+            return true;
+    }
+    return false;
+}
+
+static bool occluded_group_geometry_ray(geometry_t geometry, const struct ray* ray) {
+    struct group_geometry* group_geometry = (void*)geometry;
+    if (group_geometry->instance_count == 0)
+        return false;
+    assert(group_geometry->bvh);
+    return occluded_ray_bvh(ray, group_geometry->bvh, occluded_ray_instances, group_geometry);
+}
+
+static union attr get_group_geometry_attr(
+    geometry_t geometry, unsigned attr_index,
+    const struct ray* ray, const struct hit* hit)
+{
+    struct group_geometry* group_geometry = (void*)geometry;
+    assert(hit->instance_index < group_geometry->instance_count);
+    const struct instance* instance = &group_geometry->instances[hit->instance_index];
+    struct ray instance_ray = transform_ray_to_instance(group_geometry, hit->instance_index, ray);
+    union attr attr = get_geometry_attr(instance->geometry, attr_index, &instance_ray, hit);
+
+    // Standard attributes that are expressed in object space are converted to world space
+    switch (attr_index) {
+        case ATTR_POSITION:
+            attr.vec3 = transform_point(instance->transform, attr.vec3);
+            break;
+        case ATTR_SHADING_NORMAL:
+        case ATTR_GEOMETRY_NORMAL:
+            attr.vec3 = transform_normal(group_geometry->inverse_transforms[hit->instance_index], attr.vec3);
+            break;
+        default:
+            break;
+    }
+    return attr;
+}
+
+static struct bbox get_group_geometry_bbox(geometry_t geometry) {
+    struct group_geometry* group_geometry = (void*)geometry;
+    assert(group_geometry->bvh || group_geometry->instance_count == 0);
+    return group_geometry->instance_count > 0 ? group_geometry->bbox : empty_bbox();
+}
+
+// Tolerance used to decide whether the transformation of an instance preserves angles.
+#define SIMILARITY_TOLERANCE ((real_t)1e-4)
+
+// Returns the factor by which the transformation of an instance scales surface areas, or 0 if it is
+// not a similarity (i.e. if it contains a shear or a non-uniform scaling). In that case, the area of
+// the transformed surface cannot be deduced from the area of the surface in object space.
+static real_t get_instance_area_scale(const struct instance* instance) {
+    struct vec3 columns[3];
+    for (int i = 0; i < 3; ++i)
+        columns[i] = make_vec3(instance->transform._[i][0], instance->transform._[i][1], instance->transform._[i][2]);
+    real_t scale = lensq_vec3(columns[0]);
+    real_t tolerance = scale * SIMILARITY_TOLERANCE;
+    for (int i = 0; i < 3; ++i) {
+        if (fabs(lensq_vec3(columns[i]) - scale) > tolerance ||
+            fabs(dot_vec3(columns[i], columns[(i + 1) % 3])) > tolerance)
+            return 0;
+    }
+    return scale;
+}
+
+static inline real_t get_instance_surface_area(const struct instance* instance, real_t area_scale) {
+    return area_scale * get_geometry_surface_area(instance->geometry);
+}
+
+// Returns 0 if the transformation of one of the instances is not a similarity (see `geometry.h`).
+static real_t get_group_geometry_surface_area(geometry_t geometry) {
+    struct group_geometry* group_geometry = (void*)geometry;
+    real_t area = 0;
+    for (size_t i = 0, n = group_geometry->instance_count; i < n; ++i) {
+        real_t area_scale = get_instance_area_scale(&group_geometry->instances[i]);
+        if (area_scale == 0)
+            return 0;
+        area += get_instance_surface_area(&group_geometry->instances[i], area_scale);
+    }
+    return area;
+}
+
+// The instance is chosen with a probability proportional to its area, using the first surface coordinate,
+// which is then rescaled so that it can be used to sample the surface of the instance.
+static struct surface_sample sample_group_geometry_surface(geometry_t geometry, const struct vec2* uv) {
+    struct group_geometry* group_geometry = (void*)geometry;
+    real_t area = get_group_geometry_surface_area(geometry);
+    if (area <= 0)
+        return (struct surface_sample) { .pdf = 0 };
+
+    real_t target = uv->_[0] * area;
+    const struct instance* instance = NULL;
+    real_t area_scale = 0, instance_area = 0;
+    for (size_t i = 0, n = group_geometry->instance_count; i < n; ++i) {
+        instance = &group_geometry->instances[i];
+        area_scale = get_instance_area_scale(instance);
+        instance_area = get_instance_surface_area(instance, area_scale);
+        if (target < instance_area || i == n - 1)
+            break;
+        target -= instance_area;
+    }
+    if (instance_area <= 0)
+        return (struct surface_sample) { .pdf = 0 };
+
+    struct vec2 instance_uv = make_vec2(min_real(target / instance_area, 1), uv->_[1]);
+    struct surface_sample sample = sample_geometry_surface(instance->geometry, &instance_uv);
+    return (struct surface_sample) {
+        .point = transform_point(instance->transform, sample.point),
+        // The density is divided by the area scale to express it in world space
+        .pdf = sample.pdf / area_scale * (instance_area / area)
+    };
+}
+
+static uint32_t hash_group_geometry(const struct scene_node* node) {
+    assert(node->type == GROUP_GEOMETRY);
+    struct group_geometry* group_geometry = (void*)node;
+    uint32_t h = hash_uint(hash_init(), group_geometry->instance_count);
+    for (size_t i = 0, n = group_geometry->instance_count; i < n; ++i) {
+        const struct instance* instance = &group_geometry->instances[i];
+        h = hash_bytes(hash_ptr(h, instance->geometry), &instance->transform, sizeof(struct mat4x3));
+    }
+    return h;
+}
+
+static bool compare_group_geometry(const struct scene_node* left, const struct scene_node* right) {
+    assert(left->type == GROUP_GEOMETRY && left->type == right->type);
+    struct group_geometry* left_group_geometry  = (void*)left;
+    struct group_geometry* right_group_geometry = (void*)right;
+    if (left_group_geometry->instance_count != right_group_geometry->instance_count)
+        return false;
+    for (size_t i = 0, n = left_group_geometry->instance_count; i < n; ++i) {
+        const struct instance* left_instance  = &left_group_geometry->instances[i];
+        const struct instance* right_instance = &right_group_geometry->instances[i];
+        if (left_instance->geometry != right_instance->geometry ||
+            memcmp(&left_instance->transform, &right_instance->transform, sizeof(struct mat4x3)))
+            return false;
+    }
+    return true;
+}
+
+static void cleanup_group_geometry(struct scene_node* node) {
+    struct group_geometry* group_geometry = (void*)node;
+    if (group_geometry->bvh)
+        free_bvh(group_geometry->bvh);
+}
+
+geometry_t new_group_geometry(struct scene* scene, const struct instance* instances, size_t instance_count) {
+    // The instances are copied into the scene, along with the inverse of their transformations
+    struct instance* instances_copy = alloc_from_pool(&scene->mem_pool, sizeof(struct instance) * instance_count);
+    struct mat4x3* inverse_transforms = alloc_from_pool(&scene->mem_pool, sizeof(struct mat4x3) * instance_count);
+    for (size_t i = 0; i < instance_count; ++i) {
+        // Only two levels are supported: the hit only records one instance index
+        assert(instances[i].geometry->node.type != GROUP_GEOMETRY);
+        instances_copy[i] = instances[i];
+        inverse_transforms[i] = inverse_mat4x3(instances[i].transform);
+    }
+    struct group_geometry group_geometry = {
+        .geometry = {
+            .node = {
+                .type    = GROUP_GEOMETRY,
+                .hash    = hash_group_geometry,
+                .compare = compare_group_geometry,
+                .cleanup = cleanup_group_geometry
+            },
+            .prepare              = prepare_group_geometry,
+            .update               = update_group_geometry,
+            .intersect_ray        = intersect_group_geometry_ray,
+            .intersect_ray_packet = intersect_group_geometry_ray_packet,
+            .intersect_ray_stream = intersect_group_geometry_ray_stream,
+            .occluded_ray         = occluded_group_geometry_ray,
+            .get_attr             = get_group_geometry_attr,
+            .get_bbox             = get_group_geometry_bbox,
+            .sample_surface       = sample_group_geometry_surface,
+            .get_surface_area     = get_group_geometry_surface_area
+        },
+        .instances = instances_copy,
+        .inverse_transforms = inverse_transforms,
+        .instance_count = instance_count
+    };
+    return (geometry_t)insert_scene_node(scene,
+        &group_geometry.geometry.node,
+        sizeof(group_geometry));
+}
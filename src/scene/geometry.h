@@ -8,6 +8,8 @@
 #include "core/ray.h"
 #include "core/vec4.h"
 #include "core/vec3.h"
+#include "core/mat4x3.h"
+#include "core/bbox.h"
 
 /*
  * These objects are intersectable geometric objects that
@@ -28,23 +30,77 @@ struct surface_sample {
 
 typedef const struct geometry* geometry_t;
 
-geometry_t new_mesh_geometry(struct scene*, const struct mesh*);
-geometry_t new_submesh_geometry(struct scene*, const struct mesh*, size_t begin, size_t end);
+// Instance of a geometric object, placed in the scene with an affine transformation.
+struct instance {
+    struct mat4x3 transform; // Object-to-world transformation
+    geometry_t geometry;
+};
+
+// Creates a geometric object from a mesh, or a range of primitives of a mesh. The parameters control the
+// construction of its acceleration data structure. If they are `NULL`, `default_mesh_accel_params()` is used.
+geometry_t new_mesh_geometry(struct scene*, const struct mesh*, const struct mesh_accel_params*);
+geometry_t new_submesh_geometry(
+    struct scene*, const struct mesh*, size_t begin, size_t end,
+    const struct mesh_accel_params*);
+
+// Creates a group of instances, with a top-level BVH built over them. Instanced geometries are shared, and
+// are only prepared once. Instances cannot contain other groups. When an instance is hit, its index in the
+// group is stored in the hit, and attributes such as positions and normals are returned in world space.
+geometry_t new_group_geometry(struct scene*, const struct instance* instances, size_t instance_count);
 
 // Prepares the given geometric object for rendering (creates BVHs, ...).
 // May be computationally intensive, which is why a thread pool is provided.
 void prepare_geometry(geometry_t geometry, struct thread_pool* thread_pool);
 
+// Updates a prepared geometric object after the vertex positions of its meshes have changed,
+// by refitting its BVHs instead of rebuilding them. The topology of the meshes must not change.
+void update_geometry(geometry_t geometry, struct thread_pool* thread_pool);
+
 // Intersects the given geometry with the given ray.
 // The `any` parameter selects the intersection mode between any and closest intersection.
 bool intersect_ray_geometry(struct ray* ray, struct hit* hit, geometry_t geometry, bool any);
 
+// Intersects the given geometry with the rays of a packet whose bit is set in `mask`. The `i`-th ray
+// of the packet corresponds to `hits[i]`. Returns the mask of the rays for which an intersection was found.
+ray_mask_t intersect_ray_packet_geometry(struct ray_packet* packet, struct hit* hits, ray_mask_t mask, geometry_t geometry, bool any);
+
+// Intersects the given geometry with a large batch of rays. Rays are sorted by direction and origin with
+// `sort_rays()`, copied in that order, and traced in parallel, in streams that share node fetches. The results
+// are then copied back. For each ray, the semantics are the same as those of `intersect_ray_geometry()`: the hit
+// of a ray that does not intersect anything is left unchanged. This must not be called from a worker thread
+// of the given thread pool.
+void intersect_rays_geometry(
+    geometry_t geometry,
+    struct ray* rays, struct hit* hits,
+    size_t count, bool any,
+    struct thread_pool* thread_pool);
+
+// Returns true if the given ray intersects the geometry between `ray->t_min` and `ray->t_max`. This is
+// equivalent to `intersect_ray_geometry()` with `any` set, but faster, since the traversal does not order
+// nodes by distance, and no hit data is computed. This should be used for shadow rays.
+bool occluded_ray_geometry(const struct ray* ray, geometry_t geometry);
+
+// Tests a large batch of rays for occlusion, with the same semantics as `occluded_ray_geometry()`. The result
+// for `rays[i]` is stored in `occluded[i]`. Rays are sorted and traced in parallel, as in `intersect_rays_geometry()`.
+void occluded_rays_geometry(
+    geometry_t geometry,
+    const struct ray* rays, bool* occluded,
+    size_t count,
+    struct thread_pool* thread_pool);
+
 // Obtains an attribute from a geometry, given a ray and a hit.
 union attr get_geometry_attr(geometry_t geometry, unsigned attr_index, const struct ray* ray, const struct hit* hit);
 
+// Returns the bounding box of a geometry. The geometry must have been prepared.
+struct bbox get_geometry_bbox(geometry_t);
+
 // Samples the surface of a geometry, using the provided surface coordinates (in `[0, 1]`).
+// For groups, an instance is chosen in proportion to its area, and its surface is sampled.
 struct surface_sample sample_geometry_surface(geometry_t, const struct vec2*);
 
+// Returns the surface area of a geometry. For groups, the area of an instance is only known when its
+// transformation is a similarity (a rotation, a translation, and a uniform scaling). When that is not
+// the case for one of the instances, the area of the group is 0, and its samples have a PDF of 0.
 real_t get_geometry_surface_area(geometry_t);
 
 #endif
@@ -1,18 +1,55 @@
 #include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
 
 #include "scene/mesh.h"
 #include "accel/bvh.h"
+#include "accel/wide_bvh.h"
+#include "accel/compressed_bvh.h"
 #include "accel/accel.h"
 #include "core/thread_pool.h"
 #include "core/ray.h"
 #include "core/bbox.h"
 #include "core/tri.h"
 #include "core/quad.h"
+#include "core/hash.h"
+#include "core/mapped_file.h"
+
+// Marks the blocks of triangles whose vertex indices cannot be compressed (see `struct indexed_tri_block`).
+#define INDEXED_TRI_BLOCK_UNCOMPRESSED UINT32_MAX
+
+// Block of triangles given by the indices of their vertices in the mesh, stored as offsets relative
+// to the first vertex of the block. Neighboring triangles usually share vertices with close indices,
+// but when the indices of a block span too many vertices, `first_vertex` is set to
+// `INDEXED_TRI_BLOCK_UNCOMPRESSED`, and the indices are read from the mesh instead.
+struct indexed_tri_block {
+    uint32_t first_vertex;
+    uint16_t vertex_offsets[3][TRI_BLOCK_SIZE];
+};
+
+struct indexed_tri_leaf_data {
+    const struct indexed_tri_block* blocks;
+    const struct vec3* vertices;
+    const size_t* indices;           // Indices of the first triangle in the range of primitives of the mesh
+    const size_t* primitive_indices; // Used to find the triangles of uncompressed blocks
+    size_t tri_count;
+};
 
 struct mesh_accel {
     struct accel accel;
-    struct bvh* bvh;
-    void* primitives;
+    struct bvh* bvh;     // Only one of these BVHs is present,
+    struct bvh4* bvh4;   // depending on the layout given when
+    struct bvh8* bvh8;   // building the acceleration data structure.
+    struct compressed_bvh8* compressed_bvh8;
+    void* primitives;             // Permuted primitives (only for quad meshes)
+    struct tri_block* tri_blocks; // Permuted triangles in SoA layout (only for triangle meshes)
+    struct watertight_tri_block* watertight_tri_blocks; // Same, for the watertight intersection test
+    struct indexed_tri_block* indexed_tri_blocks; // Replaces the primitives with indexed storage
+    struct indexed_tri_leaf_data indexed_tri_leaf_data;
+    enum tri_intersection tri_intersection;
+    enum tri_storage tri_storage;
+    size_t primitive_count; // Number of references to primitives in the BVH, including duplicates
+    struct mapped_file* mapped_file; // If not `NULL`, the BVH and primitives point into this file
 };
 
 struct mesh* new_mesh(
@@ -86,11 +123,15 @@ static inline union attr interpolate_uint(
             T z = data[mesh->indices[primitive_index * 3 + 2]]; \
             return (union attr) { .name = lerp3_##name(x, y, z, uv->_[0], uv->_[1]) }; \
         } else { \
-            T x = data[mesh->indices[primitive_index * 4 + 0]]; \
-            T y = data[mesh->indices[primitive_index * 4 + 1]]; \
-            T z = data[mesh->indices[primitive_index * 4 + 2]]; \
-            T w = data[mesh->indices[primitive_index * 4 + 3]]; \
-            return (union attr) { .name = lerp4_##name(x, y, z, w, uv->_[0], uv->_[1]) }; \
+            /* See `struct mesh` for the order of the vertices of quads */ \
+            const size_t* indices = &mesh->indices[primitive_index * 4]; \
+            T x = data[indices[0]]; \
+            T y = data[indices[1]]; \
+            T z = data[indices[2]]; \
+            if (indices[2] == indices[3]) \
+                return (union attr) { .name = lerp3_##name(x, y, z, uv->_[0], uv->_[1]) }; \
+            T w = data[indices[3]]; \
+            return (union attr) { .name = lerp4_##name(x, y, w, z, uv->_[0], uv->_[1]) }; \
         } \
     }
 
@@ -182,6 +223,34 @@ static struct bbox get_quad_bbox(void* primitive_data, size_t index) {
             point_bbox(get_quad_p3(quad)))));
 }
 
+// Computes the bounding boxes of the parts of a convex polygon that lie on each side of the
+// plane `p[axis] = position`. Every pair of vertices is considered, so that the result is also
+// conservative for non-planar quads, which are made of two triangles that share a diagonal.
+static void split_polygon(
+    const struct vec3* vertices, size_t vertex_count,
+    int axis, real_t position,
+    struct bbox* left_bbox, struct bbox* right_bbox)
+{
+    *left_bbox = *right_bbox = empty_bbox();
+    for (size_t i = 0; i < vertex_count; ++i) {
+        const struct vec3* p = &vertices[i];
+        if (p->_[axis] <= position) *left_bbox  = extend_bbox(*left_bbox,  *p);
+        if (p->_[axis] >= position) *right_bbox = extend_bbox(*right_bbox, *p);
+        for (size_t j = i + 1; j < vertex_count; ++j) {
+            const struct vec3* q = &vertices[j];
+            if ((p->_[axis] < position && q->_[axis] > position) ||
+                (p->_[axis] > position && q->_[axis] < position))
+            {
+                real_t t = (position - p->_[axis]) / (q->_[axis] - p->_[axis]);
+                struct vec3 r = add_vec3(*p, scale_vec3(sub_vec3(*q, *p), t));
+                r._[axis] = position;
+                *left_bbox  = extend_bbox(*left_bbox,  r);
+                *right_bbox = extend_bbox(*right_bbox, r);
+            }
+        }
+    }
+}
+
 static struct vec3 get_tri_center(void* primitive_data, size_t index) {
     const struct tri* tri = &((const struct tri*)primitive_data)[index];
     return scale_vec3(add_vec3(tri->p0, add_vec3(get_tri_p1(tri), get_tri_p2(tri))), 1.0 / 3.0);
@@ -196,23 +265,302 @@ static struct vec3 get_quad_center(void* primitive_data, size_t index) {
         1.0 / 4.0);
 }
 
-#define GEN_INTERSECT_RAY_MESH_ACCEL(T, intersect_ray_primitive) \
-    static inline bool intersect_ray_##T##_mesh_accel_leaf( \
-        struct ray* ray, struct hit* hit, \
-        const struct bvh_node* leaf, \
-        const struct T* primitives, bool any) \
+static inline struct tri make_mesh_tri(const struct mesh* mesh, size_t primitive_index) {
+    const struct vec3* vertices = mesh->attrs[ATTR_POSITION].data;
+    const size_t* indices = &mesh->indices[primitive_index * 3];
+    return make_tri(&vertices[indices[0]], &vertices[indices[1]], &vertices[indices[2]]);
+}
+
+static inline struct quad make_mesh_quad(const struct mesh* mesh, size_t primitive_index) {
+    const struct vec3* vertices = mesh->attrs[ATTR_POSITION].data;
+    const size_t* indices = &mesh->indices[primitive_index * 4];
+    return make_quad(&vertices[indices[0]], &vertices[indices[1]], &vertices[indices[2]], &vertices[indices[3]]);
+}
+
+static inline void get_tri_vertices(const struct tri* tri, struct vec3* vertices) {
+    vertices[0] = tri->p0;
+    vertices[1] = get_tri_p1(tri);
+    vertices[2] = get_tri_p2(tri);
+}
+
+static inline void get_quad_vertices(const struct quad* quad, struct vec3* vertices) {
+    vertices[0] = quad->p0;
+    vertices[1] = get_quad_p1(quad);
+    vertices[2] = get_quad_p2(quad);
+    vertices[3] = get_quad_p3(quad);
+}
+
+// Primitives generated on the fly from the vertices and indices of a mesh. This is used to build
+// and refit acceleration data structures without storing a copy of the primitives, which would
+// otherwise have to be permuted into a second copy once the order of the leaves is known.
+struct mesh_primitives {
+    const struct mesh* mesh;
+    size_t first_primitive;
+    const size_t* primitive_indices; // If not `NULL`, maps positions in the leaves to primitives (when refitting)
+};
+
+#define GEN_MESH_PRIMITIVE_FNS(T, vertex_count) \
+    static inline struct T get_mesh_##T(void* primitive_data, size_t index) { \
+        const struct mesh_primitives* mesh_primitives = primitive_data; \
+        if (mesh_primitives->primitive_indices) \
+            index = mesh_primitives->primitive_indices[index]; \
+        return make_mesh_##T(mesh_primitives->mesh, mesh_primitives->first_primitive + index); \
+    } \
+    static struct bbox get_mesh_##T##_bbox(void* primitive_data, size_t index) { \
+        struct T primitive = get_mesh_##T(primitive_data, index); \
+        return get_##T##_bbox(&primitive, 0); \
+    } \
+    static struct vec3 get_mesh_##T##_center(void* primitive_data, size_t index) { \
+        struct T primitive = get_mesh_##T(primitive_data, index); \
+        return get_##T##_center(&primitive, 0); \
+    } \
+    static void split_mesh_##T( \
+        void* primitive_data, size_t index, \
+        int axis, real_t position, \
+        struct bbox* left_bbox, struct bbox* right_bbox) \
     { \
-        bool found = false; \
-        for (size_t i = leaf->first_child_or_primitive, n = i + leaf->primitive_count; i < n; ++i) { \
-            if (intersect_ray_primitive(ray, hit, &primitives[i])) { \
-                hit->primitive_index = i; \
-                found = true; \
-                if (any) \
-                    return true; \
-            } \
+        struct T primitive = get_mesh_##T(primitive_data, index); \
+        struct vec3 vertices[vertex_count]; \
+        get_##T##_vertices(&primitive, vertices); \
+        split_polygon(vertices, vertex_count, axis, position, left_bbox, right_bbox); \
+    }
+
+GEN_MESH_PRIMITIVE_FNS(tri, 3)
+GEN_MESH_PRIMITIVE_FNS(quad, 4)
+
+#define GEN_INTERSECT_RAY_MESH_ACCEL_BVH(T, bvh) \
+    static bool intersect_ray_##T##_mesh_accel_##bvh(struct ray* ray, struct hit* hit, const struct accel* accel, bool any) { \
+        struct mesh_accel* mesh_accel = (void*)accel; \
+        if (intersect_ray_##bvh( \
+            ray, hit, \
+            mesh_accel->bvh, \
+            any \
+                ? intersect_ray_##T##_mesh_accel_leaf_any \
+                : intersect_ray_##T##_mesh_accel_leaf_closest, \
+            get_##T##_mesh_accel_leaf_data(mesh_accel), any)) { \
+            hit->primitive_index = mesh_accel->bvh->primitive_indices[hit->primitive_index]; \
+            return true; \
         } \
-        return found; \
-    } \
+        return false; \
+    }
+
+static inline void* get_quad_mesh_accel_leaf_data(const struct mesh_accel* mesh_accel) {
+    return mesh_accel->primitives;
+}
+
+static inline struct quad get_quad_mesh_accel_primitive(const void* leaf_data, size_t index) {
+    return ((const struct quad*)leaf_data)[index];
+}
+
+static inline bool intersect_ray_quad_mesh_accel_leaf(
+    struct ray* ray, struct hit* hit,
+    const struct bvh_node* leaf,
+    const struct quad* quads, bool any)
+{
+    bool found = false;
+    for (size_t i = leaf->first_child_or_primitive, n = i + leaf->primitive_count; i < n; ++i) {
+        if (intersect_ray_quad(ray, hit, &quads[i])) {
+            hit->primitive_index = i;
+            found = true;
+            if (any)
+                return true;
+        }
+    }
+    return found;
+}
+
+// Triangles are intersected by blocks, using the block layout when intersecting single rays.
+// Blocks are aligned on the position of the triangles in the leaves, so that a leaf covers
+// a contiguous range of blocks, of which only the triangles that belong to the leaf are tested.
+static inline void* get_tri_mesh_accel_leaf_data(const struct mesh_accel* mesh_accel) {
+    return mesh_accel->tri_blocks;
+}
+
+// Packets intersect one triangle at a time, which is read back from its lane in the blocks.
+static inline struct tri get_tri_mesh_accel_primitive(const void* leaf_data, size_t index) {
+    const struct tri_block* blocks = leaf_data;
+    return get_tri_block_lane(&blocks[index / TRI_BLOCK_SIZE], index % TRI_BLOCK_SIZE);
+}
+
+// Returns the mask of the triangles of the given block that are in the range [begin, end).
+static inline unsigned get_tri_block_mask(size_t block_index, size_t begin, size_t end) {
+    size_t first = block_index * TRI_BLOCK_SIZE;
+    size_t lane_begin = begin > first ? begin - first : 0;
+    size_t lane_end = end - first < TRI_BLOCK_SIZE ? end - first : TRI_BLOCK_SIZE;
+    return (1u << lane_end) - (1u << lane_begin);
+}
+
+static inline bool intersect_ray_tri_mesh_accel_leaf(
+    struct ray* ray, struct hit* hit,
+    const struct bvh_node* leaf,
+    const struct tri_block* blocks, bool any)
+{
+    bool found = false;
+    size_t begin = leaf->first_child_or_primitive;
+    size_t end = begin + leaf->primitive_count;
+    for (size_t i = begin / TRI_BLOCK_SIZE, n = (end + TRI_BLOCK_SIZE - 1) / TRI_BLOCK_SIZE; i < n; ++i) {
+        size_t lane = intersect_ray_tri_block(ray, hit, &blocks[i], get_tri_block_mask(i, begin, end));
+        if (lane != TRI_BLOCK_SIZE) {
+            hit->primitive_index = i * TRI_BLOCK_SIZE + lane;
+            found = true;
+            if (any)
+                return true;
+        }
+    }
+    return found;
+}
+
+// The watertight intersection test needs the ray to be transformed, which is done once before the traversal.
+struct watertight_tri_leaf_data {
+    const struct watertight_tri_block* blocks;
+    struct watertight_ray watertight_ray;
+};
+
+static inline bool intersect_ray_watertight_tri_mesh_accel_leaf(
+    struct ray* ray, struct hit* hit,
+    const struct bvh_node* leaf,
+    const struct watertight_tri_leaf_data* leaf_data, bool any)
+{
+    bool found = false;
+    size_t begin = leaf->first_child_or_primitive;
+    size_t end = begin + leaf->primitive_count;
+    for (size_t i = begin / TRI_BLOCK_SIZE, n = (end + TRI_BLOCK_SIZE - 1) / TRI_BLOCK_SIZE; i < n; ++i) {
+        size_t lane = intersect_ray_watertight_tri_block(
+            ray, hit, &leaf_data->watertight_ray,
+            &leaf_data->blocks[i], get_tri_block_mask(i, begin, end));
+        if (lane != TRI_BLOCK_SIZE) {
+            hit->primitive_index = i * TRI_BLOCK_SIZE + lane;
+            found = true;
+            if (any)
+                return true;
+        }
+    }
+    return found;
+}
+
+// With indexed storage, the vertices of the triangles of a block are gathered from the mesh, and the
+// block is then intersected with the same routines as stored blocks, which gives the same results.
+static inline void get_indexed_tri_block_vertices(
+    const struct indexed_tri_leaf_data* leaf_data,
+    size_t block_index, size_t lane,
+    const struct vec3** vertices)
+{
+    const struct indexed_tri_block* block = &leaf_data->blocks[block_index];
+    if (likely(block->first_vertex != INDEXED_TRI_BLOCK_UNCOMPRESSED)) {
+        const struct vec3* first_vertex = leaf_data->vertices + block->first_vertex;
+        for (size_t i = 0; i < 3; ++i)
+            vertices[i] = first_vertex + block->vertex_offsets[i][lane];
+        return;
+    }
+    // The last block is padded with copies of the last triangle
+    size_t k = block_index * TRI_BLOCK_SIZE + lane;
+    k = k < leaf_data->tri_count ? k : leaf_data->tri_count - 1;
+    const size_t* indices = &leaf_data->indices[leaf_data->primitive_indices[k] * 3];
+    for (size_t i = 0; i < 3; ++i)
+        vertices[i] = leaf_data->vertices + indices[i];
+}
+
+static inline void load_indexed_tri_block(
+    const struct indexed_tri_leaf_data* leaf_data,
+    size_t block_index,
+    struct tri_block* block)
+{
+    for (size_t i = 0; i < TRI_BLOCK_SIZE; ++i) {
+        const struct vec3* vertices[3];
+        get_indexed_tri_block_vertices(leaf_data, block_index, i, vertices);
+        struct tri tri = make_tri(vertices[0], vertices[1], vertices[2]);
+        set_tri_block_lane(block, i, &tri);
+    }
+}
+
+static inline void load_indexed_watertight_tri_block(
+    const struct indexed_tri_leaf_data* leaf_data,
+    size_t block_index,
+    struct watertight_tri_block* block)
+{
+    for (size_t i = 0; i < TRI_BLOCK_SIZE; ++i) {
+        const struct vec3* vertices[3];
+        get_indexed_tri_block_vertices(leaf_data, block_index, i, vertices);
+        set_watertight_tri_block_lane(block, i, vertices[0], vertices[1], vertices[2]);
+    }
+}
+
+static inline void* get_indexed_tri_mesh_accel_leaf_data(const struct mesh_accel* mesh_accel) {
+    return (void*)&mesh_accel->indexed_tri_leaf_data;
+}
+
+static inline bool intersect_ray_indexed_tri_mesh_accel_leaf(
+    struct ray* ray, struct hit* hit,
+    const struct bvh_node* leaf,
+    const struct indexed_tri_leaf_data* leaf_data, bool any)
+{
+    bool found = false;
+    size_t begin = leaf->first_child_or_primitive;
+    size_t end = begin + leaf->primitive_count;
+    for (size_t i = begin / TRI_BLOCK_SIZE, n = (end + TRI_BLOCK_SIZE - 1) / TRI_BLOCK_SIZE; i < n; ++i) {
+        struct tri_block block;
+        load_indexed_tri_block(leaf_data, i, &block);
+        size_t lane = intersect_ray_tri_block(ray, hit, &block, get_tri_block_mask(i, begin, end));
+        if (lane != TRI_BLOCK_SIZE) {
+            hit->primitive_index = i * TRI_BLOCK_SIZE + lane;
+            found = true;
+            if (any)
+                return true;
+        }
+    }
+    return found;
+}
+
+struct indexed_watertight_tri_leaf_data {
+    struct indexed_tri_leaf_data indexed_tri_leaf_data;
+    struct watertight_ray watertight_ray;
+};
+
+static inline bool intersect_ray_indexed_watertight_tri_mesh_accel_leaf(
+    struct ray* ray, struct hit* hit,
+    const struct bvh_node* leaf,
+    const struct indexed_watertight_tri_leaf_data* leaf_data, bool any)
+{
+    bool found = false;
+    size_t begin = leaf->first_child_or_primitive;
+    size_t end = begin + leaf->primitive_count;
+    for (size_t i = begin / TRI_BLOCK_SIZE, n = (end + TRI_BLOCK_SIZE - 1) / TRI_BLOCK_SIZE; i < n; ++i) {
+        struct watertight_tri_block block;
+        load_indexed_watertight_tri_block(&leaf_data->indexed_tri_leaf_data, i, &block);
+        size_t lane = intersect_ray_watertight_tri_block(
+            ray, hit, &leaf_data->watertight_ray,
+            &block, get_tri_block_mask(i, begin, end));
+        if (lane != TRI_BLOCK_SIZE) {
+            hit->primitive_index = i * TRI_BLOCK_SIZE + lane;
+            found = true;
+            if (any)
+                return true;
+        }
+    }
+    return found;
+}
+
+static inline struct watertight_tri_leaf_data make_watertight_tri_leaf_data(
+    const struct mesh_accel* mesh_accel,
+    const struct ray* ray)
+{
+    return (struct watertight_tri_leaf_data) {
+        .blocks = mesh_accel->watertight_tri_blocks,
+        .watertight_ray = make_watertight_ray(ray)
+    };
+}
+
+static inline struct indexed_watertight_tri_leaf_data make_indexed_watertight_tri_leaf_data(
+    const struct mesh_accel* mesh_accel,
+    const struct ray* ray)
+{
+    return (struct indexed_watertight_tri_leaf_data) {
+        .indexed_tri_leaf_data = mesh_accel->indexed_tri_leaf_data,
+        .watertight_ray = make_watertight_ray(ray)
+    };
+}
+
+#define GEN_INTERSECT_RAY_MESH_ACCEL_LEAF(T) \
     static bool intersect_ray_##T##_mesh_accel_leaf_closest( \
         struct ray* ray, struct hit* hit, \
         const struct bvh_node* leaf, \
@@ -226,161 +574,1200 @@ static struct vec3 get_quad_center(void* primitive_data, size_t index) {
         void* intersection_data) \
     { \
         return intersect_ray_##T##_mesh_accel_leaf(ray, hit, leaf, intersection_data, true); \
-    } \
-    static bool intersect_ray_##T##_mesh_accel(struct ray* ray, struct hit* hit, const struct accel* accel, bool any) { \
+    }
+
+// The watertight intersection test needs leaf data that depends on the ray, which is created before the traversal.
+#define GEN_INTERSECT_RAY_WATERTIGHT_MESH_ACCEL_BVH(T, bvh) \
+    static bool intersect_ray_##T##_mesh_accel_##bvh( \
+        struct ray* ray, struct hit* hit, \
+        const struct accel* accel, bool any) \
+    { \
         struct mesh_accel* mesh_accel = (void*)accel; \
-        if (intersect_ray_bvh( \
+        struct T##_leaf_data leaf_data = make_##T##_leaf_data(mesh_accel, ray); \
+        if (intersect_ray_##bvh( \
             ray, hit, \
             mesh_accel->bvh, \
             any \
                 ? intersect_ray_##T##_mesh_accel_leaf_any \
                 : intersect_ray_##T##_mesh_accel_leaf_closest, \
-            mesh_accel->primitives, any)) { \
+            &leaf_data, any)) { \
             hit->primitive_index = mesh_accel->bvh->primitive_indices[hit->primitive_index]; \
             return true; \
         } \
         return false; \
     }
 
-GEN_INTERSECT_RAY_MESH_ACCEL(tri, intersect_ray_tri)
-GEN_INTERSECT_RAY_MESH_ACCEL(quad, intersect_ray_quad)
+#define GEN_INTERSECT_RAY_MESH_ACCEL_FNS(T) \
+    static bool (*const intersect_ray_##T##_mesh_accel_fns[])(struct ray*, struct hit*, const struct accel*, bool) = { \
+        [BINARY_BVH]      = intersect_ray_##T##_mesh_accel_bvh, \
+        [WIDE_BVH4]       = intersect_ray_##T##_mesh_accel_bvh4, \
+        [WIDE_BVH8]       = intersect_ray_##T##_mesh_accel_bvh8, \
+        [COMPRESSED_BVH8] = intersect_ray_##T##_mesh_accel_compressed_bvh8 \
+    };
+
+// Packets and streams are traced one ray at a time with the watertight intersection test, as well as with indexed storage
+GEN_INTERSECT_RAY_MESH_ACCEL_LEAF(watertight_tri)
+GEN_INTERSECT_RAY_WATERTIGHT_MESH_ACCEL_BVH(watertight_tri, bvh)
+GEN_INTERSECT_RAY_WATERTIGHT_MESH_ACCEL_BVH(watertight_tri, bvh4)
+GEN_INTERSECT_RAY_WATERTIGHT_MESH_ACCEL_BVH(watertight_tri, bvh8)
+GEN_INTERSECT_RAY_WATERTIGHT_MESH_ACCEL_BVH(watertight_tri, compressed_bvh8)
+GEN_INTERSECT_RAY_MESH_ACCEL_FNS(watertight_tri)
+
+GEN_INTERSECT_RAY_MESH_ACCEL_LEAF(indexed_watertight_tri)
+GEN_INTERSECT_RAY_WATERTIGHT_MESH_ACCEL_BVH(indexed_watertight_tri, bvh)
+GEN_INTERSECT_RAY_WATERTIGHT_MESH_ACCEL_BVH(indexed_watertight_tri, bvh4)
+GEN_INTERSECT_RAY_WATERTIGHT_MESH_ACCEL_BVH(indexed_watertight_tri, bvh8)
+GEN_INTERSECT_RAY_WATERTIGHT_MESH_ACCEL_BVH(indexed_watertight_tri, compressed_bvh8)
+GEN_INTERSECT_RAY_MESH_ACCEL_FNS(indexed_watertight_tri)
+
+GEN_INTERSECT_RAY_MESH_ACCEL_LEAF(indexed_tri)
+GEN_INTERSECT_RAY_MESH_ACCEL_BVH(indexed_tri, bvh)
+GEN_INTERSECT_RAY_MESH_ACCEL_BVH(indexed_tri, bvh4)
+GEN_INTERSECT_RAY_MESH_ACCEL_BVH(indexed_tri, bvh8)
+GEN_INTERSECT_RAY_MESH_ACCEL_BVH(indexed_tri, compressed_bvh8)
+GEN_INTERSECT_RAY_MESH_ACCEL_FNS(indexed_tri)
+
+#define GEN_INTERSECT_RAY_MESH_ACCEL(T) \
+    GEN_INTERSECT_RAY_MESH_ACCEL_LEAF(T) \
+    static inline ray_mask_t intersect_ray_packet_##T##_mesh_accel_leaf( \
+        struct ray_packet* packet, struct hit* hits, \
+        ray_mask_t mask, \
+        const struct bvh_node* leaf, \
+        const void* leaf_data, bool any) \
+    { \
+        ray_mask_t found = 0; \
+        for (size_t i = leaf->first_child_or_primitive, n = i + leaf->primitive_count; i < n; ++i) { \
+            struct T primitive = get_##T##_mesh_accel_primitive(leaf_data, i); \
+            ray_mask_t hit_mask = intersect_ray_packet_##T(packet, hits, mask, &primitive); \
+            for (size_t j = 0; (hit_mask >> j) != 0; ++j) { \
+                if (hit_mask & (((ray_mask_t)1) << j)) \
+                    hits[j].primitive_index = i; \
+            } \
+            found |= hit_mask; \
+            if (any && (mask &= ~hit_mask) == 0) \
+                break; \
+        } \
+        return found; \
+    } \
+    static ray_mask_t intersect_ray_packet_##T##_mesh_accel_leaf_closest( \
+        struct ray_packet* packet, struct hit* hits, \
+        ray_mask_t mask, \
+        const struct bvh_node* leaf, \
+        void* intersection_data) \
+    { \
+        return intersect_ray_packet_##T##_mesh_accel_leaf(packet, hits, mask, leaf, intersection_data, false); \
+    } \
+    static ray_mask_t intersect_ray_packet_##T##_mesh_accel_leaf_any( \
+        struct ray_packet* packet, struct hit* hits, \
+        ray_mask_t mask, \
+        const struct bvh_node* leaf, \
+        void* intersection_data) \
+    { \
+        return intersect_ray_packet_##T##_mesh_accel_leaf(packet, hits, mask, leaf, intersection_data, true); \
+    } \
+    static ray_mask_t intersect_ray_packet_##T##_mesh_accel_bvh( \
+        struct ray_packet* packet, struct hit* hits, \
+        ray_mask_t mask, \
+        const struct accel* accel, bool any) \
+    { \
+        struct mesh_accel* mesh_accel = (void*)accel; \
+        ray_mask_t hit_mask = intersect_ray_packet_bvh( \
+            packet, hits, mask, \
+            mesh_accel->bvh, \
+            any \
+                ? intersect_ray_packet_##T##_mesh_accel_leaf_any \
+                : intersect_ray_packet_##T##_mesh_accel_leaf_closest, \
+            get_##T##_mesh_accel_leaf_data(mesh_accel), any); \
+        for (size_t i = 0; (hit_mask >> i) != 0; ++i) { \
+            if (hit_mask & (((ray_mask_t)1) << i)) \
+                hits[i].primitive_index = mesh_accel->bvh->primitive_indices[hits[i].primitive_index]; \
+        } \
+        return hit_mask; \
+    } \
+    static void intersect_ray_stream_##T##_mesh_accel_bvh( \
+        struct ray* rays, struct hit* hits, \
+        const size_t* ray_ids, size_t ray_count, \
+        const struct accel* accel, bool any) \
+    { \
+        struct mesh_accel* mesh_accel = (void*)accel; \
+        bool* found = xmalloc(sizeof(bool) * ray_count); \
+        intersect_ray_stream_bvh( \
+            rays, hits, ray_ids, found, ray_count, \
+            mesh_accel->bvh, \
+            any \
+                ? intersect_ray_##T##_mesh_accel_leaf_any \
+                : intersect_ray_##T##_mesh_accel_leaf_closest, \
+            get_##T##_mesh_accel_leaf_data(mesh_accel), any); \
+        for (size_t i = 0; i < ray_count; ++i) { \
+            struct hit* hit = &hits[ray_ids[i]]; \
+            if (found[i]) \
+                hit->primitive_index = mesh_accel->bvh->primitive_indices[hit->primitive_index]; \
+        } \
+        free(found); \
+    } \
+    GEN_INTERSECT_RAY_MESH_ACCEL_BVH(T, bvh) \
+    GEN_INTERSECT_RAY_MESH_ACCEL_BVH(T, bvh4) \
+    GEN_INTERSECT_RAY_MESH_ACCEL_BVH(T, bvh8) \
+    GEN_INTERSECT_RAY_MESH_ACCEL_BVH(T, compressed_bvh8) \
+    GEN_INTERSECT_RAY_MESH_ACCEL_FNS(T) \
+    /* Packets are only traversed together in binary BVHs */ \
+    static ray_mask_t (*const intersect_ray_packet_##T##_mesh_accel_fns[])( \
+        struct ray_packet*, struct hit*, ray_mask_t, const struct accel*, bool) = \
+    { \
+        [BINARY_BVH]      = intersect_ray_packet_##T##_mesh_accel_bvh, \
+        [WIDE_BVH4]       = intersect_ray_packet_accel_one_by_one, \
+        [WIDE_BVH8]       = intersect_ray_packet_accel_one_by_one, \
+        [COMPRESSED_BVH8] = intersect_ray_packet_accel_one_by_one \
+    }; \
+    /* Streams are only filtered breadth-first in binary BVHs */ \
+    static void (*const intersect_ray_stream_##T##_mesh_accel_fns[])( \
+        struct ray*, struct hit*, const size_t*, size_t, const struct accel*, bool) = \
+    { \
+        [BINARY_BVH]      = intersect_ray_stream_##T##_mesh_accel_bvh, \
+        [WIDE_BVH4]       = intersect_ray_stream_accel_one_by_one, \
+        [WIDE_BVH8]       = intersect_ray_stream_accel_one_by_one, \
+        [COMPRESSED_BVH8] = intersect_ray_stream_accel_one_by_one \
+    };
+
+GEN_INTERSECT_RAY_MESH_ACCEL(tri)
+GEN_INTERSECT_RAY_MESH_ACCEL(quad)
+
+// Occlusion queries use dedicated leaf intersection routines, which stop at the first
+// intersection and do not compute intersection data. Primitive indices are not needed either.
+static bool occluded_ray_quad_mesh_accel_leaf(
+    const struct ray* ray,
+    const struct bvh_node* leaf,
+    void* occlusion_data)
+{
+    const struct quad* quads = occlusion_data;
+    for (size_t i = leaf->first_child_or_primitive, n = i + leaf->primitive_count; i < n; ++i) {
+        if (occluded_ray_quad(ray, &quads[i]))
+            return true;
+    }
+    return false;
+}
+
+static bool occluded_ray_tri_mesh_accel_leaf(
+    const struct ray* ray,
+    const struct bvh_node* leaf,
+    void* occlusion_data)
+{
+    const struct tri_block* blocks = occlusion_data;
+    size_t begin = leaf->first_child_or_primitive;
+    size_t end = begin + leaf->primitive_count;
+    for (size_t i = begin / TRI_BLOCK_SIZE, n = (end + TRI_BLOCK_SIZE - 1) / TRI_BLOCK_SIZE; i < n; ++i) {
+        if (occluded_ray_tri_block(ray, &blocks[i], get_tri_block_mask(i, begin, end)))
+            return true;
+    }
+    return false;
+}
+
+static bool occluded_ray_watertight_tri_mesh_accel_leaf(
+    const struct ray* ray,
+    const struct bvh_node* leaf,
+    void* occlusion_data)
+{
+    const struct watertight_tri_leaf_data* leaf_data = occlusion_data;
+    size_t begin = leaf->first_child_or_primitive;
+    size_t end = begin + leaf->primitive_count;
+    for (size_t i = begin / TRI_BLOCK_SIZE, n = (end + TRI_BLOCK_SIZE - 1) / TRI_BLOCK_SIZE; i < n; ++i) {
+        if (occluded_ray_watertight_tri_block(
+            ray, &leaf_data->watertight_ray,
+            &leaf_data->blocks[i], get_tri_block_mask(i, begin, end)))
+            return true;
+    }
+    return false;
+}
+
+static bool occluded_ray_indexed_tri_mesh_accel_leaf(
+    const struct ray* ray,
+    const struct bvh_node* leaf,
+    void* occlusion_data)
+{
+    const struct indexed_tri_leaf_data* leaf_data = occlusion_data;
+    size_t begin = leaf->first_child_or_primitive;
+    size_t end = begin + leaf->primitive_count;
+    for (size_t i = begin / TRI_BLOCK_SIZE, n = (end + TRI_BLOCK_SIZE - 1) / TRI_BLOCK_SIZE; i < n; ++i) {
+        struct tri_block block;
+        load_indexed_tri_block(leaf_data, i, &block);
+        if (occluded_ray_tri_block(ray, &block, get_tri_block_mask(i, begin, end)))
+            return true;
+    }
+    return false;
+}
+
+static bool occluded_ray_indexed_watertight_tri_mesh_accel_leaf(
+    const struct ray* ray,
+    const struct bvh_node* leaf,
+    void* occlusion_data)
+{
+    const struct indexed_watertight_tri_leaf_data* leaf_data = occlusion_data;
+    size_t begin = leaf->first_child_or_primitive;
+    size_t end = begin + leaf->primitive_count;
+    for (size_t i = begin / TRI_BLOCK_SIZE, n = (end + TRI_BLOCK_SIZE - 1) / TRI_BLOCK_SIZE; i < n; ++i) {
+        struct watertight_tri_block block;
+        load_indexed_watertight_tri_block(&leaf_data->indexed_tri_leaf_data, i, &block);
+        if (occluded_ray_watertight_tri_block(
+            ray, &leaf_data->watertight_ray,
+            &block, get_tri_block_mask(i, begin, end)))
+            return true;
+    }
+    return false;
+}
+
+#define GEN_OCCLUDED_RAY_MESH_ACCEL_BVH(T, bvh) \
+    static bool occluded_ray_##T##_mesh_accel_##bvh(const struct ray* ray, const struct accel* accel) { \
+        struct mesh_accel* mesh_accel = (void*)accel; \
+        return occluded_ray_##bvh( \
+            ray, mesh_accel->bvh, \
+            occluded_ray_##T##_mesh_accel_leaf, \
+            get_##T##_mesh_accel_leaf_data(mesh_accel)); \
+    }
+
+#define GEN_OCCLUDED_RAY_WATERTIGHT_MESH_ACCEL_BVH(T, bvh) \
+    static bool occluded_ray_##T##_mesh_accel_##bvh(const struct ray* ray, const struct accel* accel) { \
+        struct mesh_accel* mesh_accel = (void*)accel; \
+        struct T##_leaf_data leaf_data = make_##T##_leaf_data(mesh_accel, ray); \
+        return occluded_ray_##bvh( \
+            ray, mesh_accel->bvh, \
+            occluded_ray_##T##_mesh_accel_leaf, \
+            &leaf_data); \
+    }
+
+#define GEN_OCCLUDED_RAY_MESH_ACCEL_FNS(T) \
+    static bool (*const occluded_ray_##T##_mesh_accel_fns[])(const struct ray*, const struct accel*) = { \
+        [BINARY_BVH]      = occluded_ray_##T##_mesh_accel_bvh, \
+        [WIDE_BVH4]       = occluded_ray_##T##_mesh_accel_bvh4, \
+        [WIDE_BVH8]       = occluded_ray_##T##_mesh_accel_bvh8, \
+        [COMPRESSED_BVH8] = occluded_ray_##T##_mesh_accel_compressed_bvh8 \
+    };
+
+GEN_OCCLUDED_RAY_MESH_ACCEL_BVH(tri, bvh)
+GEN_OCCLUDED_RAY_MESH_ACCEL_BVH(tri, bvh4)
+GEN_OCCLUDED_RAY_MESH_ACCEL_BVH(tri, bvh8)
+GEN_OCCLUDED_RAY_MESH_ACCEL_BVH(tri, compressed_bvh8)
+GEN_OCCLUDED_RAY_MESH_ACCEL_FNS(tri)
+
+GEN_OCCLUDED_RAY_MESH_ACCEL_BVH(quad, bvh)
+GEN_OCCLUDED_RAY_MESH_ACCEL_BVH(quad, bvh4)
+GEN_OCCLUDED_RAY_MESH_ACCEL_BVH(quad, bvh8)
+GEN_OCCLUDED_RAY_MESH_ACCEL_BVH(quad, compressed_bvh8)
+GEN_OCCLUDED_RAY_MESH_ACCEL_FNS(quad)
+
+GEN_OCCLUDED_RAY_WATERTIGHT_MESH_ACCEL_BVH(watertight_tri, bvh)
+GEN_OCCLUDED_RAY_WATERTIGHT_MESH_ACCEL_BVH(watertight_tri, bvh4)
+GEN_OCCLUDED_RAY_WATERTIGHT_MESH_ACCEL_BVH(watertight_tri, bvh8)
+GEN_OCCLUDED_RAY_WATERTIGHT_MESH_ACCEL_BVH(watertight_tri, compressed_bvh8)
+GEN_OCCLUDED_RAY_MESH_ACCEL_FNS(watertight_tri)
+
+GEN_OCCLUDED_RAY_MESH_ACCEL_BVH(indexed_tri, bvh)
+GEN_OCCLUDED_RAY_MESH_ACCEL_BVH(indexed_tri, bvh4)
+GEN_OCCLUDED_RAY_MESH_ACCEL_BVH(indexed_tri, bvh8)
+GEN_OCCLUDED_RAY_MESH_ACCEL_BVH(indexed_tri, compressed_bvh8)
+GEN_OCCLUDED_RAY_MESH_ACCEL_FNS(indexed_tri)
+
+GEN_OCCLUDED_RAY_WATERTIGHT_MESH_ACCEL_BVH(indexed_watertight_tri, bvh)
+GEN_OCCLUDED_RAY_WATERTIGHT_MESH_ACCEL_BVH(indexed_watertight_tri, bvh4)
+GEN_OCCLUDED_RAY_WATERTIGHT_MESH_ACCEL_BVH(indexed_watertight_tri, bvh8)
+GEN_OCCLUDED_RAY_WATERTIGHT_MESH_ACCEL_BVH(indexed_watertight_tri, compressed_bvh8)
+GEN_OCCLUDED_RAY_MESH_ACCEL_FNS(indexed_watertight_tri)
+
+static void set_tri_mesh_accel_fns(struct mesh_accel* mesh_accel, const struct mesh_accel_params* params) {
+    mesh_accel->tri_intersection = params->tri_intersection;
+    mesh_accel->tri_storage = params->tri_storage;
+    if (params->tri_storage == INDEXED_TRI_STORAGE) {
+        bool is_watertight = params->tri_intersection == WATERTIGHT_TRI_INTERSECTION;
+        mesh_accel->accel.intersect_ray = is_watertight
+            ? intersect_ray_indexed_watertight_tri_mesh_accel_fns[params->bvh_layout]
+            : intersect_ray_indexed_tri_mesh_accel_fns[params->bvh_layout];
+        mesh_accel->accel.intersect_ray_packet = intersect_ray_packet_accel_one_by_one;
+        mesh_accel->accel.intersect_ray_stream = intersect_ray_stream_accel_one_by_one;
+        mesh_accel->accel.occluded_ray = is_watertight
+            ? occluded_ray_indexed_watertight_tri_mesh_accel_fns[params->bvh_layout]
+            : occluded_ray_indexed_tri_mesh_accel_fns[params->bvh_layout];
+        return;
+    }
+    assert(params->tri_storage == PRECOMPUTED_TRI_STORAGE);
+    if (params->tri_intersection == WATERTIGHT_TRI_INTERSECTION) {
+        mesh_accel->accel.intersect_ray = intersect_ray_watertight_tri_mesh_accel_fns[params->bvh_layout];
+        mesh_accel->accel.intersect_ray_packet = intersect_ray_packet_accel_one_by_one;
+        mesh_accel->accel.intersect_ray_stream = intersect_ray_stream_accel_one_by_one;
+        mesh_accel->accel.occluded_ray = occluded_ray_watertight_tri_mesh_accel_fns[params->bvh_layout];
+        return;
+    }
+    assert(params->tri_intersection == FAST_TRI_INTERSECTION);
+    mesh_accel->accel.intersect_ray = intersect_ray_tri_mesh_accel_fns[params->bvh_layout];
+    mesh_accel->accel.intersect_ray_packet = intersect_ray_packet_tri_mesh_accel_fns[params->bvh_layout];
+    mesh_accel->accel.intersect_ray_stream = intersect_ray_stream_tri_mesh_accel_fns[params->bvh_layout];
+    mesh_accel->accel.occluded_ray = occluded_ray_tri_mesh_accel_fns[params->bvh_layout];
+}
+
+static void set_quad_mesh_accel_fns(struct mesh_accel* mesh_accel, const struct mesh_accel_params* params) {
+    mesh_accel->accel.intersect_ray = intersect_ray_quad_mesh_accel_fns[params->bvh_layout];
+    mesh_accel->accel.intersect_ray_packet = intersect_ray_packet_quad_mesh_accel_fns[params->bvh_layout];
+    mesh_accel->accel.intersect_ray_stream = intersect_ray_stream_quad_mesh_accel_fns[params->bvh_layout];
+    mesh_accel->accel.occluded_ray = occluded_ray_quad_mesh_accel_fns[params->bvh_layout];
+}
 
 static void free_mesh_accel(struct accel* accel) {
     struct mesh_accel* mesh_accel = (void*)accel;
+    if (mesh_accel->mapped_file) {
+        // The nodes, primitive indices, and primitives belong to the mapping
+        if (mesh_accel->bvh)
+            free(mesh_accel->bvh->parents);
+        if (mesh_accel->bvh4)
+            free(mesh_accel->bvh4->parents);
+        if (mesh_accel->bvh8)
+            free(mesh_accel->bvh8->parents);
+        free(mesh_accel->bvh);
+        free(mesh_accel->bvh4);
+        free(mesh_accel->bvh8);
+        free(mesh_accel->compressed_bvh8);
+        free(mesh_accel->tri_blocks);
+        free(mesh_accel->watertight_tri_blocks);
+        free(mesh_accel->indexed_tri_blocks);
+        unmap_file(mesh_accel->mapped_file);
+        free(mesh_accel);
+        return;
+    }
     free(mesh_accel->primitives);
-    free_bvh(mesh_accel->bvh);
+    free(mesh_accel->tri_blocks);
+    free(mesh_accel->watertight_tri_blocks);
+    free(mesh_accel->indexed_tri_blocks);
+    if (mesh_accel->bvh)  free_bvh(mesh_accel->bvh);
+    if (mesh_accel->bvh4) free_bvh4(mesh_accel->bvh4);
+    if (mesh_accel->bvh8) free_bvh8(mesh_accel->bvh8);
+    if (mesh_accel->compressed_bvh8) free_compressed_bvh8(mesh_accel->compressed_bvh8);
     free(mesh_accel);
 }
 
-struct permute_task {
+// Converts the given binary BVH to the requested layout, and stores the result in the
+// acceleration data structure.
+static void convert_mesh_accel_bvh(
+    struct mesh_accel* mesh_accel,
+    struct bvh* bvh,
+    enum bvh_layout bvh_layout)
+{
+    switch (bvh_layout) {
+        case WIDE_BVH4:
+            mesh_accel->bvh4 = collapse_bvh4(bvh);
+            free_bvh(bvh);
+            break;
+        case WIDE_BVH8:
+            mesh_accel->bvh8 = collapse_bvh8(bvh);
+            free_bvh(bvh);
+            break;
+        case COMPRESSED_BVH8: {
+            struct bvh8* bvh8 = collapse_bvh8(bvh);
+            free_bvh(bvh);
+            mesh_accel->compressed_bvh8 = compress_bvh8(bvh8);
+            free_bvh8(bvh8);
+            break;
+        }
+        default:
+            assert(bvh_layout == BINARY_BVH);
+            mesh_accel->bvh = bvh;
+            break;
+    }
+}
+
+struct init_primitives_task {
     struct parallel_task_1d task;
-    const void* src_primitives;
-    void* dst_primitives;
+    void* primitives;
+    const struct mesh* mesh;
     const size_t* primitive_indices;
+    size_t first_primitive;
 };
 
-#define GEN_PERMUTE_TASK(T) \
-    static void run_permute_##T##s_task(struct parallel_task_1d* task, size_t thread_id) { \
+#define GEN_INIT_PRIMITIVES_TASK(T) \
+    static void run_init_##T##s_task(struct parallel_task_1d* task, size_t thread_id) { \
         IGNORE(thread_id); \
-        struct permute_task* permute_task = (void*)task; \
-        for (size_t i = task->range.begin, n = task->range.end; i < n; ++i) \
-            ((struct T*)permute_task->dst_primitives)[i] = \
-                ((struct T*)permute_task->src_primitives)[permute_task->primitive_indices[i]]; \
-    } \
+        struct init_primitives_task* init_primitives_task = (void*)task; \
+        struct T* primitives = init_primitives_task->primitives; \
+        for (size_t i = task->range.begin, n = task->range.end; i < n; ++i) { \
+            primitives[i] = make_mesh_##T( \
+                init_primitives_task->mesh, \
+                init_primitives_task->first_primitive + init_primitives_task->primitive_indices[i]); \
+        } \
+    }
 
-GEN_PERMUTE_TASK(tri)
-GEN_PERMUTE_TASK(quad)
+GEN_INIT_PRIMITIVES_TASK(quad)
 
-static inline void permute_primitives(
+// Generates the primitives of the mesh directly in the order given by `primitive_indices`, which
+// contains `primitive_count` indices relative to the beginning of the range of primitives of the mesh.
+static inline void init_permuted_primitives(
     struct thread_pool* thread_pool,
-    void (*run_permute_task)(struct parallel_task_1d*, size_t),
+    void (*run_init_primitives_task)(struct parallel_task_1d*, size_t),
+    const struct mesh* mesh,
+    size_t begin,
     const size_t* primitive_indices,
-    const void* src_primitives,
-    void* dst_primitives,
-    size_t primitive_count)
+    size_t primitive_count,
+    void* primitives)
 {
     parallel_for_1d(
         thread_pool,
-        run_permute_task,
-        (struct parallel_task_1d*)&(struct permute_task) {
-            .src_primitives = src_primitives,
-            .dst_primitives = dst_primitives,
-            .primitive_indices = primitive_indices
-        }, \
-        sizeof(struct permute_task),
+        run_init_primitives_task,
+        (struct parallel_task_1d*)&(struct init_primitives_task) {
+            .primitives = primitives,
+            .mesh = mesh,
+            .primitive_indices = primitive_indices,
+            .first_primitive = begin
+        },
+        sizeof(struct init_primitives_task),
         &(struct range) { 0, primitive_count });
 }
 
-struct init_primitives_task {
+static const size_t* get_mesh_accel_primitive_indices(const struct mesh_accel* mesh_accel) {
+    if (mesh_accel->bvh)  return mesh_accel->bvh->primitive_indices;
+    if (mesh_accel->bvh4) return mesh_accel->bvh4->primitive_indices;
+    if (mesh_accel->bvh8) return mesh_accel->bvh8->primitive_indices;
+    assert(mesh_accel->compressed_bvh8);
+    return mesh_accel->compressed_bvh8->primitive_indices;
+}
+
+struct tri_blocks_task {
     struct parallel_task_1d task;
-    void* primitives;
     const struct mesh* mesh;
+    const size_t* primitive_indices;
+    size_t first_primitive;
+    struct tri_block* blocks;
+    size_t tri_count;
 };
 
-static void run_init_tris_task(struct parallel_task_1d* task, size_t thread_id) {
+static void run_tri_blocks_task(struct parallel_task_1d* task, size_t thread_id) {
     IGNORE(thread_id);
-    struct init_primitives_task* init_primitives_task = (void*)task;
-    struct tri* tris = init_primitives_task->primitives;
-    const struct mesh* mesh = init_primitives_task->mesh;
-    const struct vec3* vertices = mesh->attrs[ATTR_POSITION].data;
+    struct tri_blocks_task* blocks_task = (void*)task;
     for (size_t i = task->range.begin, n = task->range.end; i < n; ++i) {
-        const struct vec3* v0 = &vertices[mesh->indices[i * 3 + 0]];
-        const struct vec3* v1 = &vertices[mesh->indices[i * 3 + 1]];
-        const struct vec3* v2 = &vertices[mesh->indices[i * 3 + 2]];
-        tris[i] = make_tri(v0, v1, v2);
+        // The last block is padded with copies of the last triangle
+        for (size_t j = 0; j < TRI_BLOCK_SIZE; ++j) {
+            size_t k = i * TRI_BLOCK_SIZE + j;
+            k = k < blocks_task->tri_count ? k : blocks_task->tri_count - 1;
+            struct tri tri = make_mesh_tri(blocks_task->mesh, blocks_task->first_primitive + blocks_task->primitive_indices[k]);
+            set_tri_block_lane(&blocks_task->blocks[i], j, &tri);
+        }
     }
 }
 
-static void run_init_quads_task(struct parallel_task_1d* task, size_t thread_id) {
+struct watertight_tri_blocks_task {
+    struct parallel_task_1d task;
+    const struct mesh* mesh;
+    const size_t* primitive_indices;
+    size_t first_primitive;
+    struct watertight_tri_block* blocks;
+    size_t tri_count;
+};
+
+static void run_watertight_tri_blocks_task(struct parallel_task_1d* task, size_t thread_id) {
     IGNORE(thread_id);
-    struct init_primitives_task* init_primitives_task = (void*)task;
-    struct quad* quads = init_primitives_task->primitives;
-    const struct mesh* mesh = init_primitives_task->mesh;
+    struct watertight_tri_blocks_task* blocks_task = (void*)task;
+    const struct mesh* mesh = blocks_task->mesh;
     const struct vec3* vertices = mesh->attrs[ATTR_POSITION].data;
     for (size_t i = task->range.begin, n = task->range.end; i < n; ++i) {
-        const struct vec3* v0 = &vertices[mesh->indices[i * 4 + 0]];
-        const struct vec3* v1 = &vertices[mesh->indices[i * 4 + 1]];
-        const struct vec3* v2 = &vertices[mesh->indices[i * 4 + 2]];
-        const struct vec3* v3 = &vertices[mesh->indices[i * 4 + 3]];
-        quads[i] = make_quad(v0, v1, v2, v3);
+        for (size_t j = 0; j < TRI_BLOCK_SIZE; ++j) {
+            size_t k = i * TRI_BLOCK_SIZE + j;
+            k = k < blocks_task->tri_count ? k : blocks_task->tri_count - 1;
+            // The vertices are taken from the mesh, so that neighboring triangles share the exact same vertices
+            const size_t* indices = &mesh->indices[(blocks_task->first_primitive + blocks_task->primitive_indices[k]) * 3];
+            set_watertight_tri_block_lane(
+                &blocks_task->blocks[i], j,
+                &vertices[indices[0]],
+                &vertices[indices[1]],
+                &vertices[indices[2]]);
+        }
     }
 }
 
-static inline void init_primitives(
+struct indexed_tri_blocks_task {
+    struct parallel_task_1d task;
+    const size_t* indices;
+    const size_t* primitive_indices;
+    struct indexed_tri_block* blocks;
+    size_t tri_count;
+};
+
+static void run_indexed_tri_blocks_task(struct parallel_task_1d* task, size_t thread_id) {
+    IGNORE(thread_id);
+    struct indexed_tri_blocks_task* blocks_task = (void*)task;
+    for (size_t i = task->range.begin, n = task->range.end; i < n; ++i) {
+        size_t vertex_indices[3][TRI_BLOCK_SIZE];
+        size_t min_index = SIZE_MAX, max_index = 0;
+        for (size_t j = 0; j < TRI_BLOCK_SIZE; ++j) {
+            size_t k = i * TRI_BLOCK_SIZE + j;
+            k = k < blocks_task->tri_count ? k : blocks_task->tri_count - 1;
+            const size_t* indices = &blocks_task->indices[blocks_task->primitive_indices[k] * 3];
+            for (size_t l = 0; l < 3; ++l) {
+                vertex_indices[l][j] = indices[l];
+                min_index = indices[l] < min_index ? indices[l] : min_index;
+                max_index = indices[l] > max_index ? indices[l] : max_index;
+            }
+        }
+
+        struct indexed_tri_block* block = &blocks_task->blocks[i];
+        if (min_index >= INDEXED_TRI_BLOCK_UNCOMPRESSED || max_index - min_index > UINT16_MAX) {
+            *block = (struct indexed_tri_block) { .first_vertex = INDEXED_TRI_BLOCK_UNCOMPRESSED };
+            continue;
+        }
+        block->first_vertex = min_index;
+        for (size_t j = 0; j < TRI_BLOCK_SIZE; ++j) {
+            for (size_t l = 0; l < 3; ++l)
+                block->vertex_offsets[l][j] = vertex_indices[l][j] - min_index;
+        }
+    }
+}
+
+// Compresses the vertex indices of the triangles, in the order of the leaves. The
+// vertices are then read from the mesh, which must outlive the acceleration data structure.
+static void init_indexed_tri_mesh_accel_leaf_data(
     struct thread_pool* thread_pool,
-    void (*run_init_primitives_task)(struct parallel_task_1d*, size_t),
+    struct mesh_accel* mesh_accel,
     const struct mesh* mesh,
-    size_t begin, size_t end,
-    void* primitives)
+    size_t begin)
 {
+    size_t block_count = (mesh_accel->primitive_count + TRI_BLOCK_SIZE - 1) / TRI_BLOCK_SIZE;
+    if (!mesh_accel->indexed_tri_blocks)
+        mesh_accel->indexed_tri_blocks = xmalloc(sizeof(struct indexed_tri_block) * (block_count > 0 ? block_count : 1));
+    mesh_accel->indexed_tri_leaf_data = (struct indexed_tri_leaf_data) {
+        .blocks = mesh_accel->indexed_tri_blocks,
+        .vertices = mesh->attrs[ATTR_POSITION].data,
+        .indices = mesh->indices + begin * 3,
+        .primitive_indices = get_mesh_accel_primitive_indices(mesh_accel),
+        .tri_count = mesh_accel->primitive_count
+    };
     parallel_for_1d(
         thread_pool,
-        run_init_primitives_task,
-        (struct parallel_task_1d*)&(struct init_primitives_task) {
-            .primitives = primitives,
-            .mesh = mesh
+        run_indexed_tri_blocks_task,
+        (struct parallel_task_1d*)&(struct indexed_tri_blocks_task) {
+            .indices = mesh_accel->indexed_tri_leaf_data.indices,
+            .primitive_indices = mesh_accel->indexed_tri_leaf_data.primitive_indices,
+            .blocks = mesh_accel->indexed_tri_blocks,
+            .tri_count = mesh_accel->primitive_count
         },
-        sizeof(struct init_primitives_task),
-        &(struct range) { begin, end });
+        sizeof(struct indexed_tri_blocks_task),
+        &(struct range) { 0, block_count });
+}
+
+// Generates the data used to intersect the leaves from the mesh, in the order of the leaves. With
+// precomputed storage, the triangles are only stored in blocks, which are used by all the queries.
+static void init_tri_mesh_accel_leaf_data(
+    struct thread_pool* thread_pool,
+    struct mesh_accel* mesh_accel,
+    const struct mesh* mesh,
+    size_t begin)
+{
+    if (mesh_accel->tri_storage == INDEXED_TRI_STORAGE) {
+        init_indexed_tri_mesh_accel_leaf_data(thread_pool, mesh_accel, mesh, begin);
+        return;
+    }
+
+    size_t block_count = (mesh_accel->primitive_count + TRI_BLOCK_SIZE - 1) / TRI_BLOCK_SIZE;
+    if (mesh_accel->tri_intersection == WATERTIGHT_TRI_INTERSECTION) {
+        if (!mesh_accel->watertight_tri_blocks)
+            mesh_accel->watertight_tri_blocks = xmalloc(sizeof(struct watertight_tri_block) * (block_count > 0 ? block_count : 1));
+        parallel_for_1d(
+            thread_pool,
+            run_watertight_tri_blocks_task,
+            (struct parallel_task_1d*)&(struct watertight_tri_blocks_task) {
+                .mesh = mesh,
+                .primitive_indices = get_mesh_accel_primitive_indices(mesh_accel),
+                .first_primitive = begin,
+                .blocks = mesh_accel->watertight_tri_blocks,
+                .tri_count = mesh_accel->primitive_count
+            },
+            sizeof(struct watertight_tri_blocks_task),
+            &(struct range) { 0, block_count });
+        return;
+    }
+
+    if (!mesh_accel->tri_blocks)
+        mesh_accel->tri_blocks = xmalloc(sizeof(struct tri_block) * (block_count > 0 ? block_count : 1));
+    parallel_for_1d(
+        thread_pool,
+        run_tri_blocks_task,
+        (struct parallel_task_1d*)&(struct tri_blocks_task) {
+            .mesh = mesh,
+            .primitive_indices = get_mesh_accel_primitive_indices(mesh_accel),
+            .first_primitive = begin,
+            .blocks = mesh_accel->tri_blocks,
+            .tri_count = mesh_accel->primitive_count
+        },
+        sizeof(struct tri_blocks_task),
+        &(struct range) { 0, block_count });
+}
+
+static void init_quad_mesh_accel_leaf_data(
+    struct thread_pool* thread_pool,
+    struct mesh_accel* mesh_accel,
+    const struct mesh* mesh,
+    size_t begin)
+{
+    // Quads are directly intersected from the permuted primitives
+    if (!mesh_accel->primitives)
+        mesh_accel->primitives = xmalloc(sizeof(struct quad) * mesh_accel->primitive_count);
+    init_permuted_primitives(
+        thread_pool, run_init_quads_task, mesh, begin,
+        get_mesh_accel_primitive_indices(mesh_accel),
+        mesh_accel->primitive_count,
+        mesh_accel->primitives);
 }
 
+// Maximum number of references to primitives that spatial splits can add, relative to the number of primitives
+#define MAX_REFERENCE_DUPLICATION 0.3
+
+static struct bvh* build_mesh_accel_bvh(
+    struct thread_pool* thread_pool,
+    void* primitives,
+    bbox_fn_t bbox_fn,
+    center_fn_t center_fn,
+    split_fn_t split_fn,
+    size_t primitive_count,
+    real_t traversal_cost,
+    const struct mesh_accel_params* params)
+{
+    struct bvh* bvh;
+    switch (params->bvh_builder) {
+        case SAH_BVH_BUILDER:
+            bvh = build_sah_bvh(thread_pool, primitives, bbox_fn, center_fn, primitive_count, traversal_cost);
+            break;
+        case SPATIAL_SPLIT_BVH_BUILDER:
+            bvh = build_sbvh(
+                thread_pool, primitives, bbox_fn, split_fn,
+                primitive_count, traversal_cost,
+                MAX_REFERENCE_DUPLICATION);
+            break;
+        case TREELET_BVH_BUILDER:
+            bvh = build_bvh(thread_pool, primitives, bbox_fn, center_fn, primitive_count, traversal_cost);
+            restructure_bvh(thread_pool, bvh, traversal_cost);
+            break;
+        default:
+            assert(params->bvh_builder == FAST_BVH_BUILDER);
+            bvh = build_bvh(thread_pool, primitives, bbox_fn, center_fn, primitive_count, traversal_cost);
+            break;
+    }
+    if (params->bvh_optimization_time > 0)
+        optimize_bvh(thread_pool, bvh, params->bvh_optimization_time);
+    return bvh;
+}
+
+/*
+ * The BVH is built from primitives that are generated on the fly from the mesh, and the primitives
+ * are only stored once the BVH has been converted to its final layout, directly in the order of the
+ * leaves. This way, they are not allocated at all while the construction buffers are, which keeps the
+ * peak memory usage during construction low. Each primitive is stored once: quads as an array, and
+ * triangles only in blocks (or as compressed indices, with indexed storage).
+ */
 #define GEN_BUILD_MESH_ACCEL(T, mesh_type, traversal_cost) \
     static struct accel* build_##T##_mesh_accel( \
         struct thread_pool* thread_pool, \
         const struct mesh* mesh, \
-        size_t begin, size_t end) \
+        size_t begin, size_t end, \
+        const struct mesh_accel_params* params) \
     { \
         assert(mesh->type == mesh_type); \
-        size_t primitive_count = end - begin; \
-        struct T* primitives = xmalloc(sizeof(struct T) * primitive_count); \
-        init_primitives(thread_pool, run_init_##T##s_task, mesh, begin, end, primitives - begin); \
-        struct bvh* bvh = build_bvh( \
-            thread_pool, primitives, \
-            get_##T##_bbox, \
-            get_##T##_center, \
-            primitive_count, \
-            traversal_cost); \
-        struct T* permuted_primitives = xmalloc(sizeof(struct T) * primitive_count); \
-        permute_primitives( \
+        struct bvh* bvh = build_mesh_accel_bvh( \
             thread_pool, \
-            run_permute_##T##s_task, \
-            bvh->primitive_indices, \
-            primitives, permuted_primitives, \
-            primitive_count); \
-        free(primitives); \
-        struct mesh_accel* mesh_accel = xmalloc(sizeof(struct mesh_accel)); \
-        mesh_accel->accel.intersect_ray = intersect_ray_##T##_mesh_accel; \
+            &(struct mesh_primitives) { .mesh = mesh, .first_primitive = begin }, \
+            get_mesh_##T##_bbox, \
+            get_mesh_##T##_center, \
+            split_mesh_##T, \
+            end - begin, \
+            traversal_cost, \
+            params); \
+        struct mesh_accel* mesh_accel = xcalloc(1, sizeof(struct mesh_accel)); \
+        /* With spatial splits, primitives can be referenced several times, and are then duplicated */ \
+        mesh_accel->primitive_count = bvh->primitive_index_count; \
+        set_##T##_mesh_accel_fns(mesh_accel, params); \
+        convert_mesh_accel_bvh(mesh_accel, bvh, params->bvh_layout); \
         mesh_accel->accel.free = free_mesh_accel; \
-        mesh_accel->bvh = bvh; \
-        mesh_accel->primitives = permuted_primitives; \
+        init_##T##_mesh_accel_leaf_data(thread_pool, mesh_accel, mesh, begin); \
         return &mesh_accel->accel; \
     }
 
 GEN_BUILD_MESH_ACCEL(tri,  TRI_MESH,  1.5)
 GEN_BUILD_MESH_ACCEL(quad, QUAD_MESH, 1.2)
 
-struct accel* build_mesh_accel(struct thread_pool* thread_pool, const struct mesh* mesh, size_t begin, size_t end) {
+static void refit_mesh_accel_bvh(
+    struct thread_pool* thread_pool,
+    struct mesh_accel* mesh_accel,
+    void* primitive_data,
+    bbox_fn_t bbox_fn)
+{
+    if (mesh_accel->bvh)
+        refit_bvh(thread_pool, mesh_accel->bvh, primitive_data, bbox_fn);
+    else if (mesh_accel->bvh4)
+        refit_bvh4(mesh_accel->bvh4, primitive_data, bbox_fn);
+    else if (mesh_accel->bvh8)
+        refit_bvh8(mesh_accel->bvh8, primitive_data, bbox_fn);
+    else
+        refit_compressed_bvh8(mesh_accel->compressed_bvh8, primitive_data, bbox_fn);
+}
+
+static void update_quad_mesh_accel(
+    struct thread_pool* thread_pool,
+    struct mesh_accel* mesh_accel,
+    const struct mesh* mesh,
+    size_t begin, size_t end)
+{
+    // The primitives are regenerated in place, in the order of the leaves
+    IGNORE(end);
+    assert(end - begin <= mesh_accel->primitive_count);
+    init_quad_mesh_accel_leaf_data(thread_pool, mesh_accel, mesh, begin);
+    refit_mesh_accel_bvh(thread_pool, mesh_accel, mesh_accel->primitives, get_quad_bbox);
+}
+
+static void update_tri_mesh_accel(
+    struct thread_pool* thread_pool,
+    struct mesh_accel* mesh_accel,
+    const struct mesh* mesh,
+    size_t begin, size_t end)
+{
+    // The blocks or compressed indices are regenerated in place, and the
+    // BVH is refit from the mesh, since the triangles are not stored as-is
+    IGNORE(end);
+    assert(end - begin <= mesh_accel->primitive_count);
+    init_tri_mesh_accel_leaf_data(thread_pool, mesh_accel, mesh, begin);
+    refit_mesh_accel_bvh(
+        thread_pool, mesh_accel,
+        &(struct mesh_primitives) {
+            .mesh = mesh,
+            .first_primitive = begin,
+            .primitive_indices = get_mesh_accel_primitive_indices(mesh_accel)
+        },
+        get_mesh_tri_bbox);
+}
+
+void update_mesh_accel(
+    struct thread_pool* thread_pool,
+    struct accel* accel,
+    const struct mesh* mesh,
+    size_t begin, size_t end)
+{
+    struct mesh_accel* mesh_accel = (void*)accel;
+    assert(accel->free == free_mesh_accel);
+    if (mesh->type == QUAD_MESH)
+        update_quad_mesh_accel(thread_pool, mesh_accel, mesh, begin, end);
+    else
+        update_tri_mesh_accel(thread_pool, mesh_accel, mesh, begin, end);
+}
+
+struct accel* build_mesh_accel(
+    struct thread_pool* thread_pool,
+    const struct mesh* mesh,
+    size_t begin, size_t end,
+    const struct mesh_accel_params* params)
+{
     return mesh->type == TRI_MESH
-        ? build_tri_mesh_accel(thread_pool, mesh, begin, end)
-        : build_quad_mesh_accel(thread_pool, mesh, begin, end);
+        ? build_tri_mesh_accel(thread_pool, mesh, begin, end, params)
+        : build_quad_mesh_accel(thread_pool, mesh, begin, end, params);
+}
+
+/*
+ * Acceleration data structures can be cached on disk. The key of an entry is a content hash of the
+ * vertex positions and indices of the mesh, along with the construction parameters. The file contains
+ * a header followed by the nodes, the primitive indices, and the permuted quads (for quad meshes), each
+ * of these arrays being aligned so that they can be used directly from a memory mapping of the file.
+ */
+
+#define MESH_ACCEL_FILE_MAGIC     "RTBVHCCH"
+#define MESH_ACCEL_FILE_VERSION   3
+#define MESH_ACCEL_FILE_ALIGNMENT 64
+
+// Size of the blocks of data that are hashed in parallel. The block size must not depend
+// on the number of threads, so that the hash is the same regardless of the thread pool.
+#define HASH_BLOCK_SIZE (1 << 20)
+
+struct mesh_accel_file_header {
+    char magic[8];
+    uint32_t version;
+    uint16_t real_size;
+    uint16_t size_t_size;
+    uint64_t key;
+    uint32_t mesh_type;
+    uint32_t bvh_layout;
+    uint64_t node_size;
+    uint64_t node_count;
+    uint64_t primitive_size;
+    uint64_t primitive_count;
+    uint64_t node_offset;
+    uint64_t primitive_index_offset;
+    uint64_t primitive_offset;
+    uint64_t file_size;
+};
+
+struct hash_task {
+    struct parallel_task_1d task;
+    const uint8_t* data;
+    size_t size;
+    uint64_t* block_hashes;
+};
+
+static void run_hash_task(struct parallel_task_1d* task, size_t thread_id) {
+    IGNORE(thread_id);
+    struct hash_task* hash_task = (void*)task;
+    for (size_t i = task->range.begin, n = task->range.end; i < n; ++i) {
+        size_t begin = i * HASH_BLOCK_SIZE;
+        size_t end = begin + HASH_BLOCK_SIZE < hash_task->size ? begin + HASH_BLOCK_SIZE : hash_task->size;
+        hash_task->block_hashes[i] = hash64_bytes(hash64_init(), hash_task->data + begin, end - begin);
+    }
+}
+
+static uint64_t hash_mesh_data(struct thread_pool* thread_pool, uint64_t h, const void* data, size_t size) {
+    size_t block_count = (size + HASH_BLOCK_SIZE - 1) / HASH_BLOCK_SIZE;
+    uint64_t* block_hashes = xmalloc(sizeof(uint64_t) * (block_count > 0 ? block_count : 1));
+    parallel_for_1d(
+        thread_pool,
+        run_hash_task,
+        (struct parallel_task_1d*)&(struct hash_task) {
+            .data = data,
+            .size = size,
+            .block_hashes = block_hashes
+        },
+        sizeof(struct hash_task),
+        &(struct range) { 0, block_count });
+    h = hash64_uint64(h, size);
+    for (size_t i = 0; i < block_count; ++i)
+        h = hash64_uint64(h, block_hashes[i]);
+    free(block_hashes);
+    return h;
+}
+
+uint64_t hash_mesh_accel_input(
+    struct thread_pool* thread_pool,
+    const struct mesh* mesh,
+    size_t begin, size_t end,
+    const struct mesh_accel_params* params)
+{
+    size_t stride = mesh->type == TRI_MESH ? 3 : 4;
+    uint64_t h = hash64_init();
+    h = hash64_uint64(h, MESH_ACCEL_FILE_VERSION);
+    h = hash64_uint64(h, sizeof(real_t));
+    h = hash64_uint64(h, sizeof(size_t));
+    h = hash64_uint64(h, mesh->type);
+    h = hash64_uint64(h, params->bvh_layout);
+    h = hash64_uint64(h, params->bvh_builder);
+    h = hash64_uint64(h, mesh->type == TRI_MESH ? params->tri_storage : PRECOMPUTED_TRI_STORAGE);
+    h = hash64_bytes(h, &params->bvh_optimization_time, sizeof(double));
+    h = hash_mesh_data(thread_pool, h, mesh->attrs[ATTR_POSITION].data, sizeof(struct vec3) * mesh->vertex_count);
+    h = hash_mesh_data(thread_pool, h, mesh->indices + begin * stride, sizeof(size_t) * (end - begin) * stride);
+    return h;
+}
+
+// Returns the size of the primitives stored in the file. Triangles are not stored, since their
+// blocks or compressed indices are regenerated from the mesh and the primitive indices on load.
+static size_t get_mesh_primitive_size(enum mesh_type mesh_type) {
+    return mesh_type == QUAD_MESH ? sizeof(struct quad) : 0;
+}
+
+static size_t get_bvh_node_size(enum bvh_layout bvh_layout) {
+    switch (bvh_layout) {
+        case WIDE_BVH4:       return sizeof(struct bvh4_node);
+        case WIDE_BVH8:       return sizeof(struct bvh8_node);
+        case COMPRESSED_BVH8: return sizeof(struct compressed_bvh8_node);
+        default:
+            assert(bvh_layout == BINARY_BVH);
+            return sizeof(struct bvh_node);
+    }
+}
+
+static inline uint64_t align_file_offset(uint64_t offset) {
+    return (offset + MESH_ACCEL_FILE_ALIGNMENT - 1) / MESH_ACCEL_FILE_ALIGNMENT * MESH_ACCEL_FILE_ALIGNMENT;
+}
+
+// Writes the given data, padded with zeros up to the given offset.
+static bool write_padded(FILE* fp, const void* data, size_t size, uint64_t offset, uint64_t next_offset) {
+    static const uint8_t zeros[MESH_ACCEL_FILE_ALIGNMENT] = { 0 };
+    assert(next_offset >= offset + size && next_offset - offset - size < MESH_ACCEL_FILE_ALIGNMENT);
+    size_t padding = next_offset - offset - size;
+    return
+        fwrite(data, 1, size, fp) == size &&
+        fwrite(zeros, 1, padding, fp) == padding;
+}
+
+bool save_mesh_accel(const struct accel* accel, const char* file_name, uint64_t key, const struct mesh* mesh) {
+    const struct mesh_accel* mesh_accel = (const void*)accel;
+    assert(accel->free == free_mesh_accel);
+
+    const void* nodes;
+    size_t node_count;
+    enum bvh_layout bvh_layout;
+    if (mesh_accel->bvh) {
+        bvh_layout = BINARY_BVH;
+        nodes = mesh_accel->bvh->nodes;
+        node_count = mesh_accel->bvh->node_count;
+    } else if (mesh_accel->bvh4) {
+        bvh_layout = WIDE_BVH4;
+        nodes = mesh_accel->bvh4->nodes;
+        node_count = mesh_accel->bvh4->node_count;
+    } else if (mesh_accel->bvh8) {
+        bvh_layout = WIDE_BVH8;
+        nodes = mesh_accel->bvh8->nodes;
+        node_count = mesh_accel->bvh8->node_count;
+    } else {
+        bvh_layout = COMPRESSED_BVH8;
+        nodes = mesh_accel->compressed_bvh8->nodes;
+        node_count = mesh_accel->compressed_bvh8->node_count;
+    }
+
+    struct mesh_accel_file_header header = {
+        .version         = MESH_ACCEL_FILE_VERSION,
+        .real_size       = sizeof(real_t),
+        .size_t_size     = sizeof(size_t),
+        .key             = key,
+        .mesh_type       = mesh->type,
+        .bvh_layout      = bvh_layout,
+        .node_size       = get_bvh_node_size(bvh_layout),
+        .node_count      = node_count,
+        .primitive_size  = get_mesh_primitive_size(mesh->type),
+        .primitive_count = mesh_accel->primitive_count
+    };
+    memcpy(header.magic, MESH_ACCEL_FILE_MAGIC, sizeof(header.magic));
+    header.node_offset            = align_file_offset(sizeof(header));
+    header.primitive_index_offset = align_file_offset(header.node_offset + header.node_size * node_count);
+    header.primitive_offset       = align_file_offset(header.primitive_index_offset + sizeof(size_t) * header.primitive_count);
+    header.file_size              = align_file_offset(header.primitive_offset + header.primitive_size * header.primitive_count);
+
+    // The file is written under a temporary name first, so that other processes never see a partial file
+    size_t tmp_file_name_size = strlen(file_name) + 5;
+    char* tmp_file_name = xmalloc(tmp_file_name_size);
+    snprintf(tmp_file_name, tmp_file_name_size, "%s.tmp", file_name);
+    FILE* fp = fopen(tmp_file_name, "wb");
+    if (!fp) {
+        free(tmp_file_name);
+        return false;
+    }
+    bool ok =
+        write_padded(fp, &header, sizeof(header), 0, header.node_offset) &&
+        write_padded(fp, nodes, header.node_size * node_count,
+            header.node_offset, header.primitive_index_offset) &&
+        write_padded(fp, get_mesh_accel_primitive_indices(mesh_accel), sizeof(size_t) * header.primitive_count,
+            header.primitive_index_offset, header.primitive_offset) &&
+        write_padded(fp, mesh_accel->primitives, header.primitive_size * header.primitive_count,
+            header.primitive_offset, header.file_size);
+    ok &= fclose(fp) == 0;
+    ok = ok && rename(tmp_file_name, file_name) == 0;
+    if (!ok)
+        remove(tmp_file_name);
+    free(tmp_file_name);
+    return ok;
+}
+
+static bool is_valid_mesh_accel_file(
+    const struct mapped_file* mapped_file,
+    uint64_t key,
+    const struct mesh* mesh,
+    const struct mesh_accel_params* params)
+{
+    const struct mesh_accel_file_header* header = mapped_file->data;
+    if (mapped_file->size < sizeof(struct mesh_accel_file_header) ||
+        memcmp(header->magic, MESH_ACCEL_FILE_MAGIC, sizeof(header->magic)) ||
+        header->version != MESH_ACCEL_FILE_VERSION ||
+        header->real_size != sizeof(real_t) ||
+        header->size_t_size != sizeof(size_t) ||
+        header->key != key ||
+        header->mesh_type != (uint32_t)mesh->type ||
+        header->bvh_layout != (uint32_t)params->bvh_layout ||
+        header->node_size != get_bvh_node_size(params->bvh_layout) ||
+        header->primitive_size != get_mesh_primitive_size(mesh->type) ||
+        header->file_size != mapped_file->size ||
+        header->node_count == 0)
+        return false;
+    // Check that the arrays are aligned, ordered, and within the bounds of the file
+    // (dividing instead of multiplying the sizes avoids overflows with corrupted headers)
+    return
+        header->node_offset % MESH_ACCEL_FILE_ALIGNMENT == 0 &&
+        header->primitive_index_offset % MESH_ACCEL_FILE_ALIGNMENT == 0 &&
+        header->primitive_offset % MESH_ACCEL_FILE_ALIGNMENT == 0 &&
+        header->node_offset >= sizeof(struct mesh_accel_file_header) &&
+        header->primitive_index_offset >= header->node_offset &&
+        header->primitive_offset >= header->primitive_index_offset &&
+        header->file_size >= header->primitive_offset &&
+        (header->primitive_index_offset - header->node_offset) / header->node_size >= header->node_count &&
+        (header->primitive_offset - header->primitive_index_offset) / sizeof(size_t) >= header->primitive_count &&
+        (header->primitive_size == 0 ||
+         (header->file_size - header->primitive_offset) / header->primitive_size >= header->primitive_count);
+}
+
+/*
+ * The contents of a file are validated before they are used, so that a corrupted or truncated cache entry
+ * is rejected instead of making the traversal read out of bounds. Every child index must be within the
+ * array of nodes and reference a node that no other node references, every leaf must reference a range of
+ * the primitive indices, and every primitive index must be within the primitive range of the mesh.
+ */
+
+static inline bool is_valid_file_primitive_range(size_t first_primitive, size_t primitive_count, size_t total_count) {
+    return primitive_count <= total_count && first_primitive <= total_count - primitive_count;
+}
+
+// Checks that each node is referenced at most once, which, since the root is never referenced,
+// guarantees that the nodes that are reachable from the root form a tree.
+static inline bool mark_file_node(bool* is_referenced, size_t node_index) {
+    if (is_referenced[node_index])
+        return false;
+    is_referenced[node_index] = true;
+    return true;
+}
+
+static bool is_valid_bvh_file_nodes(const struct bvh_node* nodes, size_t node_count, size_t primitive_count) {
+    bool* is_referenced = xcalloc(node_count, sizeof(bool));
+    bool is_valid = true;
+    for (size_t i = 0; i < node_count && is_valid; ++i) {
+        const struct bvh_node* node = &nodes[i];
+        if (node->primitive_count != 0) {
+            is_valid = is_valid_file_primitive_range(node->first_child_or_primitive, node->primitive_count, primitive_count);
+            continue;
+        }
+        // Children are stored in pairs, starting at an odd index
+        size_t first_child = node->first_child_or_primitive;
+        is_valid =
+            first_child % 2 == 1 &&
+            first_child < node_count - 1 &&
+            mark_file_node(is_referenced, first_child);
+    }
+    free(is_referenced);
+    return is_valid;
+}
+
+#define GEN_IS_VALID_WIDE_BVH_FILE_NODES(width) \
+    static bool is_valid_bvh##width##_file_nodes( \
+        const struct bvh##width##_node* nodes, \
+        size_t node_count, size_t primitive_count) \
+    { \
+        bool* is_referenced = xcalloc(node_count, sizeof(bool)); \
+        bool is_valid = true; \
+        for (size_t i = 0; i < node_count && is_valid; ++i) { \
+            const struct bvh##width##_node* node = &nodes[i]; \
+            for (size_t j = 0; j < width && is_valid; ++j) { \
+                size_t index = node->first_child_or_primitive[j]; \
+                if (node->primitive_count[j] != 0) \
+                    is_valid = is_valid_file_primitive_range(index, node->primitive_count[j], primitive_count); \
+                else if (node->bounds[0][j] <= node->bounds[1][j]) /* Empty slots are never traversed */ \
+                    is_valid = index != 0 && index < node_count && mark_file_node(is_referenced, index); \
+            } \
+        } \
+        free(is_referenced); \
+        return is_valid; \
+    }
+
+GEN_IS_VALID_WIDE_BVH_FILE_NODES(4)
+GEN_IS_VALID_WIDE_BVH_FILE_NODES(8)
+
+// The traversal finds parents by assuming that nodes are in breadth-first order, with contiguous
+// inner children and leaves, which is therefore what is checked here.
+static bool is_valid_compressed_bvh8_file_nodes(
+    const struct compressed_bvh8_node* nodes,
+    size_t node_count, size_t primitive_count)
+{
+    size_t next_child = 1, next_primitive = 0;
+    for (size_t i = 0; i < node_count; ++i) {
+        const struct compressed_bvh8_node* node = &nodes[i];
+        if (i >= next_child || node->first_child != next_child || node->first_primitive != next_primitive)
+            return false;
+        for (size_t j = 0; j < 8; ++j) {
+            if (node->inner_mask & (1u << j)) {
+                if (node->primitive_count[j] != 0)
+                    return false;
+                next_child++;
+            }
+            next_primitive += node->primitive_count[j];
+        }
+        if (next_child > node_count || next_primitive > primitive_count)
+            return false;
+    }
+    return next_child == node_count;
+}
+
+static bool is_valid_mesh_accel_file_data(
+    const struct mapped_file* mapped_file,
+    const struct mesh* mesh,
+    size_t begin,
+    enum bvh_layout bvh_layout)
+{
+    const struct mesh_accel_file_header* header = mapped_file->data;
+    const uint8_t* data = mapped_file->data;
+    const void* nodes = data + header->node_offset;
+    const size_t* primitive_indices = (const size_t*)(data + header->primitive_index_offset);
+
+    if (begin > mesh->primitive_count)
+        return false;
+    size_t range_size = mesh->primitive_count - begin;
+    for (size_t i = 0; i < header->primitive_count; ++i) {
+        if (primitive_indices[i] >= range_size)
+            return false;
+    }
+
+    switch (bvh_layout) {
+        case WIDE_BVH4:       return is_valid_bvh4_file_nodes(nodes, header->node_count, header->primitive_count);
+        case WIDE_BVH8:       return is_valid_bvh8_file_nodes(nodes, header->node_count, header->primitive_count);
+        case COMPRESSED_BVH8: return is_valid_compressed_bvh8_file_nodes(nodes, header->node_count, header->primitive_count);
+        default:
+            assert(bvh_layout == BINARY_BVH);
+            return is_valid_bvh_file_nodes(nodes, header->node_count, header->primitive_count);
+    }
+}
+
+struct accel* load_mesh_accel(
+    struct thread_pool* thread_pool,
+    const char* file_name,
+    uint64_t key,
+    const struct mesh* mesh,
+    size_t begin,
+    const struct mesh_accel_params* params)
+{
+    struct mapped_file* mapped_file = map_file(file_name);
+    if (!mapped_file)
+        return NULL;
+    if (!is_valid_mesh_accel_file(mapped_file, key, mesh, params) ||
+        !is_valid_mesh_accel_file_data(mapped_file, mesh, begin, params->bvh_layout)) {
+        unmap_file(mapped_file);
+        return NULL;
+    }
+
+    const struct mesh_accel_file_header* header = mapped_file->data;
+    uint8_t* data = mapped_file->data;
+    void* nodes = data + header->node_offset;
+    size_t* primitive_indices = (size_t*)(data + header->primitive_index_offset);
+
+    struct mesh_accel* mesh_accel = xcalloc(1, sizeof(struct mesh_accel));
+    mesh_accel->mapped_file = mapped_file;
+    mesh_accel->primitives = header->primitive_size > 0 ? data + header->primitive_offset : NULL;
+    mesh_accel->primitive_count = header->primitive_count;
+    switch (params->bvh_layout) {
+        case WIDE_BVH4:
+            mesh_accel->bvh4 = xmalloc(sizeof(struct bvh4));
+            *mesh_accel->bvh4 = (struct bvh4) { nodes, primitive_indices, header->node_count, NULL };
+            update_bvh4_parents(mesh_accel->bvh4);
+            break;
+        case WIDE_BVH8:
+            mesh_accel->bvh8 = xmalloc(sizeof(struct bvh8));
+            *mesh_accel->bvh8 = (struct bvh8) { nodes, primitive_indices, header->node_count, NULL };
+            update_bvh8_parents(mesh_accel->bvh8);
+            break;
+        case COMPRESSED_BVH8:
+            mesh_accel->compressed_bvh8 = xmalloc(sizeof(struct compressed_bvh8));
+            *mesh_accel->compressed_bvh8 = (struct compressed_bvh8) { nodes, primitive_indices, header->node_count };
+            break;
+        default:
+            assert(params->bvh_layout == BINARY_BVH);
+            mesh_accel->bvh = xmalloc(sizeof(struct bvh));
+            *mesh_accel->bvh = (struct bvh) {
+                .nodes = nodes,
+                .primitive_indices = primitive_indices,
+                .primitive_index_count = header->primitive_count,
+                .node_count = header->node_count,
+                .primitive_index_capacity = header->primitive_count,
+                .node_capacity = header->node_count
+            };
+            // Parents are not stored in the file, since they are cheap to recompute
+            update_bvh_parents(thread_pool, mesh_accel->bvh);
+            break;
+    }
+
+    // The permuted quads are used directly from the file, while triangle blocks are regenerated
+    if (mesh->type == TRI_MESH) {
+        set_tri_mesh_accel_fns(mesh_accel, params);
+        init_tri_mesh_accel_leaf_data(thread_pool, mesh_accel, mesh, begin);
+    } else {
+        set_quad_mesh_accel_fns(mesh_accel, params);
+    }
+    mesh_accel->accel.free = free_mesh_accel;
+    return &mesh_accel->accel;
 }
@@ -2,6 +2,8 @@
 #define SCENE_TRI_MESH_H
 
 #include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
 
 #include "scene/attr.h"
 
@@ -22,7 +24,7 @@ struct mesh {
         TRI_MESH,
         QUAD_MESH
     } type;
-    size_t* indices;
+    size_t* indices;           // 3 or 4 per primitive. Quads are in cyclic order, and triangles in quad meshes repeat their last vertex.
     struct attr_buf* attrs;
     size_t attr_count;
     size_t vertex_count;
@@ -54,9 +56,87 @@ void recompute_shading_normals(struct mesh* mesh);
 // (the winding order of vertices determines the normal direction).
 void recompute_geometry_normals(struct mesh* mesh);
 
+// Parameters that control the construction of the acceleration data structure of a mesh.
+struct mesh_accel_params {
+    enum bvh_layout {
+        BINARY_BVH,     // Only layout with specialized packet and stream traversal routines
+        WIDE_BVH4,
+        WIDE_BVH8,
+        COMPRESSED_BVH8 // Smallest memory footprint, slightly slower traversal
+    } bvh_layout;
+    enum bvh_builder {
+        FAST_BVH_BUILDER, // Fast parallel construction, suitable for interactive use
+        SAH_BVH_BUILDER,  // Slower construction, but better trees (for final renders)
+        SPATIAL_SPLIT_BVH_BUILDER, // Same, but splits large primitives, which uses more memory
+        TREELET_BVH_BUILDER // Fast construction followed by treelet restructuring, close to the SAH builder
+    } bvh_builder;
+    enum tri_intersection {
+        FAST_TRI_INTERSECTION,      // Rays going exactly through the edges of the triangles may miss them
+        WATERTIGHT_TRI_INTERSECTION // Slightly slower, never misses edges, and only traces rays one at a time
+    } tri_intersection; // Ignored for quad meshes
+    enum tri_storage {
+        PRECOMPUTED_TRI_STORAGE, // Stores a copy of each triangle with its edges and normal, which is the fastest
+        INDEXED_TRI_STORAGE      // Reads the vertices from the mesh, through indices compressed in each block of triangles.
+                                 // Uses several times less memory, but is slower, and only traces rays one at a time.
+                                 // The positions and indices of the mesh must then outlive the acceleration data structure.
+    } tri_storage; // Ignored for quad meshes
+    // Time (in seconds) spent optimizing the BVH after its construction, or 0 to disable this step.
+    // Worth enabling when the same static geometry is rendered for a long time.
+    double bvh_optimization_time;
+    // Directory where acceleration data structures are cached between runs, or `NULL` to disable
+    // caching. The string must remain valid until the geometry is prepared. This does not change
+    // the resulting acceleration data structure, and is thus ignored when comparing parameters.
+    const char* cache_dir;
+};
+
+static inline struct mesh_accel_params default_mesh_accel_params(void) {
+    return (struct mesh_accel_params) {
+        .bvh_layout = BINARY_BVH,
+        .bvh_builder = FAST_BVH_BUILDER,
+        .tri_intersection = FAST_TRI_INTERSECTION,
+        .tri_storage = PRECOMPUTED_TRI_STORAGE,
+        .bvh_optimization_time = 0,
+        .cache_dir = NULL
+    };
+}
+
 // Returns an acceleration data structure suitable to intersect
 // the given mesh for the given primitive range.
 // The returned object must be freed by calling `free_accel()`.
-struct accel* build_mesh_accel(struct thread_pool*, const struct mesh*, size_t, size_t);
+struct accel* build_mesh_accel(
+    struct thread_pool*,
+    const struct mesh*, size_t, size_t,
+    const struct mesh_accel_params*);
+
+// Updates an acceleration data structure built by `build_mesh_accel()` after the vertex
+// positions of the mesh have changed. The primitive range and the mesh topology must be the
+// same as when it was built. The BVH is refitted, which is much faster than rebuilding it.
+void update_mesh_accel(
+    struct thread_pool*,
+    struct accel*,
+    const struct mesh*, size_t, size_t);
+
+// Computes the key under which the acceleration data structure of the given primitive range is cached.
+// This is a 64-bit hash of the vertex positions and indices of the mesh, and of the construction parameters.
+uint64_t hash_mesh_accel_input(
+    struct thread_pool*,
+    const struct mesh*, size_t, size_t,
+    const struct mesh_accel_params*);
+
+// Saves an acceleration data structure built by `build_mesh_accel()` to a versioned binary file, along with
+// the given key. The file is only valid on machines that use the same precision and size of `size_t`.
+bool save_mesh_accel(const struct accel*, const char* file_name, uint64_t key, const struct mesh*);
+
+// Loads an acceleration data structure saved by `save_mesh_accel()`, by mapping the file in memory.
+// The mesh and the beginning of the primitive range must be the ones used to build it.
+// Returns `NULL` if the file does not exist, is invalid, or does not match the key or parameters.
+// The nodes and primitive indices are checked to be within bounds before the file is accepted.
+struct accel* load_mesh_accel(
+    struct thread_pool*,
+    const char* file_name,
+    uint64_t key,
+    const struct mesh*,
+    size_t begin,
+    const struct mesh_accel_params*);
 
 #endif
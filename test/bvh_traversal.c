@@ -0,0 +1,341 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+
+#include "accel/bvh.h"
+#include "accel/wide_bvh.h"
+#include "accel/compressed_bvh.h"
+#include "core/thread_pool.h"
+#include "core/random.h"
+#include "core/utils.h"
+
+// Traverses a BVH that is too deep for the fixed-size traversal stacks, with every layout,
+// and checks that the overflow fallback still visits every leaf exactly once, and that closest
+// hits, any hits, occlusion and packets give the same results as a brute-force search.
+// The BVH is a caterpillar: each node of its spine has another spine node and a small
+// subtree as children, and all the nodes are intersected by every ray.
+
+#define SPINE_LENGTH 1000
+#define PRIMITIVE_COUNT (2 * SPINE_LENGTH)
+#define RAY_COUNT 256
+
+struct primitives {
+    real_t positions[PRIMITIVE_COUNT]; // Position of each primitive on the x axis
+    struct bbox bboxes[PRIMITIVE_COUNT];
+    const size_t* primitive_indices;   // Primitive indices of the BVH being traversed
+    size_t visits[PRIMITIVE_COUNT];
+    bool report_hits;
+};
+
+static struct bbox get_primitive_bbox(void* primitive_data, size_t index) {
+    struct primitives* primitives = primitive_data;
+    return primitives->bboxes[primitives->primitive_indices[index]];
+}
+
+static bool intersect_ray_primitive(const struct primitives* primitives, const struct ray* ray, size_t index, real_t* t) {
+    *t = (primitives->positions[index] - ray->org._[0]) / ray->dir._[0];
+    return primitives->report_hits && *t > ray->t_min && *t < ray->t_max;
+}
+
+static bool intersect_ray_leaf(struct ray* ray, struct hit* hit, const struct bvh_node* leaf, void* intersection_data) {
+    struct primitives* primitives = intersection_data;
+    bool found = false;
+    for (size_t i = 0; i < leaf->primitive_count; ++i) {
+        size_t index = primitives->primitive_indices[leaf->first_child_or_primitive + i];
+        primitives->visits[index]++;
+        real_t t;
+        if (intersect_ray_primitive(primitives, ray, index, &t)) {
+            ray->t_max = t;
+            hit->primitive_index = index;
+            found = true;
+        }
+    }
+    return found;
+}
+
+static bool occluded_ray_leaf(const struct ray* ray, const struct bvh_node* leaf, void* occlusion_data) {
+    struct primitives* primitives = occlusion_data;
+    for (size_t i = 0; i < leaf->primitive_count; ++i) {
+        size_t index = primitives->primitive_indices[leaf->first_child_or_primitive + i];
+        primitives->visits[index]++;
+        real_t t;
+        if (intersect_ray_primitive(primitives, ray, index, &t))
+            return true;
+    }
+    return false;
+}
+
+static ray_mask_t intersect_ray_packet_leaf(
+    struct ray_packet* packet, struct hit* hits,
+    ray_mask_t mask,
+    const struct bvh_node* leaf,
+    void* intersection_data)
+{
+    ray_mask_t hit_mask = 0;
+    for (size_t i = 0; i < packet->size; ++i) {
+        if (!(mask & (((ray_mask_t)1) << i)))
+            continue;
+        struct ray ray = get_packet_ray(packet, i);
+        if (intersect_ray_leaf(&ray, &hits[i], leaf, intersection_data)) {
+            packet->t_max[i] = ray.t_max;
+            hit_mask |= ((ray_mask_t)1) << i;
+        }
+    }
+    return hit_mask;
+}
+
+static bool intersect_ray_brute_force(const struct primitives* primitives, struct ray* ray, struct hit* hit) {
+    bool found = false;
+    for (size_t i = 0; i < PRIMITIVE_COUNT; ++i) {
+        real_t t;
+        if (intersect_ray_primitive(primitives, ray, i, &t)) {
+            ray->t_max = t;
+            hit->primitive_index = i;
+            found = true;
+        }
+    }
+    return found;
+}
+
+static struct bvh_node* add_leaf(struct bvh* bvh, size_t node_index, size_t* primitive_position) {
+    struct bvh_node* leaf = &bvh->nodes[node_index];
+    leaf->primitive_count = 1;
+    leaf->first_child_or_primitive = *primitive_position;
+    // Leaves store the primitives in reverse order, so that positions and indices differ
+    bvh->primitive_indices[*primitive_position] = PRIMITIVE_COUNT - 1 - *primitive_position;
+    (*primitive_position)++;
+    return leaf;
+}
+
+static struct bvh* build_caterpillar_bvh(struct thread_pool* thread_pool, struct primitives* primitives, struct rnd_gen* rnd_gen) {
+    struct bvh* bvh = xmalloc(sizeof(struct bvh));
+    bvh->node_count = 4 * SPINE_LENGTH - 1;
+    bvh->nodes = xcalloc(bvh->node_count, sizeof(struct bvh_node));
+    bvh->primitive_indices = xmalloc(sizeof(size_t) * PRIMITIVE_COUNT);
+    bvh->primitive_index_count = PRIMITIVE_COUNT;
+    bvh->parents = NULL;
+    bvh->primitive_index_capacity = PRIMITIVE_COUNT;
+    bvh->node_capacity = bvh->node_count;
+
+    size_t spine_index = 0, next_node = 1, primitive_position = 0;
+    for (size_t i = 0; i < SPINE_LENGTH - 1; ++i) {
+        // The spine continues on either side, at random
+        bool spine_first = random_bits(rnd_gen) & 1;
+        size_t subtree_index = next_node + (spine_first ? 1 : 0);
+        bvh->nodes[spine_index].first_child_or_primitive = next_node;
+        bvh->nodes[subtree_index].first_child_or_primitive = next_node + 2;
+        add_leaf(bvh, next_node + 2, &primitive_position);
+        add_leaf(bvh, next_node + 3, &primitive_position);
+        spine_index = next_node + (spine_first ? 0 : 1);
+        next_node += 4;
+    }
+    bvh->nodes[spine_index].first_child_or_primitive = next_node;
+    add_leaf(bvh, next_node, &primitive_position);
+    add_leaf(bvh, next_node + 1, &primitive_position);
+
+    for (size_t i = 0; i < PRIMITIVE_COUNT; ++i) {
+        real_t position = random_real(rnd_gen, 1, 100);
+        real_t extent[2] = { random_real(rnd_gen, 0.5, 1), random_real(rnd_gen, 0.5, 1) };
+        primitives->positions[i] = position;
+        primitives->bboxes[i] = (struct bbox) {
+            .min = make_vec3(position - (real_t)0.5, -extent[0], -extent[1]),
+            .max = make_vec3(position + (real_t)0.5,  extent[0],  extent[1])
+        };
+    }
+
+    update_bvh_parents(thread_pool, bvh);
+    primitives->primitive_indices = bvh->primitive_indices;
+    refit_bvh(thread_pool, bvh, primitives, get_primitive_bbox);
+    return bvh;
+}
+
+static struct ray generate_ray(struct rnd_gen* rnd_gen, bool full_range) {
+    // Every ray stays within the bounding boxes of the primitives on the y and z axes
+    return (struct ray) {
+        .org = make_vec3(0, random_real(rnd_gen, -0.25, 0.25), random_real(rnd_gen, -0.25, 0.25)),
+        .dir = make_vec3(1, random_real(rnd_gen, -0.001, 0.001), random_real(rnd_gen, -0.001, 0.001)),
+        .t_min = full_range ? 0 : random_real(rnd_gen, 0, 50),
+        .t_max = full_range ? REAL_MAX : random_real(rnd_gen, 50, 110)
+    };
+}
+
+static bool check_visits(struct primitives* primitives) {
+    bool is_valid = true;
+    for (size_t i = 0; i < PRIMITIVE_COUNT; ++i) {
+        is_valid &= primitives->visits[i] == 1;
+        primitives->visits[i] = 0;
+    }
+    return is_valid;
+}
+
+static bool check_hit(
+    const struct primitives* primitives,
+    bool found, const struct ray* ray, const struct hit* hit,
+    bool expected_found, const struct ray* expected_ray, const struct hit* expected_hit,
+    const struct ray* original_ray, bool any)
+{
+    if (found != expected_found)
+        return false;
+    if (!found)
+        return ray->t_max == original_ray->t_max;
+    if (any) {
+        // Any intersection is fine, as long as it belongs to the primitive that was reported
+        real_t t;
+        return
+            hit->primitive_index < PRIMITIVE_COUNT &&
+            intersect_ray_primitive(primitives, original_ray, hit->primitive_index, &t) &&
+            ray->t_max == t;
+    }
+    return ray->t_max == expected_ray->t_max && hit->primitive_index == expected_hit->primitive_index;
+}
+
+enum layout { BINARY, WIDE4, WIDE8, COMPRESSED8, LAYOUT_COUNT };
+
+static bool intersect_ray_layout(
+    enum layout layout, struct ray* ray, struct hit* hit,
+    const struct bvh* bvh, const struct bvh4* bvh4, const struct bvh8* bvh8,
+    const struct compressed_bvh8* compressed_bvh8,
+    struct primitives* primitives, bool any)
+{
+    switch (layout) {
+        case BINARY:
+            primitives->primitive_indices = bvh->primitive_indices;
+            return intersect_ray_bvh(ray, hit, bvh, intersect_ray_leaf, primitives, any);
+        case WIDE4:
+            primitives->primitive_indices = bvh4->primitive_indices;
+            return intersect_ray_bvh4(ray, hit, bvh4, intersect_ray_leaf, primitives, any);
+        case WIDE8:
+            primitives->primitive_indices = bvh8->primitive_indices;
+            return intersect_ray_bvh8(ray, hit, bvh8, intersect_ray_leaf, primitives, any);
+        default:
+            primitives->primitive_indices = compressed_bvh8->primitive_indices;
+            return intersect_ray_compressed_bvh8(ray, hit, compressed_bvh8, intersect_ray_leaf, primitives, any);
+    }
+}
+
+static bool occluded_ray_layout(
+    enum layout layout, const struct ray* ray,
+    const struct bvh* bvh, const struct bvh4* bvh4, const struct bvh8* bvh8,
+    const struct compressed_bvh8* compressed_bvh8,
+    struct primitives* primitives)
+{
+    switch (layout) {
+        case BINARY:
+            primitives->primitive_indices = bvh->primitive_indices;
+            return occluded_ray_bvh(ray, bvh, occluded_ray_leaf, primitives);
+        case WIDE4:
+            primitives->primitive_indices = bvh4->primitive_indices;
+            return occluded_ray_bvh4(ray, bvh4, occluded_ray_leaf, primitives);
+        case WIDE8:
+            primitives->primitive_indices = bvh8->primitive_indices;
+            return occluded_ray_bvh8(ray, bvh8, occluded_ray_leaf, primitives);
+        default:
+            primitives->primitive_indices = compressed_bvh8->primitive_indices;
+            return occluded_ray_compressed_bvh8(ray, compressed_bvh8, occluded_ray_leaf, primitives);
+    }
+}
+
+static bool test_single_rays(
+    const struct bvh* bvh, const struct bvh4* bvh4, const struct bvh8* bvh8,
+    const struct compressed_bvh8* compressed_bvh8,
+    struct primitives* primitives, struct rnd_gen* rnd_gen)
+{
+    bool is_valid = true;
+    for (size_t i = 0; i < RAY_COUNT; ++i) {
+        bool full_range = i % 2 == 0;
+        struct ray original_ray = generate_ray(rnd_gen, full_range);
+        for (enum layout layout = BINARY; layout < LAYOUT_COUNT; ++layout) {
+            // Without hits and with a full range, nothing is culled, and each leaf must be reached exactly once
+            for (size_t j = 0; j < PRIMITIVE_COUNT; ++j)
+                primitives->visits[j] = 0;
+            primitives->report_hits = false;
+            struct ray ray = original_ray;
+            struct hit hit;
+            is_valid &= !intersect_ray_layout(layout, &ray, &hit, bvh, bvh4, bvh8, compressed_bvh8, primitives, false);
+            is_valid &= !full_range || check_visits(primitives);
+            is_valid &= !occluded_ray_layout(layout, &ray, bvh, bvh4, bvh8, compressed_bvh8, primitives);
+            is_valid &= !full_range || check_visits(primitives);
+
+            primitives->report_hits = true;
+            struct ray expected_ray = original_ray;
+            struct hit expected_hit;
+            bool expected_found = intersect_ray_brute_force(primitives, &expected_ray, &expected_hit);
+            for (int any = 0; any < 2; ++any) {
+                ray = original_ray;
+                bool found = intersect_ray_layout(layout, &ray, &hit, bvh, bvh4, bvh8, compressed_bvh8, primitives, any);
+                is_valid &= check_hit(primitives, found, &ray, &hit, expected_found, &expected_ray, &expected_hit, &original_ray, any);
+            }
+            is_valid &= occluded_ray_layout(layout, &original_ray, bvh, bvh4, bvh8, compressed_bvh8, primitives) == expected_found;
+        }
+    }
+    return is_valid;
+}
+
+static bool test_packets(const struct bvh* bvh, struct primitives* primitives, struct rnd_gen* rnd_gen) {
+    bool is_valid = true;
+    primitives->primitive_indices = bvh->primitive_indices;
+    primitives->report_hits = true;
+    for (size_t i = 0; i < RAY_COUNT; i += MAX_RAY_PACKET_SIZE) {
+        struct ray_packet packet = { .size = MAX_RAY_PACKET_SIZE };
+        struct ray rays[MAX_RAY_PACKET_SIZE];
+        struct hit hits[MAX_RAY_PACKET_SIZE];
+        struct ray expected_rays[MAX_RAY_PACKET_SIZE];
+        struct hit expected_hits[MAX_RAY_PACKET_SIZE];
+        bool expected_found[MAX_RAY_PACKET_SIZE];
+        for (size_t j = 0; j < MAX_RAY_PACKET_SIZE; ++j) {
+            rays[j] = generate_ray(rnd_gen, j % 2 == 0);
+            expected_rays[j] = rays[j];
+            expected_found[j] = intersect_ray_brute_force(primitives, &expected_rays[j], &expected_hits[j]);
+        }
+
+        // Some packets only have part of their rays enabled, down to a single ray
+        ray_mask_t masks[] = { full_ray_mask(MAX_RAY_PACKET_SIZE), 0x5555 & full_ray_mask(MAX_RAY_PACKET_SIZE), 1 };
+        for (size_t k = 0; k < ARRAY_SIZE(masks); ++k) {
+            for (int any = 0; any < 2; ++any) {
+                for (size_t j = 0; j < MAX_RAY_PACKET_SIZE; ++j)
+                    set_packet_ray(&packet, j, &rays[j]);
+                ray_mask_t hit_mask = intersect_ray_packet_bvh(
+                    &packet, hits, masks[k], bvh, intersect_ray_packet_leaf, primitives, any);
+                for (size_t j = 0; j < MAX_RAY_PACKET_SIZE; ++j) {
+                    ray_mask_t bit = ((ray_mask_t)1) << j;
+                    struct ray ray = get_packet_ray(&packet, j);
+                    if (!(masks[k] & bit)) {
+                        is_valid &= !(hit_mask & bit) && ray.t_max == rays[j].t_max;
+                        continue;
+                    }
+                    is_valid &= check_hit(
+                        primitives, hit_mask & bit, &ray, &hits[j],
+                        expected_found[j], &expected_rays[j], &expected_hits[j], &rays[j], any);
+                }
+            }
+        }
+    }
+    return is_valid;
+}
+
+int main() {
+    struct thread_pool* thread_pool = new_thread_pool(detect_system_thread_count());
+    struct rnd_gen rnd_gen = make_rnd_gen(42);
+    struct primitives* primitives = xcalloc(1, sizeof(struct primitives));
+
+    struct bvh* bvh = build_caterpillar_bvh(thread_pool, primitives, &rnd_gen);
+    struct bvh4* bvh4 = collapse_bvh4(bvh);
+    struct bvh8* bvh8 = collapse_bvh8(bvh);
+    struct compressed_bvh8* compressed_bvh8 = compress_bvh8(bvh8);
+
+    bool is_valid =
+        test_single_rays(bvh, bvh4, bvh8, compressed_bvh8, primitives, &rnd_gen) &&
+        test_packets(bvh, primitives, &rnd_gen);
+
+    free_compressed_bvh8(compressed_bvh8);
+    free_bvh8(bvh8);
+    free_bvh4(bvh4);
+    free_bvh(bvh);
+    free(primitives);
+    free_thread_pool(thread_pool);
+    if (!is_valid) {
+        fprintf(stderr, "Test failed: Deep BVH traversals do not match a brute-force search\n");
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
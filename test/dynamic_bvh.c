@@ -0,0 +1,198 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+
+#include "accel/dynamic_bvh.h"
+#include "accel/wide_bvh.h"
+#include "core/thread_pool.h"
+#include "core/random.h"
+#include "core/utils.h"
+
+// Inserts, removes, and moves primitives of a dynamic BVH at random, with a maximum cost ratio
+// that is low enough to trigger background rebuilds regularly, and checks that the BVH stays
+// valid: the parents are correct, every node contains its children, and every primitive that
+// is in the BVH is referenced by exactly one leaf. The edited BVH is also collapsed into wide
+// BVHs, whose leaves must reference the same primitives.
+
+#define PRIMITIVE_COUNT 4000
+#define EDIT_COUNT 50000
+#define CHECK_INTERVAL 997
+#define TRAVERSAL_COST ((real_t)1.5)
+#define MAX_COST_RATIO ((real_t)0.5)
+
+struct primitives {
+    struct bbox bboxes[PRIMITIVE_COUNT];
+    bool is_inserted[PRIMITIVE_COUNT];
+    size_t inserted_count;
+};
+
+static struct bbox get_primitive_bbox(void* primitive_data, size_t index) {
+    return ((const struct primitives*)primitive_data)->bboxes[index];
+}
+
+static struct vec3 get_primitive_center(void* primitive_data, size_t index) {
+    struct bbox bbox = get_primitive_bbox(primitive_data, index);
+    return scale_vec3(add_vec3(bbox.min, bbox.max), 0.5);
+}
+
+static struct bbox random_bbox(struct rnd_gen* rnd_gen) {
+    struct vec3 center = random_vec3(rnd_gen, -10, 10);
+    struct vec3 half_extent = random_vec3(rnd_gen, 0.01, 0.5);
+    return (struct bbox) { .min = sub_vec3(center, half_extent), .max = add_vec3(center, half_extent) };
+}
+
+static size_t random_index(struct rnd_gen* rnd_gen, size_t count) {
+    return pcg32_boundedrand_r(&rnd_gen->rng, count);
+}
+
+static size_t find_primitive(const struct primitives* primitives, struct rnd_gen* rnd_gen, bool is_inserted) {
+    size_t index;
+    do {
+        index = random_index(rnd_gen, PRIMITIVE_COUNT);
+    } while (primitives->is_inserted[index] != is_inserted);
+    return index;
+}
+
+static bool check_references(const size_t* references, const struct primitives* primitives) {
+    bool is_valid = true;
+    for (size_t i = 0; is_valid && i < PRIMITIVE_COUNT; ++i)
+        is_valid &= references[i] == (primitives->is_inserted[i] ? 1 : 0);
+    return is_valid;
+}
+
+static bool check_bvh(const struct bvh* bvh, const struct primitives* primitives) {
+    size_t* references = xcalloc(PRIMITIVE_COUNT, sizeof(size_t));
+    size_t* stack = xmalloc(sizeof(size_t) * bvh->node_count);
+    size_t stack_size = 0;
+    bool is_valid = bvh->parents != NULL;
+    stack[stack_size++] = 0;
+    while (is_valid && stack_size > 0) {
+        size_t node_index = stack[--stack_size];
+        const struct bvh_node* node = &bvh->nodes[node_index];
+        struct bbox bbox = get_bvh_node_bbox(node);
+        if (node->primitive_count == 0) {
+            size_t first_child = node->first_child_or_primitive;
+            if (first_child % 2 != 1 || first_child + 1 >= bvh->node_count) {
+                is_valid = false;
+                break;
+            }
+            for (size_t i = 0; i < 2; ++i) {
+                is_valid &=
+                    get_bvh_node_parent(bvh, first_child + i) == node_index &&
+                    bbox_contains(bbox, get_bvh_node_bbox(&bvh->nodes[first_child + i]));
+                stack[stack_size++] = first_child + i;
+            }
+        } else {
+            if (node->first_child_or_primitive + node->primitive_count > bvh->primitive_index_count) {
+                is_valid = false;
+                break;
+            }
+            for (size_t i = 0; i < node->primitive_count; ++i) {
+                size_t primitive_index = bvh->primitive_indices[node->first_child_or_primitive + i];
+                if (primitive_index >= PRIMITIVE_COUNT) {
+                    is_valid = false;
+                    break;
+                }
+                is_valid &= bbox_contains(bbox, primitives->bboxes[primitive_index]);
+                references[primitive_index]++;
+            }
+        }
+    }
+    is_valid = is_valid && check_references(references, primitives);
+    free(stack);
+    free(references);
+    return is_valid;
+}
+
+#define GEN_CHECK_WIDE_BVH(width) \
+    static bool check_bvh##width(const struct bvh* bvh, const struct primitives* primitives) { \
+        struct bvh##width* wide_bvh = collapse_bvh##width(bvh); \
+        size_t* references = xcalloc(PRIMITIVE_COUNT, sizeof(size_t)); \
+        bool is_valid = true; \
+        for (size_t i = 0; is_valid && i < wide_bvh->node_count; ++i) { \
+            const struct bvh##width##_node* node = &wide_bvh->nodes[i]; \
+            for (size_t j = 0; j < width; ++j) { \
+                for (size_t k = 0; k < node->primitive_count[j]; ++k) { \
+                    size_t primitive_index = wide_bvh->primitive_indices[node->first_child_or_primitive[j] + k]; \
+                    if (primitive_index >= PRIMITIVE_COUNT) { \
+                        is_valid = false; \
+                        break; \
+                    } \
+                    references[primitive_index]++; \
+                } \
+            } \
+        } \
+        is_valid = is_valid && check_references(references, primitives); \
+        free(references); \
+        free_bvh##width(wide_bvh); \
+        return is_valid; \
+    }
+
+GEN_CHECK_WIDE_BVH(4)
+GEN_CHECK_WIDE_BVH(8)
+
+int main() {
+    struct thread_pool* thread_pool = new_thread_pool(detect_system_thread_count());
+    struct rnd_gen rnd_gen = make_rnd_gen(42);
+    struct primitives* primitives = xcalloc(1, sizeof(struct primitives));
+
+    // The BVH is first built with half of the primitives, which have the lowest indices
+    for (size_t i = 0; i < PRIMITIVE_COUNT; ++i)
+        primitives->bboxes[i] = random_bbox(&rnd_gen);
+    primitives->inserted_count = PRIMITIVE_COUNT / 2;
+    for (size_t i = 0; i < primitives->inserted_count; ++i)
+        primitives->is_inserted[i] = true;
+    struct bvh* bvh = build_bvh(
+        thread_pool, primitives,
+        get_primitive_bbox, get_primitive_center,
+        primitives->inserted_count, TRAVERSAL_COST);
+    struct dynamic_bvh* dynamic_bvh = new_dynamic_bvh(
+        bvh, primitives, get_primitive_bbox,
+        TRAVERSAL_COST, MAX_COST_RATIO, 1);
+
+    bool is_valid = check_bvh(dynamic_bvh->bvh, primitives);
+    size_t replacement_count = 0;
+    for (size_t i = 0; is_valid && i < EDIT_COUNT; ++i) {
+        int edit = random_index(&rnd_gen, 3);
+        if (edit == 0 && primitives->inserted_count < PRIMITIVE_COUNT) {
+            size_t index = find_primitive(primitives, &rnd_gen, false);
+            primitives->bboxes[index] = random_bbox(&rnd_gen);
+            insert_dynamic_bvh_primitive(dynamic_bvh, index);
+            primitives->is_inserted[index] = true;
+            primitives->inserted_count++;
+        } else if (edit == 1 && primitives->inserted_count > 1) {
+            size_t index = find_primitive(primitives, &rnd_gen, true);
+            remove_dynamic_bvh_primitive(dynamic_bvh, index);
+            primitives->is_inserted[index] = false;
+            primitives->inserted_count--;
+        } else if (primitives->inserted_count > 1) {
+            // Moving a primitive is done by removing it and inserting it again
+            size_t index = find_primitive(primitives, &rnd_gen, true);
+            remove_dynamic_bvh_primitive(dynamic_bvh, index);
+            primitives->bboxes[index] = random_bbox(&rnd_gen);
+            insert_dynamic_bvh_primitive(dynamic_bvh, index);
+        }
+
+        replacement_count += update_dynamic_bvh(dynamic_bvh) ? 1 : 0;
+        if (i % CHECK_INTERVAL == 0) {
+            is_valid &=
+                check_bvh(dynamic_bvh->bvh, primitives) &&
+                check_bvh4(dynamic_bvh->bvh, primitives) &&
+                check_bvh8(dynamic_bvh->bvh, primitives);
+        }
+    }
+
+    // Wait for the last rebuild, if any, so that the edits replayed on it are checked as well
+    while (dynamic_bvh->rebuild)
+        replacement_count += update_dynamic_bvh(dynamic_bvh) ? 1 : 0;
+    is_valid &= check_bvh(dynamic_bvh->bvh, primitives) && replacement_count > 0;
+
+    free_dynamic_bvh(dynamic_bvh);
+    free(primitives);
+    free_thread_pool(thread_pool);
+    if (!is_valid) {
+        fprintf(stderr, "Test failed: Dynamic BVH is invalid after random edits and rebuilds\n");
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
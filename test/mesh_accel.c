@@ -0,0 +1,424 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "scene/mesh.h"
+#include "accel/accel.h"
+#include "core/thread_pool.h"
+#include "core/random.h"
+#include "core/tri.h"
+#include "core/quad.h"
+#include "core/utils.h"
+
+// Compares the acceleration data structures of meshes against a brute-force search, for every
+// layout and builder with and without optimization, every intersection test and storage of
+// triangles with the fast builder, and for closest hits, any hits, occlusion, packets, and
+// streams. Hit distances and surface coordinates must both match. Each acceleration data
+// structure is then updated after the vertices of the mesh have moved. Those of the fast builder
+// are also saved and loaded back, and corrupted files must be rejected when loading.
+
+#define PRIMITIVE_COUNT 2000
+#define RAY_COUNT 512
+#define CACHE_FILE_NAME "mesh_accel_test.bin"
+#define CACHE_KEY 0x1234
+
+struct reference {
+    bool found;
+    real_t t;
+    struct vec2 uv;
+};
+
+// Intersects a primitive of the mesh with the test that the acceleration data structure uses.
+static bool intersect_ray_primitive(
+    const struct mesh* mesh, size_t index,
+    enum tri_intersection tri_intersection,
+    struct ray* ray, struct hit* hit)
+{
+    const struct vec3* vertices = mesh->attrs[ATTR_POSITION].data;
+    if (mesh->type == QUAD_MESH) {
+        const size_t* indices = &mesh->indices[index * 4];
+        struct quad quad = make_quad(
+            &vertices[indices[0]], &vertices[indices[1]],
+            &vertices[indices[2]], &vertices[indices[3]]);
+        return intersect_ray_quad(ray, hit, &quad);
+    }
+    const size_t* indices = &mesh->indices[index * 3];
+    if (tri_intersection == WATERTIGHT_TRI_INTERSECTION) {
+        struct watertight_ray watertight_ray = make_watertight_ray(ray);
+        return intersect_ray_tri_watertight(
+            ray, hit, &watertight_ray,
+            &vertices[indices[0]], &vertices[indices[1]], &vertices[indices[2]]);
+    }
+    struct tri tri = make_tri(&vertices[indices[0]], &vertices[indices[1]], &vertices[indices[2]]);
+    return intersect_ray_tri(ray, hit, &tri);
+}
+
+static void compute_references(
+    const struct mesh* mesh,
+    enum tri_intersection tri_intersection,
+    const struct ray* rays,
+    struct reference* references)
+{
+    for (size_t i = 0; i < RAY_COUNT; ++i) {
+        struct ray ray = rays[i];
+        struct hit hit;
+        references[i].found = false;
+        for (size_t j = 0; j < mesh->primitive_count; ++j)
+            references[i].found |= intersect_ray_primitive(mesh, j, tri_intersection, &ray, &hit);
+        references[i].t = ray.t_max;
+        references[i].uv = hit.uv;
+    }
+}
+
+static bool is_close(real_t a, real_t b) {
+    real_t scale = fabs(a) > 1 ? fabs(a) : 1;
+    return fabs(a - b) <= (real_t)1.0e-4 * scale;
+}
+
+static bool is_close_uv(struct vec2 a, struct vec2 b) {
+    return is_close(a._[0], b._[0]) && is_close(a._[1], b._[1]);
+}
+
+static bool check_hit(
+    const struct mesh* mesh,
+    enum tri_intersection tri_intersection,
+    bool found, const struct ray* ray, const struct hit* hit,
+    const struct reference* reference,
+    const struct ray* original_ray, bool any)
+{
+    if (found != reference->found)
+        return false;
+    if (!found)
+        return ray->t_max == original_ray->t_max;
+    if (!any && (!is_close(ray->t_max, reference->t) || !is_close_uv(hit->uv, reference->uv)))
+        return false;
+
+    // The reported primitive must be the one that was hit, at the same surface coordinates
+    struct ray primitive_ray = *original_ray;
+    struct hit primitive_hit;
+    return
+        hit->primitive_index < mesh->primitive_count &&
+        intersect_ray_primitive(mesh, hit->primitive_index, tri_intersection, &primitive_ray, &primitive_hit) &&
+        is_close(primitive_ray.t_max, ray->t_max) &&
+        is_close_uv(primitive_hit.uv, hit->uv);
+}
+
+static bool test_single_rays(
+    const struct accel* accel,
+    const struct mesh* mesh,
+    enum tri_intersection tri_intersection,
+    const struct ray* rays,
+    const struct reference* references)
+{
+    bool is_valid = true;
+    for (size_t i = 0; i < RAY_COUNT; ++i) {
+        for (int any = 0; any < 2; ++any) {
+            struct ray ray = rays[i];
+            struct hit hit;
+            bool found = intersect_ray_accel(&ray, &hit, accel, any);
+            is_valid &= check_hit(mesh, tri_intersection, found, &ray, &hit, &references[i], &rays[i], any);
+        }
+        is_valid &= occluded_ray_accel(&rays[i], accel) == references[i].found;
+    }
+    return is_valid;
+}
+
+static bool test_packets(
+    const struct accel* accel,
+    const struct mesh* mesh,
+    enum tri_intersection tri_intersection,
+    const struct ray* rays,
+    const struct reference* references)
+{
+    static const ray_mask_t masks[] = { 0xFFFF, 0x5555, 0x8001 };
+    bool is_valid = true;
+    for (size_t i = 0; i < RAY_COUNT; i += MAX_RAY_PACKET_SIZE) {
+        for (size_t k = 0; k < ARRAY_SIZE(masks); ++k) {
+            ray_mask_t mask = masks[k] & full_ray_mask(MAX_RAY_PACKET_SIZE);
+            for (int any = 0; any < 2; ++any) {
+                struct ray_packet packet = { .size = MAX_RAY_PACKET_SIZE };
+                struct hit hits[MAX_RAY_PACKET_SIZE];
+                for (size_t j = 0; j < MAX_RAY_PACKET_SIZE; ++j)
+                    set_packet_ray(&packet, j, &rays[i + j]);
+                ray_mask_t hit_mask = intersect_ray_packet_accel(&packet, hits, mask, accel, any);
+                for (size_t j = 0; j < MAX_RAY_PACKET_SIZE; ++j) {
+                    ray_mask_t bit = ((ray_mask_t)1) << j;
+                    struct ray ray = get_packet_ray(&packet, j);
+                    if (!(mask & bit)) {
+                        is_valid &= !(hit_mask & bit) && ray.t_max == rays[i + j].t_max;
+                        continue;
+                    }
+                    is_valid &= check_hit(
+                        mesh, tri_intersection,
+                        hit_mask & bit, &ray, &hits[j],
+                        &references[i + j], &rays[i + j], any);
+                }
+            }
+        }
+    }
+    return is_valid;
+}
+
+static bool test_stream(
+    const struct accel* accel,
+    const struct mesh* mesh,
+    enum tri_intersection tri_intersection,
+    const struct ray* rays,
+    const struct reference* references)
+{
+    // The stream only contains every other ray, in reverse order
+    size_t ray_ids[RAY_COUNT / 2];
+    for (size_t i = 0; i < RAY_COUNT / 2; ++i)
+        ray_ids[i] = RAY_COUNT - 2 - 2 * i;
+
+    bool is_valid = true;
+    struct ray* stream_rays = xmalloc(sizeof(struct ray) * RAY_COUNT);
+    struct hit* stream_hits = xmalloc(sizeof(struct hit) * RAY_COUNT);
+    for (int any = 0; any < 2; ++any) {
+        memcpy(stream_rays, rays, sizeof(struct ray) * RAY_COUNT);
+        intersect_ray_stream_accel(stream_rays, stream_hits, ray_ids, RAY_COUNT / 2, accel, any);
+        for (size_t i = 0; i < RAY_COUNT; ++i) {
+            // Rays that hit nothing are left unchanged, and so are those that are not in the stream
+            bool found = stream_rays[i].t_max != rays[i].t_max;
+            if (i % 2 == 1) {
+                is_valid &= !found;
+                continue;
+            }
+            is_valid &= check_hit(
+                mesh, tri_intersection,
+                found, &stream_rays[i], &stream_hits[i],
+                &references[i], &rays[i], any);
+        }
+    }
+    free(stream_rays);
+    free(stream_hits);
+    return is_valid;
+}
+
+static bool test_accel(
+    const struct accel* accel,
+    const struct mesh* mesh,
+    enum tri_intersection tri_intersection,
+    const struct ray* rays,
+    const struct reference* references)
+{
+    return
+        test_single_rays(accel, mesh, tri_intersection, rays, references) &&
+        test_packets(accel, mesh, tri_intersection, rays, references) &&
+        test_stream(accel, mesh, tri_intersection, rays, references);
+}
+
+// For triangle meshes and without spatial splits, the file ends with one primitive index per primitive.
+// The first of them is replaced by an index that is out of the primitive range of the mesh.
+static bool corrupt_primitive_indices(void) {
+    FILE* fp = fopen(CACHE_FILE_NAME, "r+b");
+    if (!fp)
+        return false;
+    size_t primitive_index = PRIMITIVE_COUNT;
+    bool ok =
+        fseek(fp, -(long)(sizeof(size_t) * PRIMITIVE_COUNT), SEEK_END) == 0 &&
+        fwrite(&primitive_index, sizeof(size_t), 1, fp) == 1;
+    return fclose(fp) == 0 && ok;
+}
+
+static bool test_cache(
+    struct thread_pool* thread_pool,
+    const struct accel* accel,
+    const struct mesh* mesh,
+    const struct mesh_accel_params* params,
+    const struct ray* rays,
+    const struct reference* references)
+{
+    if (!save_mesh_accel(accel, CACHE_FILE_NAME, CACHE_KEY, mesh))
+        return false;
+
+    bool is_valid = true;
+    struct accel* loaded_accel = load_mesh_accel(thread_pool, CACHE_FILE_NAME, CACHE_KEY, mesh, 0, params);
+    if (loaded_accel) {
+        is_valid &= test_accel(loaded_accel, mesh, params->tri_intersection, rays, references);
+        free_accel(loaded_accel);
+    } else
+        is_valid = false;
+
+    // Files saved with another key must be rejected
+    struct accel* other_accel = load_mesh_accel(thread_pool, CACHE_FILE_NAME, CACHE_KEY + 1, mesh, 0, params);
+    if (other_accel) {
+        free_accel(other_accel);
+        is_valid = false;
+    }
+
+    // Files that reference primitives out of bounds must be rejected as well
+    if (mesh->type == TRI_MESH && params->bvh_builder != SPATIAL_SPLIT_BVH_BUILDER) {
+        is_valid &= corrupt_primitive_indices();
+        struct accel* corrupted_accel = load_mesh_accel(thread_pool, CACHE_FILE_NAME, CACHE_KEY, mesh, 0, params);
+        if (corrupted_accel) {
+            free_accel(corrupted_accel);
+            is_valid = false;
+        }
+    }
+
+    remove(CACHE_FILE_NAME);
+    return is_valid;
+}
+
+static struct mesh* generate_mesh(enum mesh_type mesh_type, struct rnd_gen* rnd_gen) {
+    static const enum attr_type attr_types[] = {
+#define f(name, type, binding) ATTR_##type,
+        STANDARD_ATTR_LIST(f)
+#undef f
+    };
+    static const enum attr_binding attr_bindings[] = {
+#define f(name, type, binding) PER_##binding,
+        STANDARD_ATTR_LIST(f)
+#undef f
+    };
+
+    // Primitives do not share vertices, and quads are planar parallelograms
+    size_t vertex_count_per_primitive = mesh_type == TRI_MESH ? 3 : 4;
+    struct mesh* mesh = new_mesh(
+        mesh_type, PRIMITIVE_COUNT,
+        PRIMITIVE_COUNT * vertex_count_per_primitive,
+        attr_types, attr_bindings, ARRAY_SIZE(attr_types));
+    struct vec3* vertices = mesh->attrs[ATTR_POSITION].data;
+    for (size_t i = 0; i < PRIMITIVE_COUNT; ++i) {
+        struct vec3* primitive_vertices = &vertices[i * vertex_count_per_primitive];
+        struct vec3 p0 = random_vec3(rnd_gen, -1, 1);
+        struct vec3 u = random_vec3(rnd_gen, -0.1, 0.1);
+        struct vec3 v = random_vec3(rnd_gen, -0.1, 0.1);
+        primitive_vertices[0] = p0;
+        primitive_vertices[1] = add_vec3(p0, u);
+        if (mesh_type == TRI_MESH)
+            primitive_vertices[2] = add_vec3(p0, v);
+        else {
+            primitive_vertices[2] = add_vec3(add_vec3(p0, u), v);
+            primitive_vertices[3] = add_vec3(p0, v);
+        }
+        for (size_t j = 0; j < vertex_count_per_primitive; ++j)
+            mesh->indices[i * vertex_count_per_primitive + j] = i * vertex_count_per_primitive + j;
+    }
+    recompute_geometry_normals(mesh);
+    recompute_shading_normals(mesh);
+    return mesh;
+}
+
+static struct vec3* move_vertices(const struct mesh* mesh, struct rnd_gen* rnd_gen) {
+    const struct vec3* vertices = mesh->attrs[ATTR_POSITION].data;
+    struct vec3* moved_vertices = xmalloc(sizeof(struct vec3) * mesh->vertex_count);
+    struct vec3 translation = random_vec3(rnd_gen, -0.5, 0.5);
+    for (size_t i = 0; i < mesh->vertex_count; ++i)
+        moved_vertices[i] = add_vec3(add_vec3(vertices[i], translation), random_vec3(rnd_gen, -0.05, 0.05));
+    return moved_vertices;
+}
+
+static void generate_rays(struct ray* rays, struct rnd_gen* rnd_gen) {
+    for (size_t i = 0; i < RAY_COUNT; ++i) {
+        struct vec3 org = random_vec3(rnd_gen, -2, 2);
+        struct vec3 target = random_vec3(rnd_gen, -1, 1);
+        rays[i] = (struct ray) {
+            .org = org,
+            .dir = normalize_vec3(sub_vec3(target, org)),
+            .t_min = i % 3 == 0 ? random_real(rnd_gen, 0, 1) : 0,
+            .t_max = i % 4 == 0 ? random_real(rnd_gen, 1, 3) : 100
+        };
+    }
+}
+
+static bool test_mesh(
+    struct thread_pool* thread_pool,
+    struct mesh* mesh,
+    const struct ray* rays,
+    struct rnd_gen* rnd_gen)
+{
+    bool is_valid = true;
+
+    struct vec3* vertices = mesh->attrs[ATTR_POSITION].data;
+    struct vec3* moved_vertices = move_vertices(mesh, rnd_gen);
+    size_t intersection_count = mesh->type == TRI_MESH ? 2 : 1;
+    size_t storage_count = mesh->type == TRI_MESH ? 2 : 1;
+
+    // The references of the original and moved vertices, for each intersection test
+    struct reference* references[2][2];
+    for (size_t i = 0; i < intersection_count; ++i) {
+        for (size_t j = 0; j < 2; ++j) {
+            references[i][j] = xmalloc(sizeof(struct reference) * RAY_COUNT);
+            mesh->attrs[ATTR_POSITION].data = j == 0 ? vertices : moved_vertices;
+            compute_references(mesh, i, rays, references[i][j]);
+        }
+    }
+    mesh->attrs[ATTR_POSITION].data = vertices;
+
+    for (size_t layout = BINARY_BVH; layout <= COMPRESSED_BVH8; ++layout) {
+        for (size_t builder = FAST_BVH_BUILDER; builder <= TREELET_BVH_BUILDER; ++builder) {
+            for (size_t intersection = 0; intersection < intersection_count; ++intersection) {
+                for (size_t storage = 0; storage < storage_count; ++storage) {
+                    for (size_t optimization = 0; optimization < 2; ++optimization) {
+                        // The leaves are intersected in the same way regardless of the builder,
+                        // so other builders are only tested with the default leaf parameters
+                        if (builder != FAST_BVH_BUILDER &&
+                            (intersection != FAST_TRI_INTERSECTION || storage != PRECOMPUTED_TRI_STORAGE))
+                            continue;
+
+                        struct mesh_accel_params params = {
+                            .bvh_layout = layout,
+                            .bvh_builder = builder,
+                            .tri_intersection = intersection,
+                            .tri_storage = storage,
+                            .bvh_optimization_time = optimization ? 0.01 : 0
+                        };
+                        bool is_combination_valid = true;
+                        struct accel* accel = build_mesh_accel(thread_pool, mesh, 0, PRIMITIVE_COUNT, &params);
+                        is_combination_valid &= test_accel(accel, mesh, intersection, rays, references[intersection][0]);
+                        // The contents of the file only depend on the layout and leaves
+                        if (builder == FAST_BVH_BUILDER && optimization == 0)
+                            is_combination_valid &= test_cache(thread_pool, accel, mesh, &params, rays, references[intersection][0]);
+
+                        mesh->attrs[ATTR_POSITION].data = moved_vertices;
+                        update_mesh_accel(thread_pool, accel, mesh, 0, PRIMITIVE_COUNT);
+                        is_combination_valid &= test_accel(accel, mesh, intersection, rays, references[intersection][1]);
+                        mesh->attrs[ATTR_POSITION].data = vertices;
+                        free_accel(accel);
+
+                        if (!is_combination_valid) {
+                            fprintf(stderr,
+                                "Invalid results for %s mesh with layout %zu, builder %zu, "
+                                "intersection %zu, storage %zu, and optimization %zu\n",
+                                mesh->type == TRI_MESH ? "triangle" : "quad",
+                                layout, builder, intersection, storage, optimization);
+                        }
+                        is_valid &= is_combination_valid;
+                    }
+                }
+            }
+        }
+    }
+
+    for (size_t i = 0; i < intersection_count; ++i) {
+        for (size_t j = 0; j < 2; ++j)
+            free(references[i][j]);
+    }
+    free(moved_vertices);
+    return is_valid;
+}
+
+int main() {
+    struct thread_pool* thread_pool = new_thread_pool(detect_system_thread_count());
+    struct rnd_gen rnd_gen = make_rnd_gen(42);
+    struct ray* rays = xmalloc(sizeof(struct ray) * RAY_COUNT);
+    generate_rays(rays, &rnd_gen);
+
+    bool is_valid = true;
+    for (int mesh_type = TRI_MESH; mesh_type <= QUAD_MESH; ++mesh_type) {
+        struct mesh* mesh = generate_mesh(mesh_type, &rnd_gen);
+        is_valid &= test_mesh(thread_pool, mesh, rays, &rnd_gen);
+        free_mesh(mesh);
+    }
+
+    free(rays);
+    free_thread_pool(thread_pool);
+    if (!is_valid) {
+        fprintf(stderr, "Test failed: Mesh acceleration data structures do not match a brute-force search\n");
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
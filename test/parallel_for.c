@@ -0,0 +1,152 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdalign.h>
+#include <stdatomic.h>
+#include <string.h>
+
+#include "core/thread_pool.h"
+#include "core/utils.h"
+
+// Checks that parallel loops process every element exactly once, for all schedules and
+// several grain sizes, both from the client and from inside a running work item. Also checks
+// that the storage for work items is reused by the thread pool instead of being reallocated.
+
+#define WIDTH  301
+#define HEIGHT 97
+
+struct count_task_1d {
+    struct parallel_task_1d task;
+    atomic_int* counts;
+};
+
+struct count_task_2d {
+    struct parallel_task_2d task;
+    atomic_int* counts;
+};
+
+static void count_1d(struct parallel_task_1d* task, size_t thread_id) {
+    IGNORE(thread_id);
+    struct count_task_1d* count_task = (void*)task;
+    for (size_t i = task->range.begin; i < task->range.end; ++i)
+        atomic_fetch_add_explicit(&count_task->counts[i], 1, memory_order_relaxed);
+}
+
+static void count_2d(struct parallel_task_2d* task, size_t thread_id) {
+    IGNORE(thread_id);
+    struct count_task_2d* count_task = (void*)task;
+    for (size_t y = task->range[1].begin; y < task->range[1].end; ++y) {
+        for (size_t x = task->range[0].begin; x < task->range[0].end; ++x)
+            atomic_fetch_add_explicit(&count_task->counts[y * WIDTH + x], 1, memory_order_relaxed);
+    }
+}
+
+static bool check_counts(atomic_int* counts, const struct range* range, size_t dim_count) {
+    // In 1D, the counts are seen as a single row of `WIDTH * HEIGHT` elements
+    size_t width = dim_count == 1 ? WIDTH * HEIGHT : WIDTH;
+    size_t height = dim_count == 1 ? 1 : HEIGHT;
+    bool is_valid = true;
+    for (size_t y = 0; y < height; ++y) {
+        for (size_t x = 0; x < width; ++x) {
+            bool is_inside =
+                x >= range[0].begin && x < range[0].end &&
+                (dim_count == 1 || (y >= range[1].begin && y < range[1].end));
+            is_valid &= atomic_load(&counts[y * width + x]) == (is_inside ? 1 : 0);
+            atomic_store(&counts[y * width + x], 0);
+        }
+    }
+    return is_valid;
+}
+
+static bool test_loops(struct thread_pool* thread_pool, atomic_int* counts) {
+    static const size_t grain_sizes[] = { 0, 1, 7, 64, 1000 };
+    static const struct range ranges[][2] = {
+        { { 0, WIDTH }, { 0, HEIGHT } },
+        { { 13, 200 }, { 5, 6 } },
+        { { 50, 50 }, { 0, HEIGHT } }
+    };
+    bool is_valid = true;
+    for (int schedule = STATIC_SCHEDULE; schedule <= GUIDED_SCHEDULE; ++schedule) {
+        for (size_t i = 0; i < ARRAY_SIZE(grain_sizes); ++i) {
+            for (size_t j = 0; j < ARRAY_SIZE(ranges); ++j) {
+                parallel_for_1d_scheduled(
+                    thread_pool, count_1d,
+                    (struct parallel_task_1d*)&(struct count_task_1d) { .counts = counts },
+                    sizeof(struct count_task_1d),
+                    ranges[j], schedule, grain_sizes[i]);
+                is_valid &= check_counts(counts, ranges[j], 1);
+
+                parallel_for_2d_scheduled(
+                    thread_pool, count_2d,
+                    (struct parallel_task_2d*)&(struct count_task_2d) { .counts = counts },
+                    sizeof(struct count_task_2d),
+                    ranges[j], schedule,
+                    (size_t[2]) { grain_sizes[i], grain_sizes[ARRAY_SIZE(grain_sizes) - 1 - i] });
+                is_valid &= check_counts(counts, ranges[j], 2);
+            }
+        }
+    }
+    return is_valid;
+}
+
+static bool test_task_storage(struct thread_pool* thread_pool) {
+    // The arena may only reach its final size after the first round
+    uintptr_t blocks[3][2];
+    bool is_valid = true;
+    for (size_t i = 0; i < 3; ++i) {
+        void* small_block = alloc_task_storage(thread_pool, 100);
+        void* large_block = alloc_task_storage(thread_pool, 1000);
+        memset(small_block, 0, 100);
+        memset(large_block, 0, 1000);
+        blocks[i][0] = (uintptr_t)small_block;
+        blocks[i][1] = (uintptr_t)large_block;
+        is_valid &= blocks[i][0] % alignof(max_align_t) == 0 && blocks[i][1] % alignof(max_align_t) == 0;
+        free_task_storage(thread_pool, large_block);
+        free_task_storage(thread_pool, small_block);
+    }
+    return is_valid && blocks[1][0] == blocks[2][0] && blocks[1][1] == blocks[2][1];
+}
+
+struct nested_task {
+    struct work_item work_item;
+    struct thread_pool* thread_pool;
+    atomic_int* counts;
+    bool is_valid;
+};
+
+static void run_nested_task(struct work_item* work_item, size_t thread_id) {
+    IGNORE(thread_id);
+    struct nested_task* nested_task = (void*)work_item;
+    nested_task->is_valid =
+        test_task_storage(nested_task->thread_pool) &&
+        test_loops(nested_task->thread_pool, nested_task->counts);
+}
+
+int main() {
+    struct thread_pool* thread_pool = new_thread_pool(detect_system_thread_count());
+    atomic_int* counts = xmalloc(sizeof(atomic_int) * WIDTH * HEIGHT);
+    for (size_t i = 0; i < WIDTH * HEIGHT; ++i)
+        atomic_init(&counts[i], 0);
+
+    bool is_valid = test_task_storage(thread_pool) && test_loops(thread_pool, counts);
+
+    struct task_group task_group;
+    init_task_group(&task_group);
+    struct nested_task nested_task = {
+        .work_item.work_fn = run_nested_task,
+        .thread_pool = thread_pool,
+        .counts = counts
+    };
+    spawn_work(thread_pool, &task_group, &nested_task.work_item, &nested_task.work_item);
+    join_work(thread_pool, &task_group);
+    is_valid &= nested_task.is_valid;
+
+    free(counts);
+    free_thread_pool(thread_pool);
+    if (!is_valid) {
+        fprintf(stderr, "Test failed: Parallel loops or task storage did not behave as expected\n");
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,116 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "core/parallel_scan.h"
+#include "core/thread_pool.h"
+#include "core/random.h"
+#include "core/utils.h"
+
+// Compares parallel reductions, scans, and partitions with their sequential
+// counterparts, for several sizes, including empty and very small ranges.
+
+#define MAX_ELEM_COUNT 1000000
+
+struct count_task {
+    struct parallel_scan_task task;
+    const uint32_t* elems;
+    size_t* even_offsets;
+};
+
+static inline bool is_even(uint32_t elem) {
+    return elem % 2 == 0;
+}
+
+// Sums the elements (first sum), and counts the even ones (second sum).
+static void run_count_task(struct parallel_scan_task* task, size_t thread_id) {
+    IGNORE(thread_id);
+    struct count_task* count_task = (void*)task;
+    for (size_t i = task->task.range.begin, n = task->task.range.end; i < n; ++i) {
+        task->sums._[0] += count_task->elems[i];
+        task->sums._[1] += is_even(count_task->elems[i]) ? 1 : 0;
+    }
+}
+
+static void run_offset_task(struct parallel_scan_task* task, size_t thread_id) {
+    IGNORE(thread_id);
+    struct count_task* count_task = (void*)task;
+    size_t even_count = task->sums._[1];
+    for (size_t i = task->task.range.begin, n = task->task.range.end; i < n; ++i) {
+        count_task->even_offsets[i] = even_count;
+        even_count += is_even(count_task->elems[i]) ? 1 : 0;
+    }
+}
+
+static bool is_elem_even(const void* elem, const void* data) {
+    IGNORE(data);
+    return is_even(*(const uint32_t*)elem);
+}
+
+static bool test_scans(struct thread_pool* thread_pool, const uint32_t* elems, size_t elem_count) {
+    size_t* values = xmalloc(sizeof(size_t) * (elem_count + 1));
+    size_t* even_offsets = xmalloc(sizeof(size_t) * (elem_count + 1));
+    uint32_t* partitioned_elems = xmalloc(sizeof(uint32_t) * (elem_count + 1));
+    size_t sum = 0, even_count = 0;
+    for (size_t i = 0; i < elem_count; ++i) {
+        sum += elems[i];
+        even_count += is_even(elems[i]) ? 1 : 0;
+        values[i] = elems[i];
+    }
+
+    bool is_valid = true;
+    struct count_task init = { .elems = elems, .even_offsets = even_offsets };
+    struct parallel_sums total = parallel_reduce(
+        thread_pool, run_count_task, &init.task, sizeof(struct count_task), &(struct range) { 0, elem_count });
+    is_valid &= total._[0] == sum && total._[1] == even_count;
+
+    total = parallel_exclusive_scan(
+        thread_pool, run_count_task, run_offset_task,
+        &init.task, sizeof(struct count_task), &(struct range) { 0, elem_count });
+    is_valid &= total._[0] == sum && total._[1] == even_count;
+
+    is_valid &= parallel_exclusive_sum(thread_pool, values, elem_count) == sum;
+
+    size_t left_count = parallel_partition(
+        thread_pool, is_elem_even, NULL,
+        elems, partitioned_elems, sizeof(uint32_t), elem_count);
+    is_valid &= left_count == even_count;
+
+    sum = even_count = 0;
+    for (size_t i = 0; i < elem_count; ++i) {
+        is_valid &= values[i] == sum;
+        is_valid &= even_offsets[i] == even_count;
+        // The partition must be stable
+        size_t j = is_even(elems[i]) ? even_offsets[i] : left_count + i - even_offsets[i];
+        is_valid &= partitioned_elems[j] == elems[i];
+        sum += elems[i];
+        even_count += is_even(elems[i]) ? 1 : 0;
+    }
+
+    free(values);
+    free(even_offsets);
+    free(partitioned_elems);
+    return is_valid;
+}
+
+int main() {
+    struct thread_pool* thread_pool = new_thread_pool(detect_system_thread_count());
+    uint32_t* elems = xmalloc(sizeof(uint32_t) * MAX_ELEM_COUNT);
+    struct rnd_gen rnd_gen = make_rnd_gen(42);
+    for (size_t i = 0; i < MAX_ELEM_COUNT; ++i)
+        elems[i] = random_bits(&rnd_gen) % 1000;
+
+    static const size_t elem_counts[] = { 0, 1, 2, 3, 17, 1000, 4097, 65536, MAX_ELEM_COUNT };
+    bool is_valid = true;
+    for (size_t i = 0; i < ARRAY_SIZE(elem_counts); ++i)
+        is_valid &= test_scans(thread_pool, elems, elem_counts[i]);
+
+    free(elems);
+    free_thread_pool(thread_pool);
+    if (!is_valid) {
+        fprintf(stderr, "Test failed: Parallel scans do not match sequential ones\n");
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
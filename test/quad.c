@@ -0,0 +1,87 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+
+#include "core/quad.h"
+#include "core/tri.h"
+#include "core/random.h"
+#include "core/utils.h"
+
+// Tests the intersection routines for quads against the two triangles that make up each quad.
+
+static struct ray random_ray(struct rnd_gen* rnd_gen) {
+    struct ray ray;
+    ray.org = random_vec3(rnd_gen, -2, 2);
+    ray.dir = normalize_vec3(sub_vec3(random_vec3(rnd_gen, -1, 1), ray.org));
+    ray.t_min = 0;
+    ray.t_max = random_real(rnd_gen, 1, 4);
+    return ray;
+}
+
+static bool is_close(real_t x, real_t y) {
+    return fabs(x - y) <= (real_t)1.0e-3 * (fabs(x) + fabs(y) + 1);
+}
+
+int main() {
+    size_t quad_count = 10000, ray_count = 100, error_count = 0, hit_count = 0;
+    struct rnd_gen rnd_gen = make_rnd_gen(42);
+    for (size_t i = 0; i < quad_count; ++i) {
+        // Generate planar quads (parallelograms), non-planar quads, and triangles stored as quads
+        struct vec3 p0 = random_vec3(&rnd_gen, -1, 1);
+        struct vec3 p1 = random_vec3(&rnd_gen, -1, 1);
+        struct vec3 p3 = random_vec3(&rnd_gen, -1, 1);
+        struct vec3 p2 = add_vec3(p1, sub_vec3(p3, p0));
+        bool is_planar = i % 3 == 0;
+        if (i % 3 == 1)
+            p2 = add_vec3(p2, random_vec3(&rnd_gen, -0.5, 0.5));
+        else if (i % 3 == 2)
+            p3 = p2;
+        struct quad quad = make_quad(&p0, &p1, &p2, &p3);
+        struct tri tris[] = { make_tri(&p0, &p1, &p3), make_tri(&p2, &p3, &p1) };
+
+        for (size_t j = 0; j < ray_count; ++j) {
+            struct ray ray = random_ray(&rnd_gen);
+            struct ray quad_ray = ray, tri_ray = ray;
+            struct hit quad_hit = empty_hit(), tri_hit = empty_hit();
+            bool quad_found = intersect_ray_quad(&quad_ray, &quad_hit, &quad);
+            bool tri_found = false;
+            for (size_t k = 0; k < 2; ++k)
+                tri_found |= intersect_ray_tri(&tri_ray, &tri_hit, &tris[k]);
+
+            struct ray_packet packet = { .size = 1 };
+            set_packet_ray(&packet, 0, &ray);
+            struct hit packet_hit = empty_hit();
+            bool packet_found = intersect_ray_packet_quad(&packet, &packet_hit, 1, &quad) != 0;
+
+            bool is_valid =
+                quad_found == tri_found &&
+                occluded_ray_quad(&ray, &quad) == tri_found &&
+                packet_found == tri_found;
+            if (is_valid && quad_found) {
+                hit_count++;
+                is_valid =
+                    is_close(quad_ray.t_max, tri_ray.t_max) &&
+                    packet.t_max[0] == quad_ray.t_max &&
+                    packet_hit.uv._[0] == quad_hit.uv._[0] &&
+                    packet_hit.uv._[1] == quad_hit.uv._[1];
+
+                // On planar quads, bilinear interpolation with the intersection coordinates gives the hit point
+                if (is_planar) {
+                    real_t u = quad_hit.uv._[0], v = quad_hit.uv._[1];
+                    struct vec3 p = add_vec3(p0, add_vec3(scale_vec3(sub_vec3(p1, p0), u), scale_vec3(sub_vec3(p3, p0), v)));
+                    struct vec3 q = add_vec3(ray.org, scale_vec3(ray.dir, quad_ray.t_max));
+                    for (int k = 0; k < 3; ++k)
+                        is_valid &= is_close(p._[k], q._[k]);
+                }
+            }
+            error_count += is_valid ? 0 : 1;
+        }
+    }
+
+    printf("%zu rays hit a quad, %zu errors\n", hit_count, error_count);
+    if (error_count > 0 || hit_count == 0) {
+        fprintf(stderr, "Test failed: Quad intersections do not match triangle intersections\n");
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,104 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <time.h>
+
+#include "core/thread_pool.h"
+#include "core/random.h"
+#include "core/utils.h"
+
+// Sorts an array with a recursive, parallel quicksort that spawns and joins
+// task groups from inside running work items, and checks the result.
+
+#define ELEM_COUNT 4000000
+#define SEQUENTIAL_SORT_THRESHOLD 2048
+
+struct sort_task {
+    struct work_item work_item;
+    struct thread_pool* thread_pool;
+    uint32_t* elems;
+    size_t elem_count;
+};
+
+static int compare_elems(const void* left, const void* right) {
+    uint32_t a = *(const uint32_t*)left, b = *(const uint32_t*)right;
+    return a < b ? -1 : (a > b ? 1 : 0);
+}
+
+static size_t partition_elems(uint32_t* elems, size_t elem_count) {
+    uint32_t pivot = elems[(elem_count - 1) / 2];
+    size_t i = 0, j = elem_count - 1;
+    while (true) {
+        while (elems[i] < pivot) i++;
+        while (elems[j] > pivot) j--;
+        if (i >= j)
+            return j + 1;
+        uint32_t tmp = elems[i];
+        elems[i++] = elems[j];
+        elems[j--] = tmp;
+    }
+}
+
+static void sort(struct work_item* work_item, size_t thread_id) {
+    IGNORE(thread_id);
+    struct sort_task* sort_task = (void*)work_item;
+    if (sort_task->elem_count <= SEQUENTIAL_SORT_THRESHOLD) {
+        qsort(sort_task->elems, sort_task->elem_count, sizeof(uint32_t), compare_elems);
+        return;
+    }
+
+    // Sort the left part in another task, and the right one in this task
+    size_t split = partition_elems(sort_task->elems, sort_task->elem_count);
+    struct task_group task_group;
+    init_task_group(&task_group);
+    struct sort_task left_task = {
+        .work_item.work_fn = sort,
+        .thread_pool = sort_task->thread_pool,
+        .elems = sort_task->elems,
+        .elem_count = split
+    };
+    spawn_work(sort_task->thread_pool, &task_group, &left_task.work_item, &left_task.work_item);
+    struct sort_task right_task = {
+        .thread_pool = sort_task->thread_pool,
+        .elems = sort_task->elems + split,
+        .elem_count = sort_task->elem_count - split
+    };
+    sort(&right_task.work_item, thread_id);
+    join_work(sort_task->thread_pool, &task_group);
+}
+
+int main() {
+    struct thread_pool* thread_pool = new_thread_pool(detect_system_thread_count());
+    uint32_t* elems = xmalloc(sizeof(uint32_t) * ELEM_COUNT);
+    struct rnd_gen rnd_gen = make_rnd_gen(42);
+    for (size_t i = 0; i < ELEM_COUNT; ++i)
+        elems[i] = random_bits(&rnd_gen) % (ELEM_COUNT / 4);
+
+    struct timespec t_start, t_end;
+    timespec_get(&t_start, TIME_UTC);
+    struct task_group task_group;
+    init_task_group(&task_group);
+    struct sort_task sort_task = {
+        .work_item.work_fn = sort,
+        .thread_pool = thread_pool,
+        .elems = elems,
+        .elem_count = ELEM_COUNT
+    };
+    spawn_work(thread_pool, &task_group, &sort_task.work_item, &sort_task.work_item);
+    join_work(thread_pool, &task_group);
+    timespec_get(&t_end, TIME_UTC);
+    printf("Sorting %d elements took %g seconds\n", ELEM_COUNT, elapsed_seconds(&t_start, &t_end));
+
+    bool is_sorted = true;
+    for (size_t i = 1; i < ELEM_COUNT; ++i)
+        is_sorted &= elems[i - 1] <= elems[i];
+    free(elems);
+    free_thread_pool(thread_pool);
+
+    if (!is_sorted) {
+        fprintf(stderr, "Test failed: The array is not sorted\n");
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
@@ -21,7 +21,7 @@ int main() {
     for (size_t i = 0; i < N; ++i) {
         int a = 0;
         struct thread_pool* pool = new_thread_pool(detect_system_thread_count());
-        struct add_job job = { { add, NULL }, &a };
+        struct add_job job = { { add, NULL, NULL }, &a };
         submit_work(pool, &job.work_item, &job.work_item);
         wait_for_completion(pool, 0);
         a = 0;
@@ -0,0 +1,255 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <time.h>
+#include <threads.h>
+
+#include "core/thread_pool.h"
+#include "core/utils.h"
+
+// Measures how the throughput of the thread pool scales with the number of threads, for fine-grained
+// work items submitted all at once, and for small rounds of items followed by a synchronization, like
+// `parallel_for_1d()` does. The results are compared with a reference pool, which is the previous
+// implementation, where all the workers take items from a single queue protected by a mutex. Also
+// checks that every item is executed exactly once in all cases. The maximum number of threads can be
+// set with the `NPROC` environment variable.
+
+#define ITEM_COUNT   100000
+#define ROUND_COUNT  2000
+#define ITEM_WORK    200
+
+struct count_job {
+    struct work_item work_item;
+    uint32_t seed;
+    uint32_t result;
+    size_t run_count;
+};
+
+static void count(struct work_item* work_item, size_t thread_id) {
+    IGNORE(thread_id);
+    struct count_job* job = (void*)work_item;
+    uint32_t x = job->seed;
+    for (size_t i = 0; i < ITEM_WORK; ++i)
+        x = x * 1664525u + 1013904223u;
+    job->result = x;
+    job->run_count++;
+}
+
+struct reference_pool {
+    thrd_t* threads;
+    size_t thread_count;
+    bool should_stop;
+    struct work_item* first_item;
+    struct work_item* last_item;
+    struct work_item* done_items;
+    size_t worked_on;
+    cnd_t avail_cond, done_cond;
+    mtx_t mutex;
+};
+
+static int run_reference_worker(void* data) {
+    struct reference_pool* pool = data;
+    mtx_lock(&pool->mutex);
+    while (true) {
+        while (!pool->first_item) {
+            if (pool->should_stop || cnd_wait(&pool->avail_cond, &pool->mutex) != thrd_success) {
+                mtx_unlock(&pool->mutex);
+                return 0;
+            }
+        }
+        struct work_item* item = pool->first_item;
+        pool->first_item = item->next;
+        if (!pool->first_item)
+            pool->last_item = NULL;
+        pool->worked_on++;
+        mtx_unlock(&pool->mutex);
+
+        item->work_fn(item, 0);
+
+        mtx_lock(&pool->mutex);
+        item->next = pool->done_items;
+        pool->done_items = item;
+        pool->worked_on--;
+        if (pool->worked_on == 0 && !pool->first_item)
+            cnd_signal(&pool->done_cond);
+    }
+}
+
+static void* new_reference_pool(size_t thread_count) {
+    struct reference_pool* pool = xcalloc(1, sizeof(struct reference_pool));
+    pool->threads = xmalloc(sizeof(thrd_t) * thread_count);
+    cnd_init(&pool->avail_cond);
+    cnd_init(&pool->done_cond);
+    mtx_init(&pool->mutex, mtx_plain);
+    for (; pool->thread_count < thread_count; pool->thread_count++) {
+        if (thrd_create(&pool->threads[pool->thread_count], run_reference_worker, pool) != thrd_success)
+            die("cannot create threads");
+    }
+    return pool;
+}
+
+static void free_reference_pool(void* data) {
+    struct reference_pool* pool = data;
+    mtx_lock(&pool->mutex);
+    pool->should_stop = true;
+    cnd_broadcast(&pool->avail_cond);
+    mtx_unlock(&pool->mutex);
+    for (size_t i = 0; i < pool->thread_count; ++i)
+        thrd_join(pool->threads[i], NULL);
+    mtx_destroy(&pool->mutex);
+    cnd_destroy(&pool->avail_cond);
+    cnd_destroy(&pool->done_cond);
+    free(pool->threads);
+    free(pool);
+}
+
+static void submit_reference_work(void* data, struct work_item* first, struct work_item* last) {
+    struct reference_pool* pool = data;
+    mtx_lock(&pool->mutex);
+    if (pool->last_item)
+        pool->last_item->next = first;
+    else
+        pool->first_item = first;
+    pool->last_item = last;
+    if (first == last)
+        cnd_signal(&pool->avail_cond);
+    else
+        cnd_broadcast(&pool->avail_cond);
+    mtx_unlock(&pool->mutex);
+}
+
+static struct work_item* wait_for_reference_completion(void* data) {
+    struct reference_pool* pool = data;
+    mtx_lock(&pool->mutex);
+    while ((pool->worked_on > 0 || pool->first_item) &&
+        cnd_wait(&pool->done_cond, &pool->mutex) == thrd_success)
+        ;
+    struct work_item* done_items = pool->done_items;
+    pool->done_items = NULL;
+    mtx_unlock(&pool->mutex);
+    return done_items;
+}
+
+static void* new_pool(size_t thread_count) {
+    return new_thread_pool(thread_count);
+}
+
+static void free_pool(void* data) {
+    free_thread_pool(data);
+}
+
+static void submit_pool_work(void* data, struct work_item* first, struct work_item* last) {
+    submit_work(data, first, last);
+}
+
+static struct work_item* wait_for_pool_completion(void* data) {
+    return wait_for_completion(data, 0);
+}
+
+struct pool_fns {
+    void* (*new_pool)(size_t);
+    void (*free_pool)(void*);
+    void (*submit_work)(void*, struct work_item*, struct work_item*);
+    struct work_item* (*wait_for_completion)(void*);
+};
+
+static const struct pool_fns pool_fns[] = {
+    { new_reference_pool, free_reference_pool, submit_reference_work, wait_for_reference_completion },
+    { new_pool, free_pool, submit_pool_work, wait_for_pool_completion }
+};
+
+static void link_jobs(struct count_job* jobs, size_t job_count) {
+    for (size_t i = 0; i < job_count; ++i)
+        jobs[i].work_item.next = i + 1 < job_count ? &jobs[i + 1].work_item : NULL;
+}
+
+static bool check_jobs(const struct count_job* jobs, size_t job_count, size_t run_count) {
+    for (size_t i = 0; i < job_count; ++i) {
+        if (jobs[i].run_count != run_count)
+            return false;
+    }
+    return true;
+}
+
+static double run_all_at_once(const struct pool_fns* fns, void* pool, struct count_job* jobs, bool* is_valid) {
+    struct timespec t_start, t_end;
+    link_jobs(jobs, ITEM_COUNT);
+    timespec_get(&t_start, TIME_UTC);
+    fns->submit_work(pool, &jobs[0].work_item, &jobs[ITEM_COUNT - 1].work_item);
+    fns->wait_for_completion(pool);
+    timespec_get(&t_end, TIME_UTC);
+    *is_valid &= check_jobs(jobs, ITEM_COUNT, 1);
+    return ITEM_COUNT / elapsed_seconds(&t_start, &t_end);
+}
+
+static double run_in_rounds(
+    const struct pool_fns* fns, void* pool, size_t thread_count,
+    struct count_job* jobs, bool* is_valid)
+{
+    struct timespec t_start, t_end;
+    size_t job_count = thread_count * 2;
+    timespec_get(&t_start, TIME_UTC);
+    for (size_t i = 0; i < ROUND_COUNT; ++i) {
+        link_jobs(jobs, job_count);
+        fns->submit_work(pool, &jobs[0].work_item, &jobs[job_count - 1].work_item);
+        // The executed items must all be given back
+        size_t done_count = 0;
+        for (struct work_item* item = fns->wait_for_completion(pool); item; item = item->next)
+            done_count++;
+        *is_valid &= done_count == job_count;
+    }
+    timespec_get(&t_end, TIME_UTC);
+    *is_valid &= check_jobs(jobs, job_count, ROUND_COUNT);
+    return ROUND_COUNT * job_count / elapsed_seconds(&t_start, &t_end);
+}
+
+int main() {
+    size_t max_thread_count = detect_system_thread_count();
+    struct count_job* jobs = xmalloc(sizeof(struct count_job) * ITEM_COUNT);
+    bool is_valid = true;
+
+    // The throughput of each pool is given in items per second, followed by the speedup relative to the
+    // same pool with one thread. The ratio is the throughput of this pool over that of the reference pool.
+    printf("%7s | %-45s | %s\n", "", "all at once", "in rounds");
+    printf("threads | %-18s | %-24s | %-18s | %s\n", "reference", "this pool, ratio", "reference", "this pool, ratio");
+    double base_throughput[2][2];
+    // The number of threads of the system is always measured, even if it is not a power of two
+    for (size_t thread_count = 1;; thread_count = min_size_t(thread_count * 2, max_thread_count)) {
+        double throughput[2][2];
+        for (size_t i = 0; i < 2; ++i) {
+            void* pool = pool_fns[i].new_pool(thread_count);
+            for (size_t j = 0; j < ITEM_COUNT; ++j)
+                jobs[j] = (struct count_job) { .work_item.work_fn = count, .seed = j };
+            throughput[0][i] = run_all_at_once(&pool_fns[i], pool, jobs, &is_valid);
+            for (size_t j = 0; j < ITEM_COUNT; ++j)
+                jobs[j].run_count = 0;
+            throughput[1][i] = run_in_rounds(&pool_fns[i], pool, thread_count, jobs, &is_valid);
+            pool_fns[i].free_pool(pool);
+        }
+
+        if (thread_count == 1) {
+            for (size_t i = 0; i < 2; ++i) {
+                for (size_t j = 0; j < 2; ++j)
+                    base_throughput[i][j] = throughput[i][j];
+            }
+        }
+        printf("%7zu", thread_count);
+        for (size_t i = 0; i < 2; ++i) {
+            printf(" | %10.0f %6.2fx | %10.0f %6.2fx %5.2f",
+                throughput[i][0], throughput[i][0] / base_throughput[i][0],
+                throughput[i][1], throughput[i][1] / base_throughput[i][1],
+                throughput[i][1] / throughput[i][0]);
+        }
+        printf("\n");
+        if (thread_count == max_thread_count)
+            break;
+    }
+    free(jobs);
+
+    if (!is_valid) {
+        fprintf(stderr, "Test failed: Work items were not executed exactly once\n");
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}